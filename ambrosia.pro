@@ -7,6 +7,13 @@ TARGET   = ambrosia
 MOC_DIR     = .moc
 OBJECTS_DIR = .obj
 
+# log levels above this are compiled out (1=error .. 5=trace), see cutestuff/util/cslog.h
+#DEFINES += CS_LOG_LEVEL=4
+
+# count every heap allocation (glibc only) and log them per stanza, see
+#   cutestuff/util/csalloc.h.  build with: qmake CONFIG+=allocstats
+allocstats:DEFINES += CS_ALLOC_STATS
+
 include(qca/qca.pri)
 include(qtcompat/qtcompat.pri)
 
@@ -19,10 +26,18 @@ IRIS_BASE = iris
 include(iris/iris.pri)
 
 HEADERS += \
-	src/router.h
+	src/router.h \
+	src/roster.h \
+	src/userstore.h \
+	src/presencetable.h \
+	src/admission.h
 
 SOURCES += \
 	src/router.cpp \
+	src/roster.cpp \
+	src/userstore.cpp \
+	src/presencetable.cpp \
+	src/admission.cpp \
 	src/main.cpp
 
 include(conf.pri)
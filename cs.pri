@@ -5,8 +5,12 @@ cutestuff {
 
 	HEADERS += \
 		$$CS_BASE/util/base64.h \
+		$$CS_BASE/util/bytechain.h \
 		$$CS_BASE/util/bytestream.h \
 		$$CS_BASE/util/bconsole.h \
+		$$CS_BASE/util/csalloc.h \
+		$$CS_BASE/util/cslog.h \
+		$$CS_BASE/util/csqueue.h \
 		#$$CS_BASE/util/safedelete.h \
 		#$$CS_BASE/network/ndns.h \
 		#$$CS_BASE/network/srvresolver.h \
@@ -18,8 +22,11 @@ cutestuff {
 
 	SOURCES += \
 		$$CS_BASE/util/base64.cpp \
+		$$CS_BASE/util/bytechain.cpp \
 		$$CS_BASE/util/bytestream.cpp \
 		$$CS_BASE/util/bconsole.cpp \
+		$$CS_BASE/util/csalloc.cpp \
+		$$CS_BASE/util/cslog.cpp \
 		#$$CS_BASE/util/safedelete.cpp \
 		#$$CS_BASE/network/ndns.cpp \
 		#$$CS_BASE/network/srvresolver.cpp \
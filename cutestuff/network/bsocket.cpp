@@ -25,12 +25,7 @@
 #include "ndns.h"
 #endif
 #include "srvresolver.h"
-
-//#define BS_DEBUG
-
-#ifdef BS_DEBUG
-#include <stdio.h>
-#endif
+#include "cslog.h"
 
 #define READBUFSIZE 65536
 
@@ -189,10 +184,7 @@ void BSocket::write(const QByteArray &a)
 {
 	if(d->state != Connected)
 		return;
-#ifdef BS_DEBUG
-	QString s = QString::fromUtf8(a);
-	fprintf(stderr, "BSocket: writing [%d]: {%s}\n", a.size(), s.latin1());
-#endif
+	CS_TRACE(Net, "BSocket: writing [%d]: {%s}", a.size(), QString::fromUtf8(a).latin1());
 	d->qsock->write(a.data(), a.size());
 }
 
@@ -209,10 +201,7 @@ QByteArray BSocket::read(int bytes)
 	else
 		block = ByteStream::read(bytes);
 
-#ifdef BS_DEBUG
-	QString s = QString::fromUtf8(block);
-	fprintf(stderr, "BSocket: read [%d]: {%s}\n", block.size(), s.latin1());
-#endif
+	CS_TRACE(Net, "BSocket: read [%d]: {%s}", block.size(), QString::fromUtf8(block).latin1());
 	return block;
 }
 
@@ -266,9 +255,7 @@ quint16 BSocket::peerPort() const
 void BSocket::srv_done()
 {
 	if(d->srv.failed()) {
-#ifdef BS_DEBUG
-		fprintf(stderr, "BSocket: Error resolving hostname.\n");
-#endif
+		CS_WARN(Net, "BSocket: Error resolving hostname.");
 		error(ErrHostNotFound);
 		return;
 	}
@@ -291,9 +278,7 @@ void BSocket::ndns_done()
 		//hostFound();
 	}
 	else {
-#ifdef BS_DEBUG
-		fprintf(stderr, "BSocket: Error resolving hostname.\n");
-#endif
+		CS_WARN(Net, "BSocket: Error resolving hostname.");
 		error(ErrHostNotFound);
 	}
 #endif
@@ -301,9 +286,7 @@ void BSocket::ndns_done()
 
 void BSocket::do_connect()
 {
-#ifdef BS_DEBUG
-	fprintf(stderr, "BSocket: Connecting to %s:%d\n", d->host.latin1(), d->port);
-#endif
+	CS_DEBUG(Net, "BSocket: Connecting to %s:%d", d->host.latin1(), d->port);
 	ensureSocket();
 	d->qsock->connectToHost(d->host, d->port);
 }
@@ -316,9 +299,7 @@ void BSocket::qs_hostFound()
 void BSocket::qs_connected()
 {
 	d->state = Connected;
-#ifdef BS_DEBUG
-	fprintf(stderr, "BSocket: Connected.\n");
-#endif
+	CS_DEBUG(Net, "BSocket: Connected.");
 	SafeDeleteLock s(&d->sd);
 	connected();
 }
@@ -327,9 +308,7 @@ void BSocket::qs_closed()
 {
 	if(d->state == Closing)
 	{
-#ifdef BS_DEBUG
-		fprintf(stderr, "BSocket: Delayed Close Finished.\n");
-#endif
+		CS_DEBUG(Net, "BSocket: Delayed Close Finished.");
 		SafeDeleteLock s(&d->sd);
 		reset();
 		delayedCloseFinished();
@@ -345,9 +324,7 @@ void BSocket::qs_readyRead()
 void BSocket::qs_bytesWritten(qint64 x64)
 {
 	int x = x64;
-#ifdef BS_DEBUG
-	fprintf(stderr, "BSocket: BytesWritten [%d].\n", x);
-#endif
+	CS_TRACE(Net, "BSocket: BytesWritten [%d].", x);
 	SafeDeleteLock s(&d->sd);
 	bytesWritten(x);
 }
@@ -355,18 +332,14 @@ void BSocket::qs_bytesWritten(qint64 x64)
 void BSocket::qs_error(QAbstractSocket::SocketError x)
 {
 	if(x == QTcpSocket::RemoteHostClosedError) {
-#ifdef BS_DEBUG
-		fprintf(stderr, "BSocket: Connection Closed.\n");
-#endif
+		CS_DEBUG(Net, "BSocket: Connection Closed.");
 		SafeDeleteLock s(&d->sd);
 		reset();
 		connectionClosed();
 		return;
 	}
 
-#ifdef BS_DEBUG
-	fprintf(stderr, "BSocket: Error.\n");
-#endif
+	CS_WARN(Net, "BSocket: Error.");
 	SafeDeleteLock s(&d->sd);
 
 	// connection error during SRV host connect?  try next
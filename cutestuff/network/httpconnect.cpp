@@ -23,9 +23,7 @@
 #include"bsocket.h"
 #include"base64.h"
 
-#ifdef PROX_DEBUG
-#include<stdio.h>
-#endif
+#include"cslog.h"
 
 // CS_NAMESPACE_BEGIN
 
@@ -141,13 +139,7 @@ void HttpConnect::connectToHost(const QString &proxyHost, int proxyPort, const Q
 	d->real_host = host;
 	d->real_port = port;
 
-#ifdef PROX_DEBUG
-	fprintf(stderr, "HttpConnect: Connecting to %s:%d", proxyHost.latin1(), proxyPort);
-	if(d->user.isEmpty())
-		fprintf(stderr, "\n");
-	else
-		fprintf(stderr, ", auth {%s,%s}\n", d->user.latin1(), d->pass.latin1());
-#endif
+	CS_DEBUG(Net, "HttpConnect: Connecting to %s:%d%s", proxyHost.latin1(), proxyPort, d->user.isEmpty() ? "" : QString(", auth {%1,%2}").arg(d->user).arg(d->pass).latin1());
 	d->sock.connectToHost(d->host, d->port);
 }
 
@@ -189,9 +181,7 @@ int HttpConnect::bytesToWrite() const
 
 void HttpConnect::sock_connected()
 {
-#ifdef PROX_DEBUG
-	fprintf(stderr, "HttpConnect: Connected\n");
-#endif
+	CS_DEBUG(Net, "HttpConnect: Connected");
 	d->inHeader = true;
 	d->headerLines.clear();
 
@@ -260,25 +250,21 @@ void HttpConnect::sock_readyRead()
 				int code;
 				QString msg;
 				if(!extractMainHeader(str, &proto, &code, &msg)) {
-#ifdef PROX_DEBUG
-					fprintf(stderr, "HttpConnect: invalid header!\n");
-#endif
+					CS_DEBUG(Net, "HttpConnect: invalid header!");
 					reset(true);
 					error(ErrProxyNeg);
 					return;
 				}
 				else {
-#ifdef PROX_DEBUG
-					fprintf(stderr, "HttpConnect: header proto=[%s] code=[%d] msg=[%s]\n", proto.latin1(), code, msg.latin1());
+#if CS_LOG_LEVEL >= CS_LOG_DEBUG
+					CS_DEBUG(Net, "HttpConnect: header proto=[%s] code=[%d] msg=[%s]", proto.latin1(), code, msg.latin1());
 					for(QStringList::ConstIterator it = d->headerLines.begin(); it != d->headerLines.end(); ++it)
-						fprintf(stderr, "HttpConnect: * [%s]\n", (*it).latin1());
+						CS_DEBUG(Net, "HttpConnect: * [%s]", (*it).latin1());
 #endif
 				}
 
 				if(code == 200) { // OK
-#ifdef PROX_DEBUG
-					fprintf(stderr, "HttpConnect: << Success >>\n");
-#endif
+					CS_DEBUG(Net, "HttpConnect: << Success >>");
 					d->active = true;
 					connected();
 
@@ -313,9 +299,7 @@ void HttpConnect::sock_readyRead()
 						errStr = tr("Invalid reply");
 					}
 
-#ifdef PROX_DEBUG
-					fprintf(stderr, "HttpConnect: << Error >> [%s]\n", errStr.latin1());
-#endif
+					CS_WARN(Net, "HttpConnect: << Error >> [%s]", errStr.latin1());
 					reset(true);
 					error(err);
 					return;
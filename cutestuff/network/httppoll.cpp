@@ -29,9 +29,7 @@
 #include"bsocket.h"
 #include"base64.h"
 
-#ifdef PROX_DEBUG
-#include<stdio.h>
-#endif
+#include"cslog.h"
 
 #define POLL_KEYS 64
 
@@ -154,13 +152,7 @@ void HttpPoll::connectToHost(const QString &proxyHost, int proxyPort, const QStr
 	bool last;
 	QString key = getKey(&last);
 
-#ifdef PROX_DEBUG
-	fprintf(stderr, "HttpPoll: Connecting to %s:%d [%s]", d->host.latin1(), d->port, d->url.latin1());
-	if(d->user.isEmpty())
-		fprintf(stderr, "\n");
-	else
-		fprintf(stderr, ", auth {%s,%s}\n", d->user.latin1(), d->pass.latin1());
-#endif
+	CS_DEBUG(Net, "HttpPoll: Connecting to %s:%d [%s]%s", d->host.latin1(), d->port, d->url.latin1(), d->user.isEmpty() ? "" : QString(", auth {%1,%2}").arg(d->user).arg(d->pass).latin1());
 	QGuardedPtr<QObject> self = this;
 	syncStarted();
 	if(!self)
@@ -354,9 +346,7 @@ void HttpPoll::do_sync()
 
 void HttpPoll::resetKey()
 {
-#ifdef PROX_DEBUG
-	fprintf(stderr, "HttpPoll: reset key!\n");
-#endif
+	CS_DEBUG(Net, "HttpPoll: reset key!");
 	QByteArray a = randomArray(64);
 	QString str = QString::fromLatin1(a.data(), a.size());
 
@@ -484,13 +474,7 @@ void HttpProxyPost::post(const QString &proxyHost, int proxyPort, const QString
 	d->postdata = data;
 	d->asProxy = asProxy;
 
-#ifdef PROX_DEBUG
-	fprintf(stderr, "HttpProxyPost: Connecting to %s:%d", proxyHost.latin1(), proxyPort);
-	if(d->user.isEmpty())
-		fprintf(stderr, "\n");
-	else
-		fprintf(stderr, ", auth {%s,%s}\n", d->user.latin1(), d->pass.latin1());
-#endif
+	CS_DEBUG(Net, "HttpProxyPost: Connecting to %s:%d%s", proxyHost.latin1(), proxyPort, d->user.isEmpty() ? "" : QString(", auth {%1,%2}").arg(d->user).arg(d->pass).latin1());
 	d->sock.connectToHost(proxyHost, proxyPort);
 }
 
@@ -520,9 +504,7 @@ QString HttpProxyPost::getHeader(const QString &var) const
 
 void HttpProxyPost::sock_connected()
 {
-#ifdef PROX_DEBUG
-	fprintf(stderr, "HttpProxyPost: Connected\n");
-#endif
+	CS_DEBUG(Net, "HttpProxyPost: Connected");
 	d->inHeader = true;
 	d->headerLines.clear();
 
@@ -592,25 +574,21 @@ void HttpProxyPost::sock_readyRead()
 			int code;
 			QString msg;
 			if(!extractMainHeader(str, &proto, &code, &msg)) {
-#ifdef PROX_DEBUG
-				fprintf(stderr, "HttpProxyPost: invalid header!\n");
-#endif
+				CS_DEBUG(Net, "HttpProxyPost: invalid header!");
 				reset(true);
 				error(ErrProxyNeg);
 				return;
 			}
 			else {
-#ifdef PROX_DEBUG
-				fprintf(stderr, "HttpProxyPost: header proto=[%s] code=[%d] msg=[%s]\n", proto.latin1(), code, msg.latin1());
+#if CS_LOG_LEVEL >= CS_LOG_DEBUG
+				CS_DEBUG(Net, "HttpProxyPost: header proto=[%s] code=[%d] msg=[%s]", proto.latin1(), code, msg.latin1());
 				for(QStringList::ConstIterator it = d->headerLines.begin(); it != d->headerLines.end(); ++it)
-					fprintf(stderr, "HttpProxyPost: * [%s]\n", (*it).latin1());
+					CS_DEBUG(Net, "HttpProxyPost: * [%s]", (*it).latin1());
 #endif
 			}
 
 			if(code == 200) { // OK
-#ifdef PROX_DEBUG
-				fprintf(stderr, "HttpProxyPost: << Success >>\n");
-#endif
+				CS_DEBUG(Net, "HttpProxyPost: << Success >>");
 			}
 			else {
 				int err;
@@ -636,9 +614,7 @@ void HttpProxyPost::sock_readyRead()
 					errStr = tr("Invalid reply");
 				}
 
-#ifdef PROX_DEBUG
-				fprintf(stderr, "HttpProxyPost: << Error >> [%s]\n", errStr.latin1());
-#endif
+				CS_WARN(Net, "HttpProxyPost: << Error >> [%s]", errStr.latin1());
 				reset(true);
 				error(err);
 				return;
@@ -649,9 +625,7 @@ void HttpProxyPost::sock_readyRead()
 
 void HttpProxyPost::sock_error(int x)
 {
-#ifdef PROX_DEBUG
-	fprintf(stderr, "HttpProxyPost: socket error: %d\n", x);
-#endif
+	CS_WARN(Net, "HttpProxyPost: socket error: %d", x);
 	reset(true);
 	if(x == BSocket::ErrHostNotFound)
 		error(ErrProxyConnect);
@@ -51,11 +51,14 @@ bool ServSock::isActive() const
 	return (d->serv ? true: false);
 }
 
-bool ServSock::listen(Q_UINT16 port)
+bool ServSock::listen(Q_UINT16 port, int backlog, const QHostAddress &address)
 {
 	stop();
 
-	d->serv = new ServSockSignal(port);
+	if(address.isNull())
+		d->serv = new ServSockSignal(port, backlog);
+	else
+		d->serv = new ServSockSignal(address, port, backlog);
 	if(!d->serv->ok()) {
 		delete d->serv;
 		d->serv = 0;
@@ -97,8 +100,13 @@ void ServSock::sss_connectionReady(int s)
 //----------------------------------------------------------------------------
 // ServSockSignal
 //----------------------------------------------------------------------------
-ServSockSignal::ServSockSignal(int port)
-:Q3ServerSocket(port, 16)
+ServSockSignal::ServSockSignal(int port, int backlog)
+:Q3ServerSocket(port, backlog)
+{
+}
+
+ServSockSignal::ServSockSignal(const QHostAddress &address, int port, int backlog)
+:Q3ServerSocket(address, port, backlog)
 {
 }
 
@@ -33,7 +33,7 @@ public:
 	~ServSock();
 
 	bool isActive() const;
-	bool listen(Q_UINT16 port);
+	bool listen(Q_UINT16 port, int backlog=16, const QHostAddress &address=QHostAddress()); // null address is any
 	void stop();
 	int port() const;
 	QHostAddress address() const;
@@ -53,7 +53,8 @@ class ServSockSignal : public Q3ServerSocket
 {
 	Q_OBJECT
 public:
-	ServSockSignal(int port);
+	ServSockSignal(int port, int backlog=16);
+	ServSockSignal(const QHostAddress &address, int port, int backlog=16);
 
 signals:
 	void connectionReady(int);
@@ -40,9 +40,7 @@
 #include"servsock.h"
 #include"bsocket.h"
 
-#ifdef PROX_DEBUG
-#include<stdio.h>
-#endif
+#include"cslog.h"
 
 // CS_NAMESPACE_BEGIN
 
@@ -598,13 +596,7 @@ void SocksClient::connectToHost(const QString &proxyHost, int proxyPort, const Q
 	d->real_port = port;
 	d->udp = udpMode;
 
-#ifdef PROX_DEBUG
-	fprintf(stderr, "SocksClient: Connecting to %s:%d", proxyHost.latin1(), proxyPort);
-	if(d->user.isEmpty())
-		fprintf(stderr, "\n");
-	else
-		fprintf(stderr, ", auth {%s,%s}\n", d->user.latin1(), d->pass.latin1());
-#endif
+	CS_DEBUG(Net, "SocksClient: Connecting to %s:%d%s", proxyHost.latin1(), proxyPort, d->user.isEmpty() ? "" : QString(", auth {%1,%2}").arg(d->user).arg(d->pass).latin1());
 	d->sock.connectToHost(d->host, d->port);
 }
 
@@ -652,9 +644,7 @@ int SocksClient::bytesToWrite() const
 
 void SocksClient::sock_connected()
 {
-#ifdef PROX_DEBUG
-	fprintf(stderr, "SocksClient: Connected\n");
-#endif
+	CS_DEBUG(Net, "SocksClient: Connected");
 
 	d->step = StepVersion;
 	writeData(spc_set_version());
@@ -699,12 +689,14 @@ void SocksClient::sock_readyRead()
 
 void SocksClient::processOutgoing(const QByteArray &block)
 {
-#ifdef PROX_DEBUG
+#if CS_LOG_LEVEL >= CS_LOG_TRACE
 	// show hex
-	fprintf(stderr, "SocksClient: client recv { ");
-	for(int n = 0; n < (int)block.size(); ++n)
-		fprintf(stderr, "%02X ", (unsigned char)block[n]);
-	fprintf(stderr, " } \n");
+	if(CSLog::isEnabled(CS_LOG_TRACE, CSLog::Net)) {
+		QString hex;
+		for(int n = 0; n < (int)block.size(); ++n)
+			hex += QString().sprintf("%02X ", (unsigned char)block[n]);
+		CS_TRACE(Net, "SocksClient: client recv { %s}", hex.latin1());
+	}
 #endif
 	ByteStream::appendArray(&d->recvBuf, block);
 
@@ -718,9 +710,7 @@ void SocksClient::processOutgoing(const QByteArray &block)
 		}
 		else if(r == 1) {
 			if(s.version != 0x05 || s.method == 0xff) {
-#ifdef PROX_DEBUG
-				fprintf(stderr, "SocksClient: Method selection failed\n");
-#endif
+				CS_DEBUG(Net, "SocksClient: Method selection failed");
 				reset(true);
 				error(ErrProxyNeg);
 				return;
@@ -736,9 +726,7 @@ void SocksClient::processOutgoing(const QByteArray &block)
 				d->authMethod = AuthUsername;
 			}
 			else {
-#ifdef PROX_DEBUG
-				fprintf(stderr, "SocksClient: Server wants to use unknown method '%02x'\n", s.method);
-#endif
+				CS_DEBUG(Net, "SocksClient: Server wants to use unknown method '%02x'", s.method);
 				reset(true);
 				error(ErrProxyNeg);
 				return;
@@ -750,9 +738,7 @@ void SocksClient::processOutgoing(const QByteArray &block)
 			}
 			else if(d->authMethod == AuthUsername) {
 				d->step = StepAuth;
-#ifdef PROX_DEBUG
-				fprintf(stderr, "SocksClient: Authenticating [Username] ...\n");
-#endif
+				CS_DEBUG(Net, "SocksClient: Authenticating [Username] ...");
 				writeData(spc_set_authUsername(d->user.latin1(), d->pass.latin1()));
 			}
 		}
@@ -792,9 +778,7 @@ void SocksClient::processOutgoing(const QByteArray &block)
 		}
 		else if(r == 1) {
 			if(s.cmd != RET_SUCCESS) {
-#ifdef PROX_DEBUG
-				fprintf(stderr, "SocksClient: client << Error >> [%02x]\n", s.cmd);
-#endif
+				CS_WARN(Net, "SocksClient: client << Error >> [%02x]", s.cmd);
 				reset(true);
 				if(s.cmd == RET_UNREACHABLE)
 					error(ErrHostNotFound);
@@ -805,9 +789,7 @@ void SocksClient::processOutgoing(const QByteArray &block)
 				return;
 			}
 
-#ifdef PROX_DEBUG
-			fprintf(stderr, "SocksClient: client << Success >>\n");
-#endif
+			CS_DEBUG(Net, "SocksClient: client << Success >>");
 			if(d->udp) {
 				if(s.address_type == 0x03)
 					d->udpAddr = s.host;
@@ -834,9 +816,7 @@ void SocksClient::processOutgoing(const QByteArray &block)
 
 void SocksClient::do_request()
 {
-#ifdef PROX_DEBUG
-	fprintf(stderr, "SocksClient: Requesting ...\n");
-#endif
+	CS_DEBUG(Net, "SocksClient: Requesting ...");
 	d->step = StepRequest;
 	int cmd = d->udp ? REQ_UDPASSOCIATE : REQ_CONNECT;
 	QByteArray buf;
@@ -888,12 +868,14 @@ void SocksClient::serve()
 
 void SocksClient::processIncoming(const QByteArray &block)
 {
-#ifdef PROX_DEBUG
+#if CS_LOG_LEVEL >= CS_LOG_TRACE
 	// show hex
-	fprintf(stderr, "SocksClient: server recv { ");
-	for(int n = 0; n < (int)block.size(); ++n)
-		fprintf(stderr, "%02X ", (unsigned char)block[n]);
-	fprintf(stderr, " } \n");
+	if(CSLog::isEnabled(CS_LOG_TRACE, CSLog::Net)) {
+		QString hex;
+		for(int n = 0; n < (int)block.size(); ++n)
+			hex += QString().sprintf("%02X ", (unsigned char)block[n]);
+		CS_TRACE(Net, "SocksClient: server recv { %s}", hex.latin1());
+	}
 #endif
 	ByteStream::appendArray(&d->recvBuf, block);
 
@@ -1034,9 +1016,7 @@ void SocksClient::grantConnect()
 	d->waiting = false;
 	writeData(sp_set_request(d->rhost, d->rport, RET_SUCCESS));
 	d->active = true;
-#ifdef PROX_DEBUG
-	fprintf(stderr, "SocksClient: server << Success >>\n");
-#endif
+	CS_DEBUG(Net, "SocksClient: server << Success >>");
 
 	if(!d->recvBuf.isEmpty()) {
 		appendRead(d->recvBuf);
@@ -1055,9 +1035,7 @@ void SocksClient::grantUDPAssociate(const QString &relayHost, int relayPort)
 	writeData(sp_set_request(relayHost, relayPort, RET_SUCCESS));
 	d->udp = true;
 	d->active = true;
-#ifdef PROX_DEBUG
-	fprintf(stderr, "SocksClient: server << Success >>\n");
-#endif
+	CS_DEBUG(Net, "SocksClient: server << Success >>");
 
 	if(!d->recvBuf.isEmpty())
 		d->recvBuf.resize(0);
@@ -23,6 +23,7 @@
 #include<qsocketnotifier.h>
 #include<unistd.h>
 #include<fcntl.h>
+#include<sys/uio.h>
 
 //----------------------------------------------------------------------------
 // BConsole
@@ -111,11 +112,12 @@ void BConsole::sn_write()
 
 int BConsole::tryWrite()
 {
-	// try a section of the write buffer
-	QByteArray a = takeWrite(1024, false);
+	// try the first few blocks of the write buffer, in place
+	struct iovec vec[16];
+	int count = writeBuf().toIovec(vec, 16);
 
 	// write it
-	int r = ::write(1, a.data(), a.size());
+	int r = ::writev(1, vec, count);
 	if(r < 0) {
 		error(ErrWrite);
 		return -1;
@@ -124,7 +126,7 @@ int BConsole::tryWrite()
 	d->w = new QSocketNotifier(1, QSocketNotifier::Write);
 	connect(d->w, SIGNAL(activated(int)), SLOT(sn_write()));
 
-	takeWrite(r);
+	writeBuf().consume(r);
 	bytesWritten(r);
 	return r;
 }
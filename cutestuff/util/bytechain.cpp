@@ -0,0 +1,173 @@
+/*
+ * bytechain.cpp - queue of bytes kept as a chain of shared blocks
+ * Copyright (C) 2005  Justin Karneges
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+#include "bytechain.h"
+
+#include <string.h>
+#ifdef Q_OS_UNIX
+# include <sys/uio.h>
+#endif
+
+// arrays at least half this size are kept as they are, shared with the
+//   caller.  smaller ones are packed into blocks of this size
+#define BYTECHAIN_BLOCK 4096
+
+// CS_NAMESPACE_BEGIN
+
+//! \class ByteChain bytechain.h
+//! \brief A byte queue that never moves what it already holds
+//!
+//! Appending shares the given array (or packs a small one into the last
+//! block), and taking from the front only moves an offset or drops
+//! blocks, so both are independent of how much is queued.  Only reading
+//! across block boundaries has to copy.
+ByteChain::ByteChain()
+{
+	offset = 0;
+	total = 0;
+	tailOpen = false;
+}
+
+int ByteChain::size() const
+{
+	return total;
+}
+
+bool ByteChain::isEmpty() const
+{
+	return (total == 0);
+}
+
+void ByteChain::clear()
+{
+	blocks.clear();
+	offset = 0;
+	total = 0;
+	tailOpen = false;
+}
+
+void ByteChain::append(const QByteArray &a)
+{
+	int len = a.size();
+	if(len == 0)
+		return;
+	total += len;
+
+	if(tailOpen) {
+		QByteArray &t = blocks.last();
+		if(t.size() + len <= BYTECHAIN_BLOCK) {
+			int at = t.size();
+			t.resize(at + len);
+			memcpy(t.data() + at, a.constData(), len);
+			return;
+		}
+	}
+
+	if(len >= BYTECHAIN_BLOCK / 2) {
+		blocks += a;
+		tailOpen = false;
+		return;
+	}
+
+	QByteArray b;
+	b.reserve(BYTECHAIN_BLOCK);
+	b.resize(len);
+	memcpy(b.data(), a.constData(), len);
+	blocks += b;
+	tailOpen = true;
+}
+
+QByteArray ByteChain::read(int size) const
+{
+	if(size <= 0 || size > total)
+		size = total;
+	if(size == 0)
+		return QByteArray();
+
+	// within the first block?
+	const QByteArray &first = blocks.first();
+	int avail = first.size() - offset;
+	if(offset == 0 && size == avail)
+		return first;
+	if(size <= avail)
+		return first.mid(offset, size);
+
+	QByteArray out(size, 0);
+	char *p = out.data();
+	int left = size;
+	for(int n = 0; left > 0; ++n) {
+		const QByteArray &b = blocks[n];
+		int skip = (n == 0 ? offset : 0);
+		int len = qMin(b.size() - skip, left);
+		memcpy(p, b.constData() + skip, len);
+		p += len;
+		left -= len;
+	}
+	return out;
+}
+
+QByteArray ByteChain::take(int size)
+{
+	QByteArray a = read(size);
+	consume(a.size());
+	return a;
+}
+
+void ByteChain::consume(int size)
+{
+	if(size <= 0)
+		return;
+	if(size >= total) {
+		clear();
+		return;
+	}
+
+	total -= size;
+	while(size > 0) {
+		int avail = blocks.first().size() - offset;
+		if(size < avail) {
+			offset += size;
+			return;
+		}
+		size -= avail;
+		blocks.removeFirst();
+		offset = 0;
+	}
+}
+
+int ByteChain::toIovec(struct iovec *vec, int max) const
+{
+#ifdef Q_OS_UNIX
+	int n;
+	for(n = 0; n < max && n < blocks.count(); ++n) {
+		const QByteArray &b = blocks[n];
+		int skip = (n == 0 ? offset : 0);
+		vec[n].iov_base = (void *)(b.constData() + skip);
+		vec[n].iov_len = b.size() - skip;
+	}
+	return n;
+#else
+	Q_UNUSED(vec);
+	Q_UNUSED(max);
+	return 0;
+#endif
+}
+
+// CS_NAMESPACE_END
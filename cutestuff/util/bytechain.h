@@ -0,0 +1,58 @@
+/*
+ * bytechain.h - queue of bytes kept as a chain of shared blocks
+ * Copyright (C) 2005  Justin Karneges
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+#ifndef CS_BYTECHAIN_H
+#define CS_BYTECHAIN_H
+
+#include <QtCore>
+
+struct iovec;
+
+// CS_NAMESPACE_BEGIN
+
+// CS_EXPORT_BEGIN
+class ByteChain
+{
+public:
+	ByteChain();
+
+	int size() const;
+	bool isEmpty() const;
+	void clear();
+
+	void append(const QByteArray &a);
+	QByteArray read(int size=0) const; // 0 means everything
+	QByteArray take(int size=0);
+	void consume(int size);
+
+	// fills up to 'max' entries for writev(), and returns how many
+	int toIovec(struct iovec *vec, int max) const;
+
+private:
+	QList<QByteArray> blocks;
+	int offset; // into the first block
+	int total;
+	bool tailOpen; // the last block is ours to append to
+};
+// CS_EXPORT_END
+
+// CS_NAMESPACE_END
+
+#endif
@@ -59,7 +59,7 @@ class ByteStream::Private
 public:
 	Private() {}
 
-	QByteArray readBuf, writeBuf;
+	ByteChain readBuf, writeBuf;
 };
 
 //!
@@ -132,28 +132,28 @@ int ByteStream::bytesToWrite() const
 //! Clears the read buffer.
 void ByteStream::clearReadBuffer()
 {
-	d->readBuf.resize(0);
+	d->readBuf.clear();
 }
 
 //!
 //! Clears the write buffer.
 void ByteStream::clearWriteBuffer()
 {
-	d->writeBuf.resize(0);
+	d->writeBuf.clear();
 }
 
 //!
 //! Appends \a block to the end of the read buffer.
 void ByteStream::appendRead(const QByteArray &block)
 {
-	appendArray(&d->readBuf, block);
+	d->readBuf.append(block);
 }
 
 //!
 //! Appends \a block to the end of the write buffer.
 void ByteStream::appendWrite(const QByteArray &block)
 {
-	appendArray(&d->writeBuf, block);
+	d->writeBuf.append(block);
 }
 
 //!
@@ -162,7 +162,7 @@ void ByteStream::appendWrite(const QByteArray &block)
 //! If \a del is TRUE, then the bytes are also removed.
 QByteArray ByteStream::takeRead(int size, bool del)
 {
-	return takeArray(&d->readBuf, size, del);
+	return del ? d->readBuf.take(size) : d->readBuf.read(size);
 }
 
 //!
@@ -171,19 +171,19 @@ QByteArray ByteStream::takeRead(int size, bool del)
 //! If \a del is TRUE, then the bytes are also removed.
 QByteArray ByteStream::takeWrite(int size, bool del)
 {
-	return takeArray(&d->writeBuf, size, del);
+	return del ? d->writeBuf.take(size) : d->writeBuf.read(size);
 }
 
 //!
 //! Returns a reference to the read buffer.
-QByteArray & ByteStream::readBuf()
+ByteChain & ByteStream::readBuf()
 {
 	return d->readBuf;
 }
 
 //!
 //! Returns a reference to the write buffer.
-QByteArray & ByteStream::writeBuf()
+ByteChain & ByteStream::writeBuf()
 {
 	return d->writeBuf;
 }
@@ -198,8 +198,13 @@ int ByteStream::tryWrite()
 
 //!
 //! Append array \a b to the end of the array pointed to by \a a.
+//! If \a a is empty, it shares the data of \a b instead of copying it.
 void ByteStream::appendArray(QByteArray *a, const QByteArray &b)
 {
+	if(a->isEmpty()) {
+		*a = b;
+		return;
+	}
 	int oldsize = a->size();
 	a->resize(oldsize + b.size());
 	memcpy(a->data() + oldsize, b.data(), b.size());
@@ -22,6 +22,7 @@
 #define CS_BYTESTREAM_H
 
 #include <QtCore>
+#include "bytechain.h"
 
 // CS_NAMESPACE_BEGIN
 
@@ -58,8 +59,8 @@ protected:
 	void appendWrite(const QByteArray &);
 	QByteArray takeRead(int size=0, bool del=true);
 	QByteArray takeWrite(int size=0, bool del=true);
-	QByteArray & readBuf();
-	QByteArray & writeBuf();
+	ByteChain & readBuf();
+	ByteChain & writeBuf();
 	virtual int tryWrite();
 
 private:
@@ -0,0 +1,94 @@
+/*
+ * csalloc.cpp - counts heap allocations, for measuring
+ * Copyright (C) 2005  Justin Karneges
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+#include "csalloc.h"
+
+#include <stdlib.h>
+
+#if defined(CS_ALLOC_STATS) && defined(__GLIBC__)
+# define CS_ALLOC_COUNTING
+#endif
+
+#ifdef CS_ALLOC_COUNTING
+// glibc's own entry points.  defining malloc() in the executable takes
+//   precedence over libc for every library, and operator new goes
+//   through it as well
+extern "C" {
+	void *__libc_malloc(size_t size);
+	void *__libc_calloc(size_t n, size_t size);
+	void *__libc_realloc(void *p, size_t size);
+}
+
+static volatile quint64 alloc_calls = 0;
+static volatile quint64 alloc_bytes = 0;
+
+static inline void countAlloc(size_t size)
+{
+	__sync_fetch_and_add(&alloc_calls, 1);
+	__sync_fetch_and_add(&alloc_bytes, (quint64)size);
+}
+
+extern "C" void *malloc(size_t size) __THROW
+{
+	countAlloc(size);
+	return __libc_malloc(size);
+}
+
+extern "C" void *calloc(size_t n, size_t size) __THROW
+{
+	countAlloc(n * size);
+	return __libc_calloc(n, size);
+}
+
+extern "C" void *realloc(void *p, size_t size) __THROW
+{
+	countAlloc(size);
+	return __libc_realloc(p, size);
+}
+#endif
+
+// CS_NAMESPACE_BEGIN
+
+//----------------------------------------------------------------------------
+// CSAlloc
+//----------------------------------------------------------------------------
+bool CSAlloc::isEnabled()
+{
+#ifdef CS_ALLOC_COUNTING
+	return true;
+#else
+	return false;
+#endif
+}
+
+CSAlloc::Stats CSAlloc::stats()
+{
+	Stats s;
+#ifdef CS_ALLOC_COUNTING
+	s.calls = __sync_fetch_and_add(&alloc_calls, 0);
+	s.bytes = __sync_fetch_and_add(&alloc_bytes, 0);
+#else
+	s.calls = 0;
+	s.bytes = 0;
+#endif
+	return s;
+}
+
+// CS_NAMESPACE_END
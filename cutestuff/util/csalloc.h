@@ -0,0 +1,49 @@
+/*
+ * csalloc.h - counts heap allocations, for measuring
+ * Copyright (C) 2005  Justin Karneges
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+#ifndef CS_ALLOC_H
+#define CS_ALLOC_H
+
+#include <QtCore>
+
+// CS_NAMESPACE_BEGIN
+
+// CS_EXPORT_BEGIN
+class CSAlloc
+{
+public:
+	class Stats
+	{
+	public:
+		quint64 calls; // malloc, calloc and realloc, from every thread
+		quint64 bytes; // as requested
+	};
+
+	// only when built with CS_ALLOC_STATS (qmake CONFIG+=allocstats) on
+	//   glibc.  it replaces malloc() for the whole process, Qt included,
+	//   and every call then pays for two atomic adds
+	static bool isEnabled();
+	static Stats stats(); // zero if not enabled
+};
+// CS_EXPORT_END
+
+// CS_NAMESPACE_END
+
+#endif
@@ -0,0 +1,212 @@
+/*
+ * cslog.cpp - leveled, categorized logging
+ * Copyright (C) 2005  Justin Karneges
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+#include "cslog.h"
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+
+#define RING_SIZE 8192
+
+static const char *level_names[] = { "", "error", "warn", "info", "debug", "trace" };
+static const char *category_names[] = { "general", "net", "stream", "protocol", "parser", "router", "presence", "store" };
+
+//----------------------------------------------------------------------------
+// CSLogWriter
+//----------------------------------------------------------------------------
+class CSLogWriter : public QThread
+{
+public:
+	QMutex m;
+	QWaitCondition w;
+	QByteArray ring[RING_SIZE];
+	int head, count, dropped;
+	bool running;
+
+	CSLogWriter()
+	{
+		head = 0;
+		count = 0;
+		dropped = 0;
+		running = false;
+	}
+
+	// call with m locked
+	bool push(const QByteArray &line)
+	{
+		if(count == RING_SIZE)
+		{
+			++dropped;
+			return false;
+		}
+		ring[(head + count) % RING_SIZE] = line;
+		++count;
+		return true;
+	}
+
+protected:
+	void run()
+	{
+		QList<QByteArray> lines;
+		while(1)
+		{
+			int lost;
+			bool done;
+			{
+				QMutexLocker locker(&m);
+				while(running && count == 0 && dropped == 0)
+					w.wait(&m);
+				for(; count > 0; --count)
+				{
+					lines += ring[head];
+					ring[head] = QByteArray();
+					head = (head + 1) % RING_SIZE;
+				}
+				lost = dropped;
+				dropped = 0;
+				done = !running;
+			}
+
+			for(int n = 0; n < lines.count(); ++n)
+				fwrite(lines[n].data(), 1, lines[n].size(), stdout);
+			if(lost > 0)
+				fprintf(stdout, "W [general] %d log lines dropped\n", lost);
+			fflush(stdout);
+			lines.clear();
+
+			if(done)
+				break;
+		}
+	}
+};
+
+static CSLogWriter *writer = 0;
+
+//----------------------------------------------------------------------------
+// CSLog
+//----------------------------------------------------------------------------
+int CSLog::runtimeLevel = CS_LOG_INFO;
+int CSLog::categoryMask = ~0;
+
+void CSLog::setLevel(int level)
+{
+	runtimeLevel = level;
+}
+
+void CSLog::setCategories(int mask)
+{
+	categoryMask = mask;
+}
+
+int CSLog::level()
+{
+	return runtimeLevel;
+}
+
+int CSLog::categories()
+{
+	return categoryMask;
+}
+
+int CSLog::levelFromString(const QString &s)
+{
+	for(int n = CS_LOG_ERROR; n <= CS_LOG_TRACE; ++n)
+	{
+		if(s == level_names[n])
+			return n;
+	}
+	return -1;
+}
+
+int CSLog::categoryFromString(const QString &s)
+{
+	for(int n = 0; n < CategoryCount; ++n)
+	{
+		if(s == category_names[n])
+			return n;
+	}
+	return -1;
+}
+
+void CSLog::start()
+{
+	if(writer)
+		return;
+	writer = new CSLogWriter;
+	writer->running = true;
+	writer->start();
+}
+
+void CSLog::stop()
+{
+	if(!writer)
+		return;
+	{
+		QMutexLocker locker(&writer->m);
+		writer->running = false;
+		writer->w.wakeOne();
+	}
+	writer->wait();
+	delete writer;
+	writer = 0;
+}
+
+void CSLog::write(int level, Category cat, const char *fmt, ...)
+{
+	// format outside of any lock
+	char buf[1024];
+	int prefix = snprintf(buf, sizeof(buf), "%c [%s] ", level_names[level][0] - 'a' + 'A', category_names[cat]);
+
+	va_list ap;
+	va_start(ap, fmt);
+	int len = vsnprintf(buf + prefix, sizeof(buf) - prefix, fmt, ap);
+	va_end(ap);
+	if(len < 0)
+		return;
+
+	QByteArray line;
+	if(prefix + len < (int)sizeof(buf))
+	{
+		line = QByteArray(buf, prefix + len);
+	}
+	else
+	{
+		// doesn't fit, do it again at the right size
+		line.resize(prefix + len + 1);
+		memcpy(line.data(), buf, prefix);
+		va_start(ap, fmt);
+		vsnprintf(line.data() + prefix, len + 1, fmt, ap);
+		va_end(ap);
+		line.resize(prefix + len);
+	}
+	line += '\n';
+
+	if(!writer)
+	{
+		fwrite(line.data(), 1, line.size(), stdout);
+		fflush(stdout);
+		return;
+	}
+
+	QMutexLocker locker(&writer->m);
+	writer->push(line);
+	writer->w.wakeOne();
+}
@@ -0,0 +1,104 @@
+/*
+ * cslog.h - leveled, categorized logging
+ * Copyright (C) 2005  Justin Karneges
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+#ifndef CS_LOG_H
+#define CS_LOG_H
+
+#include <QtCore>
+
+// levels, usable from the preprocessor
+#define CS_LOG_ERROR 1
+#define CS_LOG_WARN  2
+#define CS_LOG_INFO  3
+#define CS_LOG_DEBUG 4
+#define CS_LOG_TRACE 5
+
+// anything above this level is compiled out entirely, arguments and all
+#ifndef CS_LOG_LEVEL
+#define CS_LOG_LEVEL CS_LOG_INFO
+#endif
+
+// CS_NAMESPACE_BEGIN
+
+// CS_EXPORT_BEGIN
+class CSLog
+{
+public:
+	enum Category
+	{
+		General,
+		Net,
+		Stream,
+		Protocol,
+		Parser,
+		Router,
+		Presence,
+		Store,
+		CategoryCount
+	};
+
+	static inline bool isEnabled(int level, Category cat)
+	{
+		return level <= runtimeLevel && (categoryMask & (1 << cat));
+	}
+
+	// runtime filter, on top of CS_LOG_LEVEL
+	static void setLevel(int level);
+	static void setCategories(int mask); // bitmask of (1 << Category)
+	static int level();
+	static int categories();
+	static int levelFromString(const QString &s); // -1 if unknown
+	static int categoryFromString(const QString &s); // -1 if unknown
+
+	// until start() is called, lines are written synchronously.  after,
+	//   they go into a fixed-size ring drained by a writer thread, and
+	//   lines that don't fit are counted and dropped instead of blocking
+	static void start();
+	static void stop(); // drains the ring and waits for the writer
+
+	static void write(int level, Category cat, const char *fmt, ...)
+#ifdef __GNUC__
+		__attribute__ ((format (printf, 3, 4)))
+#endif
+		;
+
+private:
+	static int runtimeLevel;
+	static int categoryMask;
+};
+// CS_EXPORT_END
+
+// CS_NAMESPACE_END
+
+// the format arguments are only evaluated if the line is going to be
+//   written, so it is fine to pass things like stanza.toString()
+#define CS_LOG(level, cat, ...) \
+	do { \
+		if((level) <= CS_LOG_LEVEL && CSLog::isEnabled((level), CSLog::cat)) \
+			CSLog::write((level), CSLog::cat, __VA_ARGS__); \
+	} while(0)
+
+#define CS_ERROR(cat, ...) CS_LOG(CS_LOG_ERROR, cat, __VA_ARGS__)
+#define CS_WARN(cat, ...)  CS_LOG(CS_LOG_WARN, cat, __VA_ARGS__)
+#define CS_INFO(cat, ...)  CS_LOG(CS_LOG_INFO, cat, __VA_ARGS__)
+#define CS_DEBUG(cat, ...) CS_LOG(CS_LOG_DEBUG, cat, __VA_ARGS__)
+#define CS_TRACE(cat, ...) CS_LOG(CS_LOG_TRACE, cat, __VA_ARGS__)
+
+#endif
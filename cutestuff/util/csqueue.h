@@ -0,0 +1,145 @@
+/*
+ * csqueue.h - lock-free multiple producer, single consumer queue
+ * Copyright (C) 2005  Justin Karneges
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+#ifndef CS_QUEUE_H
+#define CS_QUEUE_H
+
+#include <QtCore>
+
+// CS_NAMESPACE_BEGIN
+
+// Any number of threads may push(), only one thread may pop().  A push is
+//   a single atomic exchange on the head, followed by linking the old
+//   head to the new node, so producers never wait on each other or on
+//   the consumer.  Until that link is made the consumer can't see past
+//   the node, and pop() returns false as if the queue were empty.
+//
+// The link is published with an atomic exchange, and the consumer reads
+//   links through load(), so the node's value is visible by the time the
+//   node is, on any cpu and not just on x86.
+//
+// The queue also keeps a "signaled" flag, so that a burst of pushes only
+//   wakes the consumer once: push() returns true if the consumer has to
+//   be woken, and the consumer calls beginDrain() before popping
+//   everything.  A push that lands after beginDrain() returns true again.
+template <typename T>
+class CSMpscQueue
+{
+public:
+	CSMpscQueue()
+	{
+		stub.next = 0;
+		head = &stub;
+		tail = &stub;
+		signaled = 0;
+	}
+
+	~CSMpscQueue()
+	{
+		T v;
+		while(pop(&v))
+		{
+		}
+	}
+
+	bool push(const T &v)
+	{
+		Node *n = new Node;
+		n->value = v;
+		n->next = 0;
+		enqueue(n);
+		return (q_atomic_set_int(&signaled, 1) == 0);
+	}
+
+	void beginDrain()
+	{
+		q_atomic_set_int(&signaled, 0);
+	}
+
+	bool pop(T *v)
+	{
+		Node *t = tail;
+		Node *next = load(&t->next);
+		if(t == &stub)
+		{
+			if(!next)
+				return false;
+			tail = next;
+			t = next;
+			next = load(&next->next);
+		}
+		if(!next)
+		{
+			// a producer is between its exchange and its link
+			if(t != load(&head))
+				return false;
+
+			// 't' is the last node, put the stub behind it so that it
+			//   can be handed out
+			stub.next = 0;
+			enqueue(&stub);
+			next = load(&t->next);
+			if(!next)
+				return false;
+		}
+		tail = next;
+		*v = t->value;
+		delete t;
+		return true;
+	}
+
+private:
+	class Node
+	{
+	public:
+		Node * volatile next;
+		T value;
+	};
+
+	Node * volatile head; // producers
+	Node *tail;           // consumer
+	Node stub;
+	volatile int signaled;
+
+	void enqueue(Node *n)
+	{
+		Node *prev = (Node *)q_atomic_set_ptr(&head, n);
+		q_atomic_set_ptr(&prev->next, n);
+	}
+
+	// a read with a barrier.  Qt has no plain atomic load, but swapping
+	//   the value for itself only succeeds if it was read correctly
+	static Node *load(Node * volatile *p)
+	{
+		while(1)
+		{
+			Node *v = *p;
+			if(q_atomic_test_and_set_ptr(p, v, v))
+				return v;
+		}
+	}
+
+	CSMpscQueue(const CSMpscQueue &);
+	CSMpscQueue & operator=(const CSMpscQueue &);
+};
+
+// CS_NAMESPACE_END
+
+#endif
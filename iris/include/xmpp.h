@@ -141,6 +141,10 @@ namespace XMPP
 	signals:
 		void srvLookup(const QString &server);
 		void srvResult(bool success);
+
+		// the address about to be connected to.  the receiver may call
+		//   done() to stop there, if it has another way to reach it
+		void hostResolved(const QHostAddress &addr, quint16 port);
 		//void httpSyncStarted();
 		//void httpSyncFinished();
 
@@ -250,6 +254,16 @@ namespace XMPP
 		static bool validNode(const QString &s, QString *norm=0);
 		static bool validResource(const QString &s, QString *norm=0);
 
+		// the valid* functions remember recent results, and jids built
+		//   from the same text share the normalized strings
+		class CacheStats
+		{
+		public:
+			quint64 hits, misses;
+			quint64 usecSaved; // estimated from the average miss
+		};
+		static CacheStats cacheStats();
+
 		// TODO: kill these later
 		const QString & host() const { return d; }
 		const QString & user() const { return n; }
@@ -310,11 +324,21 @@ namespace XMPP
 
 		bool isNull() const;
 
+		// a copy with a document of its own, so that it can be handed to
+		//   another thread.  stanzas made by a stream otherwise all share
+		//   the stream's document
+		Stanza detached() const;
+
 		QDomElement element() const;
 		QString toString() const;
 
 		QDomDocument & doc() const;
 		QString baseNS() const;
+
+		// bytes it takes as utf-8.  a lazy stanza is measured by the text
+		//   it arrived as, anything else is serialized to find out
+		int utf8Size() const;
+
 		QDomElement createElement(const QString &ns, const QString &tagName);
 		QDomElement createTextElement(const QString &ns, const QString &tagName, const QString &text);
 		void appendChild(const QDomElement &e);
@@ -340,6 +364,16 @@ namespace XMPP
 		void setError(const Error &err);
 		void clearError();
 
+		// kind(), to(), from(), id() and type() keep what they read from
+		//   the element.  over the stanzas released so far, how often
+		//   they were called and how often they had to read it
+		class AttrStats
+		{
+		public:
+			quint64 stanzas, lookups, domReads;
+		};
+		static AttrStats attrStats();
+
 	private:
 		friend class Stream;
 		Stanza(Stream *s, Kind k, const Jid &to, const QString &type, const QString &id);
@@ -387,6 +421,13 @@ namespace XMPP
 
 		static QString xmlToString(const QDomElement &e, bool clip=false);
 
+	protected:
+		// a lazy stanza only has its tag and attributes built, and keeps
+		//   the original xml until something needs the children
+		Stanza createLazyStanza(const QDomElement &e, const QString &xml);
+		static QString lazyStanzaXml(const Stanza &s); // empty if not lazy
+		static QDomElement stanzaElement(const Stanza &s, QString *ns); // as built, in namespace 'ns'
+
 	signals:
 		void connectionClosed();
 		void delayedCloseFinished();
@@ -484,9 +525,11 @@ namespace XMPP
 		bool old() const;
 
 		void close();
+		void closeWithError(int streamCond); // sends <stream:error/> first
 		bool stanzaAvailable() const;
 		Stanza read();
 		void write(const Stanza &s);
+		int bytesToWrite() const; // handed to the connection, not yet on the wire
 
 		int errorCondition() const;
 		QString errorText() const;
@@ -495,8 +538,10 @@ namespace XMPP
 		// extra
 		void writeDirect(const QString &s);
 		void setNoopTime(int mills);
+		void setLazyStanzas(bool);
 
 		void dialbackRequestGrant(const Jid &to, const Jid &from, bool ok);
+		void requestDialback(const Jid &to, const Jid &from, const QString &key); // another domain pair on an outbound s2s stream, answered by dialbackResult()
 		void dialbackVerifyRequestGrant(const Jid &to, const Jid &from, const QString &id, bool ok);
 
 	signals:
@@ -511,6 +556,7 @@ namespace XMPP
 		void dialbackVerifyResult(const Jid &from, bool ok);
 		void incomingXml(const QString &s);
 		void outgoingXml(const QString &s);
+		void bytesWritten(int);
 
 	public slots:
 		void continueAfterWarning();
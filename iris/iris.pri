@@ -11,6 +11,7 @@ INCLUDEPATH += $$IRIS_BASE/include $$IRIS_BASE/xmpp-core #$$IRIS_BASE/xmpp-im $$
 
 HEADERS += \
 	$$IRIS_BASE/xmpp-core/hash.h \
+	$$IRIS_BASE/xmpp-core/credentials.h \
 	$$IRIS_BASE/xmpp-core/simplesasl.h \
 	$$IRIS_BASE/xmpp-core/securestream.h \
 	$$IRIS_BASE/xmpp-core/parser.h \
@@ -32,6 +33,7 @@ SOURCES += \
 	$$IRIS_BASE/xmpp-core/tlshandler.cpp \
 	$$IRIS_BASE/xmpp-core/jid.cpp \
 	$$IRIS_BASE/xmpp-core/hash.cpp \
+	$$IRIS_BASE/xmpp-core/credentials.cpp \
 	$$IRIS_BASE/xmpp-core/simplesasl.cpp \
 	$$IRIS_BASE/xmpp-core/securestream.cpp \
 	$$IRIS_BASE/xmpp-core/parser.cpp \
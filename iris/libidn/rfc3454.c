@@ -3539,3 +3539,32 @@ Stringprep_table_element stringprep_rfc3454_D_2[] = {
   { 0 },
 };
 
+
+/*
+ * Entry counts of the tables above, without the terminator.  Every
+ * table is sorted by code point, so these allow a binary search.
+ *
+ */
+
+#define TABLE_SIZE(t) { t, sizeof (t) / sizeof (t[0]) - 1 }
+
+Stringprep_table_size stringprep_rfc3454_sizes[] = {
+  TABLE_SIZE (stringprep_rfc3454_A_1),
+  TABLE_SIZE (stringprep_rfc3454_B_1),
+  TABLE_SIZE (stringprep_rfc3454_B_2),
+  TABLE_SIZE (stringprep_rfc3454_B_3),
+  TABLE_SIZE (stringprep_rfc3454_C_1_1),
+  TABLE_SIZE (stringprep_rfc3454_C_1_2),
+  TABLE_SIZE (stringprep_rfc3454_C_2_1),
+  TABLE_SIZE (stringprep_rfc3454_C_2_2),
+  TABLE_SIZE (stringprep_rfc3454_C_3),
+  TABLE_SIZE (stringprep_rfc3454_C_4),
+  TABLE_SIZE (stringprep_rfc3454_C_5),
+  TABLE_SIZE (stringprep_rfc3454_C_6),
+  TABLE_SIZE (stringprep_rfc3454_C_7),
+  TABLE_SIZE (stringprep_rfc3454_C_8),
+  TABLE_SIZE (stringprep_rfc3454_C_9),
+  TABLE_SIZE (stringprep_rfc3454_D_1),
+  TABLE_SIZE (stringprep_rfc3454_D_2),
+  { 0 },
+};
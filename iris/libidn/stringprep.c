@@ -21,16 +21,49 @@
 
 #include "internal.h"
 
+/* Number of entries in TABLE if it is one of the sorted RFC 3454
+   tables, or -1 if it has to be scanned. */
+static ssize_t
+stringprep_table_size (Stringprep_table_element * table)
+{
+  size_t i;
+
+  for (i = 0; stringprep_rfc3454_sizes[i].table; i++)
+    if (stringprep_rfc3454_sizes[i].table == table)
+      return stringprep_rfc3454_sizes[i].size;
+
+  return -1;
+}
+
 static ssize_t
 stringprep_find_character_in_table (my_uint32_t ucs4,
-				    Stringprep_table_element * table)
+				    Stringprep_table_element * table,
+				    ssize_t size)
 {
-  ssize_t i;
+  ssize_t i, lo, hi;
 
-  for (i = 0; table[i].start; i++)
-    if (ucs4 >= table[i].start &&
-	ucs4 <= (table[i].end ? table[i].end : table[i].start))
-      return i;
+  if (size < 0)
+    {
+      for (i = 0; table[i].start || table[i].end; i++)
+	if (ucs4 >= table[i].start &&
+	    ucs4 <= (table[i].end ? table[i].end : table[i].start))
+	  return i;
+
+      return -1;
+    }
+
+  lo = 0;
+  hi = size - 1;
+  while (lo <= hi)
+    {
+      i = (lo + hi) / 2;
+      if (ucs4 < table[i].start)
+	hi = i - 1;
+      else if (ucs4 > (table[i].end ? table[i].end : table[i].start))
+	lo = i + 1;
+      else
+	return i;
+    }
 
   return -1;
 }
@@ -43,9 +76,10 @@ stringprep_find_string_in_table (my_uint32_t * ucs4,
 {
   size_t j;
   ssize_t pos;
+  ssize_t size = stringprep_table_size (table);
 
   for (j = 0; j < ucs4len; j++)
-    if ((pos = stringprep_find_character_in_table (ucs4[j], table)) != -1)
+    if ((pos = stringprep_find_character_in_table (ucs4[j], table, size)) != -1)
       {
 	if (tablepos)
 	  *tablepos = pos;
@@ -84,6 +118,22 @@ stringprep_apply_table_to_string (my_uint32_t * ucs4,
   return STRINGPREP_OK;
 }
 
+/* Strings up to this long that are plain ASCII are prepared on the
+   stack. */
+#define STRINGPREP_ASCII_MAX 64
+
+static int
+stringprep_ucs4_is_ascii (const my_uint32_t * ucs4, size_t ucs4len)
+{
+  size_t i;
+
+  for (i = 0; i < ucs4len; i++)
+    if (ucs4[i] >= 0x80)
+      return 0;
+
+  return 1;
+}
+
 #define INVERTED(x) ((x) & ((~0UL) >> 1))
 #define UNAPPLICAPLEFLAGS(flags, profileflags) \
   ((!INVERTED(profileflags) && !(profileflags & flags) && profileflags) || \
@@ -125,14 +175,33 @@ stringprep (char *in,
   my_uint32_t *q = 0;
   my_uint32_t *ucs4;
   size_t ucs4len, maxucs4len;
+  my_uint32_t ascii[4 * STRINGPREP_ASCII_MAX + 10];
+
+  /* Short ASCII strings, which is nearly all of them, skip the UTF-8
+     conversion and the allocation.  They still go through every table
+     step below. */
+  for (ucs4len = 0; ucs4len <= STRINGPREP_ASCII_MAX && in[ucs4len];
+       ucs4len++)
+    if ((unsigned char) in[ucs4len] >= 0x80)
+      break;
 
-  ucs4 = stringprep_utf8_to_ucs4 (in, -1, &ucs4len);
-  maxucs4len = 4 * ucs4len + 10;	/* XXX */
-  ucs4 = realloc (ucs4, 1 + maxucs4len * sizeof (my_uint32_t));
-  if (!ucs4)
+  if (ucs4len <= STRINGPREP_ASCII_MAX && !in[ucs4len])
     {
-      rc = STRINGPREP_MALLOC_ERROR;
-      goto done;
+      for (j = 0; j < ucs4len; j++)
+	ascii[j] = (unsigned char) in[j];
+      ucs4 = ascii;
+      maxucs4len = 4 * ucs4len + 10;
+    }
+  else
+    {
+      ucs4 = stringprep_utf8_to_ucs4 (in, -1, &ucs4len);
+      maxucs4len = 4 * ucs4len + 10;	/* XXX */
+      ucs4 = realloc (ucs4, 1 + maxucs4len * sizeof (my_uint32_t));
+      if (!ucs4)
+	{
+	  rc = STRINGPREP_MALLOC_ERROR;
+	  goto done;
+	}
     }
 
   for (i = 0; profile[i].operation; i++)
@@ -152,6 +221,10 @@ stringprep (char *in,
 	      goto done;
 	    }
 
+	  /* NFKC leaves ASCII alone */
+	  if (stringprep_ucs4_is_ascii (ucs4, ucs4len))
+	    break;
+
 	  q = stringprep_ucs4_nfkc_normalize (ucs4, ucs4len);
 
 	  if (!q)
@@ -163,7 +236,8 @@ stringprep (char *in,
 	  for (j = 0; q[j]; j++)
 	    ;
 
-	  free (ucs4);
+	  if (ucs4 != ascii)
+	    free (ucs4);
 	  ucs4 = q;
 	  ucs4len = j;
 	  q = 0;
@@ -258,10 +332,13 @@ stringprep (char *in,
 
 	    if (contains_ral != -1)
 	      {
+		ssize_t size =
+		  stringprep_table_size (profile[contains_ral].table);
 		if (!(stringprep_find_character_in_table
-		      (ucs4[0], profile[contains_ral].table) != -1 &&
+		      (ucs4[0], profile[contains_ral].table, size) != -1 &&
 		      stringprep_find_character_in_table
-		      (ucs4[ucs4len - 1], profile[contains_ral].table) != -1))
+		      (ucs4[ucs4len - 1], profile[contains_ral].table,
+		       size) != -1))
 		  {
 		    rc = STRINGPREP_BIDI_LEADTRAIL_NOT_RAL;
 		    goto done;
@@ -277,15 +354,30 @@ stringprep (char *in,
 	}
     }
 
-  p = stringprep_ucs4_to_utf8 (ucs4, ucs4len, 0, 0);
-
-  if (strlen (p) >= maxlen)
+  if (stringprep_ucs4_is_ascii (ucs4, ucs4len))
     {
-      rc = STRINGPREP_TOO_SMALL_BUFFER;
-      goto done;
+      if (ucs4len >= maxlen)
+	{
+	  rc = STRINGPREP_TOO_SMALL_BUFFER;
+	  goto done;
+	}
+
+      for (j = 0; j < ucs4len; j++)
+	in[j] = (char) ucs4[j];
+      in[ucs4len] = '\0';
     }
+  else
+    {
+      p = stringprep_ucs4_to_utf8 (ucs4, ucs4len, 0, 0);
 
-  strcpy (in, p);		/* flawfinder: ignore */
+      if (strlen (p) >= maxlen)
+	{
+	  rc = STRINGPREP_TOO_SMALL_BUFFER;
+	  goto done;
+	}
+
+      strcpy (in, p);		/* flawfinder: ignore */
+    }
 
   rc = STRINGPREP_OK;
 
@@ -294,7 +386,7 @@ done:
     free (p);
   if (q)
     free (q);
-  if (ucs4)
+  if (ucs4 && ucs4 != ascii)
     free (ucs4);
   return rc;
 }
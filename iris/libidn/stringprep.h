@@ -129,6 +129,15 @@ typedef int ssize_t;
   extern Stringprep_table_element stringprep_rfc3454_D_1[];
   extern Stringprep_table_element stringprep_rfc3454_D_2[];
 
+  struct Stringprep_table_size
+  {
+    Stringprep_table_element *table;
+    size_t size;
+  };
+  typedef struct Stringprep_table_size Stringprep_table_size;
+
+  extern Stringprep_table_size stringprep_rfc3454_sizes[];
+
   /* Generic (for debugging) */
 
   extern Stringprep_profile stringprep_generic[];
@@ -46,8 +46,7 @@
 #include "httppoll.h"
 #include "socks.h"
 #include "hash.h"
-
-#define XMPP_DEBUG
+#include "cslog.h"
 
 using namespace XMPP;
 
@@ -386,7 +385,7 @@ int AdvancedConnector::errorCode() const
 void AdvancedConnector::do_resolve()
 {
 #ifdef NO_NDNS
-	printf("resolving (aaaa=%d)\n", d->aaaa);
+	CS_DEBUG(Net, "resolving (aaaa=%d)", d->aaaa);
 	d->qdns = new QDns;
 	connect(d->qdns, SIGNAL(resultsReady()), SLOT(dns_done()));
 	if(d->aaaa)
@@ -441,64 +440,52 @@ void AdvancedConnector::dns_done()
 #endif
 
 	if(failed) {
-#ifdef XMPP_DEBUG
-		printf("dns1\n");
-#endif
+		CS_TRACE(Net, "dns1");
 		// using proxy?  then try the unresolved host through the proxy
 		/*if(d->proxy.type() != Proxy::None) {
-#ifdef XMPP_DEBUG
-			printf("dns1.1\n");
-#endif
+			CS_TRACE(Net, "dns1.1");
 			do_connect();
 		}
 		else*/ if(d->using_srv) {
-#ifdef XMPP_DEBUG
-			printf("dns1.2\n");
-#endif
+			CS_TRACE(Net, "dns1.2");
 			if(d->servers.isEmpty()) {
-#ifdef XMPP_DEBUG
-				printf("dns1.2.1\n");
-#endif
+				CS_TRACE(Net, "dns1.2.1");
 				cleanup();
 				d->errorCode = ErrConnectionRefused;
 				error();
 			}
 			else {
-#ifdef XMPP_DEBUG
-				printf("dns1.2.2\n");
-#endif
+				CS_TRACE(Net, "dns1.2.2");
 				tryNextSrv();
 				return;
 			}
 		}
 		else {
-#ifdef XMPP_DEBUG
-			printf("dns1.3\n");
-#endif
+			CS_TRACE(Net, "dns1.3");
 			cleanup();
 			d->errorCode = ErrHostNotFound;
 			error();
 		}
 	}
 	else {
-#ifdef XMPP_DEBUG
-		printf("dns2\n");
-#endif
+		CS_TRACE(Net, "dns2");
 		d->host = addr.toString();
+
+		QPointer<QObject> self = this;
+		hostResolved(addr, d->port);
+		if(!self || d->mode != Connecting)
+			return;
+
 		do_connect();
 	}
 }
 
 void AdvancedConnector::do_connect()
 {
-#ifdef XMPP_DEBUG
-	printf("trying %s:%d\n", d->host.toLatin1().data(), d->port);
-#endif
+	CS_DEBUG(Net, "trying %s:%d", d->host.toLatin1().data(), d->port);
 	//int t = d->proxy.type();
 	//if(t == Proxy::None) {
-#ifdef XMPP_DEBUG
-		printf("do_connect1\n");
-#endif
+		CS_TRACE(Net, "do_connect1");
 		BSocket *s = new BSocket;
 		d->bs = s;
 		connect(s, SIGNAL(connected()), SLOT(bs_connected()));
@@ -506,9 +493,7 @@ void AdvancedConnector::do_connect()
 		s->connectToHost(d->host, d->port);
 	/*}
 	else if(t == Proxy::HttpConnect) {
-#ifdef XMPP_DEBUG
-		printf("do_connect2\n");
-#endif
+		CS_TRACE(Net, "do_connect2");
 		HttpConnect *s = new HttpConnect;
 		d->bs = s;
 		connect(s, SIGNAL(connected()), SLOT(bs_connected()));
@@ -518,9 +503,7 @@ void AdvancedConnector::do_connect()
 		s->connectToHost(d->proxy.host(), d->proxy.port(), d->host, d->port);
 	}
 	else if(t == Proxy::Socks) {
-#ifdef XMPP_DEBUG
-		printf("do_connect3\n");
-#endif
+		CS_TRACE(Net, "do_connect3");
 		SocksClient *s = new SocksClient;
 		d->bs = s;
 		connect(s, SIGNAL(connected()), SLOT(bs_connected()));
@@ -533,9 +516,7 @@ void AdvancedConnector::do_connect()
 
 void AdvancedConnector::tryNextSrv()
 {
-#ifdef XMPP_DEBUG
-	printf("trying next srv\n");
-#endif
+	CS_DEBUG(Net, "trying next srv");
 	d->host = d->servers.first().name;
 	d->port = d->servers.first().port;
 	d->servers.removeFirst();
@@ -545,33 +526,25 @@ void AdvancedConnector::tryNextSrv()
 void AdvancedConnector::srv_done()
 {
 	QPointer<QObject> self = this;
-#ifdef XMPP_DEBUG
-	printf("srv_done1\n");
-#endif
+	CS_TRACE(Net, "srv_done1");
 	d->servers = d->srv.servers();
 	if(d->servers.isEmpty()) {
 		srvResult(false);
 		if(!self)
 			return;
 
-#ifdef XMPP_DEBUG
-		printf("srv_done1.1\n");
-#endif
+		CS_TRACE(Net, "srv_done1.1");
 		// fall back to A record
 		d->using_srv = false;
 		d->host = d->server;
 		if(d->opt_probe) {
-#ifdef XMPP_DEBUG
-			printf("srv_done1.1.1\n");
-#endif
+			CS_TRACE(Net, "srv_done1.1.1");
 			d->probe_mode = 0;
 			d->port = 5223;
 			d->will_be_ssl = true;
 		}
 		else {
-#ifdef XMPP_DEBUG
-			printf("srv_done1.1.2\n");
-#endif
+			CS_TRACE(Net, "srv_done1.1.2");
 			d->probe_mode = 1;
 			d->port = 5269;
 		}
@@ -617,9 +590,7 @@ void AdvancedConnector::bs_error(int x)
 	int err = ErrConnectionRefused;
 	//int t = d->proxy.type();
 
-#ifdef XMPP_DEBUG
-	printf("bse1\n");
-#endif
+	CS_TRACE(Net, "bse1");
 
 	// figure out the error
 	//if(t == Proxy::None) {
@@ -683,24 +654,18 @@ void AdvancedConnector::bs_error(int x)
 	}
 
 	if(d->using_srv && !d->servers.isEmpty()) {
-#ifdef XMPP_DEBUG
-		printf("bse1.1\n");
-#endif
+		CS_TRACE(Net, "bse1.1");
 		tryNextSrv();
 	}
 	else if(!d->using_srv && d->opt_probe && d->probe_mode == 0) {
-#ifdef XMPP_DEBUG
-		printf("bse1.2\n");
-#endif
+		CS_TRACE(Net, "bse1.2");
 		d->probe_mode = 1;
 		d->port = 5222;
 		d->will_be_ssl = false;
 		do_connect();
 	}
 	else {
-#ifdef XMPP_DEBUG
-		printf("bse1.3\n");
-#endif
+		CS_TRACE(Net, "bse1.3");
 		cleanup();
 		d->errorCode = ErrConnectionRefused;
 		error();
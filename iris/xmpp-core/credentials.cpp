@@ -0,0 +1,220 @@
+/*
+ * credentials.cpp - user credentials for authenticating clients
+ * Copyright (C) 2005  Justin Karneges
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+#include "credentials.h"
+
+#include <qca.h>
+#include "base64.h"
+#include "cslog.h"
+
+// how often to look at the file, in seconds
+#define CHECK_INTERVAL 1
+
+namespace XMPP
+{
+
+static QByteArray hmacSha1(const QByteArray &key, const QByteArray &msg)
+{
+	QByteArray k = key;
+	if(k.size() > 64)
+		k = QCA::SHA1::hash(k);
+	k.append(QByteArray(64 - k.size(), 0));
+
+	QByteArray ipad(64, 0), opad(64, 0);
+	for(int n = 0; n < 64; ++n) {
+		ipad[n] = k[n] ^ 0x36;
+		opad[n] = k[n] ^ 0x5c;
+	}
+	return QCA::SHA1::hash(opad + QCA::SHA1::hash(ipad + msg));
+}
+
+static bool parseLine(const QString &line, QString *user, CredentialStore::Entry *e)
+{
+	QStringList entry = line.split(':');
+	if(entry.count() < 2 || entry[0].isEmpty())
+		return false;
+
+	*user = entry[0];
+	if(entry.count() == 5 && entry[1] == "SCRAM-SHA-1") {
+		bool ok;
+		e->salt = Base64::decode(entry[2].toLatin1());
+		e->iterations = entry[3].toInt(&ok);
+		e->saltedPassword = Base64::decode(entry[4].toLatin1());
+		if(!ok || e->iterations < 1 || e->salt.isEmpty() || e->saltedPassword.size() != 20)
+			return false;
+	}
+	else
+		e->password = entry[1];
+	return true;
+}
+
+//----------------------------------------------------------------------------
+// CredentialStore
+//----------------------------------------------------------------------------
+CredentialStore::Entry::Entry()
+{
+	iterations = 0;
+}
+
+class CredentialStore::Private
+{
+public:
+	QMutex m;
+	QString fname;
+	QHash<QString, Entry> users;
+	uint lastCheck;
+	QDateTime mtime;
+	qint64 size;
+
+	// call with m locked
+	void checkFile()
+	{
+		uint now = QDateTime::currentDateTime().toTime_t();
+		if(lastCheck != 0 && now - lastCheck < CHECK_INTERVAL)
+			return;
+		lastCheck = now;
+
+		QFileInfo fi(fname);
+		if(!fi.exists()) {
+			if(!users.isEmpty()) {
+				CS_WARN(Store, "%s is gone, no users", qPrintable(fname));
+				users.clear();
+			}
+			mtime = QDateTime();
+			return;
+		}
+		if(fi.lastModified() == mtime && fi.size() == size)
+			return;
+		mtime = fi.lastModified();
+		size = fi.size();
+
+		QFile f(fname);
+		if(!f.open(QIODevice::ReadOnly)) {
+			CS_WARN(Store, "unable to read %s, keeping the old users", qPrintable(fname));
+			return;
+		}
+
+		QHash<QString, Entry> list;
+		QTextStream ts(&f);
+		int bad = 0;
+		while(!ts.atEnd()) {
+			QString line = ts.readLine();
+			if(line.isEmpty())
+				continue;
+			QString user;
+			Entry e;
+			if(parseLine(line, &user, &e))
+				list.insert(user, e);
+			else
+				++bad;
+		}
+		users = list;
+		CS_INFO(Store, "loaded %d users from %s", users.count(), qPrintable(fname));
+		if(bad > 0)
+			CS_WARN(Store, "%d bad lines in %s", bad, qPrintable(fname));
+	}
+};
+
+CredentialStore::CredentialStore()
+{
+	d = new Private;
+	d->fname = "userdb";
+	d->lastCheck = 0;
+	d->size = -1;
+}
+
+CredentialStore::~CredentialStore()
+{
+	delete d;
+}
+
+CredentialStore *CredentialStore::instance()
+{
+	static CredentialStore store;
+	return &store;
+}
+
+void CredentialStore::setFileName(const QString &fname)
+{
+	QMutexLocker locker(&d->m);
+	d->fname = fname;
+	d->lastCheck = 0;
+	d->mtime = QDateTime();
+	d->size = -1;
+}
+
+QString CredentialStore::fileName() const
+{
+	QMutexLocker locker(&d->m);
+	return d->fname;
+}
+
+bool CredentialStore::find(const QString &user, Entry *e)
+{
+	QMutexLocker locker(&d->m);
+	d->checkFile();
+	QHash<QString, Entry>::ConstIterator it = d->users.find(user);
+	if(it == d->users.end())
+		return false;
+	if(e)
+		*e = it.value();
+	return true;
+}
+
+bool CredentialStore::checkPassword(const QString &user, const QString &pass)
+{
+	Entry e;
+	if(!find(user, &e))
+		return false;
+
+	// no lock needed for hashing, it may take a while
+	if(e.saltedPassword.isEmpty())
+		return (pass == e.password);
+	return (saltedPassword(pass, e.salt, e.iterations) == e.saltedPassword);
+}
+
+int CredentialStore::count()
+{
+	QMutexLocker locker(&d->m);
+	d->checkFile();
+	return d->users.count();
+}
+
+QByteArray CredentialStore::saltedPassword(const QString &pass, const QByteArray &salt, int iterations)
+{
+	QByteArray key = pass.toUtf8();
+
+	// U1 := HMAC(pass, salt + INT(1)), Un := HMAC(pass, Un-1)
+	QByteArray first = salt;
+	first.append(char(0));
+	first.append(char(0));
+	first.append(char(0));
+	first.append(char(1));
+	QByteArray u = hmacSha1(key, first);
+	QByteArray out = u;
+	for(int n = 1; n < iterations; ++n) {
+		u = hmacSha1(key, u);
+		for(int i = 0; i < out.size(); ++i)
+			out[i] = out[i] ^ u[i];
+	}
+	return out;
+}
+
+}
@@ -0,0 +1,72 @@
+/*
+ * credentials.h - user credentials for authenticating clients
+ * Copyright (C) 2005  Justin Karneges
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+#ifndef XMPP_CREDENTIALS_H
+#define XMPP_CREDENTIALS_H
+
+#include <QtCore>
+
+namespace XMPP
+{
+	// Users and their credentials, read from a file of 'user:password'
+	// lines.  Instead of the password, a line can hold a salted hash:
+	//
+	//   user:SCRAM-SHA-1:<base64 salt>:<iterations>:<base64 salted password>
+	//
+	// where the salted password is Hi(password, salt, iterations) from
+	// SCRAM (PBKDF2 with HMAC-SHA1).  The file is read once, and is read
+	// again when its modification time or size changes; the new set
+	// replaces the old one all at once, so a lookup never sees it half
+	// loaded.  Safe to use from any thread.
+	class CredentialStore
+	{
+	public:
+		class Entry
+		{
+		public:
+			Entry();
+
+			QString password;          // empty if only the hash is known
+			QByteArray salt;
+			int iterations;
+			QByteArray saltedPassword;
+		};
+
+		static CredentialStore *instance();
+
+		void setFileName(const QString &fname);
+		QString fileName() const;
+
+		bool find(const QString &user, Entry *e);
+		bool checkPassword(const QString &user, const QString &pass);
+		int count();
+
+		static QByteArray saltedPassword(const QString &pass, const QByteArray &salt, int iterations);
+
+	private:
+		class Private;
+		Private *d;
+
+		CredentialStore();
+		~CredentialStore();
+	};
+}
+
+#endif
@@ -22,8 +22,134 @@
 
 #include <stringprep.h>
 
+#ifdef Q_OS_UNIX
+# include <sys/time.h>
+#endif
+
 using namespace XMPP;
 
+//----------------------------------------------------------------------------
+// StringPrepCache
+//----------------------------------------------------------------------------
+// entries per profile, across both generations
+#define PREP_CACHE_MAX 8192
+
+enum { PrepDomain, PrepNode, PrepResource, PrepCount };
+
+static Stringprep_profile *prep_profiles[PrepCount] =
+{
+	stringprep_nameprep,
+	stringprep_xmpp_nodeprep,
+	stringprep_xmpp_resourceprep
+};
+
+static quint64 prep_usec()
+{
+#ifdef Q_OS_UNIX
+	struct timeval tv;
+	gettimeofday(&tv, 0);
+	return (quint64)tv.tv_sec * 1000000 + tv.tv_usec;
+#else
+	return 0;
+#endif
+}
+
+static bool prep(int profile, const QString &s, QString *norm)
+{
+	QByteArray cs = s.toUtf8();
+	cs.resize(1024);
+	if(stringprep(cs.data(), 1024, (Stringprep_profile_flags)0, prep_profiles[profile]) != 0)
+		return false;
+	*norm = QString::fromUtf8(cs);
+	return true;
+}
+
+class StringPrepCache
+{
+public:
+	class Entry
+	{
+	public:
+		bool ok;
+		QString norm;
+	};
+
+	// two generations: when 'cur' fills up it becomes 'old', so anything
+	//   used since the last turnover survives it
+	QMutex m;
+	QHash<QString, Entry> cur[PrepCount], old[PrepCount];
+	quint64 hits, misses, missUsec;
+
+	StringPrepCache()
+	{
+		hits = 0;
+		misses = 0;
+		missUsec = 0;
+	}
+
+	bool valid(int profile, const QString &s, QString *norm)
+	{
+		{
+			QMutexLocker locker(&m);
+			const Entry *e = 0;
+			QHash<QString, Entry>::ConstIterator it = cur[profile].find(s);
+			if(it != cur[profile].end())
+				e = &it.value();
+			else {
+				it = old[profile].find(s);
+				if(it != old[profile].end()) {
+					// copy, the insert may replace 'old'
+					Entry found = it.value();
+					e = &insert(profile, s, found).value();
+				}
+			}
+			if(e) {
+				++hits;
+				if(norm && e->ok)
+					*norm = e->norm;
+				return e->ok;
+			}
+		}
+
+		// not known, do it outside of the lock
+		Entry e;
+		quint64 start = prep_usec();
+		e.ok = prep(profile, s, &e.norm);
+		quint64 spent = prep_usec() - start;
+
+		// keep a single copy of text that is already normalized
+		if(e.ok && e.norm == s)
+			e.norm = s;
+
+		QMutexLocker locker(&m);
+		++misses;
+		missUsec += spent;
+		insert(profile, s, e);
+		if(norm && e.ok)
+			*norm = e.norm;
+		return e.ok;
+	}
+
+	// call with m locked
+	QHash<QString, Entry>::Iterator insert(int profile, const QString &s, const Entry &e)
+	{
+		if(cur[profile].count() >= PREP_CACHE_MAX / 2) {
+			old[profile] = cur[profile];
+			cur[profile].clear();
+		}
+		return cur[profile].insert(s, e);
+	}
+};
+
+static StringPrepCache *prep_cache()
+{
+	static StringPrepCache cache;
+	return &cache;
+}
+
+//----------------------------------------------------------------------------
+// Jid
+//----------------------------------------------------------------------------
 Jid::Jid()
 {
 	valid = false;
@@ -210,33 +336,26 @@ bool Jid::compare(const Jid &a, bool compareRes) const
 
 bool Jid::validDomain(const QString &s, QString *norm)
 {
-	QByteArray cs = s.toUtf8();
-	cs.resize(1024);
-	if(stringprep(cs.data(), 1024, (Stringprep_profile_flags)0, stringprep_nameprep) != 0)
-		return false;
-	if(norm)
-		*norm = QString::fromUtf8(cs);
-	return true;
+	return prep_cache()->valid(PrepDomain, s, norm);
 }
 
 bool Jid::validNode(const QString &s, QString *norm)
 {
-	QByteArray cs = s.toUtf8();
-	cs.resize(1024);
-	if(stringprep(cs.data(), 1024, (Stringprep_profile_flags)0, stringprep_xmpp_nodeprep) != 0)
-		return false;
-	if(norm)
-		*norm = QString::fromUtf8(cs);
-	return true;
+	return prep_cache()->valid(PrepNode, s, norm);
 }
 
 bool Jid::validResource(const QString &s, QString *norm)
 {
-	QByteArray cs = s.toUtf8();
-	cs.resize(1024);
-	if(stringprep(cs.data(), 1024, (Stringprep_profile_flags)0, stringprep_xmpp_resourceprep) != 0)
-		return false;
-	if(norm)
-		*norm = QString::fromUtf8(cs);
-	return true;
+	return prep_cache()->valid(PrepResource, s, norm);
+}
+
+Jid::CacheStats Jid::cacheStats()
+{
+	StringPrepCache *c = prep_cache();
+	QMutexLocker locker(&c->m);
+	CacheStats st;
+	st.hits = c->hits;
+	st.misses = c->misses;
+	st.usecSaved = c->misses > 0 ? c->hits * c->missUsec / c->misses : 0;
+	return st;
 }
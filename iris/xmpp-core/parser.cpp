@@ -49,11 +49,73 @@
 
 #include "parser.h"
 
+#include "cslog.h"
+
 using namespace XMPP;
 
 static bool qt_bug_check = false;
 static bool qt_bug_have;
 
+// high bit of every byte in a word, for skipping over ascii
+static const quint64 ascii_mask = Q_UINT64_C(0x8080808080808080);
+
+// the utf-8 sequence at 'p'.  returns how many bytes it takes, with the
+//   character in 'uc' (U+FFFD for a malformed byte), or 0 if 'end' cuts
+//   it off before it is complete
+static int decodeUtf8Char(const uchar *p, const uchar *end, uint *uc)
+{
+	uchar c = *p;
+	if(c < 0x80) {
+		*uc = c;
+		return 1;
+	}
+
+	int need;
+	uint v, min;
+	if((c & 0xe0) == 0xc0) {
+		need = 1;
+		v = c & 0x1f;
+		min = 0x80;
+	}
+	else if((c & 0xf0) == 0xe0) {
+		need = 2;
+		v = c & 0x0f;
+		min = 0x800;
+	}
+	else if((c & 0xf8) == 0xf0) {
+		need = 3;
+		v = c & 0x07;
+		min = 0x10000;
+	}
+	else {
+		*uc = QChar::ReplacementCharacter;
+		return 1;
+	}
+
+	// split across chunks?  wait for the rest
+	int avail = end - p - 1;
+	if(avail < need) {
+		int k = 1;
+		while(k <= avail && (p[k] & 0xc0) == 0x80)
+			++k;
+		if(k > avail)
+			return 0;
+	}
+
+	int k = 1;
+	for(; k <= need && k <= avail; ++k) {
+		if((p[k] & 0xc0) != 0x80)
+			break;
+		v = (v << 6) | (p[k] & 0x3f);
+	}
+	if(k <= need || v < min || v > 0x10ffff || (v >= 0xd800 && v <= 0xdfff)) {
+		*uc = QChar::ReplacementCharacter;
+		return 1;
+	}
+	*uc = v;
+	return need + 1;
+}
+
 //----------------------------------------------------------------------------
 // StreamInput
 //----------------------------------------------------------------------------
@@ -77,7 +139,13 @@ public:
 		dec = 0;
 		in.resize(0);
 		out = "";
+		outPos = 0;
+		outAt = 0;
+		partAt = 0;
+		peeked = false;
 		at = 0;
+		utf8 = false;
+		skipBom = false;
 		paused = false;
 		mightChangeEncoding = true;
 		checkBad = true;
@@ -98,9 +166,19 @@ public:
 
 	void appendData(const QByteArray &a)
 	{
+		// everything read already?  then take the caller's buffer as it
+		//   is.  'in' is only read through constData(), so sharing it
+		//   doesn't cost a copy
+		if(firstKept() == (int)in.size()) {
+			in = a;
+			at = 0;
+			processBuf();
+			return;
+		}
+
 		int oldsize = in.size();
 		in.resize(oldsize + a.size());
-		memcpy(in.data() + oldsize, a.data(), a.size());
+		memcpy(in.data() + oldsize, a.constData(), a.size());
 		processBuf();
 	}
 
@@ -122,32 +200,40 @@ public:
 	QChar readNext(bool peek=false)
 	{
 		QChar c;
+		bool ok = false;
 		if(mightChangeEncoding)
 			c = EndOfData;
 		else {
-			if(out.isEmpty()) {
+			// decoded text is consumed by moving a cursor over it, and
+			//   only replaced once it has all been read
+			if(outPos >= out.length()) {
 				QString s;
-				if(!tryExtractPart(&s))
-					c = EndOfData;
-				else {
+				if(tryExtractPart(&s)) {
 					out = s;
-					c = out[0];
+					outPos = 0;
+					outAt = partAt;
+					ok = true;
 				}
 			}
 			else
-				c = out[0];
-			if(!peek)
-				out.remove(0, 1);
+				ok = true;
+
+			if(ok) {
+				c = out[outPos];
+				if(!peeked)
+					last_string += c;
+				peeked = peek;
+				if(!peek)
+					++outPos;
+			}
+			else
+				c = EndOfData;
 		}
-		if(c == EndOfData) {
-#ifdef XMPP_PARSER_DEBUG
-			printf("next() = EOD\n");
-#endif
+		if(!ok) {
+			CS_TRACE(Parser, "next() = EOD");
 		}
 		else {
-#ifdef XMPP_PARSER_DEBUG
-			printf("next() = [%c]\n", c.latin1());
-#endif
+			CS_TRACE(Parser, "next() = [%c]", c.latin1());
 			last = c;
 		}
 
@@ -156,9 +242,28 @@ public:
 
 	QByteArray unprocessed() const
 	{
-		QByteArray a(in.size() - at, 0);
-		memcpy(a.data(), in.data() + at, a.size());
-		return a;
+		// utf-8 is decoded ahead of the reader, so what hasn't been read
+		//   yet is still in 'in', from the byte that follows the last
+		//   char read.  a peeked char counts as read.  the bytes are
+		//   handed back as they came, after a layer switch they aren't
+		//   text anymore
+		int from = at;
+		if(unreadPart()) {
+			int units = outPos + (peeked ? 1 : 0);
+			const uchar *start = (const uchar *)in.constData() + outAt;
+			const uchar *end = (const uchar *)in.constData() + in.size();
+			const uchar *p = start;
+			for(int n = 0; n < units && p < end;) {
+				uint uc;
+				int len = decodeUtf8Char(p, end, &uc);
+				if(len == 0)
+					break;
+				p += len;
+				n += uc >= 0x10000 ? 2 : 1;
+			}
+			from = outAt + (p - start);
+		}
+		return in.mid(from);
 	}
 
 	void pause(bool b)
@@ -180,7 +285,12 @@ private:
 	QTextDecoder *dec;
 	QByteArray in;
 	QString out;
+	int outPos;
+	int outAt;  // where the bytes of 'out' start in 'in' (utf-8 only)
+	int partAt; // same, for the part tryExtractPart() last returned
+	bool peeked;
 	int at;
+	bool utf8, skipBom;
 	bool paused;
 	bool mightChangeEncoding;
 	QChar last;
@@ -188,14 +298,24 @@ private:
 	QString last_string;
 	bool checkBad;
 
+	// whether 'out' was decoded from 'in' and not all of it was read
+	bool unreadPart() const
+	{
+		return utf8 && !mightChangeEncoding && outPos + (peeked ? 1 : 0) < out.length();
+	}
+
+	// the first byte of 'in' that is still needed
+	int firstKept() const
+	{
+		return unreadPart() ? outAt : at;
+	}
+
 	void processBuf()
 	{
-#ifdef XMPP_PARSER_DEBUG
-		printf("processing.  size=%d, at=%d\n", in.size(), at);
-#endif
+		CS_TRACE(Parser, "processing.  size=%d, at=%d", in.size(), at);
 		if(!dec) {
 			QTextCodec *codec = 0;
-			uchar *p = (uchar *)in.data() + at;
+			const uchar *p = (const uchar *)in.constData() + at;
 			int size = in.size() - at;
 
 			// do we have enough information to determine the encoding?
@@ -218,6 +338,8 @@ private:
 
 			v_encoding = codec->name();
 			dec = codec->makeDecoder();
+			utf8 = !utf16;
+			skipBom = utf8;
 
 			// for utf16, put in the byte order mark
 			if(utf16) {
@@ -245,10 +367,14 @@ private:
 							v_encoding = codec->name();
 							delete dec;
 							dec = codec->makeDecoder();
+							utf8 = (codec->mibEnum() == 106);
 						}
 						mightChangeEncoding = false;
 						out.truncate(0);
+						outPos = 0;
+						peeked = false;
 						at = 0;
+						skipBom = utf8;
 						resetLastData();
 						break;
 					}
@@ -260,7 +386,10 @@ private:
 					// go to the parser
 					mightChangeEncoding = false;
 					out.truncate(0);
+					outPos = 0;
+					peeked = false;
 					at = 0;
+					skipBom = utf8;
 					resetLastData();
 					break;
 				}
@@ -303,29 +432,111 @@ private:
 		int size = in.size() - at;
 		if(size == 0)
 			return false;
-		uchar *p = (uchar *)in.data() + at;
-		QString nextChars;
-		while(1) {
-			nextChars = dec->toUnicode((const char *)p, 1);
-			++p;
-			++at;
-			if(!nextChars.isEmpty())
-				break;
-			if(at == (int)in.size())
+
+		// a byte order mark isn't part of the document
+		if(utf8 && skipBom) {
+			const char *p = in.constData() + at;
+			if(size < 3 && memcmp(p, "\xef\xbb\xbf", size) == 0)
 				return false;
+			skipBom = false;
+			if(size >= 3 && memcmp(p, "\xef\xbb\xbf", 3) == 0) {
+				at += 3;
+				if(at == (int)in.size())
+					return false;
+			}
 		}
-		last_string += nextChars;
-		*s = nextChars;
 
-		// free processed data?
-		if(at >= 1024) {
-			char *p = in.data();
-			int size = in.size() - at;
-			memmove(p, p + at, size);
-			in.resize(size);
-			at = 0;
+		int start = at;
+		if(utf8) {
+			if(!decodeUtf8(s))
+				return false;
+		}
+		else {
+			const uchar *p = (const uchar *)in.constData() + at;
+			QString nextChars;
+			while(1) {
+				nextChars = dec->toUnicode((const char *)p, 1);
+				++p;
+				++at;
+				if(!nextChars.isEmpty())
+					break;
+				if(at == (int)in.size())
+					return false;
+			}
+			*s = nextChars;
+		}
+
+		// free processed data?  the bytes of this part stay, in case
+		//   unprocessed() needs them
+		if(start >= 1024) {
+			int size = in.size() - start;
+			if(size == 0)
+				in.resize(0);
+			else {
+				char *p = in.data();
+				memmove(p, p + start, size);
+				in.resize(size);
+			}
+			at -= start;
+			start = 0;
+		}
+		partAt = start;
+
+		return true;
+	}
+
+	// decodes all of the complete utf-8 sequences available in one go.  a
+	//   sequence split at the end of the data is left in 'in' until the
+	//   rest of it arrives, and malformed bytes become U+FFFD (see
+	//   decodeUtf8Char()).
+	bool decodeUtf8(QString *s)
+	{
+		int size = in.size() - at;
+		const uchar *start = (const uchar *)in.constData() + at;
+		const uchar *p = start;
+		const uchar *end = start + size;
+
+		// never more utf-16 units than bytes
+		QString buf;
+		buf.resize(size);
+		ushort *o = (ushort *)buf.data();
+		int len = 0;
+
+		while(p < end) {
+			// ascii runs, a word at a time
+			while(end - p >= 8) {
+				quint64 w;
+				memcpy(&w, p, 8);
+				if(w & ascii_mask)
+					break;
+				for(int n = 0; n < 8; ++n)
+					o[len++] = p[n];
+				p += 8;
+			}
+			if(p == end)
+				break;
+
+			uint uc;
+			int n = decodeUtf8Char(p, end, &uc);
+			if(n == 0)
+				break;
+			p += n;
+
+			if(uc >= 0x10000) {
+				uc -= 0x10000;
+				o[len++] = 0xd800 + (uc >> 10);
+				o[len++] = 0xdc00 + (uc & 0x3ff);
+			}
+			else
+				o[len++] = uc;
 		}
 
+		at += p - start;
+		buf.resize(len);
+
+		if(buf.isEmpty())
+			return false;
+		*s = buf;
 		return true;
 	}
 
@@ -358,6 +569,9 @@ namespace XMPP
 			in = _in;
 			doc = _doc;
 			needMore = false;
+			lazyStanzas = false;
+			lazy = false;
+			topDeclares = false;
 		}
 
 		~ParserHandler()
@@ -384,6 +598,8 @@ namespace XMPP
 				nsnames += prefix;
 				nsvalues += uri;
 			}
+			else if(depth == 1)
+				topDeclares = true;
 			return true;
 		}
 
@@ -399,6 +615,20 @@ namespace XMPP
 						a.append(atts.qName(n), uri, ln, atts.value(n));
 				}
 				e->setDocumentOpen(namespaceURI, localName, qName, a, nsnames, nsvalues);
+
+				// remember the document's declarations for lazy elements
+				docNS = QString();
+				docPrefixes.clear();
+				docContext = QString();
+				for(int n = 0; n < nsnames.count(); ++n) {
+					if(nsnames[n].isEmpty())
+						docNS = nsvalues[n];
+					else {
+						docPrefixes += nsnames[n];
+						docContext += QString(" xmlns:") + nsnames[n] + "=\"" + nsvalues[n] + '"';
+					}
+				}
+
 				nsnames.clear();
 				nsvalues.clear();
 				e->setActualString(in->lastString());
@@ -407,6 +637,17 @@ namespace XMPP
 				eventList.append(e);
 				in->pause(true);
 			}
+			else if(lazy) {
+				// only watch for prefixes that come from the document
+				if(!needContext) {
+					if(usesDocPrefix(qName))
+						needContext = true;
+					for(int n = 0; n < atts.length(); ++n) {
+						if(usesDocPrefix(atts.qName(n)))
+							needContext = true;
+					}
+				}
+			}
 			else {
 				QDomElement e = doc->createElementNS(namespaceURI, qName);
 				for(int n = 0; n < atts.length(); ++n) {
@@ -427,6 +668,18 @@ namespace XMPP
 				if(depth == 1) {
 					elem = e;
 					current = e;
+
+					// plain stanza in the document's namespace?  then
+					//   skip building its children
+					if(lazyStanzas && !topDeclares && namespaceURI == docNS && qName == localName && (localName == "message" || localName == "presence" || localName == "iq")) {
+						lazy = true;
+						needContext = false;
+						for(int n = 0; n < atts.length(); ++n) {
+							if(usesDocPrefix(atts.qName(n)))
+								needContext = true;
+						}
+					}
+					topDeclares = false;
 				}
 				else {
 					current.appendChild(e);
@@ -454,6 +707,10 @@ namespace XMPP
 					Parser::Event *e = new Parser::Event;
 					e->setElement(elem);
 					e->setActualString(in->lastString());
+					if(lazy) {
+						e->setLazy(needContext ? docContext : QString());
+						lazy = false;
+					}
 					in->resetLastData();
 					eventList.append(e);
 					in->pause(true);
@@ -461,7 +718,7 @@ namespace XMPP
 					elem = QDomElement();
 					current = QDomElement();
 				}
-				else
+				else if(!lazy)
 					current = current.parentNode().toElement();
 			}
 
@@ -473,7 +730,7 @@ namespace XMPP
 
 		bool characters(const QString &str)
 		{
-			if(depth >= 1) {
+			if(depth >= 1 && !lazy) {
 				QString content = str;
 				if(content.isEmpty())
 					return true;
@@ -488,7 +745,7 @@ namespace XMPP
 
 		/*bool processingInstruction(const QString &target, const QString &data)
 		{
-			printf("Processing: [%s], [%s]\n", target.latin1(), data.latin1());
+			CS_TRACE(Parser, "Processing: [%s], [%s]", target.latin1(), data.latin1());
 			in->resetLastData();
 			return true;
 		}*/
@@ -543,6 +800,19 @@ namespace XMPP
 		QDomElement elem, current;
 		QList<Parser::Event*> eventList;
 		bool needMore;
+
+		bool lazyStanzas;
+		bool lazy, needContext, topDeclares;
+		QString docNS, docContext;
+		QStringList docPrefixes;
+
+		bool usesDocPrefix(const QString &qName) const
+		{
+			int x = qName.indexOf(':');
+			if(x == -1)
+				return false;
+			return docPrefixes.contains(qName.left(x));
+		}
 	};
 };
 
@@ -559,6 +829,8 @@ public:
 	QDomElement e;
 	QString str;
 	QStringList nsnames, nsvalues;
+	bool lazy;
+	QString context;
 };
 
 Parser::Event::Event()
@@ -669,6 +941,7 @@ void Parser::Event::setElement(const QDomElement &elem)
 		d = new Private;
 	d->type = Element;
 	d->e = elem;
+	d->lazy = false;
 }
 
 void Parser::Event::setError()
@@ -683,6 +956,34 @@ void Parser::Event::setActualString(const QString &str)
 	d->str = str;
 }
 
+bool Parser::Event::isLazy() const
+{
+	return (d && d->type == Element && d->lazy);
+}
+
+QString Parser::Event::lazyContext() const
+{
+	return d->context;
+}
+
+void Parser::Event::setLazy(const QString &context)
+{
+	d->lazy = true;
+	d->context = context;
+}
+
+void Parser::Event::expand()
+{
+	if(!isLazy())
+		return;
+	QDomDocument doc = d->e.ownerDocument();
+	QDomElement e = Parser::elementFromString(d->str, d->e.namespaceURI(), d->context, &doc);
+	if(!e.isNull())
+		d->e = e;
+	d->lazy = false;
+	d->context = QString();
+}
+
 //----------------------------------------------------------------------------
 // Parser
 //----------------------------------------------------------------------------
@@ -695,6 +996,7 @@ public:
 		in = 0;
 		handler = 0;
 		reader = 0;
+		lazyStanzas = false;
 		reset();
 	}
 
@@ -714,6 +1016,7 @@ public:
 			doc = new QDomDocument;
 			in = new StreamInput;
 			handler = new ParserHandler(in, doc);
+			handler->lazyStanzas = lazyStanzas;
 			reader = new QXmlSimpleReader;
 			reader->setContentHandler(handler);
 
@@ -728,6 +1031,7 @@ public:
 	StreamInput *in;
 	ParserHandler *handler;
 	QXmlSimpleReader *reader;
+	bool lazyStanzas;
 };
 
 Parser::Parser()
@@ -793,3 +1097,31 @@ QString Parser::encoding() const
 {
 	return d->in->encoding();
 }
+
+void Parser::setLazyStanzas(bool b)
+{
+	d->lazyStanzas = b;
+	d->handler->lazyStanzas = b;
+}
+
+QDomElement Parser::elementFromString(const QString &xml, const QString &defaultNS, const QString &context, QDomDocument *doc)
+{
+	// wrap it, so that it inherits the namespaces it would have had
+	QString wrapped = QString("<lazy xmlns=\"") + defaultNS + '"' + context + '>' + xml + "</lazy>";
+
+	QXmlInputSource src;
+	src.setData(wrapped);
+	QXmlSimpleReader reader;
+	reader.setFeature("http://xml.org/sax/features/namespaces", true);
+	reader.setFeature("http://xml.org/sax/features/namespace-prefixes", false);
+	reader.setFeature("http://trolltech.com/xml/features/report-whitespace-only-CharData", true);
+
+	QDomDocument tmp;
+	if(!tmp.setContent(&src, &reader))
+		return QDomElement();
+	for(QDomNode n = tmp.documentElement().firstChild(); !n.isNull(); n = n.nextSibling()) {
+		if(n.isElement())
+			return doc->importNode(n, true).toElement();
+	}
+	return QDomElement();
+}
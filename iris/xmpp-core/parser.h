@@ -56,6 +56,14 @@ namespace XMPP
 			// for element
 			QDomElement element() const;
 
+			// for a lazy element, element() only has the tag and its
+			//   attributes, and actualString() is the complete xml.  if
+			//   lazyContext() isn't empty, the xml relies on prefixes
+			//   declared by the document and can't stand on its own.
+			bool isLazy() const;
+			QString lazyContext() const;
+			void expand();
+
 			// for any
 			QString actualString() const;
 
@@ -65,6 +73,7 @@ namespace XMPP
 			void setElement(const QDomElement &elem);
 			void setError();
 			void setActualString(const QString &);
+			void setLazy(const QString &context);
 
 		private:
 			class Private;
@@ -77,6 +86,13 @@ namespace XMPP
 		QByteArray unprocessed() const;
 		QString encoding() const;
 
+		// report message/presence/iq elements lazily (see Event::isLazy)
+		void setLazyStanzas(bool b);
+
+		// build the element for xml text in the given default namespace,
+		//   owned by 'doc'.  'context' holds extra xmlns declarations.
+		static QDomElement elementFromString(const QString &xml, const QString &defaultNS, const QString &context, QDomDocument *doc);
+
 	private:
 		class Private;
 		Private *d;
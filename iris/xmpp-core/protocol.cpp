@@ -28,6 +28,8 @@
 #include <qca.h>
 #include "base64.h"
 #include "hash.h"
+#include "cslog.h"
+#include "credentials.h"
 
 #ifdef XMPP_TEST
 #include "td.h"
@@ -68,20 +70,6 @@ static QDomElement firstChildElement(const QDomElement &e)
 	return QDomElement();
 }
 
-static QString lookupUserPassword(const QString &user)
-{
-	QFile f("userdb");
-	if(f.open(QIODevice::ReadOnly)) {
-		QTextStream ts(&f);
-		while(!ts.atEnd()) {
-			QStringList entry = ts.readLine().split(':');
-			if(entry[0] == user)
-				return entry[1];
-		}
-	}
-	return QString();
-}
-
 //----------------------------------------------------------------------------
 // Version
 //----------------------------------------------------------------------------
@@ -186,13 +174,25 @@ void BasicProtocol::reset()
 	sasl_mechlist.clear();
 	sasl_step.resize(0);
 	stanzaToRecv = QDomElement();
+	stanzaToRecvXml = QString();
 	sendList.clear();
 }
 
-void BasicProtocol::sendStanza(const QDomElement &e)
+void BasicProtocol::sendStanza(const QDomElement &e, const QString &fromNS, const QString &toNS)
 {
 	SendItem i;
 	i.stanzaToSend = doc.importNode(e, true).toElement();
+	if(fromNS != toNS) {
+		i.stanzaFromNS = fromNS;
+		i.stanzaToNS = toNS;
+	}
+	sendList += i;
+}
+
+void BasicProtocol::sendStanzaString(const QString &xml)
+{
+	SendItem i;
+	i.stanzaStringToSend = xml;
 	sendList += i;
 }
 
@@ -210,13 +210,28 @@ void BasicProtocol::sendWhitespace()
 	sendList += i;
 }
 
-QDomElement BasicProtocol::recvStanza()
+QDomElement BasicProtocol::recvStanza(QString *xml)
 {
 	QDomElement e = stanzaToRecv;
+	if(xml)
+		*xml = stanzaToRecvXml;
 	stanzaToRecv = QDomElement();
+	stanzaToRecvXml = QString();
 	return e;
 }
 
+void BasicProtocol::setStanzaToRecv(const QDomElement &e)
+{
+	stanzaToRecv = e;
+	stanzaToRecvXml = lazyXml;
+}
+
+bool BasicProtocol::acceptsLazyElements() const
+{
+	// only stanzas that are handed to the application can stay lazy
+	return isReady();
+}
+
 void BasicProtocol::shutdown()
 {
 	doShutdown = true;
@@ -552,7 +567,13 @@ bool BasicProtocol::doStep(const QDomElement &e)
 			// outgoing stanza?
 			if(!i.stanzaToSend.isNull()) {
 				++stanzasPending;
-				writeElement(i.stanzaToSend, TypeStanza, true);
+				writeElement(i.stanzaToSend, TypeStanza, true, false, i.stanzaFromNS, i.stanzaToNS);
+				event = ESend;
+			}
+			// outgoing stanza, already serialized?
+			else if(!i.stanzaStringToSend.isEmpty()) {
+				++stanzasPending;
+				writeString(i.stanzaStringToSend, TypeStanza, true);
 				event = ESend;
 			}
 			// direct send?
@@ -795,7 +816,7 @@ void CoreProtocol::sendDialbackVerifyGrant(const Jid &to, const Jid &from, const
 
 bool CoreProtocol::loginComplete()
 {
-	printf("Login Complete\n");
+	CS_DEBUG(Protocol, "Login Complete");
 	setReady(true);
 
 	event = EReady;
@@ -1077,7 +1098,7 @@ bool CoreProtocol::dialbackStep(const QDomElement &e)
 				}
 				else {
 					bool ok = (e.attribute("type") == "valid") ? true: false;
-					printf("*** got here ***\n");
+					CS_TRACE(Protocol, "*** got here ***");
 					DBItem i;
 					if(grabPendingItem(from, to, DBItem::VerifyRequest, &i)) {
 						if(ok) {
@@ -1094,7 +1115,7 @@ bool CoreProtocol::dialbackStep(const QDomElement &e)
 						}
 					}
 					else
-						printf("not found\n");
+						CS_DEBUG(Protocol, "not found");
 				}
 			}
 		}
@@ -1104,12 +1125,12 @@ bool CoreProtocol::dialbackStep(const QDomElement &e)
 					if(isIncoming()) {
 						Jid from = e.attribute("from");
 						from = from.domain();
-						printf("verifying sender: [%s]\n", from.full().toLatin1().data());
+						CS_DEBUG(Protocol, "verifying sender: [%s]", from.full().toLatin1().data());
 						bool valid = false;
 						for(int n = 0; n < dbvalidated.size(); ++n) {
 							DBItem &i = dbvalidated[n];
 							Jid j = i.to.domain();
-							printf("  with: [%s]\n", j.full().toLatin1().data());
+							CS_DEBUG(Protocol, "  with: [%s]", j.full().toLatin1().data());
 							if(j.compare(from)) {
 								valid = true;
 								break;
@@ -1119,7 +1140,7 @@ bool CoreProtocol::dialbackStep(const QDomElement &e)
 						if(!valid)
 							return error(0);
 
-						stanzaToRecv = e;
+						setStanzaToRecv(e);
 						event = EStanzaReady;
 						return true;
 					}
@@ -1376,7 +1397,7 @@ bool CoreProtocol::normalStep(const QDomElement &e)
 		event = ESASLSuccess;
 		spare = resetStream();
 		step = Start;
-		printf("sasl success\n");
+		CS_DEBUG(Protocol, "sasl success");
 		return true;
 	}
 	else if(step == GetFeatures) {
@@ -1636,7 +1657,7 @@ bool CoreProtocol::normalStep(const QDomElement &e)
 	}
 	// server
 	else if(step == GetRequest) {
-		printf("get request: [%s], %s\n", e.namespaceURI().toLatin1().data(), e.tagName().toLatin1().data());
+		CS_DEBUG(Protocol, "get request: [%s], %s", e.namespaceURI().toLatin1().data(), e.tagName().toLatin1().data());
 		if(e.namespaceURI() == NS_TLS && e.localName() == "starttls") {
 			// TODO: don't let this be done twice
 
@@ -1650,7 +1671,7 @@ bool CoreProtocol::normalStep(const QDomElement &e)
 			if(e.localName() == "auth") {
 				if(sasl_started) {
 					// TODO
-					printf("error\n");
+					CS_DEBUG(Protocol, "error");
 					return false;
 				}
 
@@ -1664,7 +1685,7 @@ bool CoreProtocol::normalStep(const QDomElement &e)
 			}
 			else {
 				// TODO
-				printf("unknown sasl tag\n");
+				CS_DEBUG(Protocol, "unknown sasl tag");
 				return false;
 			}
 		}
@@ -1725,7 +1746,15 @@ bool CoreProtocol::normalStep(const QDomElement &e)
 						QDomElement u = doc.createElement("username");
 						u.appendChild(doc.createTextNode(user));
 						rq.appendChild(u);
-						rq.appendChild(doc.createElement("digest"));
+
+						// digest needs the password itself, so users that
+						//   only have a salted hash get plain instead, but
+						//   only over tls
+						CredentialStore::Entry ce;
+						if(tls_started && CredentialStore::instance()->find(user, &ce) && ce.password.isEmpty())
+							rq.appendChild(doc.createElement("password"));
+						else
+							rq.appendChild(doc.createElement("digest"));
 						rq.appendChild(doc.createElement("resource"));
 					}
 					r.appendChild(rq);
@@ -1737,13 +1766,28 @@ bool CoreProtocol::normalStep(const QDomElement &e)
 				else if(type == "set") {
 					user = q.elementsByTagName("username").item(0).toElement().text();
 					resource = q.elementsByTagName("resource").item(0).toElement().text();
-					QString digest = q.elementsByTagName("digest").item(0).toElement().text();
-
-					QString user_pass = lookupUserPassword(user);
-					QByteArray cs = id.toUtf8() + user_pass.toUtf8();
-					QString our_digest = QCA::SHA1::hashToString(cs);
-					if(user.isEmpty() || digest != our_digest) {
-						printf("bad login\n");
+					QDomElement de = q.elementsByTagName("digest").item(0).toElement();
+					QDomElement pe = q.elementsByTagName("password").item(0).toElement();
+
+					bool ok = false;
+					if(!user.isEmpty()) {
+						if(!de.isNull()) {
+							CredentialStore::Entry ce;
+							if(CredentialStore::instance()->find(user, &ce) && !ce.password.isEmpty()) {
+								QByteArray cs = id.toUtf8() + ce.password.toUtf8();
+								ok = (de.text() == QCA::SHA1::hashToString(cs));
+							}
+						}
+						else if(!pe.isNull() && tls_started) {
+							// plain is only for users that can't do digest,
+							//   so it can't be used to downgrade the others
+							CredentialStore::Entry ce;
+							if(CredentialStore::instance()->find(user, &ce) && ce.password.isEmpty())
+								ok = CredentialStore::instance()->checkPassword(user, pe.text());
+						}
+					}
+					if(!ok) {
+						CS_INFO(Protocol, "bad login");
 						return error(0);
 					}
 
@@ -1767,7 +1811,7 @@ bool CoreProtocol::normalStep(const QDomElement &e)
 
 	if(isReady()) {
 		if(!e.isNull() && isValidStanza(e)) {
-			stanzaToRecv = e;
+			setStanzaToRecv(e);
 			event = EStanzaReady;
 			setIncomingAsExternal();
 			return true;
@@ -143,10 +143,11 @@ namespace XMPP
 		void setSASLAuthed();
 
 		// send / recv
-		void sendStanza(const QDomElement &e);
+		void sendStanza(const QDomElement &e, const QString &fromNS=QString(), const QString &toNS=QString()); // renaming 'fromNS' to 'toNS'
+		void sendStanzaString(const QString &xml); // already serialized
 		void sendDirect(const QString &s);
 		void sendWhitespace();
-		QDomElement recvStanza();
+		QDomElement recvStanza(QString *xml=0); // xml is set if the stanza is lazy
 
 		// shutdown
 		void shutdown();
@@ -190,6 +191,7 @@ namespace XMPP
 		bool handleCloseFinished();
 		bool doStep(const QDomElement &e);
 		void itemWritten(int id, int size);
+		bool acceptsLazyElements() const;
 
 		virtual QString defaultNamespace();
 		virtual QStringList extraNamespaces(); // stringlist: prefix,uri,prefix,uri, [...]
@@ -204,6 +206,9 @@ namespace XMPP
 		bool sasl_authed;
 
 		QDomElement stanzaToRecv;
+		QString stanzaToRecvXml;
+
+		void setStanzaToRecv(const QDomElement &e);
 
 	private:
 		struct SASLCondEntry
@@ -223,6 +228,8 @@ namespace XMPP
 		struct SendItem
 		{
 			QDomElement stanzaToSend;
+			QString stanzaFromNS, stanzaToNS;
+			QString stanzaStringToSend;
 			QString stringToSend;
 			bool doWhitespace;
 		};
@@ -307,7 +307,7 @@ class SecureStream::Private
 public:
 	ByteStream *bs;
 	QList<SecureLayer*> layers;
-	int pending;
+	int pending; // plain bytes written but not yet on the wire, only a count
 	int errorCode;
 	bool active;
 	bool topInProgress;
@@ -601,6 +601,7 @@ void SecureStream::writeRawData(const QByteArray &a)
 	d->bs->write(a);
 }
 
+// decrypted data goes into ByteStream's read chain, nothing is kept here
 void SecureStream::incomingData(const QByteArray &a)
 {
 	appendRead(a);
@@ -250,6 +250,11 @@ public:
 		return false;
 	}
 
+	void setPasswordCheck(QCA::SASL::PasswordCheck)
+	{
+		// client only
+	}
+
 	int serverFirstStep(const QString &, const QByteArray *)
 	{
 		return Error;
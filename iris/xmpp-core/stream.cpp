@@ -48,17 +48,17 @@
 #include <stdlib.h>
 #include "bytestream.h"
 #include "base64.h"
+#include "cslog.h"
 #include "hash.h"
 #include "simplesasl.h"
 #include "securestream.h"
 #include "protocol.h"
+#include "credentials.h"
 
 #ifdef XMPP_TEST
 #include "td.h"
 #endif
 
-#define XMPP_DEBUG
-
 using namespace XMPP;
 
 static Debug *debug_ptr = 0;
@@ -67,6 +67,16 @@ void XMPP::setDebug(Debug *p)
 	debug_ptr = p;
 }
 
+// plaintext mechanisms of the SASL library check against our users
+static bool checkSASLPassword(const QString &user, const QString &pass)
+{
+	QString u = user;
+	int n = u.indexOf('@');
+	if(n != -1)
+		u.truncate(n);
+	return CredentialStore::instance()->checkPassword(u, pass);
+}
+
 static QByteArray randomArray(int size)
 {
 	QByteArray a(size, 0);
@@ -120,6 +130,16 @@ static QDomElement changeNS(const QDomElement &e, const QString &oldns, const QS
 	return i;
 }
 
+// one serializer per thread, it keeps state between calls
+static QThreadStorage<XmlProtocol*> thread_serializer;
+
+static XmlProtocol *serializer()
+{
+	if(!thread_serializer.hasLocalData())
+		thread_serializer.setLocalData(new CoreProtocol);
+	return thread_serializer.localData();
+}
+
 //----------------------------------------------------------------------------
 // Stanza
 //----------------------------------------------------------------------------
@@ -131,6 +151,37 @@ Stanza::Error::Error(int _type, int _condition, const QString &_text, const QDom
 	appSpec = _appSpec;
 }
 
+// what released stanzas did with their attribute cache.  taken once per
+//   stanza rather than per lookup
+class AttrTotals
+{
+public:
+	QMutex m;
+	Stanza::AttrStats st;
+
+	AttrTotals()
+	{
+		st.stanzas = 0;
+		st.lookups = 0;
+		st.domReads = 0;
+	}
+
+	void add(int lookups, int reads, bool copy)
+	{
+		QMutexLocker locker(&m);
+		if(!copy)
+			++st.stanzas;
+		st.lookups += lookups;
+		st.domReads += reads;
+	}
+};
+
+static AttrTotals *attr_totals()
+{
+	static AttrTotals totals;
+	return &totals;
+}
+
 class Stanza::Private
 {
 public:
@@ -206,9 +257,169 @@ public:
 		return QString();
 	}
 
+	// parsed top-level attributes.  copies of a stanza share the element,
+	//   so they share these as well, until one of them gets a new element.
+	//   a copy may be dropped on another thread (see detached())
+	class Attrs
+	{
+	public:
+		enum { HaveKind = 1, HaveTo = 2, HaveFrom = 4, HaveId = 8, HaveType = 16 };
+
+		QAtomic refs;
+		int have;
+		int kind;
+		Jid to, from;
+		QString id, type;
+
+		// for attrStats(), added to the totals when released.  'copy'
+		//   is set when a stanza already counted got a new element
+		int lookups, reads;
+		bool copy;
+
+		Attrs()
+		{
+			refs = 1;
+			have = 0;
+			lookups = 0;
+			reads = 0;
+			copy = false;
+		}
+
+		// a copy of the values, for a stanza that continues elsewhere
+		Attrs *clone() const
+		{
+			Attrs *a = new Attrs(*this);
+			a->refs = 1;
+			a->lookups = 0;
+			a->reads = 0;
+			a->copy = true;
+			return a;
+		}
+	};
+
+	static void release(Attrs *a)
+	{
+		if(a->refs.deref())
+			return;
+		if(a->lookups > 0)
+			attr_totals()->add(a->lookups, a->reads, a->copy);
+		delete a;
+	}
+
 	QString baseNS;
 	QDomDocument doc;
 	QDomElement e;
+	Attrs *attrs;
+
+	// the namespace the elements of 'e' were built in.  setBaseNS() only
+	//   changes 'baseNS', and the tree is moved over when someone asks
+	//   for it.  on the way to text the namespace is simply swapped
+	QString elemNS;
+
+	// for a lazy stanza, 'e' only has the tag and attributes
+	QString lazyXml;
+
+	Private()
+	{
+		attrs = new Attrs;
+	}
+
+	Private(const Private &from) : baseNS(from.baseNS), doc(from.doc), e(from.e), elemNS(from.elemNS), lazyXml(from.lazyXml)
+	{
+		attrs = from.attrs;
+		attrs->refs.ref();
+	}
+
+	~Private()
+	{
+		release(attrs);
+	}
+
+	// call after 'e' is replaced, the attribute values carry over
+	void detachAttrs()
+	{
+		if(attrs->refs == 1)
+			return;
+		Attrs *a = attrs->clone();
+		release(attrs);
+		attrs = a;
+	}
+
+	void expand()
+	{
+		if(lazyXml.isEmpty())
+			return;
+		QDomDocument owner = e.ownerDocument();
+		QDomElement full = Parser::elementFromString(lazyXml, baseNS, QString(), &owner);
+		lazyXml = QString();
+		if(full.isNull())
+			return;
+		elemNS = baseNS;
+
+		// the attributes may have been changed since
+		QDomNamedNodeMap al = full.attributes();
+		while(al.count() > 0)
+			full.removeAttributeNode(al.item(0).toAttr());
+		al = e.attributes();
+		for(uint x = 0; x < (uint)al.count(); ++x) {
+			QDomAttr a = al.item(x).cloneNode().toAttr();
+			full.setAttributeNodeNS(a);
+		}
+		e = full;
+		detachAttrs();
+	}
+
+	// bring the tree in line with 'baseNS'
+	void rebind()
+	{
+		expand();
+		if(elemNS == baseNS)
+			return;
+		e = changeNS(e, elemNS, baseNS);
+		elemNS = baseNS;
+		detachAttrs();
+	}
+
+	// the original xml, with the start tag rebuilt from 'e'
+	QString lazyToString() const
+	{
+		int start = lazyXml.indexOf('<');
+		if(start == -1)
+			return QString();
+
+		// find the end of the start tag
+		int n;
+		QChar q;
+		for(n = start + 1; n < lazyXml.length(); ++n) {
+			QChar c = lazyXml[n];
+			if(!q.isNull()) {
+				if(c == q)
+					q = QChar();
+			}
+			else if(c == '"' || c == '\'')
+				q = c;
+			else if(c == '>')
+				break;
+		}
+		if(n >= lazyXml.length())
+			return QString();
+		bool empty = (lazyXml[n - 1] == '/');
+
+		QString out = QString("<") + e.tagName();
+		QDomNamedNodeMap al = e.attributes();
+		for(uint x = 0; x < (uint)al.count(); ++x) {
+			QDomAttr a = al.item(x).toAttr();
+			QString name;
+			if(a.namespaceURI() == NS_XML)
+				name = QString("xml:") + a.localName();
+			else
+				name = a.name();
+			out += ' ' + name + "=\"" + escapeXml(a.value()) + '"';
+		}
+		out += empty ? "/>" : ">";
+		out += lazyXml.mid(n + 1);
+		return out;
+	}
 };
 
 Stanza::Private::ErrorTypeEntry Stanza::Private::errorTypeTable[] =
@@ -260,6 +471,7 @@ Stanza::Stanza(Kind k, const Jid &to, const QString &type, const QString &id)
 		kind = Message;
 
 	d->baseNS = "jabber:client";
+	d->elemNS = d->baseNS;
 	d->e = d->doc.createElementNS(d->baseNS, Private::kindToString(kind));
 	if(to.isValid())
 		setTo(to);
@@ -282,6 +494,7 @@ Stanza::Stanza(Stream *s, Kind k, const Jid &to, const QString &type, const QStr
 	d->doc = s->doc();
 	d->e = d->doc.createElementNS(d->baseNS, Private::kindToString(kind));
 	d->baseNS = s->baseNS();
+	d->elemNS = d->baseNS;
 	if(to.isValid())
 		setTo(to);
 	if(!type.isEmpty())
@@ -302,6 +515,7 @@ Stanza::Stanza(Stream *s, const QDomElement &e)
 	d->doc = s->doc();
 	d->e = e;
 	d->baseNS = s->baseNS();
+	d->elemNS = d->baseNS;
 }
 
 Stanza::Stanza(const Stanza &from)
@@ -329,14 +543,60 @@ bool Stanza::isNull() const
 	return (d ? false: true);
 }
 
+Stanza Stanza::detached() const
+{
+	Stanza s;
+	if(!d)
+		return s;
+	s.d = new Private;
+	s.d->baseNS = d->baseNS;
+	s.d->elemNS = d->elemNS;
+	s.d->e = s.d->doc.importNode(d->e, true).toElement();
+	s.d->lazyXml = d->lazyXml;
+	delete s.d->attrs;
+	s.d->attrs = d->attrs->clone();
+	return s;
+}
+
 QDomElement Stanza::element() const
 {
+	d->rebind();
+
+	// the caller may change it behind our back
+	d->attrs->have = 0;
 	return d->e;
 }
 
 QString Stanza::toString() const
 {
-	return Stream::xmlToString(d->e);
+	if(!d->lazyXml.isEmpty())
+		return d->lazyToString();
+	return serializer()->elementToString(d->e, false, d->elemNS, d->baseNS);
+}
+
+int Stanza::utf8Size() const
+{
+	if(d->lazyXml.isEmpty())
+		return serializer()->elementToUtf8(d->e, false, d->elemNS, d->baseNS).size();
+
+	// count it without encoding it
+	const QChar *p = d->lazyXml.unicode();
+	int len = d->lazyXml.length();
+	int size = 0;
+	for(int n = 0; n < len; ++n) {
+		ushort c = p[n].unicode();
+		if(c < 0x80)
+			size += 1;
+		else if(c < 0x800)
+			size += 2;
+		else if(c >= 0xd800 && c < 0xdc00 && n + 1 < len) {
+			size += 4;
+			++n;
+		}
+		else
+			size += 3;
+	}
+	return size;
 }
 
 QDomDocument & Stanza::doc() const
@@ -363,37 +623,83 @@ QDomElement Stanza::createTextElement(const QString &ns, const QString &tagName,
 
 void Stanza::appendChild(const QDomElement &e)
 {
+	// the child was most likely made for baseNS()
+	d->rebind();
 	d->e.appendChild(e);
 }
 
+Stanza::AttrStats Stanza::attrStats()
+{
+	AttrTotals *t = attr_totals();
+	QMutexLocker locker(&t->m);
+	return t->st;
+}
+
 Stanza::Kind Stanza::kind() const
 {
-	return (Kind)Private::stringToKind(d->e.tagName());
+	Private::Attrs *a = d->attrs;
+	++a->lookups;
+	if(!(a->have & Private::Attrs::HaveKind)) {
+		++a->reads;
+		a->kind = Private::stringToKind(d->e.tagName());
+		a->have |= Private::Attrs::HaveKind;
+	}
+	return (Kind)a->kind;
 }
 
 void Stanza::setKind(Kind k)
 {
+	d->expand();
 	d->e.setTagName(Private::kindToString(k));
+	d->attrs->have &= ~Private::Attrs::HaveKind;
 }
 
 Jid Stanza::to() const
 {
-	return Jid(d->e.attribute("to"));
+	Private::Attrs *a = d->attrs;
+	++a->lookups;
+	if(!(a->have & Private::Attrs::HaveTo)) {
+		++a->reads;
+		a->to = Jid(d->e.attribute("to"));
+		a->have |= Private::Attrs::HaveTo;
+	}
+	return a->to;
 }
 
 Jid Stanza::from() const
 {
-	return Jid(d->e.attribute("from"));
+	Private::Attrs *a = d->attrs;
+	++a->lookups;
+	if(!(a->have & Private::Attrs::HaveFrom)) {
+		++a->reads;
+		a->from = Jid(d->e.attribute("from"));
+		a->have |= Private::Attrs::HaveFrom;
+	}
+	return a->from;
 }
 
 QString Stanza::id() const
 {
-	return d->e.attribute("id");
+	Private::Attrs *a = d->attrs;
+	++a->lookups;
+	if(!(a->have & Private::Attrs::HaveId)) {
+		++a->reads;
+		a->id = d->e.attribute("id");
+		a->have |= Private::Attrs::HaveId;
+	}
+	return a->id;
 }
 
 QString Stanza::type() const
 {
-	return d->e.attribute("type");
+	Private::Attrs *a = d->attrs;
+	++a->lookups;
+	if(!(a->have & Private::Attrs::HaveType)) {
+		++a->reads;
+		a->type = d->e.attribute("type");
+		a->have |= Private::Attrs::HaveType;
+	}
+	return a->type;
 }
 
 QString Stanza::lang() const
@@ -404,21 +710,29 @@ QString Stanza::lang() const
 void Stanza::setTo(const Jid &j)
 {
 	d->e.setAttribute("to", j.full());
+	d->attrs->to = j;
+	d->attrs->have |= Private::Attrs::HaveTo;
 }
 
 void Stanza::setFrom(const Jid &j)
 {
 	d->e.setAttribute("from", j.full());
+	d->attrs->from = j;
+	d->attrs->have |= Private::Attrs::HaveFrom;
 }
 
 void Stanza::setId(const QString &id)
 {
 	d->e.setAttribute("id", id);
+	d->attrs->id = id;
+	d->attrs->have |= Private::Attrs::HaveId;
 }
 
 void Stanza::setType(const QString &type)
 {
 	d->e.setAttribute("type", type);
+	d->attrs->type = type;
+	d->attrs->have |= Private::Attrs::HaveType;
 }
 
 void Stanza::setLang(const QString &lang)
@@ -428,20 +742,16 @@ void Stanza::setLang(const QString &lang)
 
 void Stanza::setBaseNS(const QString &ns)
 {
-	// if same, do nothing
-	if(d->baseNS == ns)
-		return;
-
-	printf("changing ns: [%s] -> [%s]\n", d->baseNS.toLatin1().data(), ns.toLatin1().data());
-	QString oldns = d->baseNS;
+	// the tree is left alone until it is needed, see Private::elemNS.
+	//   lazy xml has no namespace of its own, it is applied on expansion
 	d->baseNS = ns;
-	d->e = changeNS(d->e, oldns, d->baseNS);
 }
 
 Stanza::Error Stanza::error() const
 {
+	d->expand();
 	Error err;
-	QDomElement e = d->e.elementsByTagNameNS(d->baseNS, "error").item(0).toElement();
+	QDomElement e = d->e.elementsByTagNameNS(d->elemNS, "error").item(0).toElement();
 	if(e.isNull())
 		return err;
 
@@ -488,10 +798,12 @@ Stanza::Error Stanza::error() const
 
 void Stanza::setError(const Error &err)
 {
+	d->expand();
+
 	// create the element if necessary
-	QDomElement errElem = d->e.elementsByTagNameNS(d->baseNS, "error").item(0).toElement();
+	QDomElement errElem = d->e.elementsByTagNameNS(d->elemNS, "error").item(0).toElement();
 	if(errElem.isNull()) {
-		errElem = d->e.ownerDocument().createElementNS(d->baseNS, "error");
+		errElem = d->e.ownerDocument().createElementNS(d->elemNS, "error");
 		d->e.appendChild(errElem);
 	}
 
@@ -508,7 +820,7 @@ void Stanza::setError(const Error &err)
 			return;
 
 		errElem.setAttribute("type", stype);
-		errElem.appendChild(d->e.ownerDocument().createElementNS(d->baseNS, scond));
+		errElem.appendChild(d->e.ownerDocument().createElementNS(d->elemNS, scond));
 	//}
 
 	// text
@@ -516,7 +828,7 @@ void Stanza::setError(const Error &err)
 	//	errElem.appendChild(d->e.ownerDocument().createTextNode(err.text));
 	//}
 	//else {
-		QDomElement te = d->e.ownerDocument().createElementNS(d->baseNS, "text");
+		QDomElement te = d->e.ownerDocument().createElementNS(d->elemNS, "text");
 		te.appendChild(d->e.ownerDocument().createTextNode(err.text));
 		errElem.appendChild(te);
 	//}
@@ -527,7 +839,8 @@ void Stanza::setError(const Error &err)
 
 void Stanza::clearError()
 {
-	QDomElement errElem = d->e.elementsByTagNameNS(d->baseNS, "error").item(0).toElement();
+	d->expand();
+	QDomElement errElem = d->e.elementsByTagNameNS(d->elemNS, "error").item(0).toElement();
 	if(!errElem.isNull())
 		d->e.removeChild(errElem);
 }
@@ -535,7 +848,6 @@ void Stanza::clearError()
 //----------------------------------------------------------------------------
 // Stream
 //----------------------------------------------------------------------------
-static XmlProtocol *foo = 0;
 Stream::Stream(QObject *parent)
 :QObject(parent)
 {
@@ -555,11 +867,31 @@ Stanza Stream::createStanza(const QDomElement &e)
 	return Stanza(this, e);
 }
 
+Stanza Stream::createLazyStanza(const QDomElement &e, const QString &xml)
+{
+	Stanza s(this, e);
+	if(!s.isNull())
+		s.d->lazyXml = xml;
+	return s;
+}
+
+QString Stream::lazyStanzaXml(const Stanza &s)
+{
+	if(s.isNull() || s.d->lazyXml.isEmpty())
+		return QString();
+	return s.d->lazyToString();
+}
+
 QString Stream::xmlToString(const QDomElement &e, bool clip)
 {
-	if(!foo)
-		foo = new CoreProtocol;
-	return foo->elementToString(e, clip);
+	return serializer()->elementToString(e, clip);
+}
+
+QDomElement Stream::stanzaElement(const Stanza &s, QString *ns)
+{
+	s.d->expand();
+	*ns = s.d->elemNS;
+	return s.d->e;
 }
 
 //----------------------------------------------------------------------------
@@ -865,9 +1197,9 @@ void ClientStream::accept()
 		QByteArray a = d->ss->read();
 		ByteStream::appendArray(&d->spare, a);
 
-		printf("starting tls server [spare=%d]\n", d->spare.size());
+		CS_DEBUG(Stream, "starting tls server [spare=%d]", d->spare.size());
 		if(!d->tls->startServer()) {
-			printf("unable to start server!\n");
+			CS_ERROR(Stream, "unable to start server!");
 			// TODO
 			return;
 		}
@@ -951,6 +1283,12 @@ void ClientStream::dialbackRequestGrant(const Jid &to, const Jid &from, bool ok)
 	processNext();
 }
 
+void ClientStream::requestDialback(const Jid &to, const Jid &from, const QString &key)
+{
+	d->client.sendDialbackResultRequest(to, from, key);
+	processNext();
+}
+
 void ClientStream::dialbackVerifyRequestGrant(const Jid &to, const Jid &from, const QString &id, bool ok)
 {
 	d->srv.sendDialbackVerifyGrant(to, from, id, ok);
@@ -1011,6 +1349,25 @@ void ClientStream::close()
 	}
 }
 
+void ClientStream::closeWithError(int streamCond)
+{
+	if(d->state != Active) {
+		close();
+		return;
+	}
+	d->state = Closing;
+	if(d->mode == Server)
+		d->srv.shutdownWithError(streamCond);
+	else
+		d->client.shutdownWithError(streamCond);
+	processNext();
+}
+
+int ClientStream::bytesToWrite() const
+{
+	return d->ss ? d->ss->bytesToWrite() : 0;
+}
+
 QDomDocument & ClientStream::doc() const
 {
 	return d->client.doc;
@@ -1066,11 +1423,27 @@ Stanza ClientStream::read()
 void ClientStream::write(const Stanza &s)
 {
 	if(d->state == Active) {
-		printf("writing stanza\n");
-		if(d->mode == Server)
-			d->srv.sendStanza(s.element());
-		else
-			d->client.sendStanza(s.element());
+		CS_TRACE(Stream, "writing stanza");
+
+		// a lazy stanza goes out as it came in.  its text declares no
+		//   namespaces of its own, so it takes on the default namespace
+		//   of whichever stream it is written to
+		QString xml = lazyStanzaXml(s);
+		if(!xml.isEmpty()) {
+			if(d->mode == Server)
+				d->srv.sendStanzaString(xml);
+			else
+				d->client.sendStanzaString(xml);
+		}
+		else {
+			// in whatever namespace it was built, renamed as it is written
+			QString ns;
+			QDomElement e = stanzaElement(s, &ns);
+			if(d->mode == Server)
+				d->srv.sendStanza(e, ns, s.baseNS());
+			else
+				d->client.sendStanza(e, ns, s.baseNS());
+		}
 		QMetaObject::invokeMethod(this, "processNext", Qt::QueuedConnection);
 	}
 }
@@ -1156,18 +1529,14 @@ void ClientStream::ss_readyRead()
 {
 	QByteArray a = d->ss->read();
 
-#ifdef XMPP_DEBUG
-	fprintf(stderr, "ClientStream: recv: %d [%s]\n", a.size(), a.data());
-#endif
+	CS_TRACE(Stream, "ClientStream: recv: %d [%s]", a.size(), a.data());
 
 	if(d->mode == Client)
 		d->client.addIncomingData(a);
 	else
 		d->srv.addIncomingData(a);
 	if(d->notify & CoreProtocol::NRecv) {
-#ifdef XMPP_DEBUG
-		printf("We needed data, so let's process it\n");
-#endif
+		CS_DEBUG(Stream, "We needed data, so let's process it");
 		processNext();
 	}
 }
@@ -1180,16 +1549,16 @@ void ClientStream::ss_bytesWritten(int bytes)
 		d->srv.outgoingDataWritten(bytes);
 
 	if(d->notify & CoreProtocol::NSend) {
-#ifdef XMPP_DEBUG
-		printf("We were waiting for data to be written, so let's process\n");
-#endif
+		CS_DEBUG(Stream, "We were waiting for data to be written, so let's process");
 		processNext();
 	}
+
+	bytesWritten(bytes);
 }
 
 void ClientStream::ss_tlsHandshaken()
 {
-	printf("TLS handshaken!\n");
+	CS_DEBUG(Stream, "TLS handshaken!");
 	QPointer<QObject> self = this;
 	securityLayerActivated(LayerTLS);
 	if(!self)
@@ -1242,9 +1611,7 @@ void ClientStream::sasl_nextStep(const QByteArray &stepData)
 
 void ClientStream::sasl_needParams(bool user, bool authzid, bool pass, bool realm)
 {
-#ifdef XMPP_DEBUG
-	printf("need params: %d,%d,%d,%d\n", user, authzid, pass, realm);
-#endif
+	CS_DEBUG(Stream, "need params: %d,%d,%d,%d", user, authzid, pass, realm);
 	if(authzid && !user) {
 		d->sasl->setAuthzid(d->jid.bare());
 		//d->sasl->setAuthzid("infiniti.homelesshackers.org");
@@ -1259,9 +1626,7 @@ void ClientStream::sasl_needParams(bool user, bool authzid, bool pass, bool real
 
 void ClientStream::sasl_authCheck(const QString &user, const QString &authzid)
 {
-#ifdef XMPP_DEBUG
-	printf("authcheck: [%s], [%s]\n", user.toLatin1().data(), authzid.toLatin1().data());
-#endif
+	CS_DEBUG(Stream, "authcheck: [%s], [%s]", user.toLatin1().data(), authzid.toLatin1().data());
 	QString u = user;
 	int n = u.indexOf('@');
 	if(n != -1)
@@ -1272,9 +1637,7 @@ void ClientStream::sasl_authCheck(const QString &user, const QString &authzid)
 
 void ClientStream::sasl_authenticated()
 {
-#ifdef XMPP_DEBUG
-	printf("sasl authed!!\n");
-#endif
+	CS_DEBUG(Stream, "sasl authed!!");
 	d->sasl_ssf = d->sasl->ssf();
 
 	if(d->mode == Server) {
@@ -1285,9 +1648,7 @@ void ClientStream::sasl_authenticated()
 
 void ClientStream::sasl_error(int)
 {
-//#ifdef XMPP_DEBUG
-//	printf("sasl error: %d\n", c);
-//#endif
+//	CS_DEBUG(Stream, "sasl error: %d", c);
 	// has to be auth error
 	int x = convertedSASLCond();
 	reset();
@@ -1298,18 +1659,19 @@ void ClientStream::sasl_error(int)
 void ClientStream::srvProcessNext()
 {
 	while(1) {
-		printf("Processing step...\n");
+		CS_TRACE(Stream, "Processing step...");
 		if(!d->srv.processStep()) {
 			int need = d->srv.need;
 			if(need == CoreProtocol::NNotify) {
 				d->notify = d->srv.notify;
 				if(d->notify & CoreProtocol::NSend)
-					printf("More data needs to be written to process next step\n");
+					CS_TRACE(Stream, "More data needs to be written to process next step");
 				if(d->notify & CoreProtocol::NRecv)
-					printf("More data is needed to process next step\n");
+					CS_TRACE(Stream, "More data is needed to process next step");
 			}
 			else if(need == CoreProtocol::NSASLMechs) {
 				if(!d->sasl) {
+					QCA::SASL::setPasswordCheck(checkSASLPassword);
 					d->sasl = new QCA::SASL;
 					connect(d->sasl, SIGNAL(authCheck(const QString &, const QString &)), SLOT(sasl_authCheck(const QString &, const QString &)));
 					connect(d->sasl, SIGNAL(nextStep(const QByteArray &)), SLOT(sasl_nextStep(const QByteArray &)));
@@ -1326,7 +1688,7 @@ void ClientStream::srvProcessNext()
 					QStringList list;
 					// TODO: d->server is probably wrong here
 					if(!d->sasl->startServer("xmpp", d->server, d->defRealm, &list)) {
-						printf("Error initializing SASL\n");
+						CS_ERROR(Stream, "Error initializing SASL");
 						return;
 					}
 					d->sasl_mechlist = list;
@@ -1335,9 +1697,9 @@ void ClientStream::srvProcessNext()
 				continue;
 			}
 			else if(need == CoreProtocol::NStartTLS) {
-				printf("Need StartTLS\n");
+				CS_DEBUG(Stream, "Need StartTLS");
 				if(!d->tls->startServer()) {
-					printf("unable to start server!\n");
+					CS_ERROR(Stream, "unable to start server!");
 					// TODO
 					return;
 				}
@@ -1345,15 +1707,15 @@ void ClientStream::srvProcessNext()
 				d->ss->startTLSServer(d->tls, a);
 			}
 			else if(need == CoreProtocol::NSASLFirst) {
-				printf("Need SASL First Step\n");
+				CS_DEBUG(Stream, "Need SASL First Step");
 				QByteArray a = d->srv.saslStep();
 				d->sasl->putServerFirstStep(d->srv.saslMech(), a);
 			}
 			else if(need == CoreProtocol::NSASLNext) {
-				printf("Need SASL Next Step\n");
+				CS_DEBUG(Stream, "Need SASL Next Step");
 				QByteArray a = d->srv.saslStep();
 				QByteArray cs(a.data(), a.size());
-				printf("[%s]\n", cs.data());
+				CS_TRACE(Stream, "[%s]", cs.data());
 				d->sasl->putStep(a);
 			}
 			else if(need == CoreProtocol::NSASLLayer) {
@@ -1368,10 +1730,10 @@ void ClientStream::srvProcessNext()
 		d->notify = 0;
 
 		int event = d->srv.event;
-		printf("event: %d\n", event);
+		CS_TRACE(Stream, "event: %d", event);
 		switch(event) {
 			case CoreProtocol::EError: {
-				printf("Error! Code=%d\n", d->srv.errorCode);
+				CS_WARN(Stream, "Error! Code=%d", d->srv.errorCode);
 				reset();
 				error(ErrProtocol);
 				//handleError();
@@ -1379,12 +1741,12 @@ void ClientStream::srvProcessNext()
 			}
 			case CoreProtocol::ESend: {
 				QByteArray a = d->srv.takeOutgoingData();
-				printf("Need Send: {%s}\n", a.data());
+				CS_TRACE(Stream, "Need Send: {%s}", a.data());
 				d->ss->write(a);
 				break;
 			}
 			case CoreProtocol::ERecvOpen: {
-				printf("Break (RecvOpen)\n");
+				CS_DEBUG(Stream, "Break (RecvOpen)");
 
 				if(d->s2s) {
 					// calculate key
@@ -1406,7 +1768,7 @@ void ClientStream::srvProcessNext()
 				break;
 			}
 			case CoreProtocol::ESASLSuccess: {
-				printf("Break SASL Success\n");
+				CS_DEBUG(Stream, "Break SASL Success");
 				disconnect(d->sasl, SIGNAL(error(int)), this, SLOT(sasl_error(int)));
 				QByteArray a = d->srv.spare;
 				d->ss->setLayerSASL(d->sasl, a);
@@ -1414,15 +1776,13 @@ void ClientStream::srvProcessNext()
 			}
 			case CoreProtocol::EPeerClosed: {
 				// TODO: this isn' an error
-				printf("peer closed\n");
+				CS_DEBUG(Stream, "peer closed");
 				reset();
 				error(ErrProtocol);
 				return;
 			}
 			case CoreProtocol::EReady: {
-#ifdef XMPP_DEBUG
-				printf("Done!\n");
-#endif
+				CS_DEBUG(Stream, "Done!");
 				d->state = Active;
 				d->jid = d->srv.clientJid;
 				setNoopTime(d->noop_time);
@@ -1432,27 +1792,25 @@ void ClientStream::srvProcessNext()
 				break;
 			}
 			case CoreProtocol::EStanzaReady: {
-#ifdef XMPP_DEBUG
-				printf("StanzaReady\n");
-#endif
+				CS_TRACE(Stream, "StanzaReady");
 				// store the stanza for now, announce after processing all events
-				Stanza s = createStanza(d->srv.recvStanza());
+				QString xml;
+				QDomElement e = d->srv.recvStanza(&xml);
+				Stanza s = xml.isEmpty() ? createStanza(e) : createLazyStanza(e, xml);
 				if(s.isNull()) {
-					printf("unable to create stanza\n");
+					CS_WARN(Stream, "unable to create stanza");
 					break;
 				}
 				d->in.append(new Stanza(s));
 				break;
 			}
 			case CoreProtocol::EDBRequest: {
-#ifdef XMPP_DEBUG
-				printf("db req: [%s]\n", d->srv.dbkey.toLatin1().data());
-#endif
+				CS_DEBUG(Stream, "db req: [%s]", d->srv.dbkey.toLatin1().data());
 				dialbackRequest(d->srv.dbto, d->srv.dbfrom, d->srv.dbkey);
 				break;
 			}
 			case CoreProtocol::EDBVerify: {
-				printf("DBVerify (server)\n");
+				CS_DEBUG(Stream, "DBVerify (server)");
 				dialbackVerifyRequest(d->srv.dbto, d->srv.dbfrom, d->srv.dbid, d->srv.dbkey);
 				break;
 			}
@@ -1479,9 +1837,7 @@ void ClientStream::processNext()
 	QPointer<QObject> self = this;
 
 	while(1) {
-#ifdef XMPP_DEBUG
-		printf("Processing step...\n");
-#endif
+		CS_TRACE(Stream, "Processing step...");
 		bool ok = d->client.processStep();
 		// deal with send/received items
 		for(QList<XmlProtocol::TransferItem>::ConstIterator it = d->client.transferItemList.begin(); it != d->client.transferItemList.end(); ++it) {
@@ -1522,24 +1878,18 @@ void ClientStream::processNext()
 		d->notify = 0;
 		switch(event) {
 			case CoreProtocol::EError: {
-#ifdef XMPP_DEBUG
-				printf("Error! Code=%d\n", d->client.errorCode);
-#endif
+				CS_WARN(Stream, "Error! Code=%d", d->client.errorCode);
 				handleError();
 				return;
 			}
 			case CoreProtocol::ESend: {
 				QByteArray a = d->client.takeOutgoingData();
-#ifdef XMPP_DEBUG
-				printf("Need Send: {%s}\n", a.data());
-#endif
+				CS_TRACE(Stream, "Need Send: {%s}", a.data());
 				d->ss->write(a);
 				break;
 			}
 			case CoreProtocol::ERecvOpen: {
-#ifdef XMPP_DEBUG
-				printf("Break (RecvOpen)\n");
-#endif
+				CS_DEBUG(Stream, "Break (RecvOpen)");
 
 #ifdef XMPP_TEST
 				QString s = QString("handshake success (lang=[%1]").arg(d->client.lang);
@@ -1557,9 +1907,7 @@ void ClientStream::processNext()
 				break;
 			}
 			case CoreProtocol::EFeatures: {
-#ifdef XMPP_DEBUG
-				printf("Break (Features)\n");
-#endif
+				CS_DEBUG(Stream, "Break (Features)");
 				if(!d->tls_warned && !d->using_tls && !d->client.features.tls_supported) {
 					d->tls_warned = true;
 					d->state = WaitTLS;
@@ -1569,15 +1917,11 @@ void ClientStream::processNext()
 				break;
 			}
 			case CoreProtocol::ESASLSuccess: {
-#ifdef XMPP_DEBUG
-				printf("Break SASL Success\n");
-#endif
+				CS_DEBUG(Stream, "Break SASL Success");
 				break;
 			}
 			case CoreProtocol::EReady: {
-#ifdef XMPP_DEBUG
-				printf("Done!\n");
-#endif
+				CS_DEBUG(Stream, "Done!");
 				if(d->s2s) {
 					d->state = Active;
 					if(d->s2s_verify) {
@@ -1599,53 +1943,47 @@ void ClientStream::processNext()
 				break;
 			}
 			case CoreProtocol::EPeerClosed: {
-#ifdef XMPP_DEBUG
-				printf("DocumentClosed\n");
-#endif
+				CS_DEBUG(Stream, "DocumentClosed");
 				reset();
 				connectionClosed();
 				return;
 			}
 			case CoreProtocol::EStanzaReady: {
-#ifdef XMPP_DEBUG
-				printf("StanzaReady\n");
-#endif
+				CS_TRACE(Stream, "StanzaReady");
 				// store the stanza for now, announce after processing all events
-				Stanza s = createStanza(d->client.recvStanza());
+				QString xml;
+				QDomElement e = d->client.recvStanza(&xml);
+				Stanza s = xml.isEmpty() ? createStanza(e) : createLazyStanza(e, xml);
 				if(s.isNull())
 					break;
 				d->in.append(new Stanza(s));
 				break;
 			}
 			case CoreProtocol::EStanzaSent: {
-#ifdef XMPP_DEBUG
-				printf("StanzasSent\n");
-#endif
+				CS_TRACE(Stream, "StanzasSent");
 				stanzaWritten();
 				if(!self)
 					return;
 				break;
 			}
 			case CoreProtocol::EClosed: {
-#ifdef XMPP_DEBUG
-				printf("Closed\n");
-#endif
+				CS_DEBUG(Stream, "Closed");
 				reset();
 				delayedCloseFinished();
 				return;
 			}
 			/*case CoreProtocol::EDBVerify: {
-				printf("DBVerify (client)\n");
+				CS_DEBUG(Stream, "DBVerify (client)");
 				dialbackVerifyRequest(d->client.dbto, d->client.dbfrom, d->client.dbkey);
 				break;
 			}*/
 			case CoreProtocol::EDBRequestResult: {
-				printf("DBRequestResult\n");
+				CS_DEBUG(Stream, "DBRequestResult");
 				dialbackResult(d->client.dbfrom, d->client.dbok);
 				break;
 			}
 			case CoreProtocol::EDBVerifyResult: {
-				printf("DBVerifyResult\n");
+				CS_DEBUG(Stream, "DBVerifyResult");
 				dialbackVerifyResult(d->client.dbfrom, d->client.dbok);
 				break;
 			}
@@ -1658,29 +1996,23 @@ bool ClientStream::handleNeed()
 	int need = d->client.need;
 	if(need == CoreProtocol::NNotify) {
 		d->notify = d->client.notify;
-#ifdef XMPP_DEBUG
 		if(d->notify & CoreProtocol::NSend)
-			printf("More data needs to be written to process next step\n");
+			CS_TRACE(Stream, "More data needs to be written to process next step");
 		if(d->notify & CoreProtocol::NRecv)
-			printf("More data is needed to process next step\n");
-#endif
+			CS_TRACE(Stream, "More data is needed to process next step");
 		return false;
 	}
 
 	d->notify = 0;
 	switch(need) {
 		case CoreProtocol::NStartTLS: {
-#ifdef XMPP_DEBUG
-			printf("Need StartTLS\n");
-#endif
+			CS_DEBUG(Stream, "Need StartTLS");
 			d->using_tls = true;
 			d->ss->startTLSClient(d->tlsHandler, d->server, d->client.spare);
 			return false;
 		}
 		case CoreProtocol::NSASLFirst: {
-#ifdef XMPP_DEBUG
-			printf("Need SASL First Step\n");
-#endif
+			CS_DEBUG(Stream, "Need SASL First Step");
 			// no SASL plugin?  fall back to Simple SASL
 			if(!QCA::isSupported(QCA::CAP_SASL)) {
 				// Simple SASL needs MD5.  do we have that either?
@@ -1732,9 +2064,7 @@ bool ClientStream::handleNeed()
 			return false;
 		}
 		case CoreProtocol::NSASLNext: {
-#ifdef XMPP_DEBUG
-			printf("Need SASL Next Step\n");
-#endif
+			CS_DEBUG(Stream, "Need SASL Next Step");
 			QByteArray a = d->client.saslStep();
 			d->sasl->putStep(a);
 			return false;
@@ -1752,9 +2082,7 @@ bool ClientStream::handleNeed()
 			break;
 		}
 		case CoreProtocol::NPassword: {
-#ifdef XMPP_DEBUG
-			printf("Need Password\n");
-#endif
+			CS_DEBUG(Stream, "Need Password");
 			d->state = NeedParams;
 			needAuthParams(false, true, false);
 			return false;
@@ -1782,22 +2110,27 @@ int ClientStream::convertedSASLCond() const
 void ClientStream::doNoop()
 {
 	if(d->state == Active) {
-#ifdef XMPP_DEBUG
-		printf("doPing\n");
-#endif
+		CS_TRACE(Stream, "doPing");
 		d->client.sendWhitespace();
 		processNext();
 	}
 }
 
+void ClientStream::setLazyStanzas(bool b)
+{
+	d->client.setLazyStanzas(b);
+	d->srv.setLazyStanzas(b);
+}
+
 void ClientStream::writeDirect(const QString &s)
 {
 	if(d->state == Active) {
-#ifdef XMPP_DEBUG
-		printf("writeDirect\n");
-#endif
-		d->client.sendDirect(s);
-		processNext();
+		CS_TRACE(Stream, "writeDirect");
+		if(d->mode == Server)
+			d->srv.sendDirect(s);
+		else
+			d->client.sendDirect(s);
+		QMetaObject::invokeMethod(this, "processNext", Qt::QueuedConnection);
 	}
 }
 
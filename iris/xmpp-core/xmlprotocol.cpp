@@ -22,86 +22,258 @@
 
 #include "bytestream.h"
 
+#include <string.h>
+
 using namespace XMPP;
 
-// stripExtraNS
+// which ASCII characters need a closer look when escaping
+enum { Plain, Escape, MaybeGt };
+static const char escapeTable[128] =
+{
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 1, 0, 0, 0, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0, // " &
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 0, 2, 0, // < >
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0
+};
+
+// the entity for uc[n], or 0 if it goes out as is.  same rules as QDom's
+//   encodeAttr(), which it uses for text as well: '>' only after "]]"
+static inline const char *escapeAt(const QChar *uc, int n, int *len)
+{
+	ushort c = uc[n].unicode();
+	if(c >= 0x80 || escapeTable[c] == Plain)
+		return 0;
+	if(escapeTable[c] == MaybeGt && !(n >= 2 && uc[n-1] == ']' && uc[n-2] == ']'))
+		return 0;
+
+	if(c == '<') {
+		*len = 4;
+		return "&lt;";
+	}
+	else if(c == '&') {
+		*len = 5;
+		return "&amp;";
+	}
+	else if(c == '"') {
+		*len = 6;
+		return "&quot;";
+	}
+	*len = 4;
+	return "&gt;";
+}
+
+QString XMPP::escapeXml(const QString &s)
+{
+	const QChar *uc = s.unicode();
+	int len = s.length();
+	QString out;
+	int plain = 0;
+	for(int n = 0; n < len; ++n) {
+		int elen;
+		const char *ent = escapeAt(uc, n, &elen);
+		if(!ent)
+			continue;
+		if(out.isNull())
+			out.reserve(len + 16);
+		out.append(QString(uc + plain, n - plain));
+		out.append(QLatin1String(ent));
+		plain = n + 1;
+	}
+	if(plain == 0)
+		return s;
+	out.append(QString(uc + plain, len - plain));
+	return out;
+}
+
+// XmlWriter
 //
-// This function removes namespace information from various nodes for
-// display purposes only (the element is pretty much useless for processing
-// after this).  We do this because QXml is a bit overzealous about outputting
-// redundant namespaces.
-static QDomElement stripExtraNS(const QDomElement &e)
-{
-	// find closest parent with a namespace
-	QDomNode par = e.parentNode();
-	while(!par.isNull() && par.namespaceURI().isNull())
-		par = par.parentNode();
-	bool noShowNS = false;
-	if(!par.isNull() && par.namespaceURI() == e.namespaceURI())
-		noShowNS = true;
-
-	// build qName (prefix:localName)
-	QString qName;
-	if(!e.prefix().isEmpty())
-		qName = e.prefix() + ':' + e.localName();
-	else
-		qName = e.tagName();
+// Serializes an element straight to UTF-8, producing the same text QDom's
+// save() does, except that a namespace is only declared where it differs
+// from the closest ancestor that has one (QDom is a bit overzealous about
+// outputting redundant namespaces).  There is no cloning of the tree and
+// no QTextStream.  Anything other than
+// elements and plain text is rare in stanzas and is left to QDom.
+class XmlWriter
+{
+public:
+	QByteArray out;
+	QString fromNS, toNS; // renaming, if fromNS is set
+
+	void ascii(const char *s, int len)
+	{
+		int size = out.size();
+		out.resize(size + len);
+		memcpy(out.data() + size, s, len);
+	}
 
-	QDomElement i;
-	uint x;
-	if(noShowNS)
-		i = e.ownerDocument().createElement(qName);
-	else
-		i = e.ownerDocument().createElementNS(e.namespaceURI(), qName);
+	void append(const QString &s)
+	{
+		append(s.unicode(), s.length());
+	}
 
-	// copy attributes
-	QDomNamedNodeMap al = e.attributes();
-	for(x = 0; x < (uint)al.count(); ++x) {
-		QDomAttr a = al.item(x).cloneNode().toAttr();
+	// ASCII is copied as is, anything else goes through the codec in runs
+	void append(const QChar *uc, int len)
+	{
+		int at = 0;
+		while(at < len) {
+			int start = at;
+			if(uc[at].unicode() < 0x80) {
+				while(at < len && uc[at].unicode() < 0x80)
+					++at;
+				int size = out.size();
+				out.resize(size + at - start);
+				char *p = out.data() + size;
+				for(int n = start; n < at; ++n)
+					*(p++) = (char)uc[n].unicode();
+			}
+			else {
+				while(at < len && uc[at].unicode() >= 0x80)
+					++at;
+				out += QString(uc + start, at - start).toUtf8();
+			}
+		}
+	}
 
-		// don't show xml namespace
-		if(a.namespaceURI() == NS_XML)
-			i.setAttribute(QString("xml:") + a.name(), a.value());
+	// same as escapeXml(), without the QString in between
+	void escaped(const QString &s)
+	{
+		const QChar *uc = s.unicode();
+		int len = s.length();
+		int plain = 0;
+		for(int n = 0; n < len; ++n) {
+			int elen;
+			const char *ent = escapeAt(uc, n, &elen);
+			if(!ent)
+				continue;
+			append(uc + plain, n - plain);
+			ascii(ent, elen);
+			plain = n + 1;
+		}
+		append(uc + plain, len - plain);
+	}
+
+	// 'scopeNS' is the namespace of the closest ancestor that has one
+	void element(const QDomElement &e, const QString &scopeNS, bool textFollows)
+	{
+		QString ns = e.namespaceURI();
+		if(!fromNS.isNull() && ns == fromNS)
+			ns = toNS;
+		bool showNS = !ns.isNull() && (scopeNS.isNull() || scopeNS != ns);
+
+		QString qName;
+		if(!e.prefix().isEmpty())
+			qName = e.prefix() + ':' + e.localName();
 		else
-			i.setAttributeNodeNS(a);
+			qName = e.tagName();
+
+		ascii("<", 1);
+		append(qName);
+		if(showNS) {
+			if(e.prefix().isEmpty())
+				ascii(" xmlns=\"", 8);
+			else {
+				ascii(" xmlns:", 7);
+				append(e.prefix());
+				ascii("=\"", 2);
+			}
+			escaped(ns);
+			ascii("\"", 1);
+		}
+
+		QDomNamedNodeMap al = e.attributes();
+		if(al.count() > 0) {
+			ascii(" ", 1);
+			for(int n = 0; n < al.count(); ++n) {
+				QDomAttr a = al.item(n).toAttr();
+				if(a.namespaceURI() == NS_XML) {
+					ascii("xml:", 4);
+					append(a.localName());
+				}
+				else {
+					if(!a.prefix().isEmpty()) {
+						append(a.prefix());
+						ascii(":", 1);
+					}
+					append(a.localName().isEmpty() ? a.name() : a.localName());
+				}
+				ascii("=\"", 2);
+				escaped(a.value());
+				ascii("\"", 1);
+
+				// QDom declares an attribute's prefix right after it,
+				//   unless the element was written with the same prefix
+				if(!a.prefix().isEmpty() && !a.namespaceURI().isEmpty() && a.namespaceURI() != NS_XML && !(showNS && e.prefix() == a.prefix())) {
+					ascii(" xmlns:", 7);
+					append(a.prefix());
+					ascii("=\"", 2);
+					escaped(a.namespaceURI());
+					ascii("\"", 1);
+				}
+				ascii(" ", 1);
+			}
+		}
+
+		QString childScope = ns.isNull() ? scopeNS : ns;
+		QDomNode n = e.firstChild();
+		if(n.isNull())
+			ascii("/>", 2);
+		else {
+			ascii(">", 1);
+			if(!n.isText())
+				ascii("\n", 1);
+			for(; !n.isNull(); n = n.nextSibling())
+				node(n, childScope);
+			ascii("</", 2);
+			append(qName);
+			ascii(">", 1);
+		}
+
+		if(!textFollows)
+			ascii("\n", 1);
 	}
 
-	// copy children
-	QDomNodeList nl = e.childNodes();
-	for(x = 0; x < (uint)nl.count(); ++x) {
-		QDomNode n = nl.item(x);
+	void node(const QDomNode &n, const QString &scopeNS)
+	{
 		if(n.isElement())
-			i.appendChild(stripExtraNS(n.toElement()));
-		else
-			i.appendChild(n.cloneNode());
+			element(n.toElement(), scopeNS, n.nextSibling().isText());
+		else if(n.isText() && !n.isCDATASection())
+			escaped(n.nodeValue());
+		else {
+			QString str;
+			{
+				QTextStream ts(&str, QIODevice::WriteOnly);
+				n.save(ts, 0);
+			}
+			append(str);
+		}
 	}
-	return i;
-}
+};
 
-// xmlToString
+// xmlToUtf8
 //
-// This function converts a QDomElement into a QString, using stripExtraNS
-// to make it pretty.
-static QString xmlToString(const QDomElement &e, const QString &fakeNS, const QString &fakeQName, bool clip)
-{
-	QDomElement i = e.cloneNode().toElement();
-
-	// It seems QDom can only have one namespace attribute at a time (see docElement 'HACK').
-	// Fortunately we only need one kind depending on the input, so it is specified here.
-	QDomElement fake = e.ownerDocument().createElementNS(fakeNS, fakeQName);
-	fake.appendChild(i);
-	fake = stripExtraNS(fake);
-	QString out;
-	{
-		QTextStream ts(&out, QIODevice::WriteOnly);
-		fake.firstChild().save(ts, 0);
+// This function converts a QDomElement into UTF-8 text, as if it were a
+// child of an element in the 'fakeNS' namespace.  Elements in 'fromNS'
+// are written as being in 'toNS', which is what changing the namespace
+// of the tree beforehand would have given.
+QByteArray XMPP::xmlToUtf8(const QDomElement &e, const QString &fakeNS, bool clip, const QString &fromNS, const QString &toNS)
+{
+	XmlWriter w;
+	if(fromNS != toNS) {
+		w.fromNS = fromNS;
+		w.toNS = toNS;
 	}
+	w.element(e, fakeNS, false);
+
 	// 'clip' means to remove any unwanted (and unneeded) characters, such as a trailing newline
 	if(clip) {
-		int n = out.lastIndexOf('>');
-		out.truncate(n+1);
+		int n = w.out.lastIndexOf('>');
+		w.out.truncate(n+1);
 	}
-	return out;
+	return w.out;
 }
 
 // createRootXmlTags
@@ -188,7 +360,7 @@ void XmlProtocol::reset()
 	tagOpen = QString();
 	tagClose = QString();
 	xml.reset();
-	outData.resize(0);
+	outData.clear();
 	trackQueue.clear();
 	transferItemList.clear();
 }
@@ -200,9 +372,7 @@ void XmlProtocol::addIncomingData(const QByteArray &a)
 
 QByteArray XmlProtocol::takeOutgoingData()
 {
-	QByteArray a = outData;
-	outData.resize(0);
-	return a;
+	return outData.take();
 }
 
 void XmlProtocol::outgoingDataWritten(int bytes)
@@ -267,6 +437,10 @@ bool XmlProtocol::processStep()
 					return true;
 				}
 				case Parser::Event::Element: {
+					// build the whole element unless the step can do without
+					if(pe.isLazy() && (!pe.lazyContext().isEmpty() || !acceptsLazyElements()))
+						pe.expand();
+					lazyXml = pe.isLazy() ? pe.actualString() : QString();
 					transferItemList += TransferItem(pe.element(), false);
 
 					//elementRecv(pe.element());
@@ -307,7 +481,17 @@ QString XmlProtocol::xmlEncoding() const
 	return xml.encoding();
 }
 
-QString XmlProtocol::elementToString(const QDomElement &e, bool clip)
+void XmlProtocol::setLazyStanzas(bool b)
+{
+	xml.setLazyStanzas(b);
+}
+
+QString XmlProtocol::elementToString(const QDomElement &e, bool clip, const QString &fromNS, const QString &toNS)
+{
+	return QString::fromUtf8(elementToUtf8(e, clip, fromNS, toNS));
+}
+
+QByteArray XmlProtocol::elementToUtf8(const QDomElement &e, bool clip, const QString &fromNS, const QString &toNS)
 {
 	if(elem.isNull())
 		elem = elemDoc.importNode(docElement(), true).toElement();
@@ -345,14 +529,7 @@ QString XmlProtocol::elementToString(const QDomElement &e, bool clip)
 		}
 	}
 
-	// build qName
-	QString qn;
-	if(!elem.prefix().isEmpty())
-		qn = elem.prefix() + ':';
-	qn += elem.localName();
-
-	// make the string
-	return xmlToString(e, ns, qn, clip);
+	return xmlToUtf8(e, ns, clip, fromNS, toNS);
 }
 
 bool XmlProtocol::stepRequiresElement() const
@@ -366,6 +543,12 @@ void XmlProtocol::itemWritten(int, int)
 	// default does nothing
 }
 
+bool XmlProtocol::acceptsLazyElements() const
+{
+	// default wants everything built
+	return false;
+}
+
 void XmlProtocol::stringSend(const QString &)
 {
 	// default does nothing
@@ -412,15 +595,14 @@ int XmlProtocol::writeString(const QString &s, int id, bool external)
 	return internalWriteString(s, TrackItem::Custom, id);
 }
 
-int XmlProtocol::writeElement(const QDomElement &e, int id, bool external, bool clip)
+int XmlProtocol::writeElement(const QDomElement &e, int id, bool external, bool clip, const QString &fromNS, const QString &toNS)
 {
 	if(e.isNull())
 		return 0;
 	transferItemList += TransferItem(e, true, external);
 
 	//elementSend(e);
-	QString out = elementToString(e, clip);
-	return internalWriteString(out, TrackItem::Custom, id);
+	return internalWriteData(elementToUtf8(e, clip, fromNS, toNS), TrackItem::Custom, id);
 }
 
 QByteArray XmlProtocol::resetStream()
@@ -445,7 +627,7 @@ int XmlProtocol::internalWriteData(const QByteArray &a, TrackItem::Type t, int i
 	i.size = a.size();
 	trackQueue += i;
 
-	ByteStream::appendArray(&outData, a);
+	outData.append(a);
 	return a.size();
 }
 
@@ -24,11 +24,18 @@
 #include <QtCore>
 #include <QtXml>
 #include "parser.h"
+#include "bytechain.h"
 
 #define NS_XML "http://www.w3.org/XML/1998/namespace"
 
 namespace XMPP
 {
+	// escapes text or an attribute value the way QDom's save() does
+	QString escapeXml(const QString &s);
+
+	// 'e' as UTF-8, as if it were a child of an element in 'fakeNS'
+	QByteArray xmlToUtf8(const QDomElement &e, const QString &fakeNS, bool clip=false, const QString &fromNS=QString(), const QString &toNS=QString());
+
 	class XmlProtocol
 	{
 	public:
@@ -71,7 +78,12 @@ namespace XMPP
 
 		inline bool isIncoming() const { return incoming; }
 		QString xmlEncoding() const;
-		QString elementToString(const QDomElement &e, bool clip=false);
+
+		// let the parser skip building stanza children where possible
+		void setLazyStanzas(bool b);
+		// elements in 'fromNS' are written as if they were in 'toNS'
+		QString elementToString(const QDomElement &e, bool clip=false, const QString &fromNS=QString(), const QString &toNS=QString());
+		QByteArray elementToUtf8(const QDomElement &e, bool clip=false, const QString &fromNS=QString(), const QString &toNS=QString());
 
 		class TransferItem
 		{
@@ -98,6 +110,7 @@ namespace XMPP
 		virtual bool stepRequiresElement() const;
 		virtual bool doStep(const QDomElement &e)=0;
 		virtual void itemWritten(int id, int size);
+		virtual bool acceptsLazyElements() const;
 
 		// 'debug'
 		virtual void stringSend(const QString &s);
@@ -109,9 +122,12 @@ namespace XMPP
 		void startAccept();
 		bool close();
 		int writeString(const QString &s, int id, bool external);
-		int writeElement(const QDomElement &e, int id, bool external, bool clip=false);
+		int writeElement(const QDomElement &e, int id, bool external, bool clip=false, const QString &fromNS=QString(), const QString &toNS=QString());
 		QByteArray resetStream();
 
+		// if the element being handled by doStep() is lazy, its xml
+		QString lazyXml;
+
 	private:
 		enum { SendOpen, RecvOpen, Open, Closing };
 		class TrackItem
@@ -130,7 +146,7 @@ namespace XMPP
 		bool closeWritten;
 
 		Parser xml;
-		QByteArray outData;
+		ByteChain outData;
 		QList<TrackItem> trackQueue;
 
 		void init();
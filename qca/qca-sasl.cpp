@@ -170,6 +170,42 @@ public:
 	QString user, authzid, pass, realm;
 };
 
+// the library is initialized once for all threads, and told to use real
+//   mutexes since connections can be handled in several threads
+static QMutex sasl_init_mutex;
+static bool sasl_mutex_set = false;
+
+static void *sasl_mutex_alloc_cb()
+{
+	return new QMutex;
+}
+
+static int sasl_mutex_lock_cb(void *m)
+{
+	((QMutex *)m)->lock();
+	return SASL_OK;
+}
+
+static int sasl_mutex_unlock_cb(void *m)
+{
+	((QMutex *)m)->unlock();
+	return SASL_OK;
+}
+
+static void sasl_mutex_free_cb(void *m)
+{
+	delete (QMutex *)m;
+}
+
+// call with sasl_init_mutex locked, before the first *_init
+static void sasl_ensure_mutex()
+{
+	if(sasl_mutex_set)
+		return;
+	sasl_set_mutex(sasl_mutex_alloc_cb, sasl_mutex_lock_cb, sasl_mutex_unlock_cb, sasl_mutex_free_cb);
+	sasl_mutex_set = true;
+}
+
 static QByteArray makeByteArray(const void *in, unsigned int len)
 {
 	QByteArray buf(len, 0);
@@ -210,6 +246,7 @@ public:
 	int ssf_min, ssf_max;
 	QString ext_authid;
 	int ext_ssf;
+	QCA::SASL::PasswordCheck passcheck;
 
 	sasl_conn_t *con;
 	sasl_interact_t *need;
@@ -241,6 +278,7 @@ public:
 		g = _g;
 		con = 0;
 		callbacks = 0;
+		passcheck = 0;
 
 		reset();
 	}
@@ -329,6 +367,14 @@ public:
 		return SASL_OK;
 	}
 
+	static int scb_checkpass(sasl_conn_t *, void *context, const char *user, const char *pass, unsigned passlen, struct propctx *)
+	{
+		SASLContext *that = (SASLContext *)context;
+		if(that->passcheck(QString::fromUtf8(user), QString::fromUtf8(QByteArray(pass, passlen))))
+			return SASL_OK;
+		return SASL_BADAUTH;
+	}
+
 	bool setsecprops()
 	{
 		sasl_security_properties_t secprops;
@@ -406,9 +452,13 @@ public:
 	{
 		resetState();
 
-		if(!g->client_init) {
-			sasl_client_init(NULL);
-			g->client_init = true;
+		{
+			QMutexLocker locker(&sasl_init_mutex);
+			if(!g->client_init) {
+				sasl_ensure_mutex();
+				sasl_client_init(NULL);
+				g->client_init = true;
+			}
 		}
 
 		callbacks = new sasl_callback_t[5];
@@ -454,25 +504,43 @@ public:
 		return clientTryAgain();
 	}
 
+	void setPasswordCheck(QCA::SASL::PasswordCheck f)
+	{
+		passcheck = f;
+	}
+
 	bool serverStart(const QString &realm, QStringList *mechlist, const QString &name)
 	{
 		resetState();
 
-		g->appname = name;
-		if(!g->server_init) {
-			sasl_server_init(NULL, QFile::encodeName(g->appname));
-			g->server_init = true;
+		{
+			QMutexLocker locker(&sasl_init_mutex);
+			if(!g->server_init) {
+				g->appname = name;
+				sasl_ensure_mutex();
+				sasl_server_init(NULL, QFile::encodeName(g->appname));
+				g->server_init = true;
+			}
 		}
 
-		callbacks = new sasl_callback_t[2];
+		callbacks = new sasl_callback_t[3];
+		int n = 0;
 
-		callbacks[0].id = SASL_CB_PROXY_POLICY;
-		callbacks[0].proc = (int(*)())scb_checkauth;
-		callbacks[0].context = this;
+		callbacks[n].id = SASL_CB_PROXY_POLICY;
+		callbacks[n].proc = (int(*)())scb_checkauth;
+		callbacks[n].context = this;
+		++n;
 
-		callbacks[1].id = SASL_CB_LIST_END;
-		callbacks[1].proc = 0;
-		callbacks[1].context = 0;
+		if(passcheck) {
+			callbacks[n].id = SASL_CB_SERVER_USERDB_CHECKPASS;
+			callbacks[n].proc = (int(*)())scb_checkpass;
+			callbacks[n].context = this;
+			++n;
+		}
+
+		callbacks[n].id = SASL_CB_LIST_END;
+		callbacks[n].proc = 0;
+		callbacks[n].context = 0;
 
 		int r = sasl_server_new(service.toLatin1().data(), host.toLatin1().data(), realm.toLatin1().data(), localAddr.isEmpty() ? 0 : localAddr.toLatin1().data(), remoteAddr.isEmpty() ? 0 : remoteAddr.toLatin1().data(), callbacks, 0, &con);
 		if(r != SASL_OK) {
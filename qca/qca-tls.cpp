@@ -75,8 +75,13 @@ static bool lib_generateKeyIV(const EVP_CIPHER *_type, const QByteArray &data, c
 	return true;
 }
 
+// shares rather than copies when 'a' is empty
 static void appendArray(QByteArray *a, const QByteArray &b)
 {
+	if(a->isEmpty()) {
+		*a = b;
+		return;
+	}
 	int oldsize = a->size();
 	a->resize(oldsize + b.size());
 	memcpy(a->data() + oldsize, b.data(), b.size());
@@ -520,11 +525,11 @@ public:
 		// deep copy
 		RSAKeyContext *c = new RSAKeyContext;
 		if(pub) {
-			++(pub->references);
+			CRYPTO_add(&pub->references, 1, CRYPTO_LOCK_RSA);
 			c->pub = pub; //RSAPublicKey_dup(pub);
 		}
 		if(sec) {
-			++(sec->references);
+			CRYPTO_add(&sec->references, 1, CRYPTO_LOCK_RSA);
 			c->sec = sec; //RSAPrivateKey_dup(sec);
 		}
 		return c;
@@ -767,7 +772,7 @@ public:
 	{
 		CertContext *c = new CertContext(*this);
 		if(x) {
-			++(x->references);
+			CRYPTO_add(&x->references, 1, CRYPTO_LOCK_X509);
 			c->x = x;
 		}
 		return c;
@@ -928,7 +933,120 @@ public:
 	QDateTime nb, na;
 };
 
+// sessions may be driven from several threads at once, so OpenSSL gets
+//   a lock table and a way to tell threads apart
 static bool ssl_init = false;
+static QMutex ssl_init_mutex;
+static QMutex *ssl_locks = 0;
+
+static void ssl_lock_cb(int mode, int n, const char *, int)
+{
+	if(mode & CRYPTO_LOCK)
+		ssl_locks[n].lock();
+	else
+		ssl_locks[n].unlock();
+}
+
+static unsigned long ssl_id_cb()
+{
+	return (unsigned long)QThread::currentThreadId();
+}
+
+static void ensure_ssl_init()
+{
+	QMutexLocker locker(&ssl_init_mutex);
+	if(ssl_init)
+		return;
+	ssl_locks = new QMutex[CRYPTO_num_locks()];
+	CRYPTO_set_id_callback(ssl_id_cb);
+	CRYPTO_set_locking_callback(ssl_lock_cb);
+	SSL_library_init();
+	SSL_load_error_strings();
+	ssl_init = true;
+}
+
+// Contexts are shared by all connections with the same role, certificate,
+//   key and trusted certificates, so those are loaded only once, and the
+//   server side session cache and ticket key are common to every
+//   connection.  A context holds references to the objects it is keyed
+//   by, so their addresses can't be reused while it is cached.  Callers
+//   that make new certificate objects per connection would add a context
+//   each time, so only the most recently used ones are kept.  Dropping a
+//   context from the cache is safe, every SSL holds its own reference.
+#define SSL_SESSION_CACHE_SIZE 20480
+#define SSL_SESSION_TIMEOUT    300
+#define SSL_CTX_CACHE_SIZE     32
+
+static const unsigned char ssl_sid_ctx[] = "qca-tls";
+static QMutex ssl_ctx_mutex;
+static QHash<QByteArray, SSL_CTX*> ssl_ctx_cache;
+static QList<QByteArray> ssl_ctx_lru; // least recently used first
+
+static void appendPointer(QByteArray *a, const void *p)
+{
+	a->append((const char *)&p, sizeof(p));
+}
+
+// call with ssl_ctx_mutex locked, the context may be evicted otherwise
+static SSL_CTX *sharedContext(bool serv, SSL_METHOD *method, const QList<QCA_CertContext*> &list, X509 *cert, RSA *key)
+{
+	QByteArray id(1, serv ? 's' : 'c');
+	appendPointer(&id, cert);
+	appendPointer(&id, key);
+	for(int n = 0; n < list.size(); ++n)
+		appendPointer(&id, ((CertContext *)list[n])->x);
+
+	SSL_CTX *ctx = ssl_ctx_cache.value(id);
+	if(ctx) {
+		if(ssl_ctx_lru.last() != id) {
+			ssl_ctx_lru.removeAll(id);
+			ssl_ctx_lru.append(id);
+		}
+		return ctx;
+	}
+
+	ctx = SSL_CTX_new(method);
+	if(!ctx)
+		return 0;
+
+	// load the cert store
+	if(!list.isEmpty()) {
+		X509_STORE *store = SSL_CTX_get_cert_store(ctx);
+		for(int n = 0; n < list.size(); ++n)
+			X509_STORE_add_cert(store, ((CertContext *)list[n])->x);
+	}
+
+	// setup the cert to send
+	if(cert && key) {
+		if(SSL_CTX_use_certificate(ctx, cert) != 1 || SSL_CTX_use_RSAPrivateKey(ctx, key) != 1) {
+			SSL_CTX_free(ctx);
+			return 0;
+		}
+	}
+
+	if(serv) {
+		SSL_CTX_set_session_id_context(ctx, ssl_sid_ctx, sizeof(ssl_sid_ctx) - 1);
+		SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER);
+		SSL_CTX_sess_set_cache_size(ctx, SSL_SESSION_CACHE_SIZE);
+		SSL_CTX_set_timeout(ctx, SSL_SESSION_TIMEOUT);
+#ifdef SSL_CTRL_CLEAR_OPTIONS
+		// stateless resumption for the clients that support it.  the
+		//   ticket key is made per context, so it is shared as well
+		SSL_CTX_clear_options(ctx, SSL_OP_NO_TICKET);
+#endif
+	}
+
+	// a write that has to be retried may come from a different buffer,
+	//   since only what is left of it gets queued
+	SSL_CTX_set_mode(ctx, SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+
+	ssl_ctx_cache.insert(id, ctx);
+	ssl_ctx_lru.append(id);
+	while(ssl_ctx_lru.count() > SSL_CTX_CACHE_SIZE)
+		SSL_CTX_free(ssl_ctx_cache.take(ssl_ctx_lru.takeFirst()));
+	return ctx;
+}
+
 class TLSContext : public QCA_TLSContext
 {
 public:
@@ -937,14 +1055,10 @@ public:
 
 	bool serv;
 	int mode;
-	QByteArray sendQueue, recvQueue;
-
-	CertContext *cert;
-	RSAKeyContext *key;
+	QByteArray sendQueue;
 
 	SSL *ssl;
 	SSL_METHOD *method;
-	SSL_CTX *context;
 	BIO *rbio, *wbio;
 	CertContext cc;
 	int vr;
@@ -952,16 +1066,9 @@ public:
 
 	TLSContext()
 	{
-		if(!ssl_init) {
-			SSL_library_init();
-			SSL_load_error_strings();
-			ssl_init = true;
-		}
+		ensure_ssl_init();
 
 		ssl = 0;
-		context = 0;
-		cert = 0;
-		key = 0;
 	}
 
 	~TLSContext()
@@ -975,21 +1082,8 @@ public:
 			SSL_free(ssl);
 			ssl = 0;
 		}
-		if(context) {
-			SSL_CTX_free(context);
-			context = 0;
-		}
-		if(cert) {
-			delete cert;
-			cert = 0;
-		}
-		if(key) {
-			delete key;
-			key = 0;
-		}
 
 		sendQueue.resize(0);
-		recvQueue.resize(0);
 		mode = Idle;
 		cc.reset();
 		vr = QCA::TLS::Unknown;
@@ -1029,20 +1123,21 @@ public:
 
 	bool setup(const QList<QCA_CertContext*> &list, const QCA_CertContext &_cc, const QCA_RSAKeyContext &kc)
 	{
-		context = SSL_CTX_new(method);
-		if(!context) {
-			reset();
-			return false;
+		X509 *cert = 0;
+		RSA *key = 0;
+		if(!_cc.isNull() && !kc.isNull()) {
+			cert = static_cast<const CertContext &>(_cc).x;
+			key = static_cast<const RSAKeyContext &>(kc).sec;
 		}
 
-		// load the cert store
-		if(!list.isEmpty()) {
-			X509_STORE *store = SSL_CTX_get_cert_store(context);
-			for(int n = 0; n < list.size(); ++n)
-				X509_STORE_add_cert(store, ((CertContext *)list[n])->x);
+		{
+			// the new SSL holds on to the context, from then on it can
+			//   leave the cache
+			QMutexLocker locker(&ssl_ctx_mutex);
+			SSL_CTX *context = sharedContext(serv, method, list, cert, key);
+			if(context)
+				ssl = SSL_new(context);
 		}
-
-		ssl = SSL_new(context);
 		if(!ssl) {
 			reset();
 			return false;
@@ -1056,20 +1151,6 @@ public:
 		// this passes control of the bios to ssl.  we don't need to free them.
 		SSL_set_bio(ssl, rbio, wbio);
 
-		// setup the cert to send
-		if(!_cc.isNull() && !kc.isNull()) {
-			cert = static_cast<CertContext*>(_cc.clone());
-			key = static_cast<RSAKeyContext*>(kc.clone());
-			if(SSL_use_certificate(ssl, cert->x) != 1) {
-				reset();
-				return false;
-			}
-			if(SSL_use_RSAPrivateKey(ssl, key->sec) != 1) {
-				reset();
-				return false;
-			}
-		}
-
 		return true;
 	}
 
@@ -1172,9 +1253,11 @@ public:
 			return false;
 		appendArray(&sendQueue, plain);
 
+		// encrypted straight out of the caller's buffer when nothing was
+		//   queued before it (see appendArray)
 		int encoded = 0;
 		if(sendQueue.size() > 0) {
-			int ret = SSL_write(ssl, sendQueue.data(), sendQueue.size());
+			int ret = SSL_write(ssl, sendQueue.constData(), sendQueue.size());
 
 			enum { Good, Continue, Done, Error };
 			int m;
@@ -1190,10 +1273,10 @@ public:
 			else {
 				m = Good;
 				encoded = ret;
-				int newsize = sendQueue.size() - encoded;
-				char *r = sendQueue.data();
-				memmove(r, r + encoded, newsize);
-				sendQueue.resize(newsize);
+				if(encoded == sendQueue.size())
+					sendQueue.resize(0);
+				else
+					sendQueue = sendQueue.mid(encoded);
 			}
 
 			if(m == Done) {
@@ -1219,14 +1302,18 @@ public:
 		if(!from_net.isEmpty())
 			BIO_write(rbio, from_net.data(), from_net.size());
 
-		QByteArray a;
+		// decrypt straight into the result, which is passed up the
+		//   stack without further copies.  the plaintext is never larger
+		//   than the ciphertext it came from, so this is usually sized
+		//   right the first time
+		QByteArray a(qMax(BIO_pending(rbio) + SSL_pending(ssl), 1024), 0);
+		int at = 0;
 		while(!v_eof) {
-			a.resize(8192);
-			int ret = SSL_read(ssl, a.data(), a.size());
+			if(at == a.size())
+				a.resize(at + 8192);
+			int ret = SSL_read(ssl, a.data() + at, a.size() - at);
 			if(ret > 0) {
-				if(ret != (int)a.size())
-					a.resize(ret);
-				appendArray(&recvQueue, a);
+				at += ret;
 			}
 			else if(ret <= 0) {
 				int x = SSL_get_error(ssl, ret);
@@ -1239,8 +1326,8 @@ public:
 			}
 		}
 
-		*plain = recvQueue;
-		recvQueue.resize(0);
+		a.resize(at);
+		*plain = a;
 
 		// could be outgoing data also
 		*to_net = readOutgoing();
@@ -1420,6 +1507,8 @@ public:
 
 	void init()
 	{
+		// before any context exists, while there is only one thread
+		ensure_ssl_init();
 	}
 
 	int qcaVersion() const
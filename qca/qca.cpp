@@ -97,6 +97,10 @@ private:
 static QList<ProviderItem*> providerList;
 static bool qca_init = false;
 
+// contexts are created from more than one thread, and the provider list
+//   can grow (plugin scan) or initialize lazily on any of those calls
+static QMutex plugin_mutex(QMutex::Recursive);
+
 static bool plugin_have(const QString &fname)
 {
 	for(int n = 0; n < providerList.size(); ++n) {
@@ -200,6 +204,7 @@ void QCA::init()
 bool QCA::isSupported(int capabilities)
 {
 	init();
+	QMutexLocker locker(&plugin_mutex);
 
 	int caps = plugin_caps();
 	if(caps & capabilities)
@@ -216,17 +221,20 @@ bool QCA::isSupported(int capabilities)
 
 void QCA::insertProvider(QCAProvider *p)
 {
+	QMutexLocker locker(&plugin_mutex);
 	plugin_addClass(p);
 }
 
 void QCA::unloadAllPlugins()
 {
+	QMutexLocker locker(&plugin_mutex);
 	plugin_unloadall();
 }
 
 static void *getContext(int cap)
 {
 	init();
+	QMutexLocker locker(&plugin_mutex);
 
 	// this call will also trip a scan for new plugins if needed
 	if(!QCA::isSupported(cap))
@@ -820,8 +828,13 @@ public:
 		tryMore = false;
 	}
 
+	// shares rather than copies when 'a' is empty, which it usually is
 	void appendArray(QByteArray *a, const QByteArray &b)
 	{
+		if(a->isEmpty()) {
+			*a = b;
+			return;
+		}
 		int oldsize = a->size();
 		a->resize(oldsize + b.size());
 		memcpy(a->data() + oldsize, b.data(), b.size());
@@ -1074,6 +1087,7 @@ void TLS::update()
 // SASL
 //----------------------------------------------------------------------------
 QString saslappname = "qca";
+SASL::PasswordCheck saslpasscheck = 0;
 class SASL::Private
 {
 public:
@@ -1126,6 +1140,11 @@ void SASL::setAppName(const QString &name)
 	saslappname = name;
 }
 
+void SASL::setPasswordCheck(PasswordCheck f)
+{
+	saslpasscheck = f;
+}
+
 void SASL::reset()
 {
 	d->localPort = -1;
@@ -1261,6 +1280,7 @@ bool SASL::startServer(const QString &service, const QString &host, const QStrin
 	d->c->setCoreProps(service, host, d->localPort != -1 ? &la : 0, d->remotePort != -1 ? &ra : 0);
 	d->setSecurityProps();
 
+	d->c->setPasswordCheck(saslpasscheck);
 	if(!d->c->serverStart(realm, mechlist, saslappname))
 		return false;
 	d->first = true;
@@ -388,6 +388,11 @@ namespace QCA
 
 		static void setAppName(const QString &name);
 
+		// servers: check plaintext passwords with this instead of the
+		//   SASL library's own user database
+		typedef bool (*PasswordCheck)(const QString &user, const QString &pass);
+		static void setPasswordCheck(PasswordCheck f);
+
 		void reset();
 		int errorCondition() const;
 
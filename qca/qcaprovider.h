@@ -161,6 +161,7 @@ public:
 	virtual bool clientStart(const QStringList &mechlist)=0;
 	virtual int clientFirstStep(bool allowClientSendFirst)=0;
 	virtual bool serverStart(const QString &realm, QStringList *mechlist, const QString &name)=0;
+	virtual void setPasswordCheck(QCA::SASL::PasswordCheck f)=0;
 	virtual int serverFirstStep(const QString &mech, const QByteArray *in)=0;
 
 	// get / set params
@@ -0,0 +1,273 @@
+/*
+ * admission.cpp - ambrosia
+ * Copyright (C) 2005  Justin Karneges <justin@affinix.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+#include "admission.h"
+
+#include <unistd.h>
+#include "cslog.h"
+
+// how often the counters are logged, while anything is happening
+#define REPORT_INTERVAL 10000
+
+class Admission::Private
+{
+public:
+	class Item
+	{
+	public:
+		int sock;
+		int tag;
+		QTime accepted;
+	};
+
+	QList<Item> priority, normal;
+	int rate, burst, maxHandshakes, maxQueue, maxWait;
+	double tokens;
+	QTime lastRefill;
+	QTimer timer, expireTimer, reportTimer;
+	Stats st;
+	qint64 authMsTotal;
+	bool changed;
+
+	void refill()
+	{
+		int ms = lastRefill.restart();
+		if(ms < 0) // midnight
+			ms += 86400000;
+		tokens += (double)ms * rate / 1000;
+		if(tokens > burst)
+			tokens = burst;
+	}
+
+	void drop(const Item &i)
+	{
+		::close(i.sock);
+		++st.dropped;
+	}
+
+	// the queues are in arrival order, so only the fronts need a look
+	void expire(QList<Item> *list)
+	{
+		while(!list->isEmpty() && list->first().accepted.elapsed() >= maxWait)
+		{
+			::close(list->takeFirst().sock);
+			++st.expired;
+			changed = true;
+		}
+	}
+
+	// come back when the oldest one is due
+	void scheduleExpire()
+	{
+		if(maxWait <= 0 || expireTimer.isActive())
+			return;
+		int age = -1;
+		if(!priority.isEmpty())
+			age = priority.first().accepted.elapsed();
+		if(!normal.isEmpty())
+			age = qMax(age, normal.first().accepted.elapsed());
+		if(age != -1)
+			expireTimer.start(qMax(maxWait - age, 0) + 1);
+	}
+};
+
+Admission::Admission(QObject *parent)
+:QObject(parent)
+{
+	d = new Private;
+	d->rate = 0;
+	d->burst = 0;
+	d->maxHandshakes = 0;
+	d->maxQueue = 1024;
+	d->maxWait = 30000;
+	d->tokens = 0;
+	d->lastRefill.start();
+	d->st.queued = 0;
+	d->st.queuedPriority = 0;
+	d->st.handshaking = 0;
+	d->st.admitted = 0;
+	d->st.dropped = 0;
+	d->st.expired = 0;
+	d->st.authenticated = 0;
+	d->st.failed = 0;
+	d->st.avgAuthMs = 0;
+	d->st.maxAuthMs = 0;
+	d->authMsTotal = 0;
+	d->changed = false;
+
+	d->timer.setSingleShot(true);
+	connect(&d->timer, SIGNAL(timeout()), SLOT(process()));
+	d->expireTimer.setSingleShot(true);
+	connect(&d->expireTimer, SIGNAL(timeout()), SLOT(process()));
+	connect(&d->reportTimer, SIGNAL(timeout()), SLOT(report()));
+	d->reportTimer.start(REPORT_INTERVAL);
+}
+
+Admission::~Admission()
+{
+	for(int n = 0; n < d->priority.count(); ++n)
+		::close(d->priority[n].sock);
+	for(int n = 0; n < d->normal.count(); ++n)
+		::close(d->normal[n].sock);
+	delete d;
+}
+
+void Admission::setRate(int perSecond, int burst)
+{
+	d->rate = perSecond;
+	d->burst = qMax(burst, 1);
+	d->tokens = d->burst;
+	d->lastRefill.restart();
+}
+
+void Admission::setMaxHandshakes(int n)
+{
+	d->maxHandshakes = n;
+}
+
+void Admission::setMaxQueue(int n)
+{
+	d->maxQueue = n;
+}
+
+void Admission::setMaxWait(int mills)
+{
+	d->maxWait = mills;
+}
+
+void Admission::add(int sock, Lane lane, int tag)
+{
+	Private::Item i;
+	i.sock = sock;
+	i.tag = tag;
+	i.accepted.start();
+	d->changed = true;
+
+	if(d->priority.count() + d->normal.count() >= d->maxQueue)
+	{
+		// make room for the priority lane at the expense of the newest
+		//   normal connection
+		if(lane == Priority && !d->normal.isEmpty())
+		{
+			d->drop(d->normal.takeLast());
+		}
+		else
+		{
+			CS_DEBUG(Router, "admission queue full, dropping connection");
+			d->drop(i);
+			return;
+		}
+	}
+
+	if(lane == Priority)
+		d->priority += i;
+	else
+		d->normal += i;
+	process();
+}
+
+void Admission::done(const QTime &accepted, bool authenticated)
+{
+	--d->st.handshaking;
+	d->changed = true;
+	if(authenticated)
+	{
+		int ms = accepted.elapsed();
+		++d->st.authenticated;
+		d->authMsTotal += ms;
+		d->st.avgAuthMs = (int)(d->authMsTotal / d->st.authenticated);
+		if(ms > d->st.maxAuthMs)
+			d->st.maxAuthMs = ms;
+	}
+	else
+		++d->st.failed;
+
+	// a slot opened up, but don't start a session from inside the
+	//   caller's handler
+	if(!d->priority.isEmpty() || !d->normal.isEmpty())
+		QMetaObject::invokeMethod(this, "process", Qt::QueuedConnection);
+}
+
+Admission::Stats Admission::stats() const
+{
+	Stats s = d->st;
+	s.queued = d->priority.count() + d->normal.count();
+	s.queuedPriority = d->priority.count();
+	return s;
+}
+
+void Admission::process()
+{
+	if(d->maxWait > 0)
+	{
+		d->expire(&d->priority);
+		d->expire(&d->normal);
+	}
+	admit();
+	d->scheduleExpire();
+}
+
+void Admission::admit()
+{
+	// priority lane is only held back by the handshake limit
+	while(!d->priority.isEmpty())
+	{
+		if(d->maxHandshakes > 0 && d->st.handshaking >= d->maxHandshakes)
+			return;
+		Private::Item i = d->priority.takeFirst();
+		++d->st.handshaking;
+		++d->st.admitted;
+		emit admitted(i.sock, i.tag, i.accepted);
+	}
+
+	while(!d->normal.isEmpty())
+	{
+		if(d->maxHandshakes > 0 && d->st.handshaking >= d->maxHandshakes)
+			return;
+		if(d->rate > 0)
+		{
+			d->refill();
+			if(d->tokens < 1)
+			{
+				// come back when the next token is in
+				int ms = (int)((1 - d->tokens) * 1000 / d->rate) + 1;
+				if(!d->timer.isActive())
+					d->timer.start(ms);
+				return;
+			}
+			d->tokens -= 1;
+		}
+		Private::Item i = d->normal.takeFirst();
+		++d->st.handshaking;
+		++d->st.admitted;
+		emit admitted(i.sock, i.tag, i.accepted);
+	}
+}
+
+void Admission::report()
+{
+	if(!d->changed)
+		return;
+	d->changed = false;
+
+	Stats s = stats();
+	CS_INFO(Router, "admission: queued=%d (priority %d), handshaking=%d, admitted=%d, dropped=%d, expired=%d, authenticated=%d (avg %dms, max %dms), failed=%d",
+		s.queued, s.queuedPriority, s.handshaking, s.admitted, s.dropped, s.expired, s.authenticated, s.avgAuthMs, s.maxAuthMs, s.failed);
+}
@@ -0,0 +1,82 @@
+/*
+ * admission.h - ambrosia
+ * Copyright (C) 2005  Justin Karneges <justin@affinix.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+#ifndef ADMISSION_H
+#define ADMISSION_H
+
+#include <QtCore>
+
+// Paces new inbound connections so that a reconnect storm doesn't stall
+// the event loop in TLS handshakes and auth.  Accepted sockets wait in a
+// bounded queue and are handed out at a token-bucket rate, with at most
+// a fixed number of sessions in their handshake at once.  The priority
+// lane (s2s) is served first and is not charged against the rate.
+// Sockets that don't fit in the queue are closed right away, and ones
+// that have waited too long are closed too.  The owner is expected to
+// close sessions that don't finish their handshake in time, so that
+// idle connections can't hold on to the handshake slots.
+class Admission : public QObject
+{
+	Q_OBJECT
+public:
+	enum Lane { Priority, Normal };
+
+	class Stats
+	{
+	public:
+		int queued, queuedPriority;
+		int handshaking;
+		int admitted, dropped, expired;
+		int authenticated, failed;
+		int avgAuthMs, maxAuthMs; // from accept to authenticated
+	};
+
+	Admission(QObject *parent=0);
+	~Admission();
+
+	void setRate(int perSecond, int burst); // 0 for no limit
+	void setMaxHandshakes(int n);           // 0 for no limit
+	void setMaxQueue(int n);
+	void setMaxWait(int mills);             // 0 for no limit
+
+	// queue an accepted socket.  'tag' is handed back with it
+	void add(int sock, Lane lane, int tag);
+
+	// a socket given out by admitted() finished its handshake, or
+	//   failed to.  'accepted' is the time passed to admitted()
+	void done(const QTime &accepted, bool authenticated);
+
+	Stats stats() const;
+
+signals:
+	void admitted(int sock, int tag, const QTime &accepted);
+
+private slots:
+	void process();
+	void report();
+
+private:
+	class Private;
+	Private *d;
+
+	void admit();
+};
+
+#endif
@@ -19,14 +19,22 @@
  */
 
 #include "router.h"
+#include "userstore.h"
+#include "presencetable.h"
+#include "cslog.h"
+#include "credentials.h"
+#include "admission.h"
 
 #include "qca-tls.h"
 #include "qca-sasl.h"
 
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
 #define SERVER_VERSION "0.2"
 
 #define NS_IMSESSION "urn:ietf:params:xml:ns:xmpp-session"
-#define NS_ROSTER    "jabber:iq:roster"
 #define NS_VCARD     "vcard-temp"
 #define NS_VERSION   "jabber:iq:version"
 
@@ -51,293 +59,6 @@ static QDomElement subelement(const QDomElement &e, const QString &ns, const QSt
 	return QDomElement();
 }
 
-static QString subtext(const QDomElement &e)
-{
-	for(QDomNode n = e.firstChild(); !n.isNull(); n = n.nextSibling())
-	{
-		if(n.isText())
-			return n.toText().data();
-	}
-	return QString();
-}
-
-class RosterChange
-{
-public:
-	Jid jid;
-	QString name;
-	bool remove;
-	QStringList groups;
-
-	bool fromXml(const QDomElement &e)
-	{
-		jid = Jid();
-		name = QString();
-		remove = false;
-		groups = QStringList();
-
-		if(e.namespaceURI() != NS_ROSTER || e.localName() != "item")
-			return false;
-
-		if(!e.hasAttribute("jid"))
-			return false;
-		jid = e.attribute("jid");
-		if(e.hasAttribute("name"))
-			name = e.attribute("name");
-		remove = e.hasAttribute("subscription") && e.attribute("subscription") == "remove";
-
-		QDomNodeList gnl = e.elementsByTagNameNS(NS_ROSTER, "group");
-		for(int n = 0; n < gnl.count(); ++n)
-			groups += subtext(gnl.item(n).toElement());
-
-		return true;
-	}
-};
-
-class RosterChangeList : public QList<RosterChange>
-{
-public:
-	bool fromXml(const QDomElement &in)
-	{
-		clear();
-		if(in.namespaceURI() != NS_ROSTER || in.localName() != "query")
-			return false;
-
-		QDomNodeList nl = in.elementsByTagNameNS(NS_ROSTER, "item");
-		for(int n = 0; n < nl.count(); ++n)
-		{
-			QDomElement e = nl.item(n).toElement();
-			RosterChange rc;
-			if(rc.fromXml(e))
-				append(rc);
-		}
-		return true;
-	}
-};
-
-class RosterItem
-{
-public:
-	Jid jid;
-	QString name;
-	QString sub;
-	bool ask;
-	QStringList groups;
-
-	QDomElement toXml(QDomDocument *doc) const
-	{
-		QDomElement e = doc->createElementNS(NS_ROSTER, "item");
-		e.setAttribute("jid", jid.full());
-		if(!name.isEmpty())
-			e.setAttribute("name", name);
-		e.setAttribute("subscription", sub);
-		if(ask)
-			e.setAttribute("ask", "subscribe");
-		for(int n = 0; n < groups.count(); ++n)
-		{
-			QDomElement ge = doc->createElementNS(NS_ROSTER, "group");
-			QDomText text = doc->createTextNode(groups[n]);
-			ge.appendChild(text);
-			e.appendChild(ge);
-		}
-		return e;
-	}
-
-	bool fromXml(const QDomElement &e)
-	{
-		jid = Jid();
-		name = QString();
-		sub = QString();
-		ask = false;
-		groups = QStringList();
-
-		if(e.namespaceURI() != NS_ROSTER || e.localName() != "item")
-			return false;
-
-		if(!e.hasAttribute("jid"))
-			return false;
-		jid = e.attribute("jid");
-		if(e.hasAttribute("name"))
-			name = e.attribute("name");
-		if(e.hasAttribute("subscription"))
-		{
-			sub = e.attribute("subscription");
-			if(sub != "none" && sub != "from" && sub != "to" && sub != "both")
-				return false;
-		}
-		ask = e.hasAttribute("ask") && e.attribute("ask") == "subscribe";
-
-		QDomNodeList gnl = e.elementsByTagNameNS(NS_ROSTER, "group");
-		for(int n = 0; n < gnl.count(); ++n)
-			groups += subtext(gnl.item(n).toElement());
-
-		return true;
-	}
-};
-
-class Roster : public QList<RosterItem>
-{
-public:
-	Roster applyChanges(const RosterChangeList &changeList)
-	{
-		Roster out;
-		for(int k = 0; k < changeList.count(); ++k)
-		{
-			const RosterChange &rc = changeList[k];
-
-			int index = -1;
-			for(int n = 0; n < count(); ++n)
-			{
-				if(at(n).jid.compare(rc.jid))
-				{
-					index = n;
-					break;
-				}
-			}
-
-			if(rc.remove)
-			{
-				if(index != -1)
-				{
-					RosterItem ri = at(index);
-					ri.sub = "remove";
-					out += ri;
-					removeAt(index);
-				}
-			}
-			else
-			{
-				// new item?
-				if(index == -1)
-				{
-					RosterItem new_item;
-					new_item.jid = rc.jid;
-					new_item.sub = "none";
-					new_item.ask = false;
-					index = count();
-					append(new_item);
-				}
-
-				RosterItem &ri = operator[](index);
-				ri.name = rc.name;
-				ri.groups = rc.groups;
-				out += ri;
-			}
-		}
-		return out;
-	}
-
-	QDomElement toXml(QDomDocument *doc) const
-	{
-		QDomElement root = doc->createElementNS(NS_ROSTER, "roster");
-		for(int n = 0; n < count(); ++n)
-			root.appendChild(at(n).toXml(doc));
-		return root;
-	}
-
-	QDomElement toQueryXml(QDomDocument *doc) const
-	{
-		QDomElement root = doc->createElementNS(NS_ROSTER, "query");
-		for(int n = 0; n < count(); ++n)
-			root.appendChild(at(n).toXml(doc));
-		return root;
-	}
-
-	bool fromXml(const QDomElement &in)
-	{
-		clear();
-		if(in.namespaceURI() != NS_ROSTER || in.localName() != "roster")
-			return false;
-
-		printf("---- reading items\n");
-		QDomNodeList nl = in.elementsByTagNameNS(NS_ROSTER, "item");
-		printf("---- nlcount: %d\n", nl.count());
-		for(int n = 0; n < nl.count(); ++n)
-		{
-			QDomElement e = nl.item(n).toElement();
-			RosterItem ri;
-			if(ri.fromXml(e))
-				append(ri);
-		}
-		return true;
-	}
-};
-
-class User
-{
-public:
-	Roster roster;
-	QDomElement vcard;
-};
-
-static QString hex(QChar c)
-{
-	QString str;
-	str.sprintf("%02x", (uchar)c.toLatin1());
-	return str;
-}
-
-static QString normalize(const QString &in)
-{
-	QString out;
-	for(int n = 0; n < in.length(); ++n)
-	{
-		if(in[n].isLetterOrNumber())
-			out += in[n];
-		else
-			out += hex(in[n]);
-	}
-	return out;
-}
-
-static User loadUser(const QString &username)
-{
-	User user;
-	QFile f("data/" + normalize(username) + ".xml");
-	printf("---- trying to read: [%s]\n", qPrintable(f.fileName()));
-	if(!f.open(QIODevice::ReadOnly))
-		return user;
-
-	QDomDocument doc;
-	doc.setContent(&f, true);
-	QDomElement u = doc.documentElement();
-	printf("[%s]\n", qPrintable(u.tagName()));
-	QDomNodeList nl = u.elementsByTagNameNS(NS_ROSTER, "roster");
-	if(nl.count() > 0)
-		user.roster.fromXml(nl.item(0).toElement());
-	nl = u.elementsByTagNameNS("vcard-temp", "vCard");
-	printf("nl count: %d\n", nl.count());
-	if(nl.count() > 0)
-		user.vcard = nl.item(0).toElement();
-	if(user.vcard.isNull())
-		printf("no vcard\n");
-	return user;
-}
-
-static void saveUser(const QString &username, const User &user)
-{
-	QDir dir("data");
-	if(!dir.exists())
-	{
-		dir.setPath(".");
-		if(!dir.mkdir("data"))
-			return;
-	}
-	QFile f("data/" + normalize(username) + ".xml");
-	printf("---- trying to write: [%s]\n", qPrintable(f.fileName()));
-	f.open(QIODevice::WriteOnly | QIODevice::Truncate);
-
-	QDomDocument doc;
-	QDomElement u = doc.createElement("user");
-	u.setAttribute("name", username);
-	u.appendChild(user.roster.toXml(&doc));
-	if(!user.vcard.isNull())
-		u.appendChild(user.vcard);
-	doc.appendChild(u);
-	QByteArray buf = doc.toString().toUtf8();
-	f.write(buf.data(), buf.size());
-}
-
 /*class PresenceItem
 {
 public:
@@ -349,65 +70,18 @@ public:
 class PresenceManager
 {
 public:
-	class Item
-	{
-	public:
-		Jid user;
-		Stanza stanza;
-		QList<Jid> dontsend;
-	};
-
-	class DPItem
-	{
-	public:
-		Jid user;
-		Jid to;
-		Stanza stanza;
-	};
+	typedef PresenceTable::Item Item;
+	typedef PresenceTable::DPItem DPItem;
 
 	QString host;
 	Router &router;
-	QList<Item> list;
-	QList<DPItem> dplist;
+	UserStore &users;
+	PresenceTable table;
 
-	PresenceManager(Router *_router) : router(*_router)
+	PresenceManager(Router *_router, UserStore *_users) : router(*_router), users(*_users)
 	{
 	}
 
-	int findItem(const Jid &user)
-	{
-		for(int n = 0; n < list.count(); ++n)
-		{
-			if(list[n].user.compare(user))
-			{
-				return n;
-			}
-		}
-		return -1;
-	}
-
-	int findDPItem(const Jid &user, const Jid &to)
-	{
-		for(int n = 0; n < dplist.count(); ++n)
-		{
-			if(dplist[n].user.compare(user) && dplist[n].to.compare(to))
-			{
-				return n;
-			}
-		}
-		return -1;
-	}
-
-	bool haveDontSend(const Item &i, const Jid &to)
-	{
-		for(int n = 0; n < i.dontsend.count(); ++n)
-		{
-			if(i.dontsend[n].compare(to))
-				return true;
-		}
-		return false;
-	}
-
 	bool forThisHost(const Jid &to)
 	{
 		Jid a = to.domain();
@@ -489,17 +163,8 @@ public:
 
 		if(in.type() == "subscribe")
 		{
-			User user = loadUser(username);
-			int index = -1;
-			for(int n = 0; n < user.roster.count(); ++n)
-			{
-				RosterItem &r = user.roster[n];
-				if(r.jid.compare(in.to()))
-				{
-					index = n;
-					break;
-				}
-			}
+			User user = users.load(username);
+			int index = user.roster.indexOf(in.to());
 
 			bool is_new = false;
 			if(index == -1)
@@ -507,23 +172,20 @@ public:
 				is_new = true;
 				RosterItem new_item;
 				new_item.jid = in.to();
-				new_item.sub = "none";
-				new_item.ask = false;
-				index = user.roster.count();
-				user.roster += new_item;
+				index = user.roster.append(new_item);
 			}
 
-			RosterItem &ri = user.roster[index];
+			const RosterItem &ri = user.roster[index];
 
 			Roster changedItems;
 
-			if(is_new || (!ri.ask && ri.sub != "to" && ri.sub != "both"))
+			if(is_new || (!ri.ask && !ri.hasTo()))
 			{
-				ri.ask = true;
-				changedItems += ri;
+				user.roster.setAsk(index, true);
+				changedItems += user.roster[index];
 			}
 
-			saveUser(username, user);
+			users.save(username, user);
 
 			if(!changedItems.isEmpty())
 			{
@@ -541,32 +203,19 @@ public:
 		}
 		else if(in.type() == "subscribed")
 		{
-			User user = loadUser(username);
-			int index = -1;
-			for(int n = 0; n < user.roster.count(); ++n)
-			{
-				RosterItem &r = user.roster[n];
-				if(r.jid.compare(in.to()))
-				{
-					index = n;
-					break;
-				}
-			}
-
+			User user = users.load(username);
+			int index = user.roster.indexOf(in.to());
 			if(index == -1)
 				return;
 
 			Roster changedItems;
-			if(user.roster[index].sub == "none" || user.roster[index].sub == "to")
+			if(!user.roster[index].hasFrom())
 			{
-				if(user.roster[index].sub == "none")
-					user.roster[index].sub = "from";
-				else
-					user.roster[index].sub = "both";
+				user.roster.setSubscription(index, user.roster[index].sub | RosterItem::SubFrom);
 				changedItems += user.roster[index];
 			}
 
-			saveUser(username, user);
+			users.save(username, user);
 
 			if(!changedItems.isEmpty())
 			{
@@ -600,18 +249,8 @@ public:
 
 		if(in.type() == "subscribe")
 		{
-			User user = loadUser(username);
-			int index = -1;
-			for(int n = 0; n < user.roster.count(); ++n)
-			{
-				RosterItem &r = user.roster[n];
-				if(r.jid.compare(in.from()))
-				{
-					index = n;
-					break;
-				}
-			}
-
+			User user = users.load(username);
+			int index = user.roster.indexOf(in.from());
 			if(index == -1)
 			{
 				// forward
@@ -620,38 +259,25 @@ public:
 			}
 
 			// forward
-			if(user.roster[index].sub == "none" || user.roster[index].sub == "to")
+			if(!user.roster[index].hasFrom())
 				router.write(in);
 		}
 		else if(in.type() == "subscribed")
 		{
-			User user = loadUser(username);
-			int index = -1;
-			for(int n = 0; n < user.roster.count(); ++n)
-			{
-				RosterItem &r = user.roster[n];
-				if(r.jid.compare(in.from()))
-				{
-					index = n;
-					break;
-				}
-			}
-
+			User user = users.load(username);
+			int index = user.roster.indexOf(in.from());
 			if(index == -1)
 				return;
 
 			Roster changedItems;
-			if(user.roster[index].sub == "none" || user.roster[index].sub == "from")
+			if(!user.roster[index].hasTo())
 			{
-				if(user.roster[index].sub == "none")
-					user.roster[index].sub = "to";
-				else
-					user.roster[index].sub = "both";
-				user.roster[index].ask = false;
+				user.roster.setSubscription(index, user.roster[index].sub | RosterItem::SubTo);
+				user.roster.setAsk(index, false);
 				changedItems += user.roster[index];
 			}
 
-			saveUser(username, user);
+			users.save(username, user);
 
 			if(!changedItems.isEmpty())
 			{
@@ -665,10 +291,11 @@ public:
 				router.write(out);
 
 				// probe & presence push
-				int x = findItem(u);
-				if(x != -1)
+				Item *i = table.item(u);
+				if(i)
 				{
-					Item &i = list[x];
+					Stanza last = i->stanza;
+					Jid from = i->user;
 
 					out = Stanza(Stanza::Presence, user.roster[index].jid, "probe");
 					out.setFrom(u);
@@ -676,9 +303,9 @@ public:
 
 					//i.watchers += u.roster[index].jid;
 
-					out = i.stanza;
+					out = last;
 					out.setTo(user.roster[index].jid);
-					out.setFrom(i.user);
+					out.setFrom(from);
 					writeFromHost(out);
 				}
 			}
@@ -707,41 +334,22 @@ public:
 
 		if(direct)
 		{
-			int index = findDPItem(u, in.to());
-
-			// don't have one for this combo yet?  make it
-			if(index == -1)
-			{
-				DPItem di;
-				di.user = u;
-				di.to = in.to();
-				index = dplist.count();
-				dplist += di;
-			}
-
-			DPItem &di = dplist[index];
-			di.stanza = in;
+			// makes one for this combo if we don't have it yet
+			DPItem *di = table.addDirected(u, in.to());
+			if(di)
+				di->stanza = in;
 
 			Stanza out = in;
 			writeFromHost(out);
 		}
 		else
 		{
-			int index = findItem(u);
-
 			// initial ?
-			bool initial = false;
-			if(index == -1)
-			{
-				initial = true;
-				Item i;
-				i.user = u;
-				index = list.count();
-				list += i;
-			}
-
-			Item &i = list[index];
-			i.stanza = in;
+			bool initial = (table.item(u) == 0);
+			Item *ip = table.addItem(u);
+			if(!ip)
+				return;
+			ip->stanza = in;
 
 			// initial can't be unavailable
 			if(initial && !avail)
@@ -750,7 +358,7 @@ public:
 				return;
 			}
 
-			User user = loadUser(u.node());
+			User user = users.load(u.node());
 
 			// TODO: send to own available resources (we don't support these yet)
 
@@ -759,69 +367,49 @@ public:
 				// send presence probes to roster items of to/both
 				//   from = u.fulljid
 				//   to   = roster jid
-				for(int n = 0; n < user.roster.count(); ++n)
+				const QHash<QString, Jid> &to = user.roster.subscribedTo();
+				for(QHash<QString, Jid>::ConstIterator it = to.begin(); it != to.end(); ++it)
 				{
-					RosterItem &r = user.roster[n];
-					if(r.sub == "to" || r.sub == "both")
-					{
-						Stanza out(Stanza::Presence, r.jid, "probe");
-						out.setFrom(u);
-						writeFromHost(out);
-					}
+					Stanza out(Stanza::Presence, it.value(), "probe");
+					out.setFrom(u);
+					writeFromHost(out);
 				}
 			}
 
 			// broadcast presence to roster items of from/both
 			//   from = u.fulljid
 			//   to   = roster.jid
-			for(int n = 0; n < user.roster.count(); ++n)
+			// local or remote, these all end up in the router, so hand
+			//   them over in one go and let it serialize only once
+			// (look the item up again, the probes above may have touched the table)
+			QList<Jid> recipients;
+			const Item *i = table.item(u);
+			const QHash<QString, Jid> &from = user.roster.subscribers();
+			for(QHash<QString, Jid>::ConstIterator it = from.begin(); it != from.end(); ++it)
 			{
-				RosterItem &r = user.roster[n];
-				if(r.sub == "from" || r.sub == "both")
-				{
-					// skip
-					if(!initial && haveDontSend(i, r.jid))
-						continue;
+				// skip
+				if(!initial && i && table.haveDontSend(*i, it.value()))
+					continue;
 
-					// TODO: if this roster item is in the dplist, remove from the dplist?
+				// TODO: if this roster item is in the dplist, remove from the dplist?
 
-					Stanza out = in;
-					out.setFrom(u);
-					out.setTo(r.jid);
-					writeFromHost(out);
-				}
+				recipients += it.value();
 			}
 
 			// send unavailable to all jids that the user has sent available directed presence to
 			if(!initial && !avail)
+				recipients += table.directedTargets(u);
+
+			if(!recipients.isEmpty())
 			{
-				for(int n = 0; n < dplist.count(); ++n)
-				{
-					DPItem &di = dplist[n];
-					if(di.user.compare(u))
-					{
-						Stanza out = in;
-						out.setFrom(u);
-						out.setTo(di.to);
-						writeFromHost(out);
-					}
-				}
+				Stanza out = in;
+				out.setFrom(u);
+				router.writeBroadcast(out, recipients);
 			}
 
 			// if going unavailable, remove all state
 			if(!avail)
-			{
-				list.removeAt(index);
-				for(int n = 0; n < dplist.count(); ++n)
-				{
-					DPItem &di = dplist[n];
-					if(di.user.compare(u))
-					{
-						dplist.removeAt(n);
-						--n; // adjust position
-					}
-				}
-			}
+				table.removeItem(u);
 
 			// send to all contacts on this server where
 			//   the user's roster contains target of from/both
@@ -843,20 +431,17 @@ public:
 
 		if(in.type() == "error")
 		{
-			int index = findItem(u);
+			Item *i = table.item(u);
 
 			// we haven't sent presence?
-			if(index == -1)
+			if(!i)
 			{
 				// skip
 				return;
 			}
 
-			Item &i = list[index];
-
 			// FIXME: deal only with bare addresses, or?
-			if(!haveDontSend(i, in.from()))
-				i.dontsend += in.from();
+			table.addDontSend(i, in.from());
 
 			// pass to the client
 			router.write(in);
@@ -864,54 +449,50 @@ public:
 		else if(in.type() == "probe")
 		{
 			// is there a directed presence?
-			int index = findDPItem(u, in.from());
-			if(index != -1)
+			const DPItem *di = table.directed(u, in.from());
+			if(di)
 			{
-				DPItem &di = dplist[index];
-				Stanza out = di.stanza;
+				Stanza out = di->stanza;
 				out.setFrom(u);
-				out.setTo(di.to);
+				out.setTo(di->to);
 				router.write(out);
 				return;
 			}
 
 			// look up regular presence
-			index = findItem(u);
+			const Item *i = table.item(u);
 
-			User user = loadUser(u.node());
+			User user = users.load(u.node());
 
 			// is the sender from the roster?
-			for(int n = 0; n < user.roster.count(); ++n)
+			int r = user.roster.indexOfBare(in.from());
+			if(r != -1)
 			{
-				RosterItem &r = user.roster[n];
-				if(r.jid.compare(in.from(), false)) // bare-jid compare
+				if(user.roster[r].hasFrom())
 				{
-					if(r.sub == "from" || r.sub == "both")
+					Stanza out;
+					if(i)
 					{
-						Stanza out;
-						if(index != -1)
-						{
-							out = list[index].stanza;
-							out.setFrom(u);
-							out.setTo(in.from());
-						}
-						else
-						{
-							out = Stanza(XMPP::Stanza::Presence, in.from(), "unavailable");
-							out.setFrom(u);
-						}
-						router.write(out);
+						out = i->stanza;
+						out.setFrom(u);
+						out.setTo(in.from());
 					}
 					else
 					{
-						// TODO: auth error
+						out = Stanza(XMPP::Stanza::Presence, in.from(), "unavailable");
+						out.setFrom(u);
 					}
+					router.write(out);
 				}
 				else
 				{
-					// TODO: some error
+					// TODO: auth error
 				}
 			}
+			else
+			{
+				// TODO: some error
+			}
 		}
 		else
 		{
@@ -925,6 +506,7 @@ class App : public QObject
 	Q_OBJECT
 public:
 	Router r;
+	UserStore users;
 	QString host;
 	bool c2s_ssl;
 
@@ -942,7 +524,7 @@ public:
 		return -1;
 	}*/
 
-	App(const QString &_host, const QCA::Cert &cert, const QCA::RSAKey &key) : presman(&r)
+	App(const QString &_host, const QCA::Cert &cert, const QCA::RSAKey &key) : presman(&r, &users)
 	{
 		host = _host;
 		presman.host = host;
@@ -961,14 +543,14 @@ public:
 	{
 		if(!r.start(host))
 		{
-			printf("Error binding to port 5222/5223/5269!\n");
+			CS_ERROR(General, "Error binding to port 5222/5223/5269!");
 			QTimer::singleShot(0, this, SIGNAL(quit()));
 			return;
 		}
 		if(c2s_ssl)
-			printf("Listening on %s:[5222,5223,5269] ...\n", host.toLatin1().data());
+			CS_INFO(General, "Listening on %s:[5222,5223,5269] ...", host.toLatin1().data());
 		else
-			printf("Listening on %s:[5222,5269] ...\n", host.toLatin1().data());
+			CS_INFO(General, "Listening on %s:[5222,5269] ...", host.toLatin1().data());
 	}
 
 signals:
@@ -977,7 +559,7 @@ signals:
 private slots:
 	void router_userSessionGone(const XMPP::Jid &jid)
 	{
-		printf("user session gone: [%s]\n", qPrintable(jid.full()));
+		CS_DEBUG(Presence, "user session gone: [%s]", qPrintable(jid.full()));
 		Stanza fake_in(XMPP::Stanza::Presence, Jid(), "unavailable");
 		fake_in.setFrom(jid);
 		QDomElement e = fake_in.createElement("jabber:client", "status");
@@ -1014,7 +596,7 @@ private slots:
 
 					if(in.type() == "get")
 					{
-						User u = loadUser(user);
+						User u = users.load(user);
 						Stanza out(XMPP::Stanza::IQ, in.from(), "result", in.id());
 						out.setFrom(in.from());
 						out.appendChild(u.roster.toQueryXml(&out.doc()));
@@ -1022,13 +604,13 @@ private slots:
 					}
 					else if(in.type() == "set")
 					{
-						User u = loadUser(user);
+						User u = users.load(user);
 						RosterChangeList changes;
 						if(!changes.fromXml(subelement(in.element(), NS_ROSTER, "query")))
 							return;
 
 						Roster changedItems = u.roster.applyChanges(changes);
-						saveUser(user, u);
+						users.save(user, u);
 
 						// ack
 						Stanza out(XMPP::Stanza::IQ, in.from(), "result", in.id());
@@ -1060,12 +642,12 @@ private slots:
 					{
 						QString user = in.to().node();
 
-						User u = loadUser(user);
+						User u = users.load(user);
 
 						Stanza out(XMPP::Stanza::IQ, in.from(), "result", in.id());
 						out.setFrom(in.to());
 						if(!u.vcard.isNull())
-							out.appendChild(u.vcard);
+							out.appendChild(u.vcard.cloneNode(true).toElement());
 
 						// return static vcard
 						/*QDomElement v = out.createElement("vcard-temp", "vCard");
@@ -1082,9 +664,9 @@ private slots:
 					{
 						if(local)
 						{
-							User u = loadUser(user);
+							User u = users.load(user);
 							u.vcard = sub;
-							saveUser(user, u);
+							users.save(user, u);
 
 							Stanza out(XMPP::Stanza::IQ, in.from(), "result", in.id());
 							//out.setFrom(in.from());
@@ -1627,13 +1209,215 @@ static QCA::RSAKey readKeyFile(const QString &fname)
 	return key;
 }
 
+static bool parseFormat(const QString &s, UserStore::Format *format)
+{
+	if(s == "xml")
+		*format = UserStore::FormatXml;
+	else if(s == "binary")
+		*format = UserStore::FormatBinary;
+	else
+		return false;
+	return true;
+}
+
+static bool parseFsyncPolicy(const QString &s, UserStore::FsyncPolicy *policy)
+{
+	if(s == "never")
+		*policy = UserStore::FsyncNever;
+	else if(s == "file")
+		*policy = UserStore::FsyncPerFile;
+	else if(s == "batch")
+		*policy = UserStore::FsyncPerBatch;
+	else
+		return false;
+	return true;
+}
+
+// comma separated category names, empty means all
+static bool parseLogCategories(const QString &s, int *mask)
+{
+	if(s.isEmpty())
+	{
+		*mask = ~0;
+		return true;
+	}
+	*mask = 0;
+	QStringList list = s.split(',');
+	for(int n = 0; n < list.count(); ++n)
+	{
+		int cat = CSLog::categoryFromString(list[n]);
+		if(cat == -1)
+			return false;
+		*mask |= (1 << cat);
+	}
+	return true;
+}
+
+// "N" or "N:M", each a positive number
+static bool parseCounts(const QString &s, int *a, int *b)
+{
+	QStringList list = s.split(':');
+	if(list.count() > 2)
+		return false;
+	bool ok;
+	*a = list[0].toInt(&ok);
+	if(!ok || *a < 1)
+		return false;
+	*b = *a;
+	if(list.count() == 2)
+	{
+		*b = list[1].toInt(&ok);
+		if(!ok || *b < 1)
+			return false;
+	}
+	return true;
+}
+
 int main(int argc, char **argv)
 {
 	QCoreApplication app(argc, argv);
 
-	if(argc < 2)
+	// split off --options from the positional arguments
+	QStringList args;
+	UserStore::Format format = UserStore::FormatXml;
+	UserStore::FsyncPolicy fsyncPolicy = UserStore::FsyncNever;
+	int storeBatch = 64, storeFlush = 1000, storeCache = 10000, storeDirty = 4096; // storeDirty in KB
+	bool convert = false;
+	int backlog = 128, rate = 0, burst = 0, maxHandshakes = 0, maxQueue = 1024, maxWait = 30, workers = 0, s2sStreams = 1;
+	int lowWater = 64, highWater = 256, hardLimit = 4096; // KB
+	bool lazyStanzas = true, loadReport = false;
+	QHostAddress bindAddress;
+	for(int n = 1; n < argc; ++n)
 	{
-		printf("Usage: ambrosia [hostname] (cert.pem) (privkey.pem)\n\n");
+		QString arg = QString::fromLocal8Bit(argv[n]);
+		if(arg.startsWith("--store=") || arg.startsWith("--convert-data="))
+		{
+			if(!parseFormat(arg.mid(arg.indexOf('=') + 1), &format))
+			{
+				printf("Unknown storage format: [%s]\n\n", qPrintable(arg));
+				return 0;
+			}
+			if(arg.startsWith("--convert-data="))
+				convert = true;
+		}
+		else if(arg.startsWith("--store-fsync="))
+		{
+			if(!parseFsyncPolicy(arg.mid(14), &fsyncPolicy))
+			{
+				printf("Unknown fsync policy: [%s]\n\n", qPrintable(arg));
+				return 0;
+			}
+		}
+		else if(arg.startsWith("--log-level="))
+		{
+			int level = CSLog::levelFromString(arg.mid(12));
+			if(level == -1)
+			{
+				printf("Unknown log level: [%s]\n\n", qPrintable(arg));
+				return 0;
+			}
+			if(level > CS_LOG_LEVEL)
+				printf("Note: built without log levels above %d\n", CS_LOG_LEVEL);
+			CSLog::setLevel(level);
+		}
+		else if(arg.startsWith("--backlog=") || arg.startsWith("--max-handshakes=") || arg.startsWith("--accept-queue=") || arg.startsWith("--accept-wait=") || arg.startsWith("--accept-rate=") || arg.startsWith("--workers=") || arg.startsWith("--write-watermarks=") || arg.startsWith("--write-limit=") || arg.startsWith("--s2s-streams=") || arg.startsWith("--store-batch=") || arg.startsWith("--store-flush=") || arg.startsWith("--store-cache=") || arg.startsWith("--store-dirty="))
+		{
+			int x, y;
+			bool pair = arg.startsWith("--accept-rate=") || arg.startsWith("--write-watermarks=");
+			if(!parseCounts(arg.mid(arg.indexOf('=') + 1), &x, &y) || (x != y && !pair))
+			{
+				printf("Bad value: [%s]\n\n", qPrintable(arg));
+				return 0;
+			}
+			if(arg.startsWith("--backlog="))
+				backlog = x;
+			else if(arg.startsWith("--max-handshakes="))
+				maxHandshakes = x;
+			else if(arg.startsWith("--accept-queue="))
+				maxQueue = x;
+			else if(arg.startsWith("--accept-wait="))
+				maxWait = x;
+			else if(arg.startsWith("--workers="))
+				workers = x;
+			else if(arg.startsWith("--s2s-streams="))
+				s2sStreams = x;
+			else if(arg.startsWith("--write-watermarks="))
+			{
+				if(x > y)
+				{
+					printf("Bad value: [%s]\n\n", qPrintable(arg));
+					return 0;
+				}
+				lowWater = x;
+				highWater = y;
+			}
+			else if(arg.startsWith("--write-limit="))
+				hardLimit = x;
+			else if(arg.startsWith("--store-batch="))
+				storeBatch = x;
+			else if(arg.startsWith("--store-flush="))
+				storeFlush = x;
+			else if(arg.startsWith("--store-cache="))
+				storeCache = x;
+			else if(arg.startsWith("--store-dirty="))
+				storeDirty = x;
+			else
+			{
+				rate = x;
+				burst = y;
+			}
+		}
+		else if(arg == "--no-lazy-stanzas")
+		{
+			lazyStanzas = false;
+		}
+		else if(arg == "--load-report")
+		{
+			loadReport = true;
+		}
+		else if(arg.startsWith("--bind="))
+		{
+			if(!bindAddress.setAddress(arg.mid(7)))
+			{
+				printf("Bad address: [%s]\n\n", qPrintable(arg));
+				return 0;
+			}
+		}
+		else if(arg.startsWith("--userdb="))
+		{
+			CredentialStore::instance()->setFileName(arg.mid(9));
+		}
+		else if(arg.startsWith("--log="))
+		{
+			int mask;
+			if(!parseLogCategories(arg.mid(6), &mask))
+			{
+				printf("Unknown log category: [%s]\n\n", qPrintable(arg));
+				return 0;
+			}
+			CSLog::setCategories(mask);
+		}
+		else
+			args += arg;
+	}
+
+	if(convert)
+	{
+		int count = UserStore::convert("data", format);
+		printf("Converted %d users\n", count);
+		return 0;
+	}
+
+	if(args.count() < 1)
+	{
+		printf("Usage: ambrosia [hostname] (cert.pem) (privkey.pem) (--store=xml|binary)\n");
+		printf("       ambrosia --convert-data=xml|binary\n");
+		printf("       (--log-level=error|warn|info|debug|trace) (--log=category,...)\n");
+		printf("       (--userdb=file) (--workers=n) (--s2s-streams=n) (--no-lazy-stanzas)\n");
+		printf("       (--bind=address) (--load-report)\n");
+		printf("       (--backlog=n) (--accept-rate=persec[:burst]) (--max-handshakes=n) (--accept-queue=n) (--accept-wait=secs)\n");
+		printf("       (--write-watermarks=lowKB:highKB) (--write-limit=KB)\n");
+		printf("       (--store-fsync=never|file|batch) (--store-batch=n) (--store-flush=ms) (--store-cache=n) (--store-dirty=KB)\n\n");
 		return 0;
 	}
 
@@ -1644,10 +1428,10 @@ int main(int argc, char **argv)
 	{
 		QCA::Cert cert;
 		QCA::RSAKey key;
-		if(argc >= 4)
+		if(args.count() >= 3)
 		{
-			cert = readCertFile(argv[2]);
-			key = readKeyFile(argv[3]);
+			cert = readCertFile(args[1]);
+			key = readKeyFile(args[2]);
 			if(cert.isNull() || key.isNull())
 			{
 				printf("Error reading cert/key files\n\n");
@@ -1655,15 +1439,50 @@ int main(int argc, char **argv)
 			}
 		}
 
-		QString host(argv[1]);
+		QString host(args[0]);
+
+		// with the pid, so that servers started together don't all pick
+		//   the same stream ids and retry delays
+		srand(time(NULL) ^ (getpid() << 16));
+
+		CSLog::start();
 
-		srand(time(NULL));
+		// load the users now rather than on the first login
+		CredentialStore::instance()->count();
 
 		App *a = new App(host, cert, key);
+		a->users.setFormat(format);
+		a->users.setFsyncPolicy(fsyncPolicy);
+		a->users.setBatchSize(storeBatch);
+		a->users.setFlushInterval(storeFlush);
+		a->users.setMaxEntries(storeCache);
+		a->users.setMaxDirtyBytes(storeDirty * 1024);
+		a->r.setListenBacklog(backlog);
+		a->r.setWorkers(workers);
+		a->r.setOutboundStreams(s2sStreams);
+		a->r.setLazyStanzas(lazyStanzas);
+		a->r.setBindAddress(bindAddress);
+		a->r.setLoadReport(loadReport);
+		a->r.setWriteLimits(lowWater * 1024, highWater * 1024, qMax(hardLimit, highWater) * 1024);
+		a->r.admission()->setRate(rate, burst);
+		a->r.admission()->setMaxHandshakes(maxHandshakes);
+		a->r.admission()->setMaxQueue(maxQueue);
+		a->r.admission()->setMaxWait(maxWait * 1000);
 		QObject::connect(a, SIGNAL(quit()), &app, SLOT(quit()));
 		a->start();
 		app.exec();
 		delete a;
+
+		Jid::CacheStats st = Jid::cacheStats();
+		CS_INFO(General, "jid cache: %llu hits, %llu misses, ~%llu ms saved", (unsigned long long)st.hits, (unsigned long long)st.misses, (unsigned long long)(st.usecSaved / 1000));
+		Stanza::AttrStats ast = Stanza::attrStats();
+		if(ast.stanzas > 0)
+		{
+			CS_INFO(General, "stanza attributes: %llu lookups, %llu read from the element, %.1f and %.1f per stanza", (unsigned long long)ast.lookups, (unsigned long long)ast.domReads,
+				(double)ast.lookups / ast.stanzas, (double)ast.domReads / ast.stanzas);
+		}
+
+		CSLog::stop();
 	}
 
 	// clean up
@@ -0,0 +1,144 @@
+/*
+ * presencetable.cpp - ambrosia
+ * Copyright (C) 2005  Justin Karneges <justin@affinix.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+#include "presencetable.h"
+
+using namespace XMPP;
+
+PresenceTable::PresenceTable()
+{
+	dpCount = 0;
+}
+
+int PresenceTable::count() const
+{
+	return items.count();
+}
+
+int PresenceTable::directedCount() const
+{
+	return dpCount;
+}
+
+void PresenceTable::clear()
+{
+	items.clear();
+	dp.clear();
+	dpCount = 0;
+}
+
+PresenceTable::Item *PresenceTable::item(const Jid &user)
+{
+	if(!user.isValid())
+		return 0;
+	QHash<QString, Item>::Iterator it = items.find(user.full());
+	if(it == items.end())
+		return 0;
+	return &it.value();
+}
+
+PresenceTable::Item *PresenceTable::addItem(const Jid &user)
+{
+	if(!user.isValid())
+		return 0;
+	QHash<QString, Item>::Iterator it = items.find(user.full());
+	if(it == items.end())
+	{
+		Item i;
+		i.user = user;
+		it = items.insert(user.full(), i);
+	}
+	return &it.value();
+}
+
+void PresenceTable::removeItem(const Jid &user)
+{
+	if(!user.isValid())
+		return;
+	items.remove(user.full());
+	removeDirected(user);
+}
+
+bool PresenceTable::haveDontSend(const Item &i, const Jid &to) const
+{
+	if(!to.isValid())
+		return false;
+	return i.dontsend.contains(to.full());
+}
+
+void PresenceTable::addDontSend(Item *i, const Jid &to)
+{
+	if(to.isValid())
+		i->dontsend.insert(to.full());
+}
+
+PresenceTable::DPItem *PresenceTable::directed(const Jid &user, const Jid &to)
+{
+	if(!user.isValid() || !to.isValid())
+		return 0;
+	QHash<QString, QHash<QString, DPItem> >::Iterator uit = dp.find(user.full());
+	if(uit == dp.end())
+		return 0;
+	QHash<QString, DPItem>::Iterator it = uit.value().find(to.full());
+	if(it == uit.value().end())
+		return 0;
+	return &it.value();
+}
+
+PresenceTable::DPItem *PresenceTable::addDirected(const Jid &user, const Jid &to)
+{
+	if(!user.isValid() || !to.isValid())
+		return 0;
+	QHash<QString, DPItem> &targets = dp[user.full()];
+	QHash<QString, DPItem>::Iterator it = targets.find(to.full());
+	if(it == targets.end())
+	{
+		DPItem di;
+		di.user = user;
+		di.to = to;
+		it = targets.insert(to.full(), di);
+		++dpCount;
+	}
+	return &it.value();
+}
+
+QList<Jid> PresenceTable::directedTargets(const Jid &user) const
+{
+	QList<Jid> list;
+	if(!user.isValid())
+		return list;
+	QHash<QString, QHash<QString, DPItem> >::ConstIterator uit = dp.find(user.full());
+	if(uit == dp.end())
+		return list;
+	for(QHash<QString, DPItem>::ConstIterator it = uit.value().begin(); it != uit.value().end(); ++it)
+		list += it.value().to;
+	return list;
+}
+
+void PresenceTable::removeDirected(const Jid &user)
+{
+	if(!user.isValid())
+		return;
+	QHash<QString, QHash<QString, DPItem> >::Iterator uit = dp.find(user.full());
+	if(uit == dp.end())
+		return;
+	dpCount -= uit.value().count();
+	dp.erase(uit);
+}
@@ -0,0 +1,80 @@
+/*
+ * presencetable.h - ambrosia
+ * Copyright (C) 2005  Justin Karneges <justin@affinix.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+#ifndef PRESENCETABLE_H
+#define PRESENCETABLE_H
+
+#include <QtCore>
+#include "xmpp.h"
+
+// Presence state of the local users: the last broadcast presence of
+// each user, the contacts that bounced it (dontsend), and directed
+// presence per (user, target).  Everything is keyed by full jid, so
+// lookups are constant time and dropping a user only touches that
+// user's own directed presences.
+//
+// Pointers returned by the lookups stay valid until the next insertion
+// or removal.
+class PresenceTable
+{
+public:
+	class Item
+	{
+	public:
+		XMPP::Jid user;
+		XMPP::Stanza stanza;
+		QSet<QString> dontsend;
+	};
+
+	class DPItem
+	{
+	public:
+		XMPP::Jid user;
+		XMPP::Jid to;
+		XMPP::Stanza stanza;
+	};
+
+	PresenceTable();
+
+	int count() const;
+	int directedCount() const;
+	void clear();
+
+	Item *item(const XMPP::Jid &user);
+	Item *addItem(const XMPP::Jid &user);
+
+	// removes the user's directed presence as well
+	void removeItem(const XMPP::Jid &user);
+
+	bool haveDontSend(const Item &i, const XMPP::Jid &to) const;
+	void addDontSend(Item *i, const XMPP::Jid &to);
+
+	DPItem *directed(const XMPP::Jid &user, const XMPP::Jid &to);
+	DPItem *addDirected(const XMPP::Jid &user, const XMPP::Jid &to);
+	QList<XMPP::Jid> directedTargets(const XMPP::Jid &user) const;
+	void removeDirected(const XMPP::Jid &user);
+
+private:
+	QHash<QString, Item> items;
+	QHash<QString, QHash<QString, DPItem> > dp;
+	int dpCount;
+};
+
+#endif
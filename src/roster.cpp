@@ -0,0 +1,282 @@
+/*
+ * roster.cpp - ambrosia
+ * Copyright (C) 2005  Justin Karneges <justin@affinix.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+#include "roster.h"
+
+using namespace XMPP;
+
+//----------------------------------------------------------------------------
+// RosterItem
+//----------------------------------------------------------------------------
+QString RosterItem::subToString(int sub)
+{
+	switch(sub)
+	{
+		case SubTo:     return "to";
+		case SubFrom:   return "from";
+		case SubBoth:   return "both";
+		case SubRemove: return "remove";
+		default:        return "none";
+	}
+}
+
+int RosterItem::stringToSub(const QString &s)
+{
+	if(s == "none")
+		return SubNone;
+	else if(s == "to")
+		return SubTo;
+	else if(s == "from")
+		return SubFrom;
+	else if(s == "both")
+		return SubBoth;
+	else
+		return -1;
+}
+
+QDomElement RosterItem::toXml(QDomDocument *doc) const
+{
+	QDomElement e = doc->createElementNS(NS_ROSTER, "item");
+	e.setAttribute("jid", jid.full());
+	if(!name.isEmpty())
+		e.setAttribute("name", name);
+	e.setAttribute("subscription", subToString(sub));
+	if(ask)
+		e.setAttribute("ask", "subscribe");
+	for(int n = 0; n < groups.count(); ++n)
+	{
+		QDomElement ge = doc->createElementNS(NS_ROSTER, "group");
+		QDomText text = doc->createTextNode(groups[n]);
+		ge.appendChild(text);
+		e.appendChild(ge);
+	}
+	return e;
+}
+
+bool RosterItem::fromXml(const QDomElement &e)
+{
+	jid = Jid();
+	name = QString();
+	sub = SubNone;
+	ask = false;
+	groups = QStringList();
+
+	if(e.namespaceURI() != NS_ROSTER || e.localName() != "item")
+		return false;
+
+	if(!e.hasAttribute("jid"))
+		return false;
+	jid = e.attribute("jid");
+	if(e.hasAttribute("name"))
+		name = e.attribute("name");
+	if(e.hasAttribute("subscription"))
+	{
+		sub = stringToSub(e.attribute("subscription"));
+		if(sub == -1)
+			return false;
+	}
+	ask = e.hasAttribute("ask") && e.attribute("ask") == "subscribe";
+
+	QDomNodeList gnl = e.elementsByTagNameNS(NS_ROSTER, "group");
+	for(int n = 0; n < gnl.count(); ++n)
+		groups += subtext(gnl.item(n).toElement());
+
+	return true;
+}
+
+//----------------------------------------------------------------------------
+// Roster
+//----------------------------------------------------------------------------
+Roster::Roster()
+{
+}
+
+int Roster::indexOf(const Jid &jid) const
+{
+	if(!jid.isValid())
+		return -1;
+	return index.value(jid.full(), -1);
+}
+
+int Roster::indexOfBare(const Jid &jid) const
+{
+	if(!jid.isValid())
+		return -1;
+	return index.value(jid.bare(), -1);
+}
+
+int Roster::append(const RosterItem &item)
+{
+	int n = items.count();
+	items.append(item);
+	if(item.jid.isValid() && !index.contains(item.jid.full()))
+		index.insert(item.jid.full(), n);
+	updateSubSets(item, SubNone);
+	return n;
+}
+
+Roster & Roster::operator+=(const RosterItem &item)
+{
+	append(item);
+	return *this;
+}
+
+void Roster::removeAt(int n)
+{
+	RosterItem item = items.takeAt(n);
+	int oldSub = item.sub;
+	item.sub = RosterItem::SubNone;
+	updateSubSets(item, oldSub);
+
+	if(item.jid.isValid() && index.value(item.jid.full(), -1) == n)
+		index.remove(item.jid.full());
+
+	// positions after the removed item have shifted down by one.  if the
+	//   removed jid had a later duplicate, that one takes over the index
+	for(int k = n; k < items.count(); ++k)
+	{
+		const Jid &j = items[k].jid;
+		if(!j.isValid())
+			continue;
+		QHash<QString, int>::Iterator it = index.find(j.full());
+		if(it == index.end())
+			index.insert(j.full(), k);
+		else if(it.value() == k + 1)
+			it.value() = k;
+	}
+}
+
+void Roster::clear()
+{
+	items.clear();
+	index.clear();
+	to_set.clear();
+	from_set.clear();
+}
+
+void Roster::setSubscription(int n, int sub)
+{
+	RosterItem &item = items[n];
+	int oldSub = item.sub;
+	item.sub = sub;
+	updateSubSets(item, oldSub);
+}
+
+void Roster::setAsk(int n, bool ask)
+{
+	items[n].ask = ask;
+}
+
+void Roster::setNameAndGroups(int n, const QString &name, const QStringList &groups)
+{
+	RosterItem &item = items[n];
+	item.name = name;
+	item.groups = groups;
+}
+
+void Roster::updateSubSets(const RosterItem &item, int oldSub)
+{
+	if(!item.jid.isValid())
+		return;
+	QString key = item.jid.full();
+
+	bool wasTo = (oldSub & RosterItem::SubTo) && !(oldSub & RosterItem::SubRemove);
+	bool wasFrom = (oldSub & RosterItem::SubFrom) && !(oldSub & RosterItem::SubRemove);
+	bool isTo = item.hasTo() && !(item.sub & RosterItem::SubRemove);
+	bool isFrom = item.hasFrom() && !(item.sub & RosterItem::SubRemove);
+
+	if(wasTo && !isTo)
+		to_set.remove(key);
+	else if(!wasTo && isTo)
+		to_set.insert(key, item.jid);
+
+	if(wasFrom && !isFrom)
+		from_set.remove(key);
+	else if(!wasFrom && isFrom)
+		from_set.insert(key, item.jid);
+}
+
+Roster Roster::applyChanges(const RosterChangeList &changeList)
+{
+	Roster out;
+	for(int k = 0; k < changeList.count(); ++k)
+	{
+		const RosterChange &rc = changeList[k];
+		int n = indexOf(rc.jid);
+
+		if(rc.remove)
+		{
+			if(n != -1)
+			{
+				RosterItem ri = items[n];
+				ri.sub = RosterItem::SubRemove;
+				out += ri;
+				removeAt(n);
+			}
+		}
+		else
+		{
+			// new item?
+			if(n == -1)
+			{
+				RosterItem new_item;
+				new_item.jid = rc.jid;
+				n = append(new_item);
+			}
+
+			setNameAndGroups(n, rc.name, rc.groups);
+			out += items[n];
+		}
+	}
+	return out;
+}
+
+QDomElement Roster::toXml(QDomDocument *doc) const
+{
+	QDomElement root = doc->createElementNS(NS_ROSTER, "roster");
+	for(int n = 0; n < items.count(); ++n)
+		root.appendChild(items[n].toXml(doc));
+	return root;
+}
+
+QDomElement Roster::toQueryXml(QDomDocument *doc) const
+{
+	QDomElement root = doc->createElementNS(NS_ROSTER, "query");
+	for(int n = 0; n < items.count(); ++n)
+		root.appendChild(items[n].toXml(doc));
+	return root;
+}
+
+bool Roster::fromXml(const QDomElement &in)
+{
+	clear();
+	if(in.namespaceURI() != NS_ROSTER || in.localName() != "roster")
+		return false;
+
+	QDomNodeList nl = in.elementsByTagNameNS(NS_ROSTER, "item");
+	for(int n = 0; n < nl.count(); ++n)
+	{
+		QDomElement e = nl.item(n).toElement();
+		RosterItem ri;
+		if(ri.fromXml(e))
+			append(ri);
+	}
+	return true;
+}
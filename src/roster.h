@@ -0,0 +1,177 @@
+/*
+ * roster.h - ambrosia
+ * Copyright (C) 2005  Justin Karneges <justin@affinix.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+#ifndef ROSTER_H
+#define ROSTER_H
+
+#include <QtCore>
+#include <QtXml>
+#include "xmpp.h"
+
+#define NS_ROSTER    "jabber:iq:roster"
+
+inline QString subtext(const QDomElement &e)
+{
+	for(QDomNode n = e.firstChild(); !n.isNull(); n = n.nextSibling())
+	{
+		if(n.isText())
+			return n.toText().data();
+	}
+	return QString();
+}
+
+class RosterChange
+{
+public:
+	XMPP::Jid jid;
+	QString name;
+	bool remove;
+	QStringList groups;
+
+	bool fromXml(const QDomElement &e)
+	{
+		jid = XMPP::Jid();
+		name = QString();
+		remove = false;
+		groups = QStringList();
+
+		if(e.namespaceURI() != NS_ROSTER || e.localName() != "item")
+			return false;
+
+		if(!e.hasAttribute("jid"))
+			return false;
+		jid = e.attribute("jid");
+		if(e.hasAttribute("name"))
+			name = e.attribute("name");
+		remove = e.hasAttribute("subscription") && e.attribute("subscription") == "remove";
+
+		QDomNodeList gnl = e.elementsByTagNameNS(NS_ROSTER, "group");
+		for(int n = 0; n < gnl.count(); ++n)
+			groups += subtext(gnl.item(n).toElement());
+
+		return true;
+	}
+};
+
+class RosterChangeList : public QList<RosterChange>
+{
+public:
+	bool fromXml(const QDomElement &in)
+	{
+		clear();
+		if(in.namespaceURI() != NS_ROSTER || in.localName() != "query")
+			return false;
+
+		QDomNodeList nl = in.elementsByTagNameNS(NS_ROSTER, "item");
+		for(int n = 0; n < nl.count(); ++n)
+		{
+			QDomElement e = nl.item(n).toElement();
+			RosterChange rc;
+			if(rc.fromXml(e))
+				append(rc);
+		}
+		return true;
+	}
+};
+
+class RosterItem
+{
+public:
+	// subscription state, as a bitfield so that "to/both" and
+	//   "from/both" are single tests
+	enum Subscription
+	{
+		SubNone   = 0,
+		SubTo     = 1,
+		SubFrom   = 2,
+		SubBoth   = SubTo | SubFrom,
+		SubRemove = 4  // only used when pushing a removal to the client
+	};
+
+	XMPP::Jid jid;
+	QString name;
+	int sub;
+	bool ask;
+	QStringList groups;
+
+	RosterItem()
+	{
+		sub = SubNone;
+		ask = false;
+	}
+
+	bool hasTo() const { return (sub & SubTo) ? true : false; }
+	bool hasFrom() const { return (sub & SubFrom) ? true : false; }
+
+	static QString subToString(int sub);
+	static int stringToSub(const QString &s);
+
+	QDomElement toXml(QDomDocument *doc) const;
+	bool fromXml(const QDomElement &e);
+};
+
+// Roster items in order, with a jid index and the to/both and from/both
+// members kept up to date, so that presence only visits the contacts
+// it is meant for.  Items can't be modified in place, use the setters
+// so the indexes stay in sync.
+class Roster
+{
+public:
+	Roster();
+
+	int count() const { return items.count(); }
+	bool isEmpty() const { return items.isEmpty(); }
+	const RosterItem & at(int n) const { return items.at(n); }
+	const RosterItem & operator[](int n) const { return items.at(n); }
+
+	// roster jids are bare, so these are the same unless the roster has
+	//   an item with a resource
+	int indexOf(const XMPP::Jid &jid) const;
+	int indexOfBare(const XMPP::Jid &jid) const;
+
+	int append(const RosterItem &item);
+	Roster & operator+=(const RosterItem &item);
+	void removeAt(int n);
+	void clear();
+
+	void setSubscription(int n, int sub);
+	void setAsk(int n, bool ask);
+	void setNameAndGroups(int n, const QString &name, const QStringList &groups);
+
+	// contacts we receive presence from (to/both), and contacts that
+	//   receive ours (from/both)
+	const QHash<QString, XMPP::Jid> & subscribedTo() const { return to_set; }
+	const QHash<QString, XMPP::Jid> & subscribers() const { return from_set; }
+
+	Roster applyChanges(const RosterChangeList &changeList);
+
+	QDomElement toXml(QDomDocument *doc) const;
+	QDomElement toQueryXml(QDomDocument *doc) const;
+	bool fromXml(const QDomElement &in);
+
+private:
+	QList<RosterItem> items;
+	QHash<QString, int> index; // jid.full() -> position
+	QHash<QString, XMPP::Jid> to_set, from_set;
+
+	void updateSubSets(const RosterItem &item, int oldSub);
+};
+
+#endif
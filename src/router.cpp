@@ -22,11 +22,205 @@
 
 #include "bsocket.h"
 #include "servsock.h"
+#include "admission.h"
+#include "cslog.h"
+#include "csalloc.h"
+#include "csqueue.h"
+#include "xmlprotocol.h"
+
+#include <stdlib.h>
+#include <sys/time.h>
+#include <sys/resource.h>
 
 using namespace XMPP;
 
 enum Mode { Client, Server };
 enum Direction { In, Out };
+enum Listener { ListenC2S, ListenC2SSSL, ListenS2S };
+enum ShardEvent { ShardWake = QEvent::User + 1, InboxWake };
+
+// how long an evicted session gets to flush its stream error
+#define EVICT_GRACE 5000
+
+// how often the write counters are logged, while anything is happening
+#define REPORT_INTERVAL 10000
+
+// another stream to a domain is opened once this much is queued on each
+//   of the ones it has
+#define POOL_GROW_LOAD 16384
+
+// outbound streams that carried nothing for this long are closed, down
+//   to one per domain
+#define POOL_IDLE_INTERVAL 60000
+
+// how long an outbound stream gets to connect and pass dialback
+#define OUTBOUND_TIMEOUT 30000
+
+// how long an inbound connection gets to authenticate, before it is
+//   closed and its admission slot goes to someone else
+#define HANDSHAKE_TIMEOUT 60000
+
+// after a failed attempt, a route is retried this many times, waiting
+//   twice as long each time (up to the max) before giving up on what is
+//   queued for it
+#define OUTBOUND_RETRIES 5
+#define BACKOFF_BASE 5000
+#define BACKOFF_MAX 300000
+
+// outbound streams are keyed by the local and remote domain they were
+//   authorized for
+static QString routeKey(const Jid &from, const Jid &to)
+{
+	return from.domain() + ' ' + to.domain();
+}
+
+// a dialback key.  it only has to be unguessable and to match when the
+//   peer asks to verify it, so it is random rather than derived from a
+//   secret
+static QString dialbackKey()
+{
+	QByteArray a(16, 0);
+	QFile f("/dev/urandom");
+	if(!f.open(QIODevice::ReadOnly) || f.read(a.data(), a.size()) != a.size())
+	{
+		for(int n = 0; n < a.size(); ++n)
+			a[n] = rand() & 0xff;
+	}
+
+	static const char *hex = "0123456789abcdef";
+	QString key;
+	for(int n = 0; n < a.size(); ++n)
+	{
+		uchar c = (uchar)a[n];
+		key += QChar(hex[c >> 4]);
+		key += QChar(hex[c & 0x0f]);
+	}
+	return key;
+}
+
+// a stanza held back for a stream or a route.  it keeps the size it was
+//   counted against the limits with, so it is only measured once
+class QueuedStanza
+{
+public:
+	Stanza s;
+	int size;
+
+	QueuedStanza() : size(0) {}
+	QueuedStanza(const Stanza &_s, int _size) : s(_s), size(_size) {}
+};
+typedef QList<QueuedStanza> StanzaQueue;
+
+static QList<Stanza> stanzasOf(const StanzaQueue &q)
+{
+	QList<Stanza> list;
+	for(int n = 0; n < q.count(); ++n)
+		list += q[n].s;
+	return list;
+}
+
+//----------------------------------------------------------------------------
+// Router::Shard
+//----------------------------------------------------------------------------
+// A worker thread for client connections.  It owns its sessions and
+//   everything below them (socket, tls, sasl, parser), and only talks to
+//   the router through two queues: commands come in on 'commands', and
+//   events go out to the router's inbox.  Routing and the rest of the
+//   server stay on the main thread.
+class Router::Shard : public QThread
+{
+public:
+	class Message
+	{
+	public:
+		enum Type
+		{
+			// to the worker
+			Accept, Write, WriteRaw, Delete, Shutdown,
+
+			// to the router
+			Added, Incoming, Authenticated, Done
+		};
+
+		int type;
+		Session *sess;
+		Stanza stanza;
+		QString xml, key;
+		int sock, listener;
+		QTime accepted;
+
+		Message(int _type = Shutdown, Session *_sess = 0)
+		{
+			type = _type;
+			sess = _sess;
+			sock = -1;
+			listener = ListenC2S;
+		}
+	};
+
+	// lives in the worker, and gets the wakeups
+	class Core : public QObject
+	{
+	public:
+		Shard *shard;
+
+		Core(Shard *_shard) : shard(_shard) {}
+
+		bool event(QEvent *e)
+		{
+			if(e->type() != (QEvent::Type)ShardWake)
+				return QObject::event(e);
+			shard->process();
+			return true;
+		}
+	};
+
+	Private *r;
+	int index;
+	Core *core;
+	CSMpscQueue<Message> commands;
+	QMutex m;
+	QWaitCondition w;
+
+	// only touched by the worker
+	QList<Session*> sessions;
+
+	Shard(Private *_r, int _index)
+	{
+		r = _r;
+		index = _index;
+		core = 0;
+	}
+
+	void startAndWait()
+	{
+		QMutexLocker locker(&m);
+		start();
+		while(!core)
+			w.wait(&m);
+	}
+
+	// from the main thread
+	void post(const Message &msg)
+	{
+		if(commands.push(msg))
+			QCoreApplication::postEvent(core, new QEvent((QEvent::Type)ShardWake));
+	}
+
+	void process();
+
+protected:
+	void run()
+	{
+		Core c(this);
+		{
+			QMutexLocker locker(&m);
+			core = &c;
+			w.wakeOne();
+		}
+		exec();
+	}
+};
 
 class Router::Private : public QObject
 {
@@ -34,34 +228,120 @@ class Router::Private : public QObject
 public:
 	Router *parent;
 	ServSock c2s, c2s_ssl, s2s;
+	int backlog;
+	Admission admission;
 	QString host, realm;
 	QCA::Cert cert;
 	QCA::RSAKey privkey;
-	QList<Session*> list;
 	Jid jhost;
 
+	// session registry
+	QList<Session*> list;
+	QHash<ClientStream*, Session*> byStream;
+	QHash<QString, Session*> clientsByFull;
+	QHash<QString, QList<Session*> > clientsByBare;
+	QHash<QString, Session*> inboundById;
+	// "local remote" (see routeKey()) -> the outbound streams for it.  a
+	//   stream can carry more than one route, see piggyback()
+	QHash<QString, QList<Session*> > outboundByRoute;
+
+	// "from to" (bare jids) -> the outbound stream that carries it.  a
+	//   pair stays on one stream, so its stanzas arrive in order
+	QHash<QString, Session*> outboundByPair;
+	int outboundStreams;
+	QTimer idleTimer;
+	bool lazyStanzas;
+	QHostAddress bindAddress;
+
+	// a route whose last stream failed and that has none left.  it
+	//   holds what is sent meanwhile, until the next attempt
+	class Backoff : public QObject
+	{
+	public:
+		StanzaQueue queue;
+		int queuedBytes;
+		int failures;
+		bool timedOut;
+		QTimer timer;
+	};
+	QHash<QString, Backoff*> backoff;
+
+	// outgoing backpressure, see setWriteLimits()
+	int lowWater, highWater, hardLimit;
+	QMutex statsMutex;
+	WriteStats wst;
+	bool wstChanged;
+	QTimer reportTimer;
+
+	// for the load report, the counts also under statsMutex
+	bool loadReporting;
+	quint64 stanzas, broadcasts, broadcastRecipients;
+	quint64 lastCpu;
+	CSAlloc::Stats lastAlloc;
+
+	// workers, if any
+	int workers, nextShard;
+	QList<Shard*> shards;
+	CSMpscQueue<Shard::Message> inbox;
+
 	Private(Router *);
 	~Private();
 
 	bool init();
 	void stop();
-	Session *ensureOutbound(const QString &host);
+	void addSession(Session *sess);
+	void sessionAuthenticated(Session *sess);
+	void removeSession(Session *sess);
+	void sessionDone(Session *sess);
+	void toRouter(const Shard::Message &msg);
+	void noteThrottled(bool on);
+	void noteCoalesced();
+	void noteEvicted();
+	Session *ensureOutbound(const Jid &from, const Jid &to);
+	Session *leastLoaded(const QList<Session*> &pool) const;
+	void unregisterOutbound(Session *sess);
+	void outboundActivated(Session *sess);
+	bool piggyback(Session *sess, const QHostAddress &addr, quint16 port);
+	void routeResult(Session *sess, const QString &route, bool ok);
+	void routeTimedOut(Session *sess, const QString &route);
+	void dropRoute(Session *sess, const QString &route);
+	Session *openOutbound(const QString &domain);
+	void holdOutbound(const QString &route, const Stanza &s, int size = -1);
+	void outboundFailed(const QString &route, const StanzaQueue &waiting, bool timedOut);
+	void bounce(const QList<Stanza> &list, int cond);
 	Session *session(ClientStream *s);
-	Session *sessionForUser(const QString &user);
+	Session *sessionForUser(const Jid &user);
 	Session *pendingInboundSession(const QString &id);
 	Session *pendingOutboundSession(const QString &id, const QString &key);
 
 	void read(const Stanza &s);
 	void write(const Stanza &s);
+	void writeBroadcast(const Stanza &s, const QList<Jid> &recipients);
 
 public slots:
 	void c2s_connectionReady(int s);
 	void c2s_ssl_connectionReady(int s);
 	void s2s_connectionReady(int s);
+	void admission_admitted(int s, int listener, const QTime &accepted);
 	void sess_done();
+	void writeReport();
+	void loadReport();
+	void idle_check();
+	void backoff_timeout();
+
+protected:
+	bool event(QEvent *e);
 };
 
-int id_num = 0;
+static QMutex id_mutex;
+static int id_num = 0;
+
+// workers create sessions too
+static int nextSessionId()
+{
+	QMutexLocker locker(&id_mutex);
+	return id_num++;
+}
 
 //----------------------------------------------------------------------------
 // Router::Session
@@ -81,15 +361,76 @@ public:
 	bool verify;
 	QString ver_id, sent_key;
 	int id;
-	QList<Stanza> pending_stanzas;
+	StanzaQueue pending_stanzas;
+	int pendingBytes;
+
+	// presence held back while the peer is slow to read, latest per
+	//   sender.  owned by the stream's thread, like the stream
+	class Held
+	{
+	public:
+		Stanza s;
+		QString xml;
+	};
+	QHash<QString, Held> held;
+	QStringList heldOrder;
+	bool throttled, evicting;
+
+	// set if the session runs on a worker.  then only the worker may touch
+	//   'stream', and the router goes by 'authJid'
+	Shard *shard;
+	Jid authJid;
+	bool closed;
+
+	// still counted against the admission handshake limit
+	bool handshaking;
+	QTime accepted;
+
+	// authenticated, or for inbound s2s, granted a dialback.  owned by
+	//   the stream's thread, unlike 'handshaking'
+	bool authed;
+
+	// keys this session is registered under (see Router::Private)
+	QString reg_full, reg_bare, reg_id, reg_domain;
+	QStringList reg_pairs, reg_routes;
+
+	// outbound only, further routes asked for over this stream, with
+	//   what is waiting for them to be authorized.  the wait is bounded
+	//   like the one for dialback on a new stream
+	class PendingRoute
+	{
+	public:
+		StanzaQueue queue;
+		int bytes;
+		QTime asked;
+		QString key;
+
+		PendingRoute() : bytes(0) {}
+	};
+	QHash<QString, PendingRoute> routesPending;
+
+	// outbound only, stanzas routed to it since the last idle check
+	int recentWrites;
+
+	// outbound only, gave up waiting for the connection or dialback
+	bool timedOut;
 
 	// incoming
 	Session(Private *_r, ByteStream *bs, Mode _mode, bool sslnow)
 	{
 		r = _r;
-		id = id_num++;
+		id = nextSessionId();
+		shard = 0;
+		recentWrites = 0;
+		timedOut = false;
+		closed = false;
+		evicting = false;
+		throttled = false;
+		pendingBytes = 0;
 		active = true;
 		verify = false;
+		handshaking = false;
+		authed = false;
 		mode = _mode;
 		dir = In;
 
@@ -102,10 +443,12 @@ public:
 		}
 
 		stream = new ClientStream(r->host, r->realm, bs, tls, sslnow, mode == Server ? true : false);
+		stream->setLazyStanzas(r->lazyStanzas);
 		connect(stream, SIGNAL(connectionClosed()), SLOT(cs_connectionClosed()));
 		connect(stream, SIGNAL(error(int)), SLOT(cs_error(int)));
 		connect(stream, SIGNAL(readyRead()), SLOT(cs_readyRead()));
 		connect(stream, SIGNAL(authenticated()), SLOT(cs_authenticated()));
+		connect(stream, SIGNAL(bytesWritten(int)), SLOT(cs_bytesWritten(int)));
 
 		// server
 		connect(stream, SIGNAL(dialbackRequest(const Jid &, const Jid &, const QString &)), SLOT(cs_dialbackRequest(const Jid &, const Jid &, const QString &)));
@@ -116,9 +459,18 @@ public:
 	Session(Private *_r, const Jid &to, const QString &key)
 	{
 		r = _r;
-		id = id_num++;
+		id = nextSessionId();
+		shard = 0;
+		recentWrites = 0;
+		timedOut = false;
+		closed = false;
+		evicting = false;
+		throttled = false;
+		pendingBytes = 0;
 		active = false;
 		verify = false;
+		handshaking = false;
+		authed = false;
 		mode = Server;
 		dir = Out;
 		sent_key = key;
@@ -126,25 +478,38 @@ public:
 		tls = 0;
 		conn = new AdvancedConnector;
 		stream = new ClientStream(conn, 0);
+		stream->setLazyStanzas(r->lazyStanzas);
 		connect(stream, SIGNAL(connectionClosed()), SLOT(cs_connectionClosed()));
 		connect(stream, SIGNAL(error(int)), SLOT(cs_error(int)));
 		connect(stream, SIGNAL(readyRead()), SLOT(cs_readyRead()));
 		connect(stream, SIGNAL(authenticated()), SLOT(cs_authenticated()));
+		connect(stream, SIGNAL(bytesWritten(int)), SLOT(cs_bytesWritten(int)));
 
 		// server
 		connect(stream, SIGNAL(dialbackResult(const Jid &, bool)), SLOT(cs_dialbackResult(const Jid &, bool)));
+		connect(conn, SIGNAL(hostResolved(const QHostAddress &, quint16)), SLOT(conn_hostResolved(const QHostAddress &, quint16)));
 
-		printf("[%d]: New outbound session\n", id);
+		CS_INFO(Router, "[%d]: New outbound session", id);
 		stream->connectToServerAsServer(to, r->host, key);
+		QTimer::singleShot(OUTBOUND_TIMEOUT, this, SLOT(outbound_timeout()));
 	}
 
 	// dialback verify
 	Session(Private *_r, const Jid &to, const QString &_id, const QString &key)
 	{
 		r = _r;
-		id = id_num++;
+		id = nextSessionId();
+		shard = 0;
+		recentWrites = 0;
+		timedOut = false;
+		closed = false;
+		evicting = false;
+		throttled = false;
+		pendingBytes = 0;
 		active = false;
 		verify = true;
+		handshaking = false;
+		authed = false;
 		mode = Server;
 		dir = Out;
 		ver_id = _id;
@@ -154,7 +519,7 @@ public:
 		stream = new ClientStream(conn, 0);
 		connect(stream, SIGNAL(dialbackVerifyResult(const Jid &, bool)), SLOT(cs_dialbackVerifyResult(const Jid &, bool)));
 
-		printf("[%d]: Verifying\n", id);
+		CS_INFO(Router, "[%d]: Verifying", id);
 		stream->connectToServerAsServerVerify(to, r->host, _id, key);
 	}
 
@@ -163,26 +528,199 @@ public:
 		delete stream;
 		delete tls;
 		delete conn;
-		printf("[%d]: deleted\n", id);
+		CS_INFO(Router, "[%d]: deleted", id);
 	}
 
 	void accept()
 	{
-		printf("[%d]: New inbound session!\n", id);
+		CS_INFO(Router, "[%d]: New inbound session!", id);
 		stream->accept();
+		QTimer::singleShot(HANDSHAKE_TIMEOUT, this, SLOT(handshake_timeout()));
 	}
 
 	void close()
 	{
-		emit done();
+		if(closed)
+			return;
+		closed = true;
+		if(throttled)
+		{
+			throttled = false;
+			r->noteThrottled(false);
+		}
+
+		// the router unregisters it, and a worker's session is deleted
+		//   when the router sends back a Delete
+		if(shard)
+			r->toRouter(Shard::Message(Shard::Message::Done, this));
+		else
+			emit done();
 	}
 
-	void write(const Stanza &s)
+	// only the latest available/unavailable presence from a sender
+	//   matters, so those can be coalesced
+	static QString presenceKey(const Stanza &s)
 	{
-		if(active)
+		if(s.kind() != Stanza::Presence)
+			return QString();
+		QString type = s.type();
+		if(!type.isEmpty() && type != "unavailable")
+			return QString();
+		return s.from().full();
+	}
+
+	// 's' is counted as 'size' bytes if it has to wait, see
+	//   Stanza::utf8Size().  -1 to have it measured
+	void write(const Stanza &s, int size = -1)
+	{
+		if(shard)
+		{
+			Shard::Message msg(Shard::Message::Write, this);
+			msg.stanza = s.detached();
+			msg.key = presenceKey(s);
+			shard->post(msg);
+		}
+		else if(active && !routesPending.isEmpty() && routesPending.contains(routeKey(s.from(), s.to())))
+		{
+			PendingRoute &pr = routesPending[routeKey(s.from(), s.to())];
+			if(size < 0)
+				size = s.utf8Size();
+			if(pr.bytes + size > r->hardLimit)
+			{
+				CS_DEBUG(Router, "[%d]: %d bytes waiting for a route, refusing more", id, pr.bytes);
+				r->bounce(QList<Stanza>() << s, Stanza::ResourceConstraint);
+				return;
+			}
+			pr.bytes += size;
+			pr.queue += QueuedStanza(s, size);
+		}
+		else if(active)
+			deliver(s, QString(), presenceKey(s));
+		else
+		{
+			// nothing goes out until dialback is through
+			if(size < 0)
+				size = s.utf8Size();
+			if(pendingBytes + size > r->hardLimit)
+			{
+				CS_DEBUG(Router, "[%d]: %d bytes waiting for dialback, refusing more", id, pendingBytes);
+				r->bounce(QList<Stanza>() << s, Stanza::ResourceConstraint);
+				return;
+			}
+			pendingBytes += size;
+			pending_stanzas.append(QueuedStanza(s, size));
+		}
+	}
+
+	// already serialized stanzas, only valid once active.  'key' is the
+	//   presenceKey() of the stanzas, if they can be coalesced
+	void writeRaw(const QString &xml, const QString &key)
+	{
+		if(shard)
+		{
+			Shard::Message msg(Shard::Message::WriteRaw, this);
+			msg.xml = xml;
+			msg.key = key;
+			shard->post(msg);
+		}
+		else
+			deliver(Stanza(), xml, key);
+	}
+
+	// the stream's thread only.  either 's' or 'xml' is set
+	void deliver(const Stanza &s, const QString &xml, const QString &key)
+	{
+		if(closed || evicting)
+			return;
+
+		int queued = stream->bytesToWrite();
+		if(queued >= r->hardLimit)
+		{
+			evict(queued);
+			return;
+		}
+		if(!throttled && queued >= r->highWater)
+		{
+			CS_DEBUG(Router, "[%d]: %d bytes queued, holding presence", id, queued);
+			throttled = true;
+			r->noteThrottled(true);
+		}
+
+		if(throttled && !key.isEmpty())
+		{
+			QHash<QString, Held>::Iterator it = held.find(key);
+			if(it == held.end())
+			{
+				it = held.insert(key, Held());
+				heldOrder += key;
+			}
+			else
+				r->noteCoalesced();
+			it.value().s = s;
+			it.value().xml = xml;
+			return;
+		}
+
+		send(s, xml);
+	}
+
+	// whether stanzas for 'route' can be written right away
+	bool ready(const QString &route) const
+	{
+		return active && (routesPending.isEmpty() || !routesPending.contains(route));
+	}
+
+	// bytes waiting to go to the peer
+	int load() const
+	{
+		return active ? stream->bytesToWrite() : pendingBytes;
+	}
+
+	// a route asked for over this stream, see Private::piggyback()
+	void askRoute(const QString &route, const Jid &to, const StanzaQueue &waiting, int bytes)
+	{
+		PendingRoute pr;
+		pr.queue = waiting;
+		pr.bytes = bytes;
+		pr.asked.start();
+		pr.key = dialbackKey();
+		routesPending.insert(route, pr);
+		stream->requestDialback(to, Jid(r->host), pr.key);
+		QTimer::singleShot(OUTBOUND_TIMEOUT, this, SLOT(route_timeout()));
+	}
+
+	// an outbound stream that is no longer needed
+	void retire()
+	{
+		CS_INFO(Router, "[%d]: Idle, closing", id);
+		stream->close();
+		QTimer::singleShot(EVICT_GRACE, this, SLOT(close_timeout()));
+	}
+
+	void send(const Stanza &s, const QString &xml)
+	{
+		if(xml.isEmpty())
 			stream->write(s);
 		else
-			pending_stanzas.append(s);
+			stream->writeDirect(xml);
+	}
+
+	void evict(int queued)
+	{
+		CS_WARN(Router, "[%d]: %d bytes queued, closing slow session", id, queued);
+		evicting = true;
+		held.clear();
+		heldOrder.clear();
+		if(throttled)
+		{
+			throttled = false;
+			r->noteThrottled(false);
+		}
+		r->noteEvicted();
+		stream->closeWithError(Stream::ResourceConstraint);
+
+		// the error is queued behind everything else, don't wait forever
+		QTimer::singleShot(EVICT_GRACE, this, SLOT(close_timeout()));
 	}
 
 signals:
@@ -190,26 +728,58 @@ signals:
 	void done();
 
 public slots:
+	void close_timeout()
+	{
+		CS_DEBUG(Router, "[%d]: Stream not closed in time", id);
+		close();
+	}
+
+	void cs_bytesWritten(int)
+	{
+		if(!throttled || closed || stream->bytesToWrite() > r->lowWater)
+			return;
+
+		CS_DEBUG(Router, "[%d]: drained, releasing %d held presences", id, heldOrder.count());
+		throttled = false;
+		r->noteThrottled(false);
+
+		QStringList order = heldOrder;
+		QHash<QString, Held> h = held;
+		held.clear();
+		heldOrder.clear();
+		for(int n = 0; n < order.count(); ++n)
+		{
+			const Held &e = h[order[n]];
+			send(e.s, e.xml);
+		}
+	}
+
 	void cs_connectionClosed()
 	{
-		printf("[%d]: Connection closed by peer\n", id);
+		CS_INFO(Router, "[%d]: Connection closed by peer", id);
 		close();
 	}
 
 	void cs_error(int)
 	{
-		printf("[%d]: Error\n", id);
+		CS_WARN(Router, "[%d]: Error", id);
 		close();
 	}
 
 	void cs_authenticated()
 	{
-		printf("[%d]: <<< Authenticated >>>\n", id);
+		CS_INFO(Router, "[%d]: <<< Authenticated >>>", id);
+		authed = true;
+		authJid = stream->jid();
+		if(shard)
+			r->toRouter(Shard::Message(Shard::Message::Authenticated, this));
+		else
+			r->sessionAuthenticated(this);
 	}
 
 	void cs_dialbackRequest(const Jid &to, const Jid &from, const QString &key)
 	{
-		printf("[%d]: Dialback Request: to=[%s], from=[%s], key=[%s]\n", id, to.full().toLatin1().data(), from.full().toLatin1().data(), key.toLatin1().data());
+		CS_DEBUG(Router, "[%d]: Dialback Request: to=[%s], from=[%s], key=[%s]", id, to.full().toLatin1().data(), from.full().toLatin1().data(), key.toLatin1().data());
 
 		Jid us = r->host;
 		if(!to.compare(us))
@@ -221,28 +791,91 @@ public slots:
 		// dialback to verify the host
 		Session *sess = new Session(r, from, stream->id(), key);
 		connect(sess, SIGNAL(done()), r, SLOT(sess_done()));
-		r->list.append(sess);
+		r->addSession(sess);
+	}
+
+	void handshake_timeout()
+	{
+		if(authed || closed)
+			return;
+		CS_WARN(Router, "[%d]: Not authenticated in time", id);
+		close();
+	}
+
+	void outbound_timeout()
+	{
+		if(active || closed)
+			return;
+		CS_WARN(Router, "[%d]: Outbound session timed out", id);
+		timedOut = true;
+		close();
+	}
+
+	void route_timeout()
+	{
+		if(closed)
+			return;
+		QStringList expired;
+		QHash<QString, PendingRoute>::ConstIterator it;
+		for(it = routesPending.begin(); it != routesPending.end(); ++it)
+		{
+			if(it.value().asked.elapsed() >= OUTBOUND_TIMEOUT)
+				expired += it.key();
+		}
+		for(int n = 0; n < expired.count(); ++n)
+			r->routeTimedOut(this, expired[n]);
+	}
+
+	void conn_hostResolved(const QHostAddress &addr, quint16 port)
+	{
+		if(closed || active)
+			return;
+
+		// another stream already goes to the same server?  then this
+		//   one isn't needed, and doesn't even connect
+		if(r->piggyback(this, addr, port))
+		{
+			CS_DEBUG(Router, "[%d]: Using an existing stream instead", id);
+			conn->done();
+			close();
+		}
 	}
 
 	void cs_dialbackResult(const Jid &from, bool ok)
 	{
-		printf("[%d]: Dialback Result: from=[%s], ok=[%s]\n", id, from.full().toLatin1().data(), ok ? "yes" : "no");
+		CS_DEBUG(Router, "[%d]: Dialback Result: from=[%s], ok=[%s]", id, from.full().toLatin1().data(), ok ? "yes" : "no");
+
+		// for a route asked for over this stream after the fact?  if it
+		//   isn't pending anymore, it timed out and was given up on
+		if(active)
+		{
+			QString route = routeKey(Jid(r->host), from);
+			if(routesPending.contains(route))
+				r->routeResult(this, route, ok);
+			else
+				CS_DEBUG(Router, "[%d]: Late dialback result for [%s], ignoring", id, from.full().toLatin1().data());
+			return;
+		}
 
 		if(ok)
 		{
 			active = true;
 			emit activated();
 
-			// send pending stanzas
-			for(int n = 0; n < pending_stanzas.size(); ++n)
-				stream->write(pending_stanzas[n]);
-			pending_stanzas.clear();
+			// send pending stanzas, possibly over other streams
+			r->outboundActivated(this);
+		}
+		else
+		{
+			// the router retries, or bounces what was waiting
+			CS_WARN(Router, "[%d]: Dialback refused", id);
+			close();
 		}
 	}
 
 	void cs_dialbackVerifyRequest(const Jid &to, const Jid &from, const QString &_id, const QString &key)
 	{
-		printf("[%d]: Dialback Verify Request: to=[%s], from=[%s], key=[%s]\n", id, to.full().toLatin1().data(), from.full().toLatin1().data(), key.toLatin1().data());
+		CS_DEBUG(Router, "[%d]: Dialback Verify Request: to=[%s], from=[%s], key=[%s]", id, to.full().toLatin1().data(), from.full().toLatin1().data(), key.toLatin1().data());
 
 		if(!r->pendingOutboundSession(_id, key))
 		{
@@ -255,17 +888,26 @@ public slots:
 
 	void cs_dialbackVerifyResult(const Jid &from, bool ok)
 	{
-		printf("[%d]: Dialback Verify Result: from=[%s], ok=[%s]\n", id, from.full().toLatin1().data(), ok ? "yes" : "no");
+		CS_DEBUG(Router, "[%d]: Dialback Verify Result: from=[%s], ok=[%s]", id, from.full().toLatin1().data(), ok ? "yes" : "no");
 
 		Session *sess = r->pendingInboundSession(ver_id);
 		if(sess)
+		{
 			sess->stream->dialbackRequestGrant(from, r->host, ok);
+
+			// a verified peer is as good as authenticated
+			if(ok && !sess->authed)
+			{
+				sess->authed = true;
+				r->sessionAuthenticated(sess);
+			}
+		}
 		close();
 	}
 
 	void cs_readyRead()
 	{
-		printf("[%d]: ReadyRead\n", id);
+		CS_TRACE(Router, "[%d]: ReadyRead", id);
 		while(stream->stanzaAvailable())
 		{
 			Stanza s = stream->read();
@@ -273,17 +915,100 @@ public slots:
 			if(mode == Client)
 				s.setFrom(stream->jid());
 
-			r->read(s);
+			if(shard)
+			{
+				Shard::Message msg(Shard::Message::Incoming, this);
+				msg.stanza = s.detached();
+				r->toRouter(msg);
+			}
+			else
+				r->read(s);
 		}
 	}
 };
 
+void Router::Shard::process()
+{
+	commands.beginDrain();
+	Message msg;
+	while(commands.pop(&msg))
+	{
+		Session *sess = msg.sess;
+		switch(msg.type)
+		{
+			case Message::Accept:
+			{
+				BSocket *bs = new BSocket;
+				bs->setSocket(msg.sock);
+				sess = new Session(r, bs, Client, msg.listener == ListenC2SSSL);
+				sess->shard = this;
+				sess->handshaking = true;
+				sess->accepted = msg.accepted;
+				sessions += sess;
+				CS_DEBUG(Router, "[%d]: on worker %d", sess->id, index);
+				r->toRouter(Message(Message::Added, sess));
+				sess->accept();
+				break;
+			}
+			case Message::Write:
+				sess->deliver(msg.stanza, QString(), msg.key);
+				break;
+			case Message::WriteRaw:
+				sess->deliver(Stanza(), msg.xml, msg.key);
+				break;
+			case Message::Delete:
+				sessions.removeAll(sess);
+				delete sess;
+				break;
+			case Message::Shutdown:
+				qDeleteAll(sessions);
+				sessions.clear();
+				quit();
+				return;
+		}
+	}
+}
+
+// user and system time of the whole process
+static quint64 cpuUsec()
+{
+	struct rusage ru;
+	if(getrusage(RUSAGE_SELF, &ru) != 0)
+		return 0;
+	return (quint64)(ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000 + ru.ru_utime.tv_usec + ru.ru_stime.tv_usec;
+}
+
 //----------------------------------------------------------------------------
 // Router::Private
 //----------------------------------------------------------------------------
 Router::Private::Private(Router *_parent)
 {
 	parent = _parent;
+	backlog = 16;
+	workers = 0;
+	nextShard = 0;
+	outboundStreams = 1;
+	lazyStanzas = true;
+	connect(&idleTimer, SIGNAL(timeout()), SLOT(idle_check()));
+	idleTimer.start(POOL_IDLE_INTERVAL);
+	lowWater = 64 * 1024;
+	highWater = 256 * 1024;
+	hardLimit = 4 * 1024 * 1024;
+	wst.throttled = 0;
+	wst.throttleEvents = 0;
+	wst.coalesced = 0;
+	wst.evicted = 0;
+	wstChanged = false;
+	stanzas = 0;
+	broadcasts = 0;
+	broadcastRecipients = 0;
+	loadReporting = CSAlloc::isEnabled();
+	lastCpu = cpuUsec();
+	lastAlloc = CSAlloc::stats();
+	connect(&reportTimer, SIGNAL(timeout()), SLOT(writeReport()));
+	connect(&reportTimer, SIGNAL(timeout()), SLOT(loadReport()));
+	reportTimer.start(REPORT_INTERVAL);
+	connect(&admission, SIGNAL(admitted(int, int, const QTime &)), SLOT(admission_admitted(int, int, const QTime &)));
 	connect(&c2s, SIGNAL(connectionReady(int)), SLOT(c2s_connectionReady(int)));
 	connect(&c2s_ssl, SIGNAL(connectionReady(int)), SLOT(c2s_ssl_connectionReady(int)));
 	connect(&s2s, SIGNAL(connectionReady(int)), SLOT(s2s_connectionReady(int)));
@@ -296,105 +1021,620 @@ Router::Private::~Private()
 
 bool Router::Private::init()
 {
-	if(!c2s.listen(5222) || (!cert.isNull() && !c2s_ssl.listen(5223)) || !s2s.listen(5269)) {
+	if(!c2s.listen(5222, backlog, bindAddress) || (!cert.isNull() && !c2s_ssl.listen(5223, backlog, bindAddress)) || !s2s.listen(5269, backlog, bindAddress)) {
 		c2s.stop();
 		c2s_ssl.stop();
 		s2s.stop();
 		return false;
 	}
+
+	for(int n = 0; n < workers; ++n)
+	{
+		Shard *shard = new Shard(this, n);
+		shard->startAndWait();
+		shards += shard;
+	}
+	if(workers > 0)
+		CS_INFO(Router, "Client connections on %d worker threads", workers);
 	return true;
 }
 
 void Router::Private::stop()
 {
-	qDeleteAll(list);
+	// the workers delete their own sessions
+	for(int n = 0; n < shards.count(); ++n)
+		shards[n]->post(Shard::Message(Shard::Message::Shutdown));
+	for(int n = 0; n < shards.count(); ++n)
+	{
+		shards[n]->wait();
+		delete shards[n];
+	}
+	shards.clear();
+
+	// whatever they sent meanwhile refers to deleted sessions
+	Shard::Message msg;
+	while(inbox.pop(&msg))
+	{
+	}
+
+	for(int n = 0; n < list.count(); ++n)
+	{
+		if(!list[n]->shard)
+			delete list[n];
+	}
+	list.clear();
+	byStream.clear();
+	clientsByFull.clear();
+	clientsByBare.clear();
+	inboundById.clear();
+	outboundByRoute.clear();
+	outboundByPair.clear();
+	qDeleteAll(backoff);
+	backoff.clear();
 	c2s.stop();
 	c2s_ssl.stop();
 	s2s.stop();
 }
 
-Router::Session *Router::Private::ensureOutbound(const QString &host)
+void Router::Private::addSession(Session *sess)
+{
+	list.append(sess);
+	byStream.insert(sess->stream, sess);
+
+	if(sess->mode == Server)
+	{
+		if(sess->dir == In)
+		{
+			// inbound s2s streams have their id assigned up front
+			sess->reg_id = sess->stream->id();
+			inboundById.insert(sess->reg_id, sess);
+		}
+		else if(!sess->verify)
+		{
+			sess->reg_domain = routeKey(Jid(host), sess->stream->jid());
+			outboundByRoute[sess->reg_domain].append(sess);
+		}
+	}
+}
+
+void Router::Private::sessionAuthenticated(Session *sess)
+{
+	if(sess->handshaking)
+	{
+		sess->handshaking = false;
+		admission.done(sess->accepted, true);
+	}
+
+	if(sess->mode != Client)
+		return;
+
+	const Jid &j = sess->authJid;
+	if(j.isEmpty())
+		return;
+
+	sess->reg_full = j.full();
+	sess->reg_bare = j.bare();
+	clientsByFull.insert(sess->reg_full, sess);
+	clientsByBare[sess->reg_bare].append(sess);
+}
+
+void Router::Private::removeSession(Session *sess)
+{
+	if(sess->handshaking)
+	{
+		sess->handshaking = false;
+		admission.done(sess->accepted, false);
+	}
+
+	list.removeAll(sess);
+	byStream.remove(sess->stream);
+
+	if(!sess->reg_full.isEmpty() && clientsByFull.value(sess->reg_full) == sess)
+		clientsByFull.remove(sess->reg_full);
+	if(!sess->reg_bare.isEmpty())
+	{
+		QHash<QString, QList<Session*> >::Iterator it = clientsByBare.find(sess->reg_bare);
+		if(it != clientsByBare.end())
+		{
+			it.value().removeAll(sess);
+			if(it.value().isEmpty())
+				clientsByBare.erase(it);
+		}
+	}
+	if(!sess->reg_id.isEmpty() && inboundById.value(sess->reg_id) == sess)
+		inboundById.remove(sess->reg_id);
+	unregisterOutbound(sess);
+}
+
+// takes it out of the pool, new stanzas no longer go to it
+void Router::Private::unregisterOutbound(Session *sess)
+{
+	QStringList routes = sess->reg_routes;
+	if(!sess->reg_domain.isEmpty())
+		routes += sess->reg_domain;
+	for(int n = 0; n < routes.count(); ++n)
+	{
+		QHash<QString, QList<Session*> >::Iterator it = outboundByRoute.find(routes[n]);
+		if(it != outboundByRoute.end())
+		{
+			it.value().removeAll(sess);
+			if(it.value().isEmpty())
+				outboundByRoute.erase(it);
+		}
+	}
+	for(int n = 0; n < sess->reg_pairs.count(); ++n)
+	{
+		if(outboundByPair.value(sess->reg_pairs[n]) == sess)
+			outboundByPair.remove(sess->reg_pairs[n]);
+	}
+	sess->reg_pairs.clear();
+}
+
+static QString pairKey(const Jid &from, const Jid &to)
+{
+	return from.bare() + ' ' + to.bare();
+}
+
+Router::Session *Router::Private::ensureOutbound(const Jid &from, const Jid &to)
 {
-	Jid to = host;
-	for(int n = 0; n < list.size(); ++n)
+	QString pair = pairKey(from, to);
+	Session *sess = outboundByPair.value(pair);
+	if(!sess)
 	{
-		if(list[n]->mode == Server && list[n]->dir == Out && list[n]->stream->jid().compare(host))
-			return list[n];
+		QString domain = to.domain();
+		QString route = routeKey(from, to);
+		QList<Session*> pool = outboundByRoute.value(route);
+
+		// waiting to try again?  the caller queues it with holdOutbound()
+		if(pool.isEmpty() && backoff.contains(route))
+			return 0;
+		sess = leastLoaded(pool);
+
+		// fire up a connection.  when there are streams already, the
+		//   new one only takes pairs once it is up
+		if(!sess || (sess->load() >= POOL_GROW_LOAD && pool.count() < outboundStreams))
+		{
+			Session *extra = openOutbound(domain);
+			if(!sess)
+				sess = extra;
+			else
+				CS_DEBUG(Router, "[%d]: %d bytes queued, opening stream %d to [%s]", sess->id, sess->load(), pool.count() + 1, domain.toLatin1().data());
+		}
+
+		outboundByPair.insert(pair, sess);
+		sess->reg_pairs += pair;
 	}
+	++sess->recentWrites;
+	return sess;
+}
 
-	// fire up a connection
-	Session *sess = new Session(this, to, "123");
+Router::Session *Router::Private::openOutbound(const QString &domain)
+{
+	Session *sess = new Session(this, Jid(domain), dialbackKey());
 	connect(sess, SIGNAL(done()), SLOT(sess_done()));
-	list.append(sess);
+	addSession(sess);
 	return sess;
 }
 
-Router::Session *Router::Private::session(ClientStream *s)
+// for a route in backoff
+void Router::Private::holdOutbound(const QString &route, const Stanza &s, int size)
 {
-	for(int n = 0; n < list.size(); ++n)
+	Backoff *b = backoff.value(route);
+	if(size < 0)
+		size = s.utf8Size();
+	if(b->queuedBytes + size > hardLimit)
 	{
-		if(list[n]->stream == s)
-			return list[n];
+		bounce(QList<Stanza>() << s, Stanza::ResourceConstraint);
+		return;
 	}
-	return 0;
+	b->queue += QueuedStanza(s, size);
+	b->queuedBytes += size;
 }
 
-Router::Session *Router::Private::sessionForUser(const QString &user)
+// the last attempt at a route failed, with 'waiting' still unsent
+void Router::Private::outboundFailed(const QString &route, const StanzaQueue &waiting, bool timedOut)
 {
-	for(int n = 0; n < list.size(); ++n)
+	// another stream is still there to take it
+	if(outboundByRoute.contains(route))
 	{
-		if(list[n]->mode == Client && list[n]->stream->jid().node() == user)
-			return list[n];
+		for(int n = 0; n < waiting.count(); ++n)
+		{
+			const QueuedStanza &q = waiting[n];
+			Session *sess = ensureOutbound(q.s.from(), q.s.to());
+			if(sess)
+				sess->write(q.s, q.size);
+			else
+				holdOutbound(routeKey(q.s.from(), q.s.to()), q.s, q.size);
+		}
+		return;
 	}
-	return 0;
+
+	Backoff *b = backoff.value(route);
+	if(!b)
+	{
+		b = new Backoff;
+		b->queuedBytes = 0;
+		b->failures = 0;
+		b->timer.setSingleShot(true);
+		connect(&b->timer, SIGNAL(timeout()), SLOT(backoff_timeout()));
+		backoff.insert(route, b);
+	}
+
+	// what the stream had was sent before anything queued since
+	b->queue = waiting + b->queue;
+	for(int n = 0; n < waiting.count(); ++n)
+		b->queuedBytes += waiting[n].size;
+	b->timedOut = timedOut;
+	++b->failures;
+
+	if(b->failures > OUTBOUND_RETRIES)
+	{
+		CS_WARN(Router, "route [%s] unreachable after %d attempts, bouncing %d stanzas", route.toLatin1().data(), b->failures, b->queue.count());
+		QList<Stanza> list = stanzasOf(b->queue);
+		backoff.remove(route);
+		delete b;
+		bounce(list, timedOut ? Stanza::ServerTimeout : Stanza::ServerNotFound);
+		return;
+	}
+
+	// with jitter, so that routes that went down together don't all
+	//   come back at the same moment
+	int delay = qMin(BACKOFF_MAX, BACKOFF_BASE << (b->failures - 1));
+	delay = delay / 2 + rand() % (delay / 2 + 1);
+	CS_INFO(Router, "route [%s] failed (%d), retrying in %dms with %d stanzas waiting", route.toLatin1().data(), b->failures, delay, b->queue.count());
+	b->timer.start(delay);
 }
 
-Router::Session *Router::Private::pendingInboundSession(const QString &id)
+void Router::Private::backoff_timeout()
+{
+	QString route;
+	Backoff *b = 0;
+	QHash<QString, Backoff*>::ConstIterator it;
+	for(it = backoff.begin(); it != backoff.end(); ++it)
+	{
+		if(&it.value()->timer == sender())
+		{
+			route = it.key();
+			b = it.value();
+			break;
+		}
+	}
+	if(!b)
+		return;
+
+	// nothing to send, so no reason to try before someone asks
+	if(b->queue.isEmpty())
+	{
+		backoff.remove(route);
+		b->deleteLater();
+		return;
+	}
+
+	// the state stays around until the new stream is up, to count the
+	//   failures.  the queue goes to the stream, and from there on it
+	//   is the one that collects
+	StanzaQueue list = b->queue;
+	b->queue.clear();
+	b->queuedBytes = 0;
+	openOutbound(route.section(' ', 1));
+	for(int n = 0; n < list.count(); ++n)
+	{
+		const QueuedStanza &q = list[n];
+		Session *sess = ensureOutbound(q.s.from(), q.s.to());
+		if(sess)
+			sess->write(q.s, q.size);
+		else
+			holdOutbound(routeKey(q.s.from(), q.s.to()), q.s, q.size);
+	}
+}
+
+// answer local senders with an error.  presence is dropped instead, it
+//   would only flood clients with errors about a server they can't help
+void Router::Private::bounce(const QList<Stanza> &list, int cond)
+{
+	int type = (cond == Stanza::ServerTimeout || cond == Stanza::ResourceConstraint) ? Stanza::Wait : Stanza::Cancel;
+	for(int n = 0; n < list.count(); ++n)
+	{
+		const Stanza &s = list[n];
+		if(s.kind() == Stanza::Presence || s.type() == "error" || s.from().domain() != host)
+			continue;
+
+		Stanza e = s.detached();
+		e.setTo(s.from());
+		e.setFrom(s.to());
+		e.setType("error");
+		e.setBaseNS("jabber:client");
+		e.setError(Stanza::Error(type, cond));
+		write(e);
+	}
+}
+
+// streams that are up come first, then the least queued
+Router::Session *Router::Private::leastLoaded(const QList<Session*> &pool) const
 {
-	for(int n = 0; n < list.size(); ++n)
+	Session *best = 0;
+	int bestLoad = 0;
+	for(int n = 0; n < pool.count(); ++n)
 	{
-		if(list[n]->mode == Server && list[n]->dir == In && list[n]->stream->id() == id)
-			return list[n];
+		Session *sess = pool[n];
+		int load = sess->load();
+		if(!best || (sess->active && !best->active) || (sess->active == best->active && load < bestLoad))
+		{
+			best = sess;
+			bestLoad = load;
+		}
 	}
+	return best;
+}
+
+void Router::Private::outboundActivated(Session *sess)
+{
+	// everything still waiting for this domain can go now, spread over
+	//   the streams that are up.  none of it was sent yet, so moving a
+	//   pair to another stream doesn't reorder anything
+	QList<Session*> pool = outboundByRoute.value(sess->reg_domain);
+	if(!pool.contains(sess))
+		pool += sess;
+
+	// the route works again
+	Backoff *b = backoff.value(sess->reg_domain);
+	if(b)
+	{
+		backoff.remove(sess->reg_domain);
+		delete b;
+	}
+	StanzaQueue waiting;
+	for(int n = 0; n < pool.count(); ++n)
+	{
+		if(pool[n] != sess && pool[n]->active)
+			continue;
+		waiting += pool[n]->pending_stanzas;
+		pool[n]->pending_stanzas.clear();
+		pool[n]->pendingBytes = 0;
+	}
+
+	QList<Session*> up;
+	for(int n = 0; n < pool.count(); ++n)
+	{
+		if(pool[n]->active)
+			up += pool[n];
+	}
+
+	QHash<QString, Session*> moved;
+	for(int n = 0; n < waiting.count(); ++n)
+	{
+		const Stanza &s = waiting[n].s;
+		QString pair = pairKey(s.from(), s.to());
+		Session *dest = moved.value(pair);
+		if(!dest)
+		{
+			dest = leastLoaded(up);
+			moved.insert(pair, dest);
+			if(outboundByPair.contains(pair))
+			{
+				outboundByPair.insert(pair, dest);
+				dest->reg_pairs += pair;
+			}
+		}
+		dest->write(s, waiting[n].size);
+	}
+	if(!waiting.isEmpty())
+		CS_DEBUG(Router, "[%d]: sent %d pending stanzas over %d streams", sess->id, waiting.count(), up.count());
+}
+
+// a new outbound stream has resolved the server it is about to connect
+//   to.  if an authorized one already goes there, ask for the new route
+//   over that instead (dialback allows any number of domain pairs per
+//   stream) and let this one go before it connects
+bool Router::Private::piggyback(Session *sess, const QHostAddress &addr, quint16 port)
+{
+	if(outboundByRoute.value(sess->reg_domain).count() != 1)
+		return false;
+
+	Session *carrier = 0;
+	for(int n = 0; n < list.count(); ++n)
+	{
+		Session *i = list[n];
+		if(i != sess && i->mode == Server && i->dir == Out && !i->verify && i->active && !i->closed && i->conn->havePeerAddress() && i->conn->peerAddress() == addr && i->conn->peerPort() == port)
+		{
+			carrier = i;
+			break;
+		}
+	}
+	if(!carrier)
+		return false;
+
+	QString route = sess->reg_domain;
+	Jid to = sess->stream->jid();
+	CS_INFO(Router, "[%d]: [%s] is on the same server, asking for it over this stream", carrier->id, to.full().toLatin1().data());
+
+	// whatever was waiting moves over, to wait for the new route
+	StanzaQueue waiting = sess->pending_stanzas;
+	int bytes = sess->pendingBytes;
+	sess->pending_stanzas.clear();
+	sess->pendingBytes = 0;
+	unregisterOutbound(sess);
+	sess->reg_domain = QString();
+
+	carrier->reg_routes += route;
+	outboundByRoute[route].append(carrier);
+	carrier->askRoute(route, to, waiting, bytes);
+	return true;
+}
+
+void Router::Private::routeResult(Session *sess, const QString &route, bool ok)
+{
+	StanzaQueue waiting = sess->routesPending.take(route).queue;
+
+	if(ok)
+	{
+		CS_DEBUG(Router, "[%d]: route [%s] authorized, sending %d stanzas", sess->id, route.toLatin1().data(), waiting.count());
+
+		// the route works again
+		Backoff *b = backoff.value(route);
+		if(b)
+		{
+			backoff.remove(route);
+			delete b;
+		}
+		for(int n = 0; n < waiting.count(); ++n)
+			sess->write(waiting[n].s, waiting[n].size);
+		return;
+	}
+
+	// same as a refused dialback on a stream of its own: retried, and
+	//   bounced if it keeps failing
+	CS_WARN(Router, "[%d]: route [%s] refused, %d stanzas waiting", sess->id, route.toLatin1().data(), waiting.count());
+	dropRoute(sess, route);
+	outboundFailed(route, waiting, false);
+}
+
+void Router::Private::routeTimedOut(Session *sess, const QString &route)
+{
+	StanzaQueue waiting = sess->routesPending.take(route).queue;
+	CS_WARN(Router, "[%d]: route [%s] timed out, %d stanzas waiting", sess->id, route.toLatin1().data(), waiting.count());
+	dropRoute(sess, route);
+	outboundFailed(route, waiting, true);
+}
+
+// the stream no longer carries 'route'
+void Router::Private::dropRoute(Session *sess, const QString &route)
+{
+	sess->reg_routes.removeAll(route);
+	QHash<QString, QList<Session*> >::Iterator it = outboundByRoute.find(route);
+	if(it != outboundByRoute.end())
+	{
+		it.value().removeAll(sess);
+		if(it.value().isEmpty())
+			outboundByRoute.erase(it);
+	}
+
+	// and the pairs that were headed there
+	QString domain = route.section(' ', 1);
+	QStringList pairs = sess->reg_pairs;
+	for(int n = 0; n < pairs.count(); ++n)
+	{
+		if(Jid(pairs[n].section(' ', 1)).domain() == domain && outboundByPair.value(pairs[n]) == sess)
+		{
+			outboundByPair.remove(pairs[n]);
+			sess->reg_pairs.removeAll(pairs[n]);
+		}
+	}
+}
+
+// close the streams that have been idle, keeping one per domain
+void Router::Private::idle_check()
+{
+	QList<Session*> idle;
+	QHash<QString, QList<Session*> >::ConstIterator it;
+	for(it = outboundByRoute.begin(); it != outboundByRoute.end(); ++it)
+	{
+		const QList<Session*> &pool = it.value();
+		int keep = pool.count();
+		for(int n = 0; n < pool.count(); ++n)
+		{
+			Session *sess = pool[n];
+			if(keep > 1 && sess->active && sess->reg_routes.isEmpty() && sess->recentWrites == 0 && sess->load() == 0)
+			{
+				idle += sess;
+				--keep;
+			}
+			sess->recentWrites = 0;
+		}
+	}
+
+	for(int n = 0; n < idle.count(); ++n)
+	{
+		unregisterOutbound(idle[n]);
+		idle[n]->retire();
+	}
+}
+
+Router::Session *Router::Private::session(ClientStream *s)
+{
+	return byStream.value(s);
+}
+
+Router::Session *Router::Private::sessionForUser(const Jid &user)
+{
+	// exact resource first, otherwise any session of the bare jid
+	Session *sess = clientsByFull.value(user.full());
+	if(sess)
+		return sess;
+
+	QHash<QString, QList<Session*> >::ConstIterator it = clientsByBare.find(user.bare());
+	if(it != clientsByBare.end() && !it.value().isEmpty())
+		return it.value().first();
 	return 0;
 }
 
+Router::Session *Router::Private::pendingInboundSession(const QString &id)
+{
+	return inboundById.value(id);
+}
+
 Router::Session *Router::Private::pendingOutboundSession(const QString &id, const QString &key)
 {
-	for(int n = 0; n < list.size(); ++n)
+	// the remote assigns the stream id, so only the outbound sessions are scanned
+	QHash<QString, QList<Session*> >::ConstIterator it;
+	for(it = outboundByRoute.begin(); it != outboundByRoute.end(); ++it)
 	{
-		if(list[n]->mode == Server && list[n]->dir == Out && !list[n]->active && list[n]->stream->id() == id && list[n]->sent_key == key)
-			return list[n];
+		const QList<Session*> &pool = it.value();
+		for(int n = 0; n < pool.count(); ++n)
+		{
+			Session *sess = pool[n];
+			if(sess->stream->id() != id)
+				continue;
+			if(!sess->active && sess->sent_key == key)
+				return sess;
+
+			// or a route asked for over it, each has a key of its own
+			QHash<QString, Session::PendingRoute>::ConstIterator rit;
+			for(rit = sess->routesPending.begin(); rit != sess->routesPending.end(); ++rit)
+			{
+				if(rit.value().key == key)
+					return sess;
+			}
+		}
 	}
 	return 0;
 }
 
 void Router::Private::c2s_connectionReady(int s)
 {
-	BSocket *bs = new BSocket;
-	bs->setSocket(s);
-	Session *sess = new Session(this, bs, Client, false);
-	list.append(sess);
-	connect(sess, SIGNAL(done()), SLOT(sess_done()));
-	sess->accept();
+	admission.add(s, Admission::Normal, ListenC2S);
 }
 
 void Router::Private::c2s_ssl_connectionReady(int s)
 {
-	BSocket *bs = new BSocket;
-	bs->setSocket(s);
-	Session *sess = new Session(this, bs, Client, true);
-	list.append(sess);
-	connect(sess, SIGNAL(done()), SLOT(sess_done()));
-	sess->accept();
+	admission.add(s, Admission::Normal, ListenC2SSSL);
 }
 
 void Router::Private::s2s_connectionReady(int s)
 {
+	// servers carry many users each, so they go first
+	admission.add(s, Admission::Priority, ListenS2S);
+}
+
+void Router::Private::admission_admitted(int s, int listener, const QTime &accepted)
+{
+	if(listener != ListenS2S && !shards.isEmpty())
+	{
+		Shard::Message msg(Shard::Message::Accept);
+		msg.sock = s;
+		msg.listener = listener;
+		msg.accepted = accepted;
+		shards[nextShard]->post(msg);
+		nextShard = (nextShard + 1) % shards.count();
+		return;
+	}
+
 	BSocket *bs = new BSocket;
 	bs->setSocket(s);
-	Session *sess = new Session(this, bs, Server, false);
-	list.append(sess);
+	Session *sess = new Session(this, bs, listener == ListenS2S ? Server : Client, listener == ListenC2SSSL);
+	sess->handshaking = true;
+	sess->accepted = accepted;
+	addSession(sess);
 	connect(sess, SIGNAL(done()), SLOT(sess_done()));
 	sess->accept();
 }
@@ -402,52 +1642,284 @@ void Router::Private::s2s_connectionReady(int s)
 void Router::Private::sess_done()
 {
 	Session *sess = (Session *)sender();
+	sess->deleteLater();
+	sessionDone(sess);
+}
 
+void Router::Private::sessionDone(Session *sess)
+{
 	Jid userSession;
-	if(sess->mode == Client && sess->stream)
-		userSession = sess->stream->jid();
+	if(sess->mode == Client)
+		userSession = sess->authJid;
 
-	sess->deleteLater();
-	int n = list.indexOf(sess);
-	list.removeAt(n);
+	// what an outbound stream still held is retried, or bounced
+	bool failed = (sess->mode == Server && sess->dir == Out && !sess->verify && !sess->active && !sess->reg_domain.isEmpty());
+	QString route = sess->reg_domain;
+	StanzaQueue waiting = sess->pending_stanzas;
+	QHash<QString, Session::PendingRoute> routes = sess->routesPending;
+	sess->pending_stanzas.clear();
+	sess->routesPending.clear();
+
+	removeSession(sess);
+
+	if(failed)
+		outboundFailed(route, waiting, sess->timedOut);
+	QHash<QString, Session::PendingRoute>::ConstIterator it;
+	for(it = routes.begin(); it != routes.end(); ++it)
+		outboundFailed(it.key(), it.value().queue, false);
 
 	if(!userSession.isEmpty())
 		emit parent->userSessionGone(userSession);
 }
 
+// from any thread
+void Router::Private::toRouter(const Shard::Message &msg)
+{
+	if(inbox.push(msg))
+		QCoreApplication::postEvent(this, new QEvent((QEvent::Type)InboxWake));
+}
+
+bool Router::Private::event(QEvent *e)
+{
+	if(e->type() != (QEvent::Type)InboxWake)
+		return QObject::event(e);
+
+	inbox.beginDrain();
+	Shard::Message msg;
+	while(inbox.pop(&msg))
+	{
+		Session *sess = msg.sess;
+		switch(msg.type)
+		{
+			case Shard::Message::Added:
+				addSession(sess);
+				break;
+			case Shard::Message::Incoming:
+				read(msg.stanza);
+				break;
+			case Shard::Message::Authenticated:
+				sessionAuthenticated(sess);
+				break;
+			case Shard::Message::Done:
+				sessionDone(sess);
+				sess->shard->post(Shard::Message(Shard::Message::Delete, sess));
+				break;
+		}
+	}
+	return true;
+}
+
 void Router::Private::read(const Stanza &s)
 {
 	// incoming always jabber:client
 	Stanza sw = s;
 	sw.setBaseNS("jabber:client");
-	printf("Reading Stanza: [%s]\n", sw.toString().toLatin1().data());
+	CS_DEBUG(Router, "Reading Stanza: [%s]", sw.toString().toLatin1().data());
 	emit parent->readyRead(sw);
 }
 
 void Router::Private::write(const Stanza &s)
 {
-	printf("Writing Stanza: [%s]\n", s.toString().toLatin1().data());
+	CS_DEBUG(Router, "Writing Stanza: [%s]", s.toString().toLatin1().data());
+
+	if(loadReporting)
+	{
+		QMutexLocker locker(&statsMutex);
+		++stanzas;
+	}
 
 	Jid outhost = Jid(s.to().domain());
 
 	// local?
 	if(jhost.compare(outhost))
 	{
-		Session *sess = sessionForUser(s.to().node());
+		Session *sess = sessionForUser(s.to());
 		if(sess)
 			sess->write(s);
 		else
-			printf("no session for user: [%s]\n", s.to().node().toLatin1().data());
+			CS_DEBUG(Router, "no session for user: [%s]", s.to().node().toLatin1().data());
 	}
 	else
 	{
-		Session *sess = ensureOutbound(outhost.full());
+		Session *sess = ensureOutbound(s.from(), s.to());
 		Stanza sw = s;
 		sw.setBaseNS("jabber:server");
-		sess->write(sw);
+		if(sess)
+			sess->write(sw);
+		else
+			holdOutbound(routeKey(s.from(), s.to()), sw);
+	}
+}
+
+// the counters are bumped from the workers too
+void Router::Private::noteThrottled(bool on)
+{
+	QMutexLocker locker(&statsMutex);
+	if(on)
+	{
+		++wst.throttled;
+		++wst.throttleEvents;
+	}
+	else
+		--wst.throttled;
+	wstChanged = true;
+}
+
+void Router::Private::noteCoalesced()
+{
+	QMutexLocker locker(&statsMutex);
+	++wst.coalesced;
+	wstChanged = true;
+}
+
+void Router::Private::noteEvicted()
+{
+	QMutexLocker locker(&statsMutex);
+	++wst.evicted;
+	wstChanged = true;
+}
+
+void Router::Private::writeReport()
+{
+	WriteStats s;
+	{
+		QMutexLocker locker(&statsMutex);
+		if(!wstChanged)
+			return;
+		wstChanged = false;
+		s = wst;
+	}
+	CS_INFO(Router, "writes: throttled=%d, throttle events=%d, coalesced=%d, evicted=%d",
+		s.throttled, s.throttleEvents, s.coalesced, s.evicted);
+}
+
+// cpu time and heap use since the last report, per unit of work.  both
+//   are for the whole process, so this is meant for a steady, uniform
+//   load such as test/loadgen generates
+void Router::Private::loadReport()
+{
+	if(!loadReporting)
+		return;
+
+	quint64 st, b, rcpt;
+	{
+		QMutexLocker locker(&statsMutex);
+		st = stanzas;
+		b = broadcasts;
+		rcpt = broadcastRecipients;
+		stanzas = 0;
+		broadcasts = 0;
+		broadcastRecipients = 0;
+	}
+	quint64 cpu = cpuUsec();
+	quint64 usec = cpu - lastCpu;
+	lastCpu = cpu;
+	CSAlloc::Stats a = CSAlloc::stats();
+	quint64 calls = a.calls - lastAlloc.calls;
+	quint64 bytes = a.bytes - lastAlloc.bytes;
+	lastAlloc = a;
+
+	if(st > 0)
+	{
+		CS_INFO(Router, "load: %llu stanzas routed, %.1f us cpu per stanza",
+			(unsigned long long)st, (double)usec / st);
+		if(CSAlloc::isEnabled())
+		{
+			CS_INFO(Router, "load: %llu allocations, %llu bytes per stanza",
+				(unsigned long long)calls, (unsigned long long)(bytes / st));
+		}
+	}
+	if(b > 0)
+	{
+		CS_INFO(Router, "load: %llu broadcasts to %llu recipients, %.1f us cpu per broadcast",
+			(unsigned long long)b, (unsigned long long)rcpt, (double)usec / b);
+		if(CSAlloc::isEnabled())
+		{
+			CS_INFO(Router, "load: %llu allocations, %llu bytes per broadcast",
+				(unsigned long long)calls, (unsigned long long)(bytes / b));
+		}
 	}
 }
 
+void Router::Private::writeBroadcast(const Stanza &s, const QList<Jid> &recipients)
+{
+	if(loadReporting)
+	{
+		QMutexLocker locker(&statsMutex);
+		++broadcasts;
+		broadcastRecipients += recipients.count();
+	}
+
+	// serialize once, without a 'to'.  the stanza lives in the stream's
+	//   default namespace, so the same text is valid on c2s and s2s
+	Stanza base = s;
+	base.setBaseNS("jabber:client");
+	QDomElement e = base.element().cloneNode(true).toElement();
+	e.removeAttribute("to");
+	QString xml = Stream::xmlToString(e, true);
+
+	QString tag = QString("<") + e.tagName();
+	bool canStamp = xml.startsWith(tag) && xml.length() > tag.length() && (xml[tag.length()] == ' ' || xml[tag.length()] == '>' || xml[tag.length()] == '/');
+	QString head = xml.left(tag.length());
+	QString tail = xml.mid(tag.length());
+
+	// one buffer per destination stream.  a batch holds one sender's
+	//   presence, so a newer one can replace it while the peer is slow
+	QString key = Session::presenceKey(s);
+	QHash<Session*, QString> batches;
+	QList<Session*> order;
+	for(int n = 0; n < recipients.count(); ++n)
+	{
+		const Jid &to = recipients[n];
+		Jid outhost = Jid(to.domain());
+
+		Session *sess;
+		if(jhost.compare(outhost))
+		{
+			sess = sessionForUser(to);
+			if(!sess)
+			{
+				CS_DEBUG(Router, "no session for user: [%s]", to.node().toLatin1().data());
+				continue;
+			}
+		}
+		else
+		{
+			sess = ensureOutbound(s.from(), to);
+			if(!sess)
+			{
+				Stanza out = s.detached();
+				out.setTo(to);
+				out.setBaseNS("jabber:server");
+				holdOutbound(routeKey(s.from(), to), out);
+				continue;
+			}
+		}
+
+		// still dialing back?  queue it the normal way
+		if(!canStamp || (sess->mode == Server ? !sess->ready(routeKey(s.from(), to)) : !sess->active))
+		{
+			Stanza out = s.detached();
+			out.setTo(to);
+			if(sess->mode == Server)
+				out.setBaseNS("jabber:server");
+			sess->write(out);
+			continue;
+		}
+
+		QHash<Session*, QString>::Iterator it = batches.find(sess);
+		if(it == batches.end())
+		{
+			it = batches.insert(sess, QString());
+			order += sess;
+		}
+		it.value() += head + " to=\"" + escapeXml(to.full()) + '"' + tail;
+	}
+
+	for(int n = 0; n < order.count(); ++n)
+		order[n]->writeRaw(batches.value(order[n]), key);
+}
+
 //----------------------------------------------------------------------------
 // Router
 //----------------------------------------------------------------------------
@@ -483,23 +1955,70 @@ void Router::stop()
 	d->stop();
 }
 
+void Router::setListenBacklog(int n)
+{
+	d->backlog = n;
+}
+
+void Router::setWorkers(int n)
+{
+	d->workers = n;
+}
+
+void Router::setOutboundStreams(int n)
+{
+	d->outboundStreams = qMax(n, 1);
+}
+
+void Router::setLazyStanzas(bool b)
+{
+	d->lazyStanzas = b;
+}
+
+void Router::setBindAddress(const QHostAddress &addr)
+{
+	d->bindAddress = addr;
+}
+
+void Router::setLoadReport(bool b)
+{
+	d->loadReporting = b || CSAlloc::isEnabled();
+}
+
+void Router::setWriteLimits(int low, int high, int hard)
+{
+	d->lowWater = low;
+	d->highWater = high;
+	d->hardLimit = hard;
+}
+
+Router::WriteStats Router::writeStats() const
+{
+	QMutexLocker locker(&d->statsMutex);
+	return d->wst;
+}
+
+Admission *Router::admission() const
+{
+	return &d->admission;
+}
+
 void Router::write(const XMPP::Stanza &s)
 {
 	d->write(s);
 }
 
+void Router::writeBroadcast(const XMPP::Stanza &s, const QList<XMPP::Jid> &recipients)
+{
+	d->writeBroadcast(s, recipients);
+}
+
 XMPP::Jid Router::userSessionJid(const XMPP::Jid &possiblyBare)
 {
-	for(int n = 0; n < d->list.count(); ++n)
-	{
-		Session *s = d->list[n];
-		if(s->mode == Client)
-		{
-			if(s->stream->jid().compare(possiblyBare, false))
-				return s->stream->jid();
-		}
-	}
-	return XMPP::Jid();
+	QHash<QString, QList<Session*> >::ConstIterator it = d->clientsByBare.find(possiblyBare.bare());
+	if(it == d->clientsByBare.end() || it.value().isEmpty())
+		return XMPP::Jid();
+	return it.value().first()->authJid;
 }
 
 #include "router.moc"
@@ -26,20 +26,68 @@
 #include "qca.h"
 #include "xmpp.h"
 
+class Admission;
+
 class Router : public QObject
 {
 	Q_OBJECT
 public:
+	class WriteStats
+	{
+	public:
+		int throttled;      // sessions currently holding back presence
+		int throttleEvents; // times a session crossed the high watermark
+		int coalesced;      // held presences replaced by a newer one
+		int evicted;        // sessions closed for not reading
+	};
+
 	Router();
 	~Router();
 
 	void setCertificate(const QCA::Cert &cert, const QCA::RSAKey &key);
 
+	// call these before start()
+	void setListenBacklog(int n);
+
+	// run client connections on this many threads of their own, each
+	//   with its own event loop.  0 (the default) keeps everything on
+	//   the calling thread
+	void setWorkers(int n);
+
+	// open up to this many streams to a remote domain (default 1).  each
+	//   sender/recipient pair sticks to one of them, new pairs go to the
+	//   least busy, and streams that stay idle are closed again
+	void setOutboundStreams(int n);
+
+	// relay message/presence/iq as the text they arrived in (the
+	//   default), rather than parsing and serializing them again
+	void setLazyStanzas(bool b);
+
+	// listen on this address only, rather than on all of them
+	void setBindAddress(const QHostAddress &addr);
+
+	// log the cpu time per routed stanza and broadcast every so often.
+	//   always on when built with CONFIG+=allocstats, which adds the
+	//   bytes allocated
+	void setLoadReport(bool b);
+	Admission *admission() const; // pacing of new inbound connections
+
+	// bytes queued on a session's socket.  above 'high', availability
+	//   presence to it is held back, latest per sender, until the queue
+	//   drains below 'low'.  at 'hard' the session is closed with a
+	//   resource-constraint stream error
+	void setWriteLimits(int low, int high, int hard);
+	WriteStats writeStats() const;
+
 	bool start(const QString &host);
 	void stop();
 
 	void write(const XMPP::Stanza &s);
 
+	// deliver the same stanza to many recipients.  it is serialized
+	//   once, and each destination stream gets a single write
+	void writeBroadcast(const XMPP::Stanza &s, const QList<XMPP::Jid> &recipients);
+
 	XMPP::Jid userSessionJid(const XMPP::Jid &possiblyBare);
 
 signals:
@@ -51,6 +99,7 @@ public:
 	class Private;
 private:
 	class Session;
+	class Shard;
 	Private *d;
 };
 
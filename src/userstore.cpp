@@ -0,0 +1,846 @@
+/*
+ * userstore.cpp - ambrosia
+ * Copyright (C) 2005  Justin Karneges <justin@affinix.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+#include "userstore.h"
+
+#include "cslog.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+static QString hex(QChar c)
+{
+	QString str;
+	str.sprintf("%02x", (uchar)c.toLatin1());
+	return str;
+}
+
+static QString normalize(const QString &in)
+{
+	QString out;
+	for(int n = 0; n < in.length(); ++n)
+	{
+		if(in[n].isLetterOrNumber())
+			out += in[n];
+		else
+			out += hex(in[n]);
+	}
+	return out;
+}
+
+//----------------------------------------------------------------------------
+// XML format
+//----------------------------------------------------------------------------
+static bool readXmlUser(QIODevice *dev, QString *username, User *user)
+{
+	QDomDocument doc;
+	if(!doc.setContent(dev, true))
+		return false;
+	QDomElement u = doc.documentElement();
+	*username = u.attribute("name");
+	QDomNodeList nl = u.elementsByTagNameNS(NS_ROSTER, "roster");
+	if(nl.count() > 0)
+		user->roster.fromXml(nl.item(0).toElement());
+	nl = u.elementsByTagNameNS("vcard-temp", "vCard");
+	if(nl.count() > 0)
+		user->vcard = nl.item(0).toElement();
+	return true;
+}
+
+static QByteArray writeXmlUser(const QString &username, const User &user)
+{
+	QDomDocument doc;
+	QDomElement u = doc.createElement("user");
+	u.setAttribute("name", username);
+	u.appendChild(user.roster.toXml(&doc));
+	if(!user.vcard.isNull())
+		u.appendChild(doc.importNode(user.vcard, true));
+	doc.appendChild(u);
+	return doc.toString().toUtf8();
+}
+
+//----------------------------------------------------------------------------
+// Binary format
+//----------------------------------------------------------------------------
+// All integers are little endian, strings are a u32 length followed by
+// UTF-8 data:
+//
+//   "AMBU" u16:version u16:reserved str:username u32:itemcount
+//   item*  u32:size u8:sub u8:ask str:jid str:name u16:groupcount str*
+//   str:vcard (serialized vCard element, empty if none)
+//
+// Each item carries its own size so that later versions can append
+// fields without breaking older readers.
+#define USER_MAGIC   "AMBU"
+#define USER_VERSION 1
+
+class BinaryWriter
+{
+public:
+	QByteArray buf;
+
+	void u8(int x)
+	{
+		buf += (char)(x & 0xff);
+	}
+
+	void u16(int x)
+	{
+		u8(x);
+		u8(x >> 8);
+	}
+
+	void u32(quint32 x)
+	{
+		u16(x & 0xffff);
+		u16(x >> 16);
+	}
+
+	void str(const QString &s)
+	{
+		QByteArray cs = s.toUtf8();
+		u32(cs.size());
+		buf += cs;
+	}
+
+	// fill in a u32 reserved earlier at 'at'
+	void patch32(int at, quint32 x)
+	{
+		buf[at] = (char)(x & 0xff);
+		buf[at + 1] = (char)((x >> 8) & 0xff);
+		buf[at + 2] = (char)((x >> 16) & 0xff);
+		buf[at + 3] = (char)((x >> 24) & 0xff);
+	}
+};
+
+class BinaryReader
+{
+public:
+	const uchar *p, *end;
+	bool ok;
+
+	BinaryReader(const uchar *_p, int size)
+	{
+		p = _p;
+		end = _p + size;
+		ok = true;
+	}
+
+	bool have(quint32 n)
+	{
+		if(!ok || (quint32)(end - p) < n)
+			ok = false;
+		return ok;
+	}
+
+	int u8()
+	{
+		if(!have(1))
+			return 0;
+		return *(p++);
+	}
+
+	int u16()
+	{
+		if(!have(2))
+			return 0;
+		int x = p[0] | (p[1] << 8);
+		p += 2;
+		return x;
+	}
+
+	quint32 u32()
+	{
+		if(!have(4))
+			return 0;
+		quint32 x = p[0] | (p[1] << 8) | (p[2] << 16) | ((quint32)p[3] << 24);
+		p += 4;
+		return x;
+	}
+
+	QString str()
+	{
+		quint32 len = u32();
+		if(!have(len))
+			return QString();
+		QString s = QString::fromUtf8((const char *)p, len);
+		p += len;
+		return s;
+	}
+};
+
+static bool readBinaryUser(const uchar *data, int size, QString *username, User *user)
+{
+	BinaryReader in(data, size);
+	if(!in.have(4) || memcmp(in.p, USER_MAGIC, 4) != 0)
+		return false;
+	in.p += 4;
+	if(in.u16() != USER_VERSION)
+		return false;
+	in.u16(); // reserved
+
+	*username = in.str();
+	quint32 count = in.u32();
+	for(quint32 n = 0; n < count && in.ok; ++n)
+	{
+		quint32 recsize = in.u32();
+		if(!in.have(recsize))
+			break;
+		const uchar *next = in.p + recsize;
+		BinaryReader rec(in.p, recsize);
+
+		RosterItem ri;
+		ri.sub = rec.u8() & RosterItem::SubBoth;
+		ri.ask = rec.u8() ? true : false;
+		ri.jid = rec.str();
+		ri.name = rec.str();
+		int groups = rec.u16();
+		for(int k = 0; k < groups && rec.ok; ++k)
+			ri.groups += rec.str();
+		if(!rec.ok)
+			return false;
+		user->roster += ri;
+
+		in.p = next;
+	}
+
+	QString vcard = in.str();
+	if(!in.ok)
+		return false;
+	if(!vcard.isEmpty())
+	{
+		QDomDocument doc;
+		if(doc.setContent(vcard, true))
+			user->vcard = doc.documentElement();
+	}
+	return true;
+}
+
+static QByteArray writeBinaryUser(const QString &username, const User &user)
+{
+	BinaryWriter out;
+	out.buf += USER_MAGIC;
+	out.u16(USER_VERSION);
+	out.u16(0);
+	out.str(username);
+	out.u32(user.roster.count());
+	for(int n = 0; n < user.roster.count(); ++n)
+	{
+		const RosterItem &ri = user.roster[n];
+		int at = out.buf.size();
+		out.u32(0);
+		out.u8(ri.sub & RosterItem::SubBoth);
+		out.u8(ri.ask ? 1 : 0);
+		out.str(ri.jid.full());
+		out.str(ri.name);
+		out.u16(ri.groups.count());
+		for(int k = 0; k < ri.groups.count(); ++k)
+			out.str(ri.groups[k]);
+		out.patch32(at, out.buf.size() - at - 4);
+	}
+
+	QString vcard;
+	if(!user.vcard.isNull())
+	{
+		QDomDocument doc;
+		doc.appendChild(doc.importNode(user.vcard, true));
+		vcard = doc.toString();
+	}
+	out.str(vcard);
+	return out.buf;
+}
+
+// map the file and walk it in place, rather than reading it into memory
+static bool mapBinaryUser(const QString &fname, QString *username, User *user, int *size)
+{
+	int fd = ::open(QFile::encodeName(fname).data(), O_RDONLY);
+	if(fd == -1)
+		return false;
+
+	struct stat st;
+	if(::fstat(fd, &st) != 0 || st.st_size == 0)
+	{
+		::close(fd);
+		return false;
+	}
+
+	void *p = ::mmap(0, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	::close(fd);
+	if(p == MAP_FAILED)
+		return false;
+
+	bool ok = readBinaryUser((const uchar *)p, st.st_size, username, user);
+	::munmap(p, st.st_size);
+	*size = st.st_size;
+	return ok;
+}
+
+static QString formatExtension(int format)
+{
+	return format == UserStore::FormatBinary ? ".bin" : ".xml";
+}
+
+static QByteArray writeUser(int format, const QString &username, const User &user)
+{
+	if(format == UserStore::FormatBinary)
+		return writeBinaryUser(username, user);
+	else
+		return writeXmlUser(username, user);
+}
+
+static bool readUser(int format, const QString &fname, QString *username, User *user, int *size)
+{
+	*size = 0;
+	if(format == UserStore::FormatBinary)
+		return mapBinaryUser(fname, username, user, size);
+
+	QFile f(fname);
+	if(!f.open(QIODevice::ReadOnly))
+		return false;
+	*size = f.size();
+	return readXmlUser(&f, username, user);
+}
+
+//----------------------------------------------------------------------------
+// UserStoreWriter
+//----------------------------------------------------------------------------
+class UserStoreWriter : public QThread
+{
+	Q_OBJECT
+public:
+	class Job
+	{
+	public:
+		QString username;
+		QString fileName;
+		QString staleFileName; // same user in the other format, if any
+		QByteArray data;
+	};
+
+	QString dataDir;
+
+	UserStoreWriter(const QString &_dataDir)
+	{
+		dataDir = _dataDir;
+		fsyncPolicy = UserStore::FsyncNever;
+		busy = false;
+		quit = false;
+	}
+
+	~UserStoreWriter()
+	{
+		stop();
+	}
+
+	void setFsyncPolicy(int p)
+	{
+		QMutexLocker locker(&m);
+		fsyncPolicy = p;
+	}
+
+	void enqueue(const QList<Job> &batch)
+	{
+		QMutexLocker locker(&m);
+		queue += batch;
+		cond.wakeOne();
+	}
+
+	void waitForIdle()
+	{
+		QMutexLocker locker(&m);
+		while(busy || !queue.isEmpty())
+			idle.wait(&m);
+	}
+
+	void stop()
+	{
+		m.lock();
+		quit = true;
+		cond.wakeOne();
+		m.unlock();
+		wait();
+	}
+
+signals:
+	void written(const QStringList &done, const QStringList &failed);
+
+protected:
+	void run()
+	{
+		while(1)
+		{
+			m.lock();
+			while(queue.isEmpty() && !quit)
+				cond.wait(&m);
+			if(queue.isEmpty())
+			{
+				m.unlock();
+				break;
+			}
+			QStringList done, failed;
+			QList<Job> batch = coalesce(queue, &done);
+			queue.clear();
+			busy = true;
+			int policy = fsyncPolicy;
+			m.unlock();
+
+			writeBatch(batch, policy, &done, &failed);
+
+			m.lock();
+			busy = false;
+			idle.wakeAll();
+			m.unlock();
+
+			emit written(done, failed);
+		}
+	}
+
+private:
+	QMutex m;
+	QWaitCondition cond, idle;
+	QList<Job> queue;
+	bool busy, quit;
+	int fsyncPolicy;
+
+	bool ensureDir()
+	{
+		QDir dir(dataDir);
+		if(dir.exists())
+			return true;
+		dir.setPath(".");
+		return dir.mkdir(dataDir);
+	}
+
+	// a user saved again before the writer got to the first save has
+	//   two jobs, and both would write the same .new file.  only the
+	//   newest is written, the older ones are done along with it
+	static QList<Job> coalesce(const QList<Job> &jobs, QStringList *superseded)
+	{
+		QHash<QString, int> newest;
+		for(int n = 0; n < jobs.count(); ++n)
+			newest.insert(jobs[n].username, n);
+
+		QList<Job> out;
+		for(int n = 0; n < jobs.count(); ++n)
+		{
+			if(newest.value(jobs[n].username) == n)
+				out += jobs[n];
+			else
+				*superseded += jobs[n].username;
+		}
+		return out;
+	}
+
+	static bool replaceFile(const QString &from, const QString &to)
+	{
+		return ::rename(QFile::encodeName(from).data(), QFile::encodeName(to).data()) == 0;
+	}
+
+	void writeBatch(const QList<Job> &batch, int policy, QStringList *done, QStringList *failed)
+	{
+		if(!ensureDir())
+		{
+			CS_ERROR(Store, "unable to create: [%s]", qPrintable(dataDir));
+			for(int n = 0; n < batch.count(); ++n)
+				*failed += batch[n].username;
+			return;
+		}
+
+		// write everything to temporary files first, so a crash never
+		//   leaves a half-written user behind
+		QList<QFile*> files;
+		for(int n = 0; n < batch.count(); ++n)
+		{
+			const Job &j = batch[n];
+			QFile *f = new QFile(j.fileName + ".new");
+			if(!f->open(QIODevice::WriteOnly | QIODevice::Truncate))
+			{
+				CS_ERROR(Store, "unable to write: [%s]", qPrintable(f->fileName()));
+				delete f;
+				files += 0;
+				continue;
+			}
+			if(f->write(j.data.data(), j.data.size()) != j.data.size() || !f->flush())
+			{
+				CS_ERROR(Store, "unable to write: [%s]", qPrintable(f->fileName()));
+				f->close();
+				f->remove();
+				delete f;
+				files += 0;
+				continue;
+			}
+			if(policy == UserStore::FsyncPerFile)
+				::fsync(f->handle());
+			files += f;
+		}
+
+		if(policy == UserStore::FsyncPerBatch)
+		{
+			for(int n = 0; n < files.count(); ++n)
+			{
+				if(files[n])
+					::fsync(files[n]->handle());
+			}
+		}
+
+		for(int n = 0; n < files.count(); ++n)
+		{
+			QFile *f = files[n];
+			if(!f)
+			{
+				*failed += batch[n].username;
+				continue;
+			}
+			f->close();
+			if(!replaceFile(f->fileName(), batch[n].fileName))
+			{
+				CS_ERROR(Store, "unable to replace: [%s]", qPrintable(batch[n].fileName));
+				*failed += batch[n].username;
+			}
+			else
+			{
+				if(!batch[n].staleFileName.isEmpty())
+					QFile::remove(batch[n].staleFileName);
+				*done += batch[n].username;
+			}
+			delete f;
+		}
+	}
+};
+
+//----------------------------------------------------------------------------
+// UserStore
+//----------------------------------------------------------------------------
+class UserStore::Private
+{
+public:
+	class Entry
+	{
+	public:
+		User user;
+		bool dirty;
+		int inFlight;    // batches handed to the writer, but not yet written
+		int size;        // last known serialized size
+		QByteArray data; // serialized user, while dirty
+		QLinkedList<QString>::Iterator lru;
+	};
+
+	QString dataDir;
+	int format;
+	int maxEntries;
+	int batchSize;
+	int maxDirtyBytes;
+	int dirtyBytes;
+	QHash<QString, Entry*> entries;
+	QLinkedList<QString> lru; // least recently used first
+	QList<QString> dirty;
+	QTimer flushTimer;
+	UserStoreWriter *writer;
+
+	QString fileName(const QString &username, int fmt) const
+	{
+		return dataDir + '/' + normalize(username) + formatExtension(fmt);
+	}
+
+	void touch(const QString &username, Entry *e)
+	{
+		lru.erase(e->lru);
+		e->lru = lru.insert(lru.end(), username);
+	}
+
+	void evict()
+	{
+		QLinkedList<QString>::Iterator it = lru.begin();
+		while(entries.count() > maxEntries && it != lru.end())
+		{
+			Entry *e = entries.value(*it);
+			if(e->dirty || e->inFlight > 0)
+			{
+				++it;
+				continue;
+			}
+			entries.remove(*it);
+			it = lru.erase(it);
+			delete e;
+		}
+	}
+
+	User readFile(const QString &username, int *size)
+	{
+		// prefer the configured format, but pick up files in the other
+		//   one until they get rewritten
+		int other = (format == UserStore::FormatBinary) ? UserStore::FormatXml : UserStore::FormatBinary;
+		QString name;
+		User user;
+		if(readUser(format, fileName(username, format), &name, &user, size))
+			return user;
+		user = User();
+		if(readUser(other, fileName(username, other), &name, &user, size))
+			return user;
+		return User();
+	}
+
+	// serialize a user that is about to become (or stay) dirty, and
+	//   account for its size
+	void markDirty(const QString &username, Entry *e)
+	{
+		if(e->dirty)
+			dirtyBytes -= e->size;
+		else
+		{
+			e->dirty = true;
+			dirty += username;
+		}
+		e->data = writeUser(format, username, e->user);
+		e->size = e->data.size();
+		dirtyBytes += e->size;
+	}
+
+	void takeBatch(int max)
+	{
+		QList<UserStoreWriter::Job> batch;
+		while(!dirty.isEmpty() && (max == -1 || batch.count() < max))
+		{
+			QString username = dirty.takeFirst();
+			Entry *e = entries.value(username);
+			dirtyBytes -= e->size;
+
+			UserStoreWriter::Job j;
+			j.username = username;
+			j.fileName = fileName(username, format);
+			j.staleFileName = fileName(username, format == UserStore::FormatBinary ? UserStore::FormatXml : UserStore::FormatBinary);
+			j.data = e->data;
+			batch += j;
+
+			e->data = QByteArray();
+			e->dirty = false;
+			++e->inFlight;
+		}
+		if(!batch.isEmpty())
+			writer->enqueue(batch);
+	}
+};
+
+UserStore::UserStore(const QString &dataDir, QObject *parent)
+:QObject(parent)
+{
+	d = new Private;
+	d->dataDir = dataDir;
+	d->format = FormatXml;
+	d->maxEntries = 10000;
+	d->batchSize = 64;
+	d->maxDirtyBytes = 4 * 1024 * 1024;
+	d->dirtyBytes = 0;
+	d->flushTimer.setSingleShot(true);
+	d->flushTimer.setInterval(1000);
+	connect(&d->flushTimer, SIGNAL(timeout()), SLOT(flushBatch()));
+
+	d->writer = new UserStoreWriter(dataDir);
+	connect(d->writer, SIGNAL(written(const QStringList &, const QStringList &)), SLOT(writer_written(const QStringList &, const QStringList &)));
+	d->writer->start();
+}
+
+UserStore::~UserStore()
+{
+	flush();
+	delete d->writer;
+	qDeleteAll(d->entries);
+	delete d;
+}
+
+void UserStore::setFormat(Format f)
+{
+	d->format = f;
+}
+
+void UserStore::setMaxEntries(int n)
+{
+	d->maxEntries = n;
+	d->evict();
+}
+
+void UserStore::setFlushInterval(int mills)
+{
+	d->flushTimer.setInterval(mills);
+}
+
+void UserStore::setBatchSize(int n)
+{
+	d->batchSize = n;
+}
+
+void UserStore::setMaxDirtyBytes(int bytes)
+{
+	d->maxDirtyBytes = bytes;
+}
+
+void UserStore::setFsyncPolicy(FsyncPolicy p)
+{
+	d->writer->setFsyncPolicy(p);
+}
+
+User UserStore::load(const QString &username)
+{
+	Private::Entry *e = d->entries.value(username);
+	if(e)
+	{
+		d->touch(username, e);
+		return e->user;
+	}
+
+	e = new Private::Entry;
+	e->user = d->readFile(username, &e->size);
+	e->dirty = false;
+	e->inFlight = 0;
+	e->lru = d->lru.insert(d->lru.end(), username);
+	d->entries.insert(username, e);
+	User user = e->user;
+	d->evict();
+	return user;
+}
+
+void UserStore::save(const QString &username, const User &user)
+{
+	Private::Entry *e = d->entries.value(username);
+	if(e)
+		d->touch(username, e);
+	else
+	{
+		e = new Private::Entry;
+		e->dirty = false;
+		e->inFlight = 0;
+		e->size = 0;
+		e->lru = d->lru.insert(d->lru.end(), username);
+		d->entries.insert(username, e);
+	}
+	e->user = user;
+	d->markDirty(username, e);
+
+	// too much unwritten data?  push it all out now
+	if(d->dirtyBytes > d->maxDirtyBytes)
+		d->takeBatch(-1);
+	else if(!d->flushTimer.isActive())
+		d->flushTimer.start();
+
+	d->evict();
+}
+
+void UserStore::flush()
+{
+	d->flushTimer.stop();
+	d->takeBatch(-1);
+	d->writer->waitForIdle();
+}
+
+int UserStore::count() const
+{
+	return d->entries.count();
+}
+
+int UserStore::dirtyCount() const
+{
+	return d->dirty.count();
+}
+
+int UserStore::dirtyBytes() const
+{
+	return d->dirtyBytes;
+}
+
+int UserStore::convert(const QString &dataDir, Format to)
+{
+	int from = (to == FormatBinary) ? FormatXml : FormatBinary;
+	QDir dir(dataDir);
+	QStringList files = dir.entryList(QStringList() << QString("*") + formatExtension(from), QDir::Files);
+	int count = 0;
+	for(int n = 0; n < files.count(); ++n)
+	{
+		QString fname = dir.filePath(files[n]);
+		QString username;
+		User user;
+		int size;
+		if(!readUser(from, fname, &username, &user, &size) || username.isEmpty())
+		{
+			CS_WARN(Store, "skipping unreadable file: [%s]", qPrintable(fname));
+			continue;
+		}
+
+		QString base = fname.left(fname.length() - formatExtension(from).length());
+		QFile f(base + formatExtension(to) + ".new");
+		if(!f.open(QIODevice::WriteOnly | QIODevice::Truncate))
+		{
+			CS_ERROR(Store, "unable to write: [%s]", qPrintable(f.fileName()));
+			continue;
+		}
+		QByteArray buf = writeUser(to, username, user);
+		f.write(buf.data(), buf.size());
+		f.flush();
+		::fsync(f.handle());
+		f.close();
+		if(::rename(QFile::encodeName(f.fileName()).data(), QFile::encodeName(base + formatExtension(to)).data()) != 0)
+		{
+			CS_ERROR(Store, "unable to replace: [%s]", qPrintable(base + formatExtension(to)));
+			continue;
+		}
+		QFile::remove(fname);
+		++count;
+	}
+	return count;
+}
+
+void UserStore::flushBatch()
+{
+	d->takeBatch(d->batchSize);
+	if(!d->dirty.isEmpty())
+		QTimer::singleShot(0, this, SLOT(flushBatch()));
+}
+
+void UserStore::writer_written(const QStringList &done, const QStringList &failed)
+{
+	for(int n = 0; n < done.count(); ++n)
+	{
+		Private::Entry *e = d->entries.value(done[n]);
+		if(e && e->inFlight > 0)
+			--e->inFlight;
+	}
+
+	// whatever didn't make it to disk goes back on the dirty list, unless
+	//   it was saved again in the meantime and is already there
+	for(int n = 0; n < failed.count(); ++n)
+	{
+		Private::Entry *e = d->entries.value(failed[n]);
+		if(!e)
+			continue;
+		if(e->inFlight > 0)
+			--e->inFlight;
+		if(!e->dirty)
+			d->markDirty(failed[n], e);
+	}
+	if(!failed.isEmpty() && !d->flushTimer.isActive())
+		d->flushTimer.start();
+
+	d->evict();
+}
+
+#include "userstore.moc"
@@ -0,0 +1,87 @@
+/*
+ * userstore.h - ambrosia
+ * Copyright (C) 2005  Justin Karneges <justin@affinix.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+#ifndef USERSTORE_H
+#define USERSTORE_H
+
+#include <QtCore>
+#include "roster.h"
+
+class User
+{
+public:
+	Roster roster;
+	QDomElement vcard;
+};
+
+// Keeps recently used users in memory and writes changes back to
+// data/<user>.xml (or .bin) from a background thread.  Only cache
+// misses touch the disk on the read side.
+class UserStore : public QObject
+{
+	Q_OBJECT
+public:
+	enum Format
+	{
+		FormatXml,    // <user> document, parsed with QDom
+		FormatBinary  // length-prefixed records, read through mmap
+	};
+
+	enum FsyncPolicy
+	{
+		FsyncNever,    // leave it to the kernel
+		FsyncPerFile,  // fsync each file before it replaces the old one
+		FsyncPerBatch  // fsync all files of a batch together, then replace them
+	};
+
+	UserStore(const QString &dataDir = "data", QObject *parent = 0);
+	~UserStore();
+
+	void setFormat(Format f);
+	void setMaxEntries(int n);
+	void setFlushInterval(int mills);
+	void setBatchSize(int n);
+	void setMaxDirtyBytes(int bytes);
+	void setFsyncPolicy(FsyncPolicy p);
+
+	User load(const QString &username);
+	void save(const QString &username, const User &user);
+
+	// write out everything that is dirty and wait for it to hit the disk
+	void flush();
+
+	// rewrite every file in dataDir into the given format, returns the
+	//   number of users converted
+	static int convert(const QString &dataDir, Format to);
+
+	int count() const;
+	int dirtyCount() const;
+	int dirtyBytes() const;
+
+private slots:
+	void flushBatch();
+	void writer_written(const QStringList &done, const QStringList &failed);
+
+private:
+	class Private;
+	Private *d;
+};
+
+#endif
@@ -0,0 +1,107 @@
+// Checks ByteChain against a plain QByteArray doing the same appends,
+// reads, takes and consumes, with a mix of small (packed) and large
+// (shared) appends.  Also checks that large arrays are handed back
+// without a copy, and that toIovec() covers exactly what is queued.
+//
+// usage: bytechaintest (iterations)
+
+#include <QtCore>
+
+#include <stdlib.h>
+#include <sys/uio.h>
+
+#include "bytechain.h"
+#include "testutil.h"
+
+static QByteArray makeData(int size)
+{
+	static char next = 0;
+	QByteArray a(size, 0);
+	for(int n = 0; n < size; ++n)
+		a[n] = next++;
+	return a;
+}
+
+static QByteArray fromIovec(const ByteChain &c, int max)
+{
+	QVector<struct iovec> vec(max);
+	int count = c.toIovec(vec.data(), max);
+	QByteArray out;
+	for(int n = 0; n < count; ++n)
+		out += QByteArray((const char *)vec[n].iov_base, vec[n].iov_len);
+	return out;
+}
+
+int main(int argc, char **argv)
+{
+	QCoreApplication app(argc, argv);
+	int iterations = argc > 1 ? atoi(argv[1]) : 100000;
+
+	// a large array goes in and comes out as is
+	{
+		ByteChain c;
+		QByteArray big = makeData(100000);
+		c.append(big);
+		QByteArray out = c.read();
+		CHECK(out == big);
+		CHECK(out.constData() == big.constData());
+		c.consume(10);
+		CHECK(c.size() == big.size() - 10);
+		CHECK(c.take() == big.mid(10));
+		CHECK(c.isEmpty());
+	}
+
+	ByteChain c;
+	QByteArray ref;
+	for(test_step = 0; test_step < iterations; ++test_step)
+	{
+		int op = rnd(10);
+		if(op < 4)
+		{
+			// mostly small writes, some big ones
+			int size = rnd(8) == 0 ? rnd(20000) : rnd(300);
+			QByteArray a = makeData(size);
+			c.append(a);
+			ref += a;
+		}
+		else if(op < 6)
+		{
+			int size = rnd(ref.size() + 10);
+			QByteArray expected = (size == 0 || size > ref.size()) ? ref : ref.left(size);
+			CHECK(c.read(size) == expected);
+		}
+		else if(op < 8)
+		{
+			int size = rnd(ref.size() + 10);
+			QByteArray expected = (size == 0 || size > ref.size()) ? ref : ref.left(size);
+			CHECK(c.take(size) == expected);
+			ref = ref.mid(expected.size());
+		}
+		else if(op < 9)
+		{
+			int size = rnd(ref.size() + 10);
+			c.consume(size);
+			ref = ref.mid(qMin(size, ref.size()));
+		}
+		else
+		{
+			CHECK(fromIovec(c, 1024) == ref);
+			QByteArray part = fromIovec(c, 2);
+			CHECK(ref.startsWith(part));
+		}
+
+		CHECK(c.size() == ref.size());
+		CHECK(c.isEmpty() == ref.isEmpty());
+
+		// keep it from growing without end
+		if(ref.size() > 1000000)
+		{
+			c.clear();
+			ref.clear();
+		}
+	}
+
+	CHECK(c.read() == ref);
+
+	return testResult();
+}
@@ -0,0 +1,170 @@
+// Checks that the stringprep cache behind Jid::validNode(), validDomain()
+// and validResource() gives the same answers as the uncached first
+// lookup: on a hit, after the generations have turned over, and from
+// several threads at once.  Also checks a few normalizations and that
+// cacheStats() counts the hits.
+//
+// usage: jidtest
+
+#include <QtCore>
+
+#include <stdio.h>
+
+#include "xmpp.h"
+#include "testutil.h"
+
+using namespace XMPP;
+
+enum { Node, Domain, Resource };
+
+class Input
+{
+public:
+	int kind;
+	QString s;
+	bool ok;
+	QString norm;
+};
+
+static bool lookup(int kind, const QString &s, QString *norm)
+{
+	*norm = QString();
+	if(kind == Node)
+		return Jid::validNode(s, norm);
+	else if(kind == Domain)
+		return Jid::validDomain(s, norm);
+	else
+		return Jid::validResource(s, norm);
+}
+
+static QList<Input> makeInputs(const QString &tag)
+{
+	QList<Input> list;
+	for(int n = 0; n < 200; ++n)
+	{
+		QString num = tag + QString::number(n);
+		Input i;
+		i.kind = Node;
+		i.s = "User" + num;
+		list += i;
+		i.s = "bad@" + num;
+		list += i;
+		i.s = "bad<" + num;
+		list += i;
+		i.kind = Domain;
+		i.s = "ExAmple" + num + ".COM";
+		list += i;
+		i.kind = Resource;
+		i.s = "Res " + num;
+		list += i;
+		i.s = QString("bad") + QChar(7) + num;
+		list += i;
+	}
+	return list;
+}
+
+// results have to match what was recorded from the first lookup
+static int recheck(const QList<Input> &list)
+{
+	int bad = 0;
+	for(int n = 0; n < list.count(); ++n)
+	{
+		const Input &i = list[n];
+		QString norm;
+		bool ok = lookup(i.kind, i.s, &norm);
+		if(ok != i.ok || (ok && norm != i.norm))
+			++bad;
+	}
+	return bad;
+}
+
+// enough new entries per profile to fill both generations
+static void churn(const QString &tag)
+{
+	QString norm;
+	for(int n = 0; n < 9000; ++n)
+	{
+		QString s = tag + QString::number(n);
+		Jid::validNode(s, &norm);
+		Jid::validDomain(s, &norm);
+		Jid::validResource(s, &norm);
+	}
+}
+
+class Checker : public QThread
+{
+public:
+	QList<Input> list;
+	int bad;
+
+	Checker(const QList<Input> &_list) : list(_list), bad(0) {}
+
+protected:
+	void run()
+	{
+		for(int n = 0; n < 50; ++n)
+			bad += recheck(list);
+	}
+};
+
+int main(int argc, char **argv)
+{
+	QCoreApplication app(argc, argv);
+
+	// normalization
+	QString norm;
+	CHECK(Jid::validNode("User", &norm) && norm == "user");
+	CHECK(Jid::validDomain("ExAmple.COM", &norm) && norm == "example.com");
+	CHECK(Jid::validResource("Home", &norm) && norm == "Home");
+	CHECK(!Jid::validNode("a@b", &norm));
+	CHECK(!Jid::validNode("a@b", &norm));
+	Jid j("User@ExAmple.COM/Home");
+	CHECK(j.isValid() && j.full() == "user@example.com/Home");
+	CHECK(!Jid("a<b@example.com").isValid());
+
+	// first lookups are misses, so they are the reference
+	QList<Input> list = makeInputs("a");
+	for(int n = 0; n < list.count(); ++n)
+		list[n].ok = lookup(list[n].kind, list[n].s, &list[n].norm);
+	for(int n = 0; n < list.count(); n += 6)
+	{
+		CHECK(list[n].ok && list[n].norm == list[n].s.toLower());
+		CHECK(!list[n + 1].ok && !list[n + 2].ok);
+		CHECK(list[n + 3].ok && list[n + 3].norm == list[n + 3].s.toLower());
+		CHECK(list[n + 4].ok && list[n + 4].norm == list[n + 4].s);
+		CHECK(!list[n + 5].ok);
+	}
+
+	// hits
+	Jid::CacheStats before = Jid::cacheStats();
+	CHECK(recheck(list) == 0);
+	Jid::CacheStats after = Jid::cacheStats();
+	CHECK(after.hits - before.hits == (quint64)list.count());
+	CHECK(after.misses == before.misses);
+
+	// push everything out of both generations, then look again
+	churn("x");
+	before = Jid::cacheStats();
+	CHECK(recheck(list) == 0);
+	after = Jid::cacheStats();
+	CHECK(after.misses - before.misses == (quint64)list.count());
+
+	// several threads over the same inputs, while the cache turns over
+	QList<Checker*> threads;
+	for(int n = 0; n < 4; ++n)
+		threads += new Checker(list);
+	for(int n = 0; n < 4; ++n)
+		threads[n]->start();
+	churn("y");
+	for(int n = 0; n < 4; ++n)
+	{
+		threads[n]->wait();
+		CHECK(threads[n]->bad == 0);
+	}
+	qDeleteAll(threads);
+
+	Jid::CacheStats st = Jid::cacheStats();
+	printf("%llu hits, %llu misses, %llu usec saved\n", (unsigned long long)st.hits, (unsigned long long)st.misses, (unsigned long long)st.usecSaved);
+
+	return testResult();
+}
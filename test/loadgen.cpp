@@ -0,0 +1,500 @@
+// Message load generator for measuring how the server scales with
+// --workers.  Logs in a number of users over plain non-SASL streams, then
+// has each pair of users bounce messages back and forth, keeping a fixed
+// number in flight per user, and prints the delivered message rate once
+// a second, with the latency from send to delivery.  Run the server with
+// --workers=1, 2, 4 .. and compare the rates.  One loadgen is a single
+// thread, so for more load than it can generate, run a few of them with
+// different prefixes.
+//
+// To see what relaying the received text saves, run the same load
+// against a server started with and without --no-lazy-stanzas.  Built
+// with CONFIG+=allocstats, the server logs the bytes it allocated per
+// routed stanza.
+//
+// The users need to exist:
+//   loadgen --userdb 1000 load >> userdb
+//
+// With --presence, the users instead send broadcast presence at a fixed
+// total rate, and the presences that arrive are counted.  For that the
+// users need rosters of mutual contacts, written into ./data (run it
+// where the server runs, while the server is down):
+//   loadgen --rosters example.com 1000 50 load
+// A server built with CONFIG+=allocstats logs the bytes it allocated
+// per broadcast every 10 seconds.
+//
+// With --s2s, half of the users log into each of two servers and every
+// pair spans both, so all messages go through s2s.  For two instances
+// on one machine, map the domains to two loopback addresses in
+// /etc/hosts, give each a directory of its own (data/ is relative) and
+// the same userdb, and start them with --bind, e.g.:
+//   127.0.0.1 a.test / 127.0.0.2 b.test in /etc/hosts
+//   (cd a && ambrosia a.test --bind=127.0.0.1 --userdb=../userdb --load-report)
+//   (cd b && ambrosia b.test --bind=127.0.0.2 --userdb=../userdb --load-report)
+//   loadgen --s2s b.test a.test 1000 60
+// --load-report has each server log the CPU time it spends per routed
+// stanza.  Compare --s2s-streams=1 and more for the throughput.
+//
+// usage: loadgen (--presence | --s2s otherhost) [host] [users] [seconds] (prefix) (window|rate) (port)
+
+#include <QtCore>
+#include <QtNetwork>
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "qca.h"
+#include "hash.h"
+
+#define PASSWORD "password"
+
+class Client;
+
+class LoadGen : public QObject
+{
+	Q_OBJECT
+public:
+	enum Mode { Messages, Presence };
+
+	QString host, otherHost;
+	int mode, port, seconds, window, rate;
+	QList<Client*> clients;
+	int ready, failed;
+	qint64 delivered, lastDelivered, errors, sent, lastSent;
+	QTime started, lastTick, lastPulse;
+	QTimer tick, pulse;
+	int nextSender;
+	double owed;
+
+	// message latency, in ms.  the bodies carry the send time on 'clock'
+	QTime clock;
+	qint64 latencySum, lastLatencySum, latencyCount, lastLatencyCount;
+	int latencyMax;
+	QVector<qint64> latencies; // histogram, the last bucket is "or more"
+
+	LoadGen()
+	{
+		mode = Messages;
+		ready = 0;
+		failed = 0;
+		delivered = 0;
+		lastDelivered = 0;
+		errors = 0;
+		sent = 0;
+		lastSent = 0;
+		nextSender = 0;
+		owed = 0;
+		clock.start();
+		latencySum = 0;
+		lastLatencySum = 0;
+		latencyCount = 0;
+		lastLatencyCount = 0;
+		latencyMax = 0;
+		latencies.fill(0, 10001);
+		connect(&tick, SIGNAL(timeout()), SLOT(tick_timeout()));
+		connect(&pulse, SIGNAL(timeout()), SLOT(pulse_timeout()));
+	}
+
+	void clientReady();
+	void clientFailed();
+	void startSending();
+
+signals:
+	void quit();
+
+private slots:
+	void tick_timeout()
+	{
+		int ms = lastTick.restart();
+		qint64 n = delivered - lastDelivered;
+		lastDelivered = delivered;
+		qint64 s = sent - lastSent;
+		lastSent = sent;
+		if(mode == Presence)
+			printf("%lld broadcasts/s, %lld presences/s received\n", (long long)(s * 1000 / qMax(ms, 1)), (long long)(n * 1000 / qMax(ms, 1)));
+		else
+		{
+			qint64 count = latencyCount - lastLatencyCount;
+			qint64 sum = latencySum - lastLatencySum;
+			lastLatencyCount = latencyCount;
+			lastLatencySum = latencySum;
+			printf("%lld msgs/s, %.2f ms latency\n", (long long)(n * 1000 / qMax(ms, 1)), count ? (double)sum / count : 0.0);
+		}
+		fflush(stdout);
+
+		if(started.elapsed() >= seconds * 1000)
+		{
+			tick.stop();
+			pulse.stop();
+			int elapsed = qMax(started.elapsed(), 1);
+			if(mode == Presence)
+			{
+				printf("total: %lld broadcasts in %d ms, %lld presences received, %.1f per broadcast\n", (long long)sent, elapsed,
+					(long long)delivered, sent ? (double)delivered / sent : 0.0);
+			}
+			else
+			{
+				printf("total: %lld messages in %d ms, %lld msgs/s average, %lld bounced\n", (long long)delivered, elapsed,
+					(long long)(delivered * 1000 / elapsed), (long long)errors);
+				printf("latency: %.2f ms average, %d ms median, %d ms 99th percentile, %d ms max\n",
+					latencyCount ? (double)latencySum / latencyCount : 0.0, percentile(50), percentile(99), latencyMax);
+			}
+			emit quit();
+		}
+	}
+
+	void pulse_timeout();
+
+public:
+	void addLatency(int ms)
+	{
+		ms = qMax(ms, 0);
+		latencySum += ms;
+		++latencyCount;
+		latencyMax = qMax(latencyMax, ms);
+		++latencies[qMin(ms, latencies.count() - 1)];
+	}
+
+	int percentile(int p) const
+	{
+		qint64 want = (latencyCount * p + 99) / 100;
+		qint64 seen = 0;
+		for(int n = 0; n < latencies.count(); ++n)
+		{
+			seen += latencies[n];
+			if(seen >= want && seen > 0)
+				return n;
+		}
+		return 0;
+	}
+};
+
+class Client : public QObject
+{
+	Q_OBJECT
+public:
+	enum State { Connecting, WaitStream, WaitAuth, Ready, Failed };
+
+	LoadGen *gen;
+	QString user, host, partner, partnerHost;
+	QTcpSocket sock;
+	State state;
+	QByteArray in;
+	int counter;
+
+	Client(LoadGen *_gen, const QString &_user, const QString &_host, const QString &_partner, const QString &_partnerHost)
+	{
+		gen = _gen;
+		user = _user;
+		host = _host;
+		partner = _partner;
+		partnerHost = _partnerHost;
+		state = Connecting;
+		counter = 0;
+		connect(&sock, SIGNAL(connected()), SLOT(sock_connected()));
+		connect(&sock, SIGNAL(readyRead()), SLOT(sock_readyRead()));
+		connect(&sock, SIGNAL(error(QAbstractSocket::SocketError)), SLOT(sock_error()));
+		sock.connectToHost(host, gen->port);
+	}
+
+	void write(const QString &s)
+	{
+		QByteArray a = s.toUtf8();
+		sock.write(a.data(), a.size());
+	}
+
+	void sendMessage()
+	{
+		write(QString("<message to='%1@%2' type='chat'><body>%3</body></message>").arg(partner).arg(partnerHost).arg(gen->clock.elapsed()));
+	}
+
+	void sendPresence()
+	{
+		write(QString("<presence><status>%1</status></presence>").arg(counter++));
+		++gen->sent;
+	}
+
+	// pull a quoted attribute out of the start tag at 'at'
+	static QString attribute(const QByteArray &buf, int at, const char *name)
+	{
+		int end = buf.indexOf('>', at);
+		QByteArray tag = buf.mid(at, end == -1 ? -1 : end - at);
+		int n = tag.indexOf(QByteArray(" ") + name + '=');
+		if(n == -1)
+			return QString();
+		n += strlen(name) + 2;
+		char q = tag[n - 1];
+		int e = tag.indexOf(q, n);
+		if(e == -1)
+			return QString();
+		return QString::fromUtf8(tag.mid(n, e - n));
+	}
+
+private slots:
+	void sock_connected()
+	{
+		state = WaitStream;
+		write(QString("<?xml version='1.0'?><stream:stream xmlns='jabber:client' xmlns:stream='http://etherx.jabber.org/streams' to='%1'>").arg(host));
+	}
+
+	void sock_error()
+	{
+		printf("%s: %s\n", qPrintable(user), qPrintable(sock.errorString()));
+		if(state != Ready && state != Failed)
+			gen->clientFailed();
+		state = Failed;
+	}
+
+	void sock_readyRead()
+	{
+		in += sock.readAll();
+
+		if(state == WaitStream)
+		{
+			int at = in.indexOf("<stream:stream");
+			if(at == -1 || in.indexOf('>', at) == -1)
+				return;
+			QString id = attribute(in, at, "id");
+			in.clear();
+
+			QString digest = QCA::SHA1::hashToString((id + PASSWORD).toUtf8());
+			write(QString("<iq type='set' id='auth'><query xmlns='jabber:iq:auth'><username>%1</username><digest>%2</digest><resource>load</resource></query></iq>").arg(user).arg(digest));
+			state = WaitAuth;
+		}
+		else if(state == WaitAuth)
+		{
+			int at = in.indexOf("<iq");
+			if(at == -1 || in.indexOf('>', at) == -1)
+				return;
+			QString type = attribute(in, at, "type");
+			in.clear();
+			if(type != "result")
+			{
+				printf("%s: login failed\n", qPrintable(user));
+				state = Failed;
+				gen->clientFailed();
+				return;
+			}
+			write("<presence/>");
+			state = Ready;
+			gen->clientReady();
+		}
+		else if(state == Ready && gen->mode == LoadGen::Presence)
+		{
+			// counted from the start, not during login
+			int at = 0;
+			while((at = in.indexOf("<presence", at)) != -1)
+			{
+				if(gen->started.isValid())
+					++gen->delivered;
+				at += 9;
+			}
+			in = in.right(8);
+		}
+		else if(state == Ready)
+		{
+			// every message that comes in is answered with another one,
+			//   so the number in flight stays the same
+			int at = 0;
+			while(1)
+			{
+				int start = in.indexOf("<message", at);
+				if(start == -1)
+				{
+					// keep the tail, in case a tag is split across reads
+					in = in.right(7);
+					break;
+				}
+				int end = in.indexOf("</message>", start);
+				if(end == -1)
+				{
+					in = in.mid(start);
+					break;
+				}
+
+				// a bounce takes that message out of flight
+				if(attribute(in, start, "type") == "error")
+					++gen->errors;
+				else
+				{
+					int b = in.indexOf("<body>", start);
+					if(b != -1 && b < end)
+					{
+						b += 6;
+						int sent = in.mid(b, in.indexOf('<', b) - b).toInt();
+						gen->addLatency(gen->clock.elapsed() - sent);
+					}
+					++gen->delivered;
+					sendMessage();
+				}
+				at = end + 10;
+			}
+		}
+	}
+};
+
+void LoadGen::clientReady()
+{
+	++ready;
+	if(ready + failed == clients.count())
+		startSending();
+}
+
+void LoadGen::clientFailed()
+{
+	++failed;
+	if(ready + failed == clients.count())
+		startSending();
+}
+
+void LoadGen::startSending()
+{
+	printf("%d logged in, %d failed\n", ready, failed);
+	if(ready == 0)
+	{
+		emit quit();
+		return;
+	}
+
+	if(mode == Presence)
+	{
+		lastPulse.start();
+		pulse.start(50);
+	}
+	else
+	{
+		for(int n = 0; n < clients.count(); ++n)
+		{
+			if(clients[n]->state != Client::Ready)
+				continue;
+			for(int k = 0; k < window; ++k)
+				clients[n]->sendMessage();
+		}
+	}
+	started.start();
+	lastTick.start();
+	tick.start(1000);
+}
+
+// spreads 'rate' broadcasts a second over the users, in turn
+void LoadGen::pulse_timeout()
+{
+	owed += (double)rate * lastPulse.restart() / 1000;
+	for(; owed >= 1; owed -= 1)
+	{
+		for(int tries = 0; tries < clients.count(); ++tries)
+		{
+			Client *c = clients[nextSender];
+			nextSender = (nextSender + 1) % clients.count();
+			if(c->state == Client::Ready)
+			{
+				c->sendPresence();
+				break;
+			}
+		}
+	}
+}
+
+// user n has the n-k'th to n+k'th users as contacts, so every
+//   subscription is mutual
+static int writeRosters(const QString &host, int users, int contacts, const QString &prefix)
+{
+	QDir().mkdir("data");
+	int half = qMin(contacts / 2, (users - 1) / 2);
+	for(int n = 0; n < users; ++n)
+	{
+		QString xml = QString("<user name=\"%1%2\"><roster xmlns=\"jabber:iq:roster\">").arg(prefix).arg(n);
+		for(int d = 1; d <= half; ++d)
+		{
+			int a = (n + d) % users;
+			int b = (n - d + users) % users;
+			xml += QString("<item jid=\"%1%2@%3\" subscription=\"both\"/>").arg(prefix).arg(a).arg(host);
+			xml += QString("<item jid=\"%1%2@%3\" subscription=\"both\"/>").arg(prefix).arg(b).arg(host);
+		}
+		xml += "</roster></user>";
+
+		QFile f(QString("data/%1%2.xml").arg(prefix).arg(n));
+		if(!f.open(QIODevice::WriteOnly | QIODevice::Truncate))
+		{
+			printf("unable to write: %s\n", qPrintable(f.fileName()));
+			return n;
+		}
+		QByteArray a = xml.toUtf8();
+		f.write(a.data(), a.size());
+	}
+	return users;
+}
+
+#include "loadgen.moc"
+
+int main(int argc, char **argv)
+{
+	QCoreApplication app(argc, argv);
+
+	if(argc >= 3 && QString(argv[1]) == "--userdb")
+	{
+		int users = atoi(argv[2]);
+		QString prefix = argc > 3 ? argv[3] : "load";
+		for(int n = 0; n < users; ++n)
+			printf("%s%d:%s\n", qPrintable(prefix), n, PASSWORD);
+		return 0;
+	}
+
+	if(argc >= 5 && QString(argv[1]) == "--rosters")
+	{
+		int n = writeRosters(argv[2], atoi(argv[3]), atoi(argv[4]), argc > 5 ? argv[5] : "load");
+		printf("wrote %d users into data/\n", n);
+		return 0;
+	}
+
+	LoadGen gen;
+	if(argc > 1 && QString(argv[1]) == "--presence")
+	{
+		gen.mode = LoadGen::Presence;
+		--argc;
+		++argv;
+	}
+	else if(argc > 2 && QString(argv[1]) == "--s2s")
+	{
+		gen.otherHost = argv[2];
+		argc -= 2;
+		argv += 2;
+	}
+
+	if(argc < 4)
+	{
+		printf("usage: loadgen (--presence | --s2s otherhost) [host] [users] [seconds] (prefix) (window|rate) (port)\n");
+		printf("       loadgen --userdb [users] (prefix)\n");
+		printf("       loadgen --rosters [host] [users] [contacts] (prefix)\n\n");
+		return 0;
+	}
+
+	QCA::insertProvider(XMPP::createProviderHash());
+
+	gen.host = argv[1];
+	int users = atoi(argv[2]) & ~1; // in pairs
+	gen.seconds = atoi(argv[3]);
+	QString prefix = argc > 4 ? argv[4] : "load";
+	gen.window = argc > 5 ? atoi(argv[5]) : 4;
+	gen.rate = argc > 5 ? atoi(argv[5]) : users; // broadcasts per second, in presence mode
+	gen.port = argc > 6 ? atoi(argv[6]) : 5222;
+
+	for(int n = 0; n < users; ++n)
+	{
+		// with --s2s, odd users are on the other server
+		QString host = gen.host, partnerHost = gen.host;
+		if(!gen.otherHost.isEmpty())
+		{
+			if(n & 1)
+				host = gen.otherHost;
+			else
+				partnerHost = gen.otherHost;
+		}
+		gen.clients += new Client(&gen, prefix + QString::number(n), host, prefix + QString::number(n ^ 1), partnerHost);
+	}
+
+	QObject::connect(&gen, SIGNAL(quit()), &app, SLOT(quit()));
+	app.exec();
+	qDeleteAll(gen.clients);
+	return 0;
+}
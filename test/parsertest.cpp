@@ -0,0 +1,133 @@
+// Checks that Parser::unprocessed() hands back the bytes that follow an
+// element exactly as they arrived, as happens at a STARTTLS or SASL
+// layer switch, even when they are not valid utf-8 or were already
+// decoded.  Then measures how fast the parser gets through a stream of
+// stanzas (plain ascii, non-ascii text and a large base64 vCard), fed in
+// network sized chunks, with lazy stanzas off and on.
+//
+// usage: parsertest (megabytes)
+
+#include <QtCore>
+#include <QtXml>
+
+#include <stdlib.h>
+
+#include "parser.h"
+#include "testutil.h"
+
+using namespace XMPP;
+
+static const char *stream_open =
+	"<?xml version='1.0'?><stream:stream xmlns='jabber:client' xmlns:stream='http://etherx.jabber.org/streams' to='example.com' version='1.0'>";
+
+// reads events until an element shows up, returns its name
+static QString nextElement(Parser *p)
+{
+	while(1)
+	{
+		Parser::Event e = p->readNext();
+		if(e.isNull())
+			return QString();
+		if(e.type() == Parser::Event::Element)
+			return e.element().tagName();
+		if(e.type() == Parser::Event::Error)
+			return "(error)";
+	}
+}
+
+static void checkUnprocessed(const QByteArray &after, int chunk)
+{
+	QByteArray data = QByteArray(stream_open) + "<proceed xmlns='urn:ietf:params:xml:ns:xmpp-tls'/>" + after;
+
+	Parser p;
+	QString name;
+	int at = 0;
+	while(name.isEmpty() && at < data.size())
+	{
+		int size = qMin(chunk, data.size() - at);
+		p.appendData(data.mid(at, size));
+		at += size;
+		name = nextElement(&p);
+	}
+	CHECK(name == "proceed");
+	CHECK(p.unprocessed() + data.mid(at) == after);
+}
+
+static QByteArray makeStream(int bytes)
+{
+	QByteArray photo;
+	for(int n = 0; n < 48 * 1024; ++n)
+		photo += "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/"[(n * 7) & 63];
+
+	QByteArray plain = "<message to='juliet@example.com/balcony' from='romeo@example.net/orchard' type='chat' id='m1'><body>Wherefore art thou, Romeo?</body></message>";
+	QByteArray intl = "<message to='juliet@example.com' type='chat'><body>h\xc3\xa9llo \xe2\x80\x93 \xe6\x97\xa5\xe6\x9c\xac\xe8\xaa\x9e \xf0\x9f\x98\x80</body></message>";
+	QByteArray vcard = "<iq type='result' id='v1'><vCard xmlns='vcard-temp'><FN>Juliet</FN><PHOTO><TYPE>image/png</TYPE><BINVAL>" + photo + "</BINVAL></PHOTO></vCard></iq>";
+
+	QByteArray out = stream_open;
+	int n = 0;
+	while(out.size() < bytes)
+	{
+		if(n % 200 == 199)
+			out += vcard;
+		else if(n % 2)
+			out += intl;
+		else
+			out += plain;
+		++n;
+	}
+	return out;
+}
+
+// returns the elements parsed
+static int parseAll(const QByteArray &data, bool lazy, int chunk)
+{
+	Parser p;
+	p.setLazyStanzas(lazy);
+	int count = 0;
+	for(int at = 0; at < data.size(); at += chunk)
+	{
+		p.appendData(data.mid(at, qMin(chunk, data.size() - at)));
+		while(1)
+		{
+			Parser::Event e = p.readNext();
+			if(e.isNull())
+				break;
+			if(e.type() == Parser::Event::Element)
+				++count;
+		}
+	}
+	return count;
+}
+
+int main(int argc, char **argv)
+{
+	QCoreApplication app(argc, argv);
+	int megs = argc > 1 ? atoi(argv[1]) : 32;
+
+	// tls records, with bytes that aren't utf-8 and some that are
+	QByteArray binary;
+	for(int n = 0; n < 4096; ++n)
+		binary += (char)((n * 131 + 7) & 0xff);
+	QByteArray tail = QByteArray("\x16\x03\x01\x00\xc5\xe2\x82\xac\xf0\x9f\x98", 11);
+	int chunks[] = { 1, 7, 64, 4096, 100000, 0 };
+	for(int n = 0; chunks[n]; ++n)
+	{
+		checkUnprocessed(binary, chunks[n]);
+		checkUnprocessed(tail, chunks[n]);
+		checkUnprocessed(QByteArray("<auth/>"), chunks[n]);
+		checkUnprocessed(QByteArray(), chunks[n]);
+	}
+
+	QByteArray data = makeStream(megs * 1024 * 1024);
+	for(int lazy = 0; lazy < 2; ++lazy)
+	{
+		QTime t;
+		t.start();
+		int count = parseAll(data, lazy, 4096);
+		int ms = t.elapsed();
+		printf("%s: %d stanzas, %d bytes in %d ms, %.1f MB/s\n", lazy ? "lazy" : "full", count, data.size(), ms,
+			(double)data.size() / (1024 * 1024) * 1000 / qMax(ms, 1));
+	}
+
+	return testResult();
+}
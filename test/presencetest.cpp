@@ -0,0 +1,135 @@
+// Checks PresenceTable against plain sets of (user, target) pairs over
+// random adds and removals of users, directed presence and dontsend
+// entries, including that removing a user drops only that user's
+// directed presence and keeps directedCount() right.
+//
+// usage: presencetest (iterations)
+
+#include <QtCore>
+
+#include <stdlib.h>
+
+#include "presencetable.h"
+#include "testutil.h"
+
+using namespace XMPP;
+
+// pairs are kept as "user target"
+class Ref
+{
+public:
+	QSet<QString> users;
+	QSet<QString> directed, dontsend;
+};
+
+static QString pair(const Jid &user, const Jid &to)
+{
+	return user.full() + ' ' + to.full();
+}
+
+static void removeUser(QSet<QString> *set, const Jid &user)
+{
+	QString prefix = user.full() + ' ';
+	QSet<QString> out;
+	for(QSet<QString>::ConstIterator it = set->begin(); it != set->end(); ++it)
+	{
+		if(!(*it).startsWith(prefix))
+			out.insert(*it);
+	}
+	*set = out;
+}
+
+static QSet<QString> targetsOf(const Ref &ref, const Jid &user)
+{
+	QString prefix = user.full() + ' ';
+	QSet<QString> set;
+	for(QSet<QString>::ConstIterator it = ref.directed.begin(); it != ref.directed.end(); ++it)
+	{
+		if((*it).startsWith(prefix))
+			set.insert((*it).mid(prefix.length()));
+	}
+	return set;
+}
+
+int main(int argc, char **argv)
+{
+	QCoreApplication app(argc, argv);
+	int iterations = argc > 1 ? atoi(argv[1]) : 20000;
+
+	QList<Jid> users, contacts;
+	for(int n = 0; n < 10; ++n)
+		users += Jid(QString("user%1@example.com/res").arg(n));
+	for(int n = 0; n < 20; ++n)
+		contacts += Jid(QString("contact%1@example.org/r%2").arg(n / 2).arg(n % 2));
+
+	PresenceTable t;
+	Ref ref;
+
+	// invalid jids are refused
+	CHECK(t.addItem(Jid()) == 0);
+	CHECK(t.addDirected(users[0], Jid()) == 0);
+	CHECK(t.count() == 0 && t.directedCount() == 0);
+
+	for(test_step = 0; test_step < iterations; ++test_step)
+	{
+		const Jid &u = users[rnd(users.count())];
+		const Jid &c = contacts[rnd(contacts.count())];
+		int op = rnd(10);
+		if(op < 3)
+		{
+			PresenceTable::Item *i = t.addItem(u);
+			CHECK(i && i->user.full() == u.full());
+			ref.users.insert(u.full());
+		}
+		else if(op < 4)
+		{
+			t.removeItem(u);
+			ref.users.remove(u.full());
+			removeUser(&ref.directed, u);
+			removeUser(&ref.dontsend, u);
+		}
+		else if(op < 6)
+		{
+			PresenceTable::DPItem *di = t.addDirected(u, c);
+			CHECK(di && di->user.full() == u.full() && di->to.full() == c.full());
+			ref.directed.insert(pair(u, c));
+		}
+		else if(op < 7)
+		{
+			t.removeDirected(u);
+			removeUser(&ref.directed, u);
+		}
+		else if(op < 8)
+		{
+			PresenceTable::Item *i = t.item(u);
+			if(i)
+			{
+				t.addDontSend(i, c);
+				ref.dontsend.insert(pair(u, c));
+			}
+		}
+		else
+		{
+			PresenceTable::Item *i = t.item(u);
+			CHECK((i != 0) == ref.users.contains(u.full()));
+			if(i)
+				CHECK(t.haveDontSend(*i, c) == ref.dontsend.contains(pair(u, c)));
+			CHECK((t.directed(u, c) != 0) == ref.directed.contains(pair(u, c)));
+		}
+
+		CHECK(t.count() == ref.users.count());
+		CHECK(t.directedCount() == ref.directed.count());
+
+		QSet<QString> targets;
+		QList<Jid> list = t.directedTargets(u);
+		for(int n = 0; n < list.count(); ++n)
+			targets.insert(list[n].full());
+		CHECK(list.count() == targets.count());
+		CHECK(targets == targetsOf(ref, u));
+	}
+
+	t.clear();
+	CHECK(t.count() == 0 && t.directedCount() == 0 && t.directedTargets(users[0]).isEmpty());
+
+	return testResult();
+}
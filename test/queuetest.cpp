@@ -0,0 +1,150 @@
+// Stress test for CSMpscQueue: several producer threads push numbered
+// items while the main thread pops, and every item has to arrive exactly
+// once and in order per producer.  Also prints the push rate for a few
+// producer counts, which should hold up as producers are added.
+//
+// usage: queuetest (items per producer)
+
+#include <QtCore>
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "csqueue.h"
+
+class Item
+{
+public:
+	int producer;
+	int seq;
+};
+
+class Producer : public QThread
+{
+public:
+	CSMpscQueue<Item> *q;
+	int producer, count;
+
+	Producer(CSMpscQueue<Item> *_q, int _producer, int _count)
+	{
+		q = _q;
+		producer = _producer;
+		count = _count;
+	}
+
+protected:
+	void run()
+	{
+		for(int n = 0; n < count; ++n)
+		{
+			Item i;
+			i.producer = producer;
+			i.seq = n;
+			q->push(i);
+		}
+	}
+};
+
+// pop everything there is, checking the order per producer
+static void drain(CSMpscQueue<Item> *q, QVector<int> *next, int *total, int *failures)
+{
+	q->beginDrain();
+	Item i;
+	while(q->pop(&i))
+	{
+		if(i.producer < 0 || i.producer >= next->count())
+		{
+			printf("bad producer %d\n", i.producer);
+			++(*failures);
+			continue;
+		}
+		if(i.seq != (*next)[i.producer])
+		{
+			if(*failures < 10)
+				printf("producer %d: got %d, expected %d\n", i.producer, i.seq, (*next)[i.producer]);
+			++(*failures);
+		}
+		(*next)[i.producer] = i.seq + 1;
+		++(*total);
+	}
+}
+
+// returns the number of failures
+static int runOnce(int producers, int count, int *ms)
+{
+	CSMpscQueue<Item> q;
+	QVector<int> next(producers, 0);
+	int failures = 0;
+	int total = 0;
+	int expected = producers * count;
+
+	QList<Producer*> list;
+	for(int n = 0; n < producers; ++n)
+		list += new Producer(&q, n, count);
+
+	QTime t;
+	t.start();
+	for(int n = 0; n < list.count(); ++n)
+		list[n]->start();
+
+	while(total < expected)
+	{
+		bool running = false;
+		for(int n = 0; n < list.count(); ++n)
+		{
+			if(list[n]->isRunning())
+				running = true;
+		}
+
+		drain(&q, &next, &total, &failures);
+
+		// all pushes were linked before the producers finished, so
+		//   anything missing now is lost
+		if(!running && total < expected)
+		{
+			printf("lost %d items\n", expected - total);
+			++failures;
+			break;
+		}
+	}
+	*ms = t.elapsed();
+
+	for(int n = 0; n < list.count(); ++n)
+	{
+		list[n]->wait();
+		delete list[n];
+	}
+
+	Item i;
+	if(q.pop(&i))
+	{
+		printf("extra items in the queue\n");
+		++failures;
+	}
+	return failures;
+}
+
+int main(int argc, char **argv)
+{
+	QCoreApplication app(argc, argv);
+	int count = argc > 1 ? atoi(argv[1]) : 1000000;
+
+	int failures = 0;
+	int counts[] = { 1, 2, 4, 8, 0 };
+	for(int n = 0; counts[n]; ++n)
+	{
+		int ms;
+		int f = runOnce(counts[n], count, &ms);
+		failures += f;
+		double rate = (double)counts[n] * count * 1000 / qMax(ms, 1);
+		printf("%d producers: %d items in %d ms, %.0f/s%s\n", counts[n], counts[n] * count, ms, rate, f ? " FAILED" : "");
+	}
+
+	if(failures)
+	{
+		printf("FAILED\n");
+		return 1;
+	}
+	printf("ok\n");
+	return 0;
+}
@@ -0,0 +1,101 @@
+// Checks the Roster jid index and the to/from subscription sets against
+// a linear search over the items, over random appends and removals.
+// The jids are drawn from a small pool so that duplicates, which the
+// index has to hand over on removal, come up often.
+//
+// usage: rostertest (iterations)
+
+#include <QtCore>
+
+#include <stdlib.h>
+
+#include "roster.h"
+#include "testutil.h"
+
+using namespace XMPP;
+
+static int linearIndexOf(const Roster &r, const Jid &j)
+{
+	for(int n = 0; n < r.count(); ++n)
+	{
+		if(r.at(n).jid.full() == j.full())
+			return n;
+	}
+	return -1;
+}
+
+static QSet<QString> linearSet(const Roster &r, int sub)
+{
+	QSet<QString> set;
+	for(int n = 0; n < r.count(); ++n)
+	{
+		if(r.at(n).sub & sub)
+			set.insert(r.at(n).jid.full());
+	}
+	return set;
+}
+
+static QSet<QString> keys(const QHash<QString, Jid> &h)
+{
+	QSet<QString> set;
+	for(QHash<QString, Jid>::ConstIterator it = h.begin(); it != h.end(); ++it)
+		set.insert(it.key());
+	return set;
+}
+
+int main(int argc, char **argv)
+{
+	QCoreApplication app(argc, argv);
+	int iterations = argc > 1 ? atoi(argv[1]) : 20000;
+
+	QList<Jid> pool;
+	for(int n = 0; n < 40; ++n)
+		pool += Jid(QString("user%1@example.com").arg(n));
+
+	// index, with duplicates
+	Roster r;
+	for(test_step = 0; test_step < iterations; ++test_step)
+	{
+		if(r.count() < 60 && (r.isEmpty() || rnd(2) == 0))
+		{
+			RosterItem i;
+			i.jid = pool[rnd(pool.count())];
+			CHECK(r.append(i) == r.count() - 1);
+		}
+		else
+			r.removeAt(rnd(r.count()));
+
+		for(int n = 0; n < pool.count(); ++n)
+		{
+			CHECK(r.indexOf(pool[n]) == linearIndexOf(r, pool[n]));
+			CHECK(r.indexOfBare(pool[n].withResource("res")) == linearIndexOf(r, pool[n]));
+		}
+	}
+
+	// subscription sets, one item per jid
+	r.clear();
+	int subs[] = { RosterItem::SubNone, RosterItem::SubTo, RosterItem::SubFrom, RosterItem::SubBoth };
+	for(test_step = 0; test_step < iterations; ++test_step)
+	{
+		int op = rnd(3);
+		if(op == 0 && r.count() < pool.count())
+		{
+			RosterItem i;
+			do
+			{
+				i.jid = pool[rnd(pool.count())];
+			} while(r.indexOf(i.jid) != -1);
+			i.sub = subs[rnd(4)];
+			r += i;
+		}
+		else if(op == 1 && !r.isEmpty())
+			r.removeAt(rnd(r.count()));
+		else if(!r.isEmpty())
+			r.setSubscription(rnd(r.count()), subs[rnd(4)]);
+
+		CHECK(keys(r.subscribedTo()) == linearSet(r, RosterItem::SubTo));
+		CHECK(keys(r.subscribers()) == linearSet(r, RosterItem::SubFrom));
+	}
+
+	return testResult();
+}
@@ -0,0 +1,166 @@
+// Measures the router's session registry: 1M stanzas delivered across
+// 50k client sessions (plus some s2s ones) through the hash indexes that
+// Router::Private keeps, compared with the list scan they replaced.  The
+// registry is internal to router.cpp, so the same structures are built
+// here from the same Jid keys.  Both ways have to find the same session.
+//
+// The scan is too slow to run for every stanza, so it is timed on a
+// sample and scaled up.
+//
+// usage: routertest (sessions) (stanzas)
+
+#include <QtCore>
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "xmpp.h"
+#include "testutil.h"
+
+using namespace XMPP;
+
+enum { Client, Server };
+enum { In, Out };
+
+class Session
+{
+public:
+	int mode, dir;
+	Jid jid;
+	QString id;
+};
+
+// as in Router::Private
+class Registry
+{
+public:
+	QList<Session*> list;
+	QHash<QString, Session*> clientsByFull;
+	QHash<QString, QList<Session*> > clientsByBare;
+	QHash<QString, Session*> inboundById;
+
+	void add(Session *sess)
+	{
+		list.append(sess);
+		if(sess->mode == Client)
+		{
+			clientsByFull.insert(sess->jid.full(), sess);
+			clientsByBare[sess->jid.bare()].append(sess);
+		}
+		else if(sess->dir == In)
+			inboundById.insert(sess->id, sess);
+	}
+
+	Session *sessionForUser(const Jid &user) const
+	{
+		Session *sess = clientsByFull.value(user.full());
+		if(sess)
+			return sess;
+
+		QHash<QString, QList<Session*> >::ConstIterator it = clientsByBare.find(user.bare());
+		if(it != clientsByBare.end() && !it.value().isEmpty())
+			return it.value().first();
+		return 0;
+	}
+
+	// the old lookup
+	Session *scanForUser(const Jid &user) const
+	{
+		for(int n = 0; n < list.size(); ++n)
+		{
+			if(list[n]->mode == Client && list[n]->jid.compare(user, false))
+				return list[n];
+		}
+		return 0;
+	}
+
+	Session *pendingInboundSession(const QString &id) const
+	{
+		return inboundById.value(id);
+	}
+
+	Session *scanInbound(const QString &id) const
+	{
+		for(int n = 0; n < list.size(); ++n)
+		{
+			if(list[n]->mode == Server && list[n]->dir == In && list[n]->id == id)
+				return list[n];
+		}
+		return 0;
+	}
+};
+
+int main(int argc, char **argv)
+{
+	QCoreApplication app(argc, argv);
+	int sessions = argc > 1 ? atoi(argv[1]) : 50000;
+	int stanzas = argc > 2 ? atoi(argv[2]) : 1000000;
+	int servers = qMax(sessions / 50, 1);
+	int sample = qMin(stanzas, 2000);
+
+	Registry r;
+	QList<Jid> users;
+	for(int n = 0; n < sessions; ++n)
+	{
+		Session *sess = new Session;
+		sess->mode = Client;
+		sess->dir = In;
+		sess->jid = Jid(QString("user%1@example.com/res%2").arg(n).arg(n % 3));
+		users += sess->jid;
+		r.add(sess);
+
+		// interleave the s2s sessions, as they would be in the list
+		if(n % (sessions / servers) == 0)
+		{
+			Session *s2s = new Session;
+			s2s->mode = Server;
+			s2s->dir = In;
+			s2s->id = QString("stream%1").arg(n);
+			r.add(s2s);
+		}
+	}
+
+	// the recipients, by bare jid as most stanzas are addressed
+	QList<Jid> to;
+	for(int n = 0; n < stanzas; ++n)
+		to += Jid(users[rnd(sessions)].bare());
+
+	QTime t;
+	t.start();
+	int found = 0;
+	for(int n = 0; n < stanzas; ++n)
+	{
+		if(r.sessionForUser(to[n]))
+			++found;
+	}
+	int hashMs = t.elapsed();
+	CHECK(found == stanzas);
+
+	t.start();
+	for(int n = 0; n < sample; ++n)
+	{
+		test_step = n;
+		Session *sess = r.scanForUser(to[n]);
+		CHECK(sess && sess == r.sessionForUser(to[n]));
+	}
+	test_step = -1;
+	double scanMs = (double)t.elapsed() * stanzas / sample;
+
+	printf("%d sessions, %d stanzas\n", r.list.count(), stanzas);
+	printf("hash lookup: %d ms, %.0f ns per stanza\n", hashMs, (double)hashMs * 1000000 / stanzas);
+	printf("list scan:   %.0f ms (from %d stanzas), %.0f ns per stanza\n", scanMs, sample, scanMs * 1000000 / stanzas);
+
+	// dialback verification looks up inbound streams by id
+	t.start();
+	for(int n = 0; n < sample; ++n)
+	{
+		QString id = QString("stream%1").arg((n * (sessions / servers)) % sessions);
+		test_step = n;
+		CHECK(r.scanInbound(id) == r.pendingInboundSession(id));
+	}
+	test_step = -1;
+	printf("inbound by id: %d checks in %d ms\n", sample, t.elapsed());
+
+	qDeleteAll(r.list);
+	return testResult();
+}
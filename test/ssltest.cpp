@@ -2,6 +2,9 @@
 #include <QtNetwork>
 #include <QtXml>
 
+#include <stdlib.h>
+#include <openssl/ssl.h>
+
 #include "base64.h"
 #include "qca.h"
 #include "qca-tls.h"
@@ -248,19 +251,123 @@ private:
 
 #include "ssltest.moc"
 
+// one handshake between a QCA server and an OpenSSL client, in memory.
+//   the client offers '*sess' if there is one, and keeps the first
+//   session it gets
+static bool benchHandshake(SSL_CTX *cctx, const QCA::Cert &cert, const QCA::RSAKey &key, SSL_SESSION **sess, bool *reused)
+{
+	QCA::TLS srv;
+	srv.setCertificate(cert, key);
+	if(!srv.startServer())
+		return false;
+
+	SSL *c = SSL_new(cctx);
+	BIO *rbio = BIO_new(BIO_s_mem());
+	BIO *wbio = BIO_new(BIO_s_mem());
+	SSL_set_bio(c, rbio, wbio);
+	if(*sess)
+		SSL_set_session(c, *sess);
+	SSL_set_connect_state(c);
+
+	bool ok = false;
+	for(int n = 0; n < 32; ++n) {
+		SSL_do_handshake(c);
+
+		QByteArray a;
+		char buf[4096];
+		int r;
+		while((r = BIO_read(wbio, buf, sizeof(buf))) > 0)
+			a += QByteArray(buf, r);
+		if(!a.isEmpty())
+			srv.writeIncoming(a);
+
+		QByteArray b = srv.readOutgoing();
+		if(!b.isEmpty())
+			BIO_write(rbio, b.data(), b.size());
+
+		if(SSL_is_init_finished(c) && srv.isHandshaken()) {
+			ok = true;
+			break;
+		}
+	}
+
+	*reused = SSL_session_reused(c) ? true : false;
+	if(ok && !*sess)
+		*sess = SSL_get1_session(c);
+	SSL_free(c);
+	return ok;
+}
+
+// full handshakes against resumed ones, on the server side of qca-tls
+static int bench(const QString &certFile, const QString &keyFile, int count)
+{
+	QCA::Cert cert;
+	QCA::RSAKey key;
+	QFile f(certFile);
+	if(f.open(QIODevice::ReadOnly))
+		cert.fromPEM(QString::fromLatin1(f.readAll()));
+	f.close();
+	f.setFileName(keyFile);
+	if(f.open(QIODevice::ReadOnly))
+		key.fromPEM(QString::fromLatin1(f.readAll()));
+	if(cert.isNull() || key.isNull()) {
+		printf("Error reading cert/key files\n");
+		return 1;
+	}
+
+	SSL_CTX *cctx = SSL_CTX_new(SSLv23_client_method());
+	SSL_SESSION *sess = 0;
+	bool reused;
+
+	// warm up, and get the session to resume
+	if(!benchHandshake(cctx, cert, key, &sess, &reused) || !sess) {
+		printf("Handshake failed\n");
+		SSL_CTX_free(cctx);
+		return 1;
+	}
+
+	for(int pass = 0; pass < 2; ++pass) {
+		bool resume = (pass == 1);
+		int good = 0, resumed = 0;
+		QTime t;
+		t.start();
+		for(int n = 0; n < count; ++n) {
+			SSL_SESSION *s = resume ? sess : 0;
+			if(benchHandshake(cctx, cert, key, &s, &reused))
+				++good;
+			if(reused)
+				++resumed;
+			if(s && s != sess)
+				SSL_SESSION_free(s);
+		}
+		int ms = t.elapsed();
+		printf("%s: %d handshakes (%d ok, %d resumed) in %d ms, %.3f ms each\n",
+			resume ? "resumed" : "full", count, good, resumed, ms, (double)ms / count);
+	}
+
+	SSL_SESSION_free(sess);
+	SSL_CTX_free(cctx);
+	return 0;
+}
+
 int main(int argc, char **argv)
 {
 	QCA::init();
 	QCA::insertProvider(createProviderTLS());
 
 	QCoreApplication app(argc, argv);
-	QString host = argc > 1 ? argv[1] : "andbit.net";
 
 	if(!QCA::isSupported(QCA::CAP_TLS)) {
 		printf("TLS not supported!\n");
 		return 1;
 	}
 
+	// ssltest --bench cert.pem privkey.pem (count)
+	if(argc >= 4 && QString(argv[1]) == "--bench")
+		return bench(argv[2], argv[3], argc > 4 ? atoi(argv[4]) : 500);
+
+	QString host = argc > 1 ? argv[1] : "andbit.net";
+
 	SecureTest *s = new SecureTest;
 	QObject::connect(s, SIGNAL(quit()), &app, SLOT(quit()));
 	s->start(host);
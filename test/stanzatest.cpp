@@ -0,0 +1,147 @@
+// Reports how many times the element is read for a routed stanza, now
+// that Stanza keeps kind, to, from, id and type after the first read.
+// Each stanza below gets the accessor calls the server makes on it on
+// its way through: App::router_readyRead(), then PresenceManager for
+// presence, and Router::write().  Without the cache every lookup was a
+// read.  Also checks that the cached values follow the setters and
+// that element() drops them.
+//
+// The server logs the same figures for real traffic when it exits.
+//
+// usage: stanzatest (stanzas)
+
+#include <QtCore>
+#include <QtXml>
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "xmpp.h"
+#include "testutil.h"
+
+using namespace XMPP;
+
+// just enough of a stream to make stanzas from parsed elements
+class TestStream : public Stream
+{
+public:
+	mutable QDomDocument d;
+
+	QDomDocument & doc() const { return d; }
+	QString baseNS() const { return "jabber:client"; }
+	bool old() const { return false; }
+	void close() {}
+	bool stanzaAvailable() const { return false; }
+	Stanza read() { return Stanza(); }
+	void write(const Stanza &) {}
+	int errorCondition() const { return 0; }
+	QString errorText() const { return QString(); }
+	QDomElement errorAppSpec() const { return QDomElement(); }
+
+	Stanza parse(const QString &xml)
+	{
+		QDomDocument tmp;
+		tmp.setContent("<stream xmlns='jabber:client'>" + xml + "</stream>", true);
+		QDomElement e = d.importNode(tmp.documentElement().firstChild(), true).toElement();
+		return createStanza(e);
+	}
+};
+
+// router_readyRead() finds the sender and the kind, Router::write()
+//   looks up the recipient's domain and session
+static void routeMessage(const Stanza &in)
+{
+	in.from();
+	in.from();
+	in.kind();
+	in.kind();
+	in.kind();
+	in.to();
+	in.to();
+	in.type();
+}
+
+// PresenceManager checks the type against each case, and the sender and
+//   target on the way to the broadcast
+static void routePresence(const Stanza &in)
+{
+	in.from();
+	in.from();
+	in.kind();
+	in.kind();
+	for(int n = 0; n < 8; ++n)
+		in.type();
+	for(int n = 0; n < 4; ++n)
+	{
+		in.to();
+		in.from();
+	}
+	in.id();
+}
+
+static Stanza::AttrStats since(const Stanza::AttrStats &before)
+{
+	Stanza::AttrStats now = Stanza::attrStats();
+	Stanza::AttrStats st;
+	st.stanzas = now.stanzas - before.stanzas;
+	st.lookups = now.lookups - before.lookups;
+	st.domReads = now.domReads - before.domReads;
+	return st;
+}
+
+static void report(const char *name, const Stanza::AttrStats &st)
+{
+	printf("%s: %llu stanzas, %.1f lookups and %.1f element reads per stanza\n", name, (unsigned long long)st.stanzas,
+		(double)st.lookups / qMax(st.stanzas, (quint64)1), (double)st.domReads / qMax(st.stanzas, (quint64)1));
+}
+
+int main(int argc, char **argv)
+{
+	QCoreApplication app(argc, argv);
+	int count = argc > 1 ? atoi(argv[1]) : 10000;
+	TestStream stream;
+
+	// the values, and what changes them
+	{
+		Stanza s = stream.parse("<message to='juliet@example.com/balcony' from='romeo@example.net' type='chat' id='m1'><body>hi</body></message>");
+		CHECK(s.kind() == Stanza::Message);
+		CHECK(s.to().full() == "juliet@example.com/balcony");
+		CHECK(s.from().full() == "romeo@example.net");
+		CHECK(s.type() == "chat");
+		CHECK(s.id() == "m1");
+
+		Stanza copy = s;
+		copy.setTo(Jid("nurse@example.com"));
+		CHECK(copy.to().full() == "nurse@example.com");
+
+		s.element().setAttribute("type", "normal");
+		CHECK(s.type() == "normal");
+	}
+
+	Stanza::AttrStats before = Stanza::attrStats();
+	for(int n = 0; n < count; ++n)
+	{
+		Stanza s = stream.parse(QString("<message to='user%1@example.com' from='romeo@example.net/orchard' type='chat'><body>%1</body></message>").arg(n));
+		routeMessage(s);
+		test_step = n;
+		CHECK(s.to().node() == QString("user%1").arg(n));
+	}
+	test_step = -1;
+	Stanza::AttrStats msg = since(before);
+	CHECK(msg.stanzas == (quint64)count);
+	CHECK(msg.domReads <= msg.stanzas * 4);
+	report("message", msg);
+
+	before = Stanza::attrStats();
+	for(int n = 0; n < count; ++n)
+	{
+		Stanza s = stream.parse(QString("<presence from='user%1@example.com/home'><show>away</show></presence>").arg(n));
+		routePresence(s);
+	}
+	Stanza::AttrStats pres = since(before);
+	CHECK(pres.stanzas == (quint64)count);
+	CHECK(pres.domReads <= pres.stanzas * 5);
+	report("presence", pres);
+
+	return testResult();
+}
@@ -0,0 +1,96 @@
+// Times stringprep() over a corpus of typical JID parts, the way
+// Jid::validNode(), validDomain() and validResource() call it: mostly
+// short lowercase ascii, some mixed case, and a few non-ascii names.
+// Also checks a handful of results, so a faster path can't quietly
+// change an answer.
+//
+// usage: stringpreptest (calls per profile)
+
+#include <QtCore>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include <stringprep.h>
+
+#include "testutil.h"
+
+static const char *nodes[] =
+{
+	"juliet", "romeo", "alice", "bob", "support", "admin", "john.smith",
+	"j_doe", "user12345", "test-account", "Juliet", "RoMeO", "Bob.Builder",
+	"jos\xc3\xa9", "m\xc3\xbcller", "\xe6\x97\xa5\xe6\x9c\xac", "stra\xc3\x9f" "e",
+	0
+};
+
+static const char *domains[] =
+{
+	"example.com", "jabber.org", "chat.example.net", "conference.jabber.org",
+	"im.example.co.uk", "Example.COM", "b\xc3\xbc" "cher.example", 0
+};
+
+static const char *resources[] =
+{
+	"Home", "Work", "laptop", "Psi", "Gajim.ABC123", "mobile-4f2a", "balcony",
+	"orchard", "Tkabber", "My Phone", "r\xc3\xa9sum\xc3\xa9", 0
+};
+
+static double now()
+{
+	struct timeval tv;
+	gettimeofday(&tv, 0);
+	return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+static int prep(const char *in, Stringprep_profile *profile, char *out)
+{
+	strcpy(out, in);
+	return stringprep(out, 1024, (Stringprep_profile_flags)0, profile);
+}
+
+static bool prepsTo(const char *in, Stringprep_profile *profile, const char *expect)
+{
+	char buf[1024];
+	if(prep(in, profile, buf) != STRINGPREP_OK)
+		return expect == 0;
+	return expect && strcmp(buf, expect) == 0;
+}
+
+// returns seconds for 'calls' preps, cycling through the list
+static double run(const char **list, Stringprep_profile *profile, int calls)
+{
+	int count = 0;
+	while(list[count])
+		++count;
+
+	char buf[1024];
+	double start = now();
+	for(int n = 0; n < calls; ++n)
+		prep(list[n % count], profile, buf);
+	return now() - start;
+}
+
+int main(int argc, char **argv)
+{
+	int calls = argc > 1 ? atoi(argv[1]) : 200000;
+
+	CHECK(prepsTo("Juliet", stringprep_xmpp_nodeprep, "juliet"));
+	CHECK(prepsTo("juliet", stringprep_xmpp_nodeprep, "juliet"));
+	CHECK(prepsTo("M\xc3\x9cLLER", stringprep_xmpp_nodeprep, "m\xc3\xbcller"));
+	CHECK(prepsTo("stra\xc3\x9f" "e", stringprep_xmpp_nodeprep, "strasse"));
+	CHECK(prepsTo("a@b", stringprep_xmpp_nodeprep, 0));
+	CHECK(prepsTo("a\x01" "b", stringprep_xmpp_nodeprep, 0));
+	CHECK(prepsTo("Example.COM", stringprep_nameprep, "example.com"));
+	CHECK(prepsTo("Home", stringprep_xmpp_resourceprep, "Home"));
+	CHECK(prepsTo("My Phone", stringprep_xmpp_resourceprep, "My Phone"));
+	CHECK(prepsTo("a\x07" "b", stringprep_xmpp_resourceprep, 0));
+
+	double node = run(nodes, stringprep_xmpp_nodeprep, calls);
+	double domain = run(domains, stringprep_nameprep, calls);
+	double resource = run(resources, stringprep_xmpp_resourceprep, calls);
+	printf("%d calls each: nodeprep %.2fs, nameprep %.2fs, resourceprep %.2fs\n", calls, node, domain, resource);
+
+	return testResult();
+}
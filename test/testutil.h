@@ -0,0 +1,49 @@
+// Shared by the self-checking test programs: CHECK() counts a failure
+// and carries on, rnd() gives the same sequence on every run, and
+// testResult() prints the outcome and gives the exit code.
+
+#ifndef TESTUTIL_H
+#define TESTUTIL_H
+
+#include <QtCore>
+
+#include <stdio.h>
+
+static int test_failures = 0;
+
+// set by loops so a failure says where it happened, -1 for none
+static int test_step = -1;
+
+#define CHECK(x) \
+	do { \
+		if(!(x)) { \
+			if(test_failures < 10) { \
+				if(test_step >= 0) \
+					printf("%s:%d: failed: %s (step %d)\n", __FILE__, __LINE__, #x, test_step); \
+				else \
+					printf("%s:%d: failed: %s\n", __FILE__, __LINE__, #x); \
+			} \
+			++test_failures; \
+		} \
+	} while(0)
+
+static quint32 test_seed = 1;
+
+static inline int rnd(int max)
+{
+	test_seed = test_seed * 1103515245 + 12345;
+	return (int)((test_seed >> 8) % (quint32)max);
+}
+
+static inline int testResult()
+{
+	if(test_failures)
+	{
+		printf("%d checks FAILED\n", test_failures);
+		return 1;
+	}
+	printf("ok\n");
+	return 0;
+}
+
+#endif
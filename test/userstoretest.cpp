@@ -0,0 +1,122 @@
+// Times loading users from disk in the XML format and in the binary one,
+// for rosters of 10, 100 and 1000 items.  The users are written as XML
+// through UserStore, loaded back cold, converted with
+// UserStore::convert() and loaded again, so both passes read the same
+// data.  Each load has to give back the roster that was saved.
+//
+// usage: userstoretest (users per roster size)
+
+#include <QtCore>
+#include <QtXml>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "userstore.h"
+#include "testutil.h"
+
+using namespace XMPP;
+
+static User makeUser(int items)
+{
+	User u;
+	for(int n = 0; n < items; ++n)
+	{
+		RosterItem i;
+		i.jid = Jid(QString("contact%1@example%2.com").arg(n).arg(n % 7));
+		i.name = QString("Contact %1").arg(n);
+		i.sub = n % 4;
+		i.ask = (n % 5) == 0;
+		i.groups += (n % 2) ? "Friends" : "Work";
+		u.roster += i;
+	}
+
+	QDomDocument doc;
+	u.vcard = doc.createElementNS("vcard-temp", "vCard");
+	QDomElement fn = doc.createElement("FN");
+	fn.appendChild(doc.createTextNode("Juliet Capulet"));
+	u.vcard.appendChild(fn);
+	return u;
+}
+
+static bool sameRoster(const Roster &a, const Roster &b)
+{
+	if(a.count() != b.count())
+		return false;
+	for(int n = 0; n < a.count(); ++n)
+	{
+		if(!a[n].jid.compare(b[n].jid) || a[n].name != b[n].name || a[n].sub != b[n].sub || a[n].ask != b[n].ask || a[n].groups != b[n].groups)
+			return false;
+	}
+	return true;
+}
+
+// returns milliseconds for loading every user once, from a cold store
+static int loadAll(const QString &dir, UserStore::Format format, const QStringList &names, const User &expect)
+{
+	UserStore store(dir);
+	store.setFormat(format);
+	QTime t;
+	t.start();
+	QList<User> users;
+	for(int n = 0; n < names.count(); ++n)
+		users += store.load(names[n]);
+	int ms = t.elapsed();
+
+	for(int n = 0; n < users.count(); ++n)
+	{
+		test_step = n;
+		CHECK(sameRoster(users[n].roster, expect.roster));
+		CHECK(!users[n].vcard.isNull());
+	}
+	test_step = -1;
+	return ms;
+}
+
+static void removeDir(const QString &path)
+{
+	QDir dir(path);
+	QStringList files = dir.entryList(QDir::Files);
+	for(int n = 0; n < files.count(); ++n)
+		dir.remove(files[n]);
+	QDir().rmdir(path);
+}
+
+int main(int argc, char **argv)
+{
+	QCoreApplication app(argc, argv);
+	int count = argc > 1 ? atoi(argv[1]) : 200;
+
+	int sizes[] = { 10, 100, 1000, 0 };
+	for(int s = 0; sizes[s]; ++s)
+	{
+		QString dir = QDir::tempPath() + QString("/userstoretest-%1-%2").arg(getpid()).arg(sizes[s]);
+		removeDir(dir);
+		QDir().mkdir(dir);
+
+		User user = makeUser(sizes[s]);
+		QStringList names;
+		{
+			UserStore store(dir);
+			store.setFormat(UserStore::FormatXml);
+			for(int n = 0; n < count; ++n)
+			{
+				names += QString("user%1").arg(n);
+				store.save(names[n], user);
+			}
+			store.flush();
+		}
+
+		int xmlMs = loadAll(dir, UserStore::FormatXml, names, user);
+		CHECK(UserStore::convert(dir, UserStore::FormatBinary) == count);
+		int binMs = loadAll(dir, UserStore::FormatBinary, names, user);
+
+		printf("%4d items: xml %d ms, binary %d ms for %d users (%.2f / %.2f ms each)\n", sizes[s], xmlMs, binMs, count,
+			(double)xmlMs / count, (double)binMs / count);
+
+		removeDir(dir);
+	}
+
+	return testResult();
+}
@@ -0,0 +1,166 @@
+// Checks that xmlToUtf8() writes the same bytes as the QDom based
+// serializer it replaced (stripExtraNS() and a QTextStream save(), kept
+// below as the reference), over a small corpus of stanzas.  Also checks
+// that writing with a namespace rename gives the same bytes as the
+// reference does on a tree that was in the new namespace to begin with.
+//
+// usage: xmltest
+
+#include <QtCore>
+#include <QtXml>
+
+#include <stdio.h>
+
+#include "xmlprotocol.h"
+
+using namespace XMPP;
+
+static const char *corpus[] =
+{
+	"<message to='a@b/c' from='d@e' type='chat' id='1'><body>hi &amp; &lt;there&gt; ]]&gt; \"q\" 'a'</body></message>",
+	"<presence xml:lang='en'><status>x</status><x xmlns='vcard-temp:x:update'><photo/></x></presence>",
+	"<iq type='get' id='r1'><query xmlns='jabber:iq:roster'><item jid='a@b' name='A &amp; B'><group>G</group></item></query></iq>",
+	"<p:foo xmlns:p='urn:p'><p:bar/><baz/></p:foo>",
+	"<message xmlns:x='urn:x' x:attr='v'><body>b</body></message>",
+	"<p:e xmlns:p='urn:p' p:a='1' b='2'/>",
+	"<message><body>h\xc3\xa9llo \xe2\x80\x93 \xe6\x97\xa5\xe6\x9c\xac</body></message>",
+	"<message><body><![CDATA[a<b]]></body><!-- c --></message>",
+	"<message><html xmlns='http://jabber.org/protocol/xhtml-im'><body xmlns='http://www.w3.org/1999/xhtml'><p>a <b>b</b> c</p></body></html></message>",
+	"<presence>\n  <show>away</show>\n  <priority>5</priority>\n</presence>",
+	"<iq type='set'><query xmlns='jabber:iq:private'><storage xmlns='storage:bookmarks'><conference jid='r@c' autojoin='1'><nick>n</nick></conference></storage></query></iq>",
+	"<message type='error'><error type='cancel'><item-not-found xmlns='urn:ietf:params:xml:ns:xmpp-stanzas'/></error></message>",
+	0
+};
+
+// the old serializer
+static QDomElement stripExtraNS(const QDomElement &e)
+{
+	// find closest parent with a namespace
+	QDomNode par = e.parentNode();
+	while(!par.isNull() && par.namespaceURI().isNull())
+		par = par.parentNode();
+	bool noShowNS = false;
+	if(!par.isNull() && par.namespaceURI() == e.namespaceURI())
+		noShowNS = true;
+
+	// build qName (prefix:localName)
+	QString qName;
+	if(!e.prefix().isEmpty())
+		qName = e.prefix() + ':' + e.localName();
+	else
+		qName = e.tagName();
+
+	QDomElement i;
+	uint x;
+	if(noShowNS)
+		i = e.ownerDocument().createElement(qName);
+	else
+		i = e.ownerDocument().createElementNS(e.namespaceURI(), qName);
+
+	// copy attributes
+	QDomNamedNodeMap al = e.attributes();
+	for(x = 0; x < (uint)al.count(); ++x) {
+		QDomAttr a = al.item(x).cloneNode().toAttr();
+
+		// don't show xml namespace
+		if(a.namespaceURI() == NS_XML)
+			i.setAttribute(QString("xml:") + a.name(), a.value());
+		else
+			i.setAttributeNodeNS(a);
+	}
+
+	// copy children
+	QDomNodeList nl = e.childNodes();
+	for(x = 0; x < (uint)nl.count(); ++x) {
+		QDomNode n = nl.item(x);
+		if(n.isElement())
+			i.appendChild(stripExtraNS(n.toElement()));
+		else
+			i.appendChild(n.cloneNode());
+	}
+	return i;
+}
+
+static QString xmlToString(const QDomElement &e, const QString &fakeNS, const QString &fakeQName, bool clip)
+{
+	QDomElement i = e.cloneNode().toElement();
+
+	QDomElement fake = e.ownerDocument().createElementNS(fakeNS, fakeQName);
+	fake.appendChild(i);
+	fake = stripExtraNS(fake);
+	QString out;
+	{
+		QTextStream ts(&out, QIODevice::WriteOnly);
+		fake.firstChild().save(ts, 0);
+	}
+	if(clip) {
+		int n = out.lastIndexOf('>');
+		out.truncate(n+1);
+	}
+	return out;
+}
+
+static QDomElement parse(QDomDocument *doc, const QString &ns, const char *xml)
+{
+	QString s = QString("<stream:stream xmlns:stream='http://etherx.jabber.org/streams' xmlns='%1'>").arg(ns)
+		+ QString::fromUtf8(xml) + "</stream:stream>";
+	QString err;
+	if(!doc->setContent(s, true, &err))
+		printf("parse error: %s\n", qPrintable(err));
+	return doc->documentElement().firstChildElement();
+}
+
+static bool compare(const char *what, int n, const QByteArray &expected, const QByteArray &got)
+{
+	if(expected == got)
+		return true;
+	printf("%d (%s) differs:\n  expected: [%s]\n  got:      [%s]\n", n, what, expected.data(), got.data());
+	return false;
+}
+
+int main(int argc, char **argv)
+{
+	QCoreApplication app(argc, argv);
+
+	int failures = 0;
+	int count = 0;
+	for(int n = 0; corpus[n]; ++n)
+	{
+		QDomDocument doc, sdoc;
+		QDomElement e = parse(&doc, "jabber:client", corpus[n]);
+		QDomElement se = parse(&sdoc, "jabber:server", corpus[n]);
+		if(e.isNull() || se.isNull())
+		{
+			++failures;
+			continue;
+		}
+
+		for(int clip = 0; clip < 2; ++clip)
+		{
+			QByteArray expected = xmlToString(e, "jabber:client", "stream:stream", clip).toUtf8();
+			if(!compare(clip ? "clipped" : "plain", n, expected, xmlToUtf8(e, "jabber:client", clip)))
+				++failures;
+
+			// the stanza outside of its own namespace, declared
+			expected = xmlToString(e, "jabber:server", "stream:stream", clip).toUtf8();
+			if(!compare(clip ? "foreign, clipped" : "foreign", n, expected, xmlToUtf8(e, "jabber:server", clip)))
+				++failures;
+
+			// renamed on output, against one parsed in the new namespace
+			expected = xmlToString(se, "jabber:server", "stream:stream", clip).toUtf8();
+			if(!compare(clip ? "renamed, clipped" : "renamed", n, expected, xmlToUtf8(e, "jabber:server", clip, "jabber:client", "jabber:server")))
+				++failures;
+
+			count += 3;
+		}
+	}
+
+	printf("%d of %d comparisons differ\n", failures, count);
+	if(failures)
+	{
+		printf("FAILED\n");
+		return 1;
+	}
+	printf("ok\n");
+	return 0;
+}